@@ -0,0 +1,454 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Append-only file of opaque records, each framed as Record Size (4 bytes,
+// uint32_t, host order, including itself) followed by the payload.
+//
+// File: Magic (8 bytes) | Log Id (8 bytes, host order) | Records
+//
+// Every file the log creates, at open or by a rewrite, gets a new random Log
+// Id, so a position (Log Id and file offset) names one point in one file's
+// history. Files written before the header existed start with a record
+// instead and have Log Id 0, which names no position.
+//
+// Appending only copies the record into a buffer. A dedicated writer thread
+// takes the whole buffer at once, writes it with one write call and fsyncs
+// according to the policy, so the records of every thread that appended
+// meanwhile share one write and one fsync (group commit). With ALWAYS, a
+// record is durable once wait_durable returns for its sequence; the other
+// policies never make an appending thread wait.
+//
+// A rewrite replaces the log with a compact one: the owner calls
+// begin_rewrite, writes the records describing its current state to a new
+// file, and hands it to finish_rewrite. Every record appended after
+// begin_rewrite is copied to the new file before it replaces the old one, so
+// the records must be idempotent, applying them again to a state that
+// already includes them changes nothing.
+class AppendLog {
+public:
+    enum class FsyncPolicy { ALWAYS, PERIODIC, NEVER };
+
+    AppendLog() = default;
+
+    ~AppendLog() {
+        if (writer.joinable()) {
+            {
+                std::scoped_lock lock(mtx);
+                stopping = true;
+            }
+            work_cv.notify_one();
+            writer.join();
+            close(fd);
+        }
+    }
+
+    AppendLog(const AppendLog&) = delete;
+    AppendLog& operator=(const AppendLog&) = delete;
+
+    // Where the next record appended will be, and the sequence append
+    // returned for the record before it
+    struct Position {
+        uint64_t log_id = 0;
+        uint64_t offset = 0;
+        uint64_t sequence = 0;
+    };
+
+    // Bytes before the first record of a file with this Log Id
+    static uint64_t header_size(uint64_t log_id) {
+        return log_id != 0 ? HEADER_SIZE : 0;
+    }
+
+    // Reads the Log Id of the log at path and its size. A missing file has
+    // Log Id 0 and size 0.
+    static bool read_header(const std::string& path, uint64_t& log_id, uint64_t& size) {
+        log_id = 0;
+        size = 0;
+        int file = ::open(path.c_str(), O_RDONLY);
+        if (file == -1) {
+            return errno == ENOENT;
+        }
+        struct stat file_stat;
+        char header[HEADER_SIZE];
+        bool read_ok = fstat(file, &file_stat) == 0;
+        if (read_ok) {
+            size = file_stat.st_size;
+            if (pread(file, header, HEADER_SIZE, 0) == HEADER_SIZE && std::memcmp(header, MAGIC, sizeof(MAGIC)) == 0) {
+                std::memcpy(&log_id, header + sizeof(MAGIC), sizeof(uint64_t));
+            }
+        }
+        close(file);
+        return read_ok;
+    }
+
+    // Calls apply with the payload of every complete record of the log at
+    // path, in order, from the first one or from start_offset, a record
+    // boundary of a Position, then cuts off a record torn by a crash. Returns
+    // false if the file exists but can't be read.
+    static bool replay(const std::string& path, const std::function<void(std::string_view)>& apply,
+                       uint64_t start_offset = 0) {
+        int file = ::open(path.c_str(), O_RDWR);
+        if (file == -1) {
+            return errno == ENOENT;
+        }
+        if (start_offset == 0) {
+            uint64_t log_id;
+            uint64_t size;
+            read_header(path, log_id, size);
+            start_offset = header_size(log_id);
+        }
+        if (lseek(file, start_offset, SEEK_SET) == -1) {
+            close(file);
+            return false;
+        }
+
+        std::string buffer;
+        std::string chunk(READ_CHUNK_SIZE, '\0');
+        uint64_t valid_bytes = start_offset;
+        size_t offset = 0;
+        while (true) {
+            ssize_t bytes_read = read(file, chunk.data(), chunk.size());
+            if (bytes_read < 0) {
+                close(file);
+                return false;
+            }
+            if (bytes_read == 0) break;
+            buffer.erase(0, offset);
+            offset = 0;
+            buffer.append(chunk, 0, bytes_read);
+
+            while (buffer.size() - offset >= sizeof(uint32_t)) {
+                uint32_t record_size;
+                std::memcpy(&record_size, &buffer[offset], sizeof(uint32_t));
+                if (record_size < sizeof(uint32_t) || record_size > buffer.size() - offset) break;
+                apply(std::string_view(buffer).substr(offset + sizeof(uint32_t), record_size - sizeof(uint32_t)));
+                offset += record_size;
+                valid_bytes += record_size;
+            }
+        }
+
+        struct stat file_stat;
+        if (fstat(file, &file_stat) == 0 && static_cast<uint64_t>(file_stat.st_size) > valid_bytes) {
+            std::cerr << "Dropping " << file_stat.st_size - valid_bytes << " bytes of incomplete records from " << path << "\n";
+            if (ftruncate(file, valid_bytes) != 0) {
+                std::cerr << "Failed to truncate " << path << "\n";
+            }
+        }
+        close(file);
+        return true;
+    }
+
+    // Frames a record made of the concatenated parts onto output, the way
+    // append writes it
+    static void frame_record(std::string& output, std::initializer_list<std::string_view> parts) {
+        uint32_t record_size = sizeof(uint32_t);
+        for (std::string_view part : parts) {
+            record_size += part.size();
+        }
+        output.append(reinterpret_cast<const char*>(&record_size), sizeof(uint32_t));
+        for (std::string_view part : parts) {
+            output += part;
+        }
+    }
+
+    // Opens the log at path for appending, creating it with a new Log Id if
+    // needed, and starts the writer thread. Returns false if the file can't
+    // be opened.
+    bool open(const std::string& path, FsyncPolicy policy, int fsync_interval_ms, uint64_t rewrite_min_bytes) {
+        uint64_t size;
+        if (!read_header(path, log_id, size)) {
+            return false;
+        }
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd == -1) {
+            return false;
+        }
+        if (size == 0 && !write_header(fd, log_id)) {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        this->path = path;
+        this->policy = policy;
+        this->fsync_interval_ms = fsync_interval_ms;
+        this->rewrite_min_bytes = rewrite_min_bytes;
+        file_bytes = lseek(fd, 0, SEEK_END);
+        rewritten_bytes = file_bytes;
+        appended_offset = file_bytes;
+        writer = std::thread([this] { run_writer(); });
+        return true;
+    }
+
+    // Appends one record made of the concatenated parts. Returns its
+    // sequence, the log size in bytes once it is written.
+    uint64_t append(std::initializer_list<std::string_view> parts) {
+        std::unique_lock lock(mtx);
+        bool was_empty = pending.empty();
+        size_t pending_bytes = pending.size();
+        frame_record(pending, parts);
+        appended_sequence += pending.size() - pending_bytes;
+        appended_offset += pending.size() - pending_bytes;
+        uint64_t sequence = appended_sequence;
+        lock.unlock();
+
+        // The writer drains everything at once, so only the first record of a
+        // group needs to wake it
+        if (was_empty) {
+            work_cv.notify_one();
+        }
+        return sequence;
+    }
+
+    bool syncs_every_record() const {
+        return policy == FsyncPolicy::ALWAYS;
+    }
+
+    // The sequence up to which records are on disk
+    uint64_t durable() const {
+        return durable_sequence.load(std::memory_order_acquire);
+    }
+
+    // Calls listener on the writer thread, with the log's lock held, each time
+    // more records are on disk, for callers that don't wait in wait_durable
+    void set_durable_listener(std::function<void()> listener) {
+        std::scoped_lock lock(mtx);
+        durable_listener = std::move(listener);
+    }
+
+    // Waits until every record up to sequence is on disk. Only the ALWAYS
+    // policy waits, the others return right away.
+    void wait_durable(uint64_t sequence) {
+        if (policy != FsyncPolicy::ALWAYS || durable_sequence.load(std::memory_order_acquire) >= sequence) {
+            return;
+        }
+        std::unique_lock lock(mtx);
+        durable_cv.wait(lock, [&] { return durable_sequence.load(std::memory_order_relaxed) >= sequence; });
+    }
+
+    Position position() const {
+        std::scoped_lock lock(mtx);
+        return {log_id, appended_offset, appended_sequence};
+    }
+
+    // Waits until every record before position is on disk, whatever the
+    // policy
+    void sync(const Position& position) {
+        std::unique_lock lock(mtx);
+        if (durable_sequence.load(std::memory_order_relaxed) >= position.sequence) {
+            return;
+        }
+        sync_sequence = std::max(sync_sequence, position.sequence);
+        work_cv.notify_one();
+        durable_cv.wait(lock, [&] { return durable_sequence.load(std::memory_order_relaxed) >= position.sequence; });
+    }
+
+    // True once the log has grown to twice its size after the last rewrite,
+    // and to at least rewrite_min_bytes
+    bool needs_rewrite() const {
+        std::scoped_lock lock(mtx);
+        return !rewriting && file_bytes >= std::max(rewrite_min_bytes, 2 * rewritten_bytes);
+    }
+
+    uint64_t size() const {
+        std::scoped_lock lock(mtx);
+        return file_bytes;
+    }
+
+    // Writes the header of the rewritten log, with a new Log Id, to new_fd and
+    // starts copying the records appended from now on for it. Returns false
+    // if the header can't be written.
+    bool begin_rewrite(int new_fd) {
+        uint64_t new_log_id;
+        if (!write_header(new_fd, new_log_id)) {
+            return false;
+        }
+        std::scoped_lock lock(mtx);
+        rewrite_log_id = new_log_id;
+        rewriting = true;
+        return true;
+    }
+
+    // Appends the records copied since begin_rewrite to new_fd, after the
+    // records the owner wrote there, and replaces the log with it. Waits
+    // until the writer has switched to it, and returns false if that failed.
+    bool finish_rewrite(int new_fd, const std::string& new_path) {
+        std::unique_lock lock(mtx);
+        rewrite_fd = new_fd;
+        rewrite_path = new_path;
+        work_cv.notify_one();
+        rewrite_cv.wait(lock, [&] { return rewrite_fd == -1; });
+        return rewrite_succeeded;
+    }
+
+    void abort_rewrite() {
+        std::scoped_lock lock(mtx);
+        rewriting = false;
+        rewrite_buffer.clear();
+    }
+
+private:
+    static constexpr size_t READ_CHUNK_SIZE = 1 << 20;
+    static constexpr char MAGIC[8] = {'F', 'I', 'N', 'C', 'H', 'A', 'O', 'F'};
+    static constexpr ssize_t HEADER_SIZE = sizeof(MAGIC) + sizeof(uint64_t);
+
+    // Writes the header of a new file with a new, nonzero Log Id
+    static bool write_header(int file, uint64_t& new_log_id) {
+        std::random_device random;
+        do {
+            new_log_id = (static_cast<uint64_t>(random()) << 32) ^ random() ^
+                         std::chrono::steady_clock::now().time_since_epoch().count();
+        } while (new_log_id == 0);
+        char header[HEADER_SIZE];
+        std::memcpy(header, MAGIC, sizeof(MAGIC));
+        std::memcpy(header + sizeof(MAGIC), &new_log_id, sizeof(uint64_t));
+        return write_all(file, header, HEADER_SIZE);
+    }
+
+    static bool write_all(int file, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t written = write(file, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    void run_writer() {
+        std::string writing;
+        auto last_sync = std::chrono::steady_clock::now();
+        std::unique_lock lock(mtx);
+        while (true) {
+            // Sleep until there are records, a rewrite to finish, or a
+            // periodic fsync due for records already written
+            auto has_work = [&] {
+                return !pending.empty() || rewrite_fd != -1 || stopping ||
+                       sync_sequence > durable_sequence.load(std::memory_order_relaxed);
+            };
+            if (policy == FsyncPolicy::PERIODIC && written_sequence > durable_sequence.load(std::memory_order_relaxed)) {
+                work_cv.wait_until(lock, last_sync + std::chrono::milliseconds(fsync_interval_ms), has_work);
+            } else {
+                work_cv.wait(lock, has_work);
+            }
+
+            writing.swap(pending);
+            if (rewriting) {
+                rewrite_buffer += writing;
+            }
+            uint64_t end_sequence = appended_sequence;
+            bool sync_requested = sync_sequence > durable_sequence.load(std::memory_order_relaxed);
+            bool finishing = rewrite_fd != -1;
+            bool stop = stopping;
+            lock.unlock();
+
+            if (!writing.empty() && !write_all(fd, writing.data(), writing.size())) {
+                std::perror("Failed to write the append-only log");
+            }
+            uint64_t written_bytes = writing.size();
+            writing.clear();
+
+            bool succeeded = finishing && switch_to_rewritten_log();
+            auto now = std::chrono::steady_clock::now();
+            bool sync = policy == FsyncPolicy::ALWAYS || sync_requested ||
+                        (policy == FsyncPolicy::PERIODIC && now - last_sync >= std::chrono::milliseconds(fsync_interval_ms));
+            if (sync && end_sequence > durable_sequence.load(std::memory_order_relaxed)) {
+                fdatasync(fd);
+                last_sync = now;
+            }
+
+            lock.lock();
+            file_bytes += written_bytes;
+            written_sequence = end_sequence;
+            if (sync) {
+                durable_sequence.store(end_sequence, std::memory_order_release);
+                durable_cv.notify_all();
+                if (durable_listener) {
+                    durable_listener();
+                }
+            }
+            if (finishing) {
+                if (succeeded) {
+                    file_bytes = rewritten_bytes = lseek(fd, 0, SEEK_END);
+                    // Records appended meanwhile go to the new file next
+                    appended_offset = file_bytes + pending.size();
+                    log_id = rewrite_log_id;
+                }
+                rewriting = false;
+                rewrite_buffer.clear();
+                rewrite_succeeded = succeeded;
+                rewrite_fd = -1;
+                rewrite_cv.notify_all();
+            }
+            if (stop && pending.empty()) {
+                fdatasync(fd);
+                return;
+            }
+        }
+    }
+
+    // Runs on the writer thread, after the latest records reached the old log
+    // and were copied to rewrite_buffer, so nothing is lost in between
+    bool switch_to_rewritten_log() {
+        if (!write_all(rewrite_fd, rewrite_buffer.data(), rewrite_buffer.size()) || fdatasync(rewrite_fd) != 0 ||
+            rename(rewrite_path.c_str(), path.c_str()) != 0) {
+            std::perror("Failed to replace the append-only log");
+            close(rewrite_fd);
+            unlink(rewrite_path.c_str());
+            return false;
+        }
+        close(fd);
+        fd = rewrite_fd;
+        return true;
+    }
+
+    std::string path;
+    FsyncPolicy policy = FsyncPolicy::NEVER;
+    int fsync_interval_ms = 0;
+    uint64_t rewrite_min_bytes = 0;
+    int fd = -1;
+    std::thread writer;
+
+    mutable std::mutex mtx;
+    std::condition_variable work_cv;    // Wakes the writer
+    std::condition_variable durable_cv; // Wakes threads in wait_durable
+    std::condition_variable rewrite_cv; // Wakes the thread in finish_rewrite
+    std::function<void()> durable_listener;
+    std::string pending;                // Records not taken by the writer yet
+    uint64_t appended_sequence = 0;
+    uint64_t written_sequence = 0;
+    std::atomic<uint64_t> durable_sequence{0};
+    uint64_t file_bytes = 0;
+    uint64_t rewritten_bytes = 0; // Log size after the last rewrite, or at open
+    bool stopping = false;
+    uint64_t sync_sequence = 0;   // Sequence a sync call waits to be on disk
+    uint64_t log_id = 0;
+    uint64_t appended_offset = 0; // File offset after the last record appended
+
+    bool rewriting = false;
+    uint64_t rewrite_log_id = 0;
+    std::string rewrite_buffer; // Records appended since begin_rewrite
+    int rewrite_fd = -1;
+    std::string rewrite_path;
+    bool rewrite_succeeded = false;
+};
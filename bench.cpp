@@ -0,0 +1,564 @@
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define FINCH_CLIENT_NO_MAIN // Exclude main function from client.cpp
+#include "client.cpp"
+#include "latency_histogram.h"
+#include "zipfian.h"
+
+// YCSB-style benchmark (Cooper et al., "Benchmarking Cloud Serving Systems
+// with YCSB") against running servers. A load phase inserts the records, then
+// every thread runs its share of the operations through its own FinchClient,
+// or one client shared by all threads with --shared-client, one request at a
+// time, recording every operation's latency.
+//
+// Closed loop, the default, starts the next operation as soon as the previous
+// one returns. With --rate, operations are scheduled at a fixed arrival rate
+// instead, and latency is measured from the scheduled start, so time spent
+// queued behind a slow operation counts too (no coordinated omission).
+
+enum Operation { READ, UPDATE, INSERT, SCAN, READ_MODIFY_WRITE, OPERATION_COUNT };
+
+const char* const OPERATION_NAMES[OPERATION_COUNT] = {"read", "update", "insert", "scan", "read_modify_write"};
+
+enum class Distribution { UNIFORM, ZIPFIAN, HOTSPOT, LATEST };
+
+const char* distribution_name(Distribution distribution) {
+    switch (distribution) {
+    case Distribution::UNIFORM: return "uniform";
+    case Distribution::ZIPFIAN: return "zipfian";
+    case Distribution::HOTSPOT: return "hotspot";
+    case Distribution::LATEST: return "latest";
+    }
+    return "";
+}
+
+// The core YCSB workloads: percentage of each operation and the request
+// distribution they are defined with
+struct Workload {
+    char name;
+    int percent[OPERATION_COUNT];
+    Distribution distribution;
+    const char* description;
+};
+
+const Workload WORKLOADS[] = {
+    {'a', {50, 50, 0, 0, 0}, Distribution::ZIPFIAN, "update heavy"},
+    {'b', {95, 5, 0, 0, 0}, Distribution::ZIPFIAN, "read mostly"},
+    {'c', {100, 0, 0, 0, 0}, Distribution::ZIPFIAN, "read only"},
+    {'d', {95, 0, 5, 0, 0}, Distribution::LATEST, "read latest"},
+    {'e', {0, 0, 5, 95, 0}, Distribution::ZIPFIAN, "short ranges"},
+    {'f', {50, 0, 0, 0, 50}, Distribution::ZIPFIAN, "read-modify-write"},
+};
+
+// Longest scan of workload E, scans are uniform from 1 to this many keys
+const uint64_t MAX_SCAN_LENGTH = 100;
+
+struct BenchConfig {
+    const Workload* workload = &WORKLOADS[0];
+    Distribution distribution = Distribution::ZIPFIAN;
+    bool distribution_set = false; // Otherwise the workload's own
+    double theta = 0.99;
+    double hot_key_fraction = 0.2; // Hotspot: this share of the keys
+    double hot_op_fraction = 0.8;  // gets this share of the operations
+    uint64_t record_count = 100000;
+    uint64_t operation_count = 1000000;
+    int thread_count = 8;
+    size_t min_value_size = 100;
+    size_t max_value_size = 100;
+    double rate = 0; // Operations per second over all threads, 0 for closed loop
+    bool load = true;
+    bool json = false;
+    std::string server_list = "node_list.txt";
+    size_t shared_pool_size = 0; // Connections per server of the shared client, 0 for a client per thread
+    LocalTransport transport = LocalTransport::SHARED_MEMORY; // For servers on this host
+};
+
+BenchConfig config;
+
+// Bench latencies are recorded with 1.6% error, see latency_histogram.h
+using Histogram = LatencyHistogram<6>;
+
+struct ThreadResult {
+    Histogram latencies[OPERATION_COUNT];
+    uint64_t not_found = 0;
+    uint64_t failed = 0;
+    uint64_t value_bytes = 0; // Of the values written and read
+};
+
+// Records are "user" followed by a hash of their index, as YCSB names them, so
+// that neighbouring indices land on unrelated servers and partitions
+std::string key_name(uint64_t index) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 8; ++i) {
+        hash = (hash ^ ((index >> (i * 8)) & 0xff)) * 0x100000001b3ULL;
+    }
+    return "user" + std::to_string(hash);
+}
+
+// Random values of the configured sizes, cut from one random buffer
+class ValueSource {
+public:
+    explicit ValueSource(uint64_t seed) : rng(seed) {
+        // Values start anywhere in the first VALUE_OFFSETS bytes
+        buffer.resize(config.max_value_size + VALUE_OFFSETS);
+        for (char& c : buffer) {
+            c = static_cast<char>('a' + rng() % 26);
+        }
+    }
+
+    std::string next() {
+        size_t size = config.min_value_size + rng() % (config.max_value_size - config.min_value_size + 1);
+        return buffer.substr(rng() % (buffer.size() - size), size);
+    }
+
+private:
+    static constexpr size_t VALUE_OFFSETS = 4096;
+
+    std::mt19937_64 rng;
+    std::string buffer;
+};
+
+// Inserted records, the load phase's plus the inserts of workloads D and E
+std::atomic<uint64_t> inserted_count{0};
+
+// Picks record indices according to the request distribution
+class KeyChooser {
+public:
+    KeyChooser(const ZipfianGenerator& zipfian, uint64_t seed) : zipfian(zipfian), rng(seed) {}
+
+    uint64_t next() {
+        uint64_t count = inserted_count.load(std::memory_order_relaxed);
+        switch (config.distribution) {
+        case Distribution::UNIFORM:
+            return rng() % count;
+        case Distribution::ZIPFIAN:
+            // Over the loaded records, scattered so the hot ones aren't neighbours
+            return scatter(zipfian.next(rng)) % count;
+        case Distribution::HOTSPOT: {
+            uint64_t hot_count = std::max<uint64_t>(1, count * config.hot_key_fraction);
+            bool hot = std::uniform_real_distribution<double>(0.0, 1.0)(rng) < config.hot_op_fraction;
+            return hot || hot_count == count ? rng() % hot_count : hot_count + rng() % (count - hot_count);
+        }
+        case Distribution::LATEST:
+            // The most recently inserted records are the most popular
+            return count - 1 - std::min(count - 1, zipfian.next(rng));
+        }
+        return 0;
+    }
+
+    int choose_operation() {
+        int roll = rng() % 100;
+        for (int operation = 0; operation < OPERATION_COUNT; ++operation) {
+            roll -= config.workload->percent[operation];
+            if (roll < 0) {
+                return operation;
+            }
+        }
+        return READ;
+    }
+
+    uint64_t scan_length() {
+        return 1 + rng() % MAX_SCAN_LENGTH;
+    }
+
+private:
+    static uint64_t scatter(uint64_t rank) {
+        rank = (rank ^ (rank >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        rank = (rank ^ (rank >> 27)) * 0x94d049bb133111ebULL;
+        return rank ^ (rank >> 31);
+    }
+
+    const ZipfianGenerator& zipfian;
+    std::mt19937_64 rng;
+};
+
+std::unique_ptr<FinchClient> shared_client; // With --shared-client
+
+// The shared client, or a new one for the calling thread kept in own_client
+FinchClient& thread_client(std::unique_ptr<FinchClient>& own_client) {
+    if (shared_client) {
+        return *shared_client;
+    }
+    own_client = std::make_unique<FinchClient>(config.server_list);
+    own_client->set_local_transport(config.transport);
+    return *own_client;
+}
+
+// Inserts the records with pipelined PUTs, each thread a contiguous share
+double run_load_phase() {
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> failed{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < config.thread_count; ++t) {
+        threads.emplace_back([&, t] {
+            std::unique_ptr<FinchClient> own_client;
+            FinchClient& client = thread_client(own_client);
+            ValueSource values(1000 + t);
+            std::vector<std::future<bool>> puts;
+            for (uint64_t i = t; i < config.record_count; i += config.thread_count) {
+                puts.push_back(client.put_async(key_name(i), values.next()));
+            }
+            client.flush();
+            for (auto& put : puts) {
+                failed += !put.get();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    inserted_count = config.record_count;
+    if (failed > 0) {
+        std::cerr << failed << " records failed to load\n";
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Runs one operation and returns whether the servers answered. Reads of a
+// missing key count as not found, like YCSB's.
+bool run_operation(FinchClient& client, KeyChooser& keys, ValueSource& values, int operation, ThreadResult& result) {
+    switch (operation) {
+    case READ: {
+        std::string value = client.get(key_name(keys.next()));
+        result.not_found += value.empty();
+        result.value_bytes += value.size();
+        return true;
+    }
+    case UPDATE: {
+        std::string value = values.next();
+        result.value_bytes += value.size();
+        return client.put(key_name(keys.next()), value);
+    }
+    case INSERT: {
+        std::string value = values.next();
+        result.value_bytes += value.size();
+        return client.put(key_name(inserted_count.fetch_add(1)), value);
+    }
+    case SCAN: {
+        // Servers run without --ordered-index here, and record keys are
+        // spread over servers and partitions by hash anyway, so a scan reads
+        // consecutive records with one MGET, a batch of YCSB's scan size
+        uint64_t first = keys.next();
+        uint64_t last = std::min(first + keys.scan_length(), inserted_count.load(std::memory_order_relaxed));
+        std::vector<std::string> scanned;
+        for (uint64_t index = first; index < last; ++index) {
+            scanned.push_back(key_name(index));
+        }
+        for (const std::string& value : client.mget(scanned)) {
+            result.not_found += value.empty();
+            result.value_bytes += value.size();
+        }
+        return true;
+    }
+    case READ_MODIFY_WRITE: {
+        std::string key = key_name(keys.next());
+        std::string value = client.get(key);
+        result.not_found += value.empty();
+        result.value_bytes += value.size();
+        value = values.next();
+        result.value_bytes += value.size();
+        return client.put(key, value);
+    }
+    }
+    return false;
+}
+
+void run_thread(int t, uint64_t operation_count, const ZipfianGenerator& zipfian,
+                std::chrono::steady_clock::time_point start, ThreadResult& result) {
+    std::unique_ptr<FinchClient> own_client;
+    FinchClient& client = thread_client(own_client);
+    KeyChooser keys(zipfian, 1 + t);
+    ValueSource values(2000 + t);
+
+    // Open loop: this thread's operations arrive every interval, staggered
+    // against the other threads'
+    std::chrono::nanoseconds interval(0);
+    if (config.rate > 0) {
+        interval = std::chrono::nanoseconds(static_cast<int64_t>(1e9 * config.thread_count / config.rate));
+    }
+    auto scheduled = start + interval * t / config.thread_count;
+
+    for (uint64_t i = 0; i < operation_count; ++i) {
+        int operation = keys.choose_operation();
+        auto begin = std::chrono::steady_clock::now();
+        if (config.rate > 0) {
+            if (begin < scheduled) {
+                std::this_thread::sleep_until(scheduled);
+            }
+            begin = scheduled;
+            scheduled += interval;
+        }
+        bool answered;
+        try {
+            answered = run_operation(client, keys, values, operation, result);
+        } catch (const std::exception&) {
+            answered = false;
+        }
+        auto end = std::chrono::steady_clock::now();
+        if (!answered) {
+            result.failed++;
+            continue;
+        }
+        result.latencies[operation].record(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+    }
+}
+
+double micros(double nanoseconds) {
+    return nanoseconds / 1000.0;
+}
+
+void print_text_report(const ThreadResult& total, double load_seconds, double run_seconds) {
+    const Workload& workload = *config.workload;
+    std::cout << "Workload " << static_cast<char>(std::toupper(workload.name)) << " (" << workload.description << "), "
+              << distribution_name(config.distribution) << " keys, " << config.record_count << " records, "
+              << config.min_value_size;
+    if (config.max_value_size != config.min_value_size) {
+        std::cout << "-" << config.max_value_size;
+    }
+    std::cout << " byte values\n";
+    if (config.load) {
+        std::cout << "Load: " << config.record_count << " records in " << load_seconds << " s, "
+                  << static_cast<uint64_t>(config.record_count / load_seconds) << " records/s\n";
+    }
+    uint64_t completed = 0;
+    for (const Histogram& latencies : total.latencies) {
+        completed += latencies.size();
+    }
+    std::cout << "Run: " << config.thread_count << " threads, "
+              << (config.rate > 0 ? "open loop at " + std::to_string(static_cast<uint64_t>(config.rate)) + " ops/s"
+                                  : std::string("closed loop"))
+              << ", " << completed << " operations in " << run_seconds << " s, "
+              << static_cast<uint64_t>(completed / run_seconds) << " ops/s, " << total.failed << " failed, "
+              << total.not_found << " not found, " << std::fixed << std::setprecision(1)
+              << total.value_bytes / run_seconds / (1 << 20) << " MB/s of values\n" << std::defaultfloat;
+
+    std::cout << std::left << std::setw(18) << "operation" << std::right << std::setw(10) << "count" << std::setw(10)
+              << "ops/s" << std::setw(10) << "mean us" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+              << std::setw(10) << "p99.9 us" << std::setw(10) << "max us" << "\n";
+    std::cout << std::fixed << std::setprecision(1);
+    for (int operation = 0; operation < OPERATION_COUNT; ++operation) {
+        const Histogram& latencies = total.latencies[operation];
+        if (latencies.size() == 0) continue;
+        std::cout << std::left << std::setw(18) << OPERATION_NAMES[operation] << std::right << std::setw(10)
+                  << latencies.size() << std::setw(10) << static_cast<uint64_t>(latencies.size() / run_seconds)
+                  << std::setw(10) << micros(latencies.mean()) << std::setw(10) << micros(latencies.percentile(0.5))
+                  << std::setw(10) << micros(latencies.percentile(0.99)) << std::setw(10)
+                  << micros(latencies.percentile(0.999)) << std::setw(10) << micros(latencies.maximum()) << "\n";
+    }
+}
+
+void print_json_report(const ThreadResult& total, double load_seconds, double run_seconds) {
+    uint64_t completed = 0;
+    for (const Histogram& latencies : total.latencies) {
+        completed += latencies.size();
+    }
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(3);
+    json << "{\"workload\":\"" << config.workload->name << "\",\"distribution\":\""
+         << distribution_name(config.distribution) << "\",\"records\":" << config.record_count
+         << ",\"min_value_size\":" << config.min_value_size << ",\"max_value_size\":" << config.max_value_size
+         << ",\"threads\":" << config.thread_count << ",\"mode\":\"" << (config.rate > 0 ? "open" : "closed")
+         << "\",\"target_rate\":" << config.rate << ",\"load_seconds\":" << (config.load ? load_seconds : 0)
+         << ",\"run_seconds\":" << run_seconds << ",\"operations\":" << completed
+         << ",\"throughput\":" << completed / run_seconds
+         << ",\"value_bytes_per_second\":" << total.value_bytes / run_seconds << ",\"failed\":" << total.failed
+         << ",\"not_found\":" << total.not_found << ",\"latency_us\":{";
+    bool first = true;
+    for (int operation = 0; operation < OPERATION_COUNT; ++operation) {
+        const Histogram& latencies = total.latencies[operation];
+        if (latencies.size() == 0) continue;
+        json << (first ? "" : ",") << "\"" << OPERATION_NAMES[operation] << "\":{\"count\":" << latencies.size()
+             << ",\"throughput\":" << latencies.size() / run_seconds << ",\"mean\":" << micros(latencies.mean())
+             << ",\"p50\":" << micros(latencies.percentile(0.5)) << ",\"p99\":" << micros(latencies.percentile(0.99))
+             << ",\"p999\":" << micros(latencies.percentile(0.999)) << ",\"max\":" << micros(latencies.maximum())
+             << "}";
+        first = false;
+    }
+    json << "}}";
+    std::cout << json.str() << "\n";
+}
+
+void print_usage() {
+    std::cerr << "Usage: bench [--workload=a|b|c|d|e|f] [--distribution=uniform|zipfian|hotspot|latest]\n"
+              << "             [--theta=X] [--hotspot=KEYS:OPS] [--records=N] [--operations=N] [--threads=N]\n"
+              << "             [--value-size=BYTES[-BYTES]] [--rate=OPS] [--no-load] [--json] [--servers=FILE]\n"
+              << "             [--shared-client[=CONNECTIONS]] [--transport=tcp|unix|shm]\n"
+              << "  --workload      a: 50/50 read/update     b: 95/5 read/update   c: read only\n"
+              << "                  d: 95/5 read/insert, latest keys\n"
+              << "                  e: 95/5 scan/insert      f: 50/50 read/read-modify-write (default: a)\n"
+              << "  --distribution  request distribution (default: the workload's)\n"
+              << "  --theta         Zipfian skew (default: 0.99)\n"
+              << "  --hotspot       share of the keys getting a share of the operations (default: 0.2:0.8)\n"
+              << "  --records       records loaded before the run (default: 100000)\n"
+              << "  --operations    operations over all threads (default: 1000000)\n"
+              << "  --threads       client threads, each with its own connections (default: 8)\n"
+              << "  --value-size    value size, or a range picked from uniformly, K, M or G for KiB,\n"
+              << "                  MiB or GiB (default: 100)\n"
+              << "  --rate          open loop at this many operations per second over all threads\n"
+              << "                  (default: closed loop)\n"
+              << "  --no-load       run against records loaded by an earlier run\n"
+              << "  --json          print the results as one JSON object\n"
+              << "  --servers       server list (default: node_list.txt)\n"
+              << "  --shared-client one client for all threads, with this many connections per server\n"
+              << "                  (default: " << DEFAULT_POOL_SIZE << ")\n"
+              << "  --transport     how to reach servers on this host, see set_local_transport\n"
+              << "                  (default: shm)\n";
+}
+
+// Bytes, or KiB, MiB or GiB with a K, M or G suffix
+size_t parse_size(const std::string& text) {
+    size_t suffix_pos;
+    size_t size = std::stoull(text, &suffix_pos);
+    std::string suffix = text.substr(suffix_pos);
+    if (suffix == "K") return size << 10;
+    if (suffix == "M") return size << 20;
+    if (suffix == "G") return size << 30;
+    if (!suffix.empty()) throw std::invalid_argument("size suffix");
+    return size;
+}
+
+bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg.rfind("--workload=", 0) == 0) {
+                std::string name = arg.substr(11);
+                config.workload = nullptr;
+                for (const Workload& workload : WORKLOADS) {
+                    if (name.size() == 1 && std::tolower(name[0]) == workload.name) {
+                        config.workload = &workload;
+                    }
+                }
+                if (!config.workload) return false;
+            } else if (arg.rfind("--distribution=", 0) == 0) {
+                std::string name = arg.substr(15);
+                config.distribution_set = true;
+                if (name == "uniform") {
+                    config.distribution = Distribution::UNIFORM;
+                } else if (name == "zipfian") {
+                    config.distribution = Distribution::ZIPFIAN;
+                } else if (name == "hotspot") {
+                    config.distribution = Distribution::HOTSPOT;
+                } else if (name == "latest") {
+                    config.distribution = Distribution::LATEST;
+                } else {
+                    return false;
+                }
+            } else if (arg.rfind("--theta=", 0) == 0) {
+                config.theta = std::stod(arg.substr(8));
+                if (config.theta <= 0 || config.theta >= 1) return false;
+            } else if (arg.rfind("--hotspot=", 0) == 0) {
+                std::string fractions = arg.substr(10);
+                size_t colon = fractions.find(':');
+                if (colon == std::string::npos) return false;
+                config.hot_key_fraction = std::stod(fractions.substr(0, colon));
+                config.hot_op_fraction = std::stod(fractions.substr(colon + 1));
+                if (config.hot_key_fraction <= 0 || config.hot_key_fraction > 1 || config.hot_op_fraction < 0 ||
+                    config.hot_op_fraction > 1) {
+                    return false;
+                }
+            } else if (arg.rfind("--records=", 0) == 0) {
+                config.record_count = std::stoull(arg.substr(10));
+                if (config.record_count < 2) return false;
+            } else if (arg.rfind("--operations=", 0) == 0) {
+                config.operation_count = std::stoull(arg.substr(13));
+            } else if (arg.rfind("--threads=", 0) == 0) {
+                config.thread_count = std::stoi(arg.substr(10));
+                if (config.thread_count < 1) return false;
+            } else if (arg.rfind("--value-size=", 0) == 0) {
+                std::string sizes = arg.substr(13);
+                size_t dash = sizes.find('-');
+                config.min_value_size = parse_size(sizes.substr(0, dash));
+                config.max_value_size = dash == std::string::npos ? config.min_value_size : parse_size(sizes.substr(dash + 1));
+                if (config.min_value_size == 0 || config.max_value_size < config.min_value_size) return false;
+            } else if (arg.rfind("--rate=", 0) == 0) {
+                config.rate = std::stod(arg.substr(7));
+                if (config.rate <= 0) return false;
+            } else if (arg == "--no-load") {
+                config.load = false;
+            } else if (arg == "--json") {
+                config.json = true;
+            } else if (arg.rfind("--servers=", 0) == 0) {
+                config.server_list = arg.substr(10);
+            } else if (arg == "--shared-client") {
+                config.shared_pool_size = DEFAULT_POOL_SIZE;
+            } else if (arg.rfind("--shared-client=", 0) == 0) {
+                config.shared_pool_size = std::stoull(arg.substr(16));
+                if (config.shared_pool_size < 1) return false;
+            } else if (arg == "--transport=tcp") {
+                config.transport = LocalTransport::TCP;
+            } else if (arg == "--transport=unix") {
+                config.transport = LocalTransport::UNIX_SOCKET;
+            } else if (arg == "--transport=shm") {
+                config.transport = LocalTransport::SHARED_MEMORY;
+            } else {
+                return false;
+            }
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    if (!config.distribution_set) {
+        config.distribution = config.workload->distribution;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        print_usage();
+        return 1;
+    }
+
+    double load_seconds = 0;
+    try {
+        if (config.shared_pool_size > 0) {
+            shared_client = std::make_unique<FinchClient>(config.server_list, DEFAULT_WINDOW_SIZE, config.shared_pool_size);
+            shared_client->set_local_transport(config.transport);
+        }
+        if (config.load) {
+            load_seconds = run_load_phase();
+        } else {
+            inserted_count = config.record_count;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    ZipfianGenerator zipfian(config.record_count, config.theta);
+    std::vector<ThreadResult> results(config.thread_count);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < config.thread_count; ++t) {
+        uint64_t share = config.operation_count / config.thread_count + (t < static_cast<int>(config.operation_count % config.thread_count));
+        threads.emplace_back(run_thread, t, share, std::cref(zipfian), start, std::ref(results[t]));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double run_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    ThreadResult total;
+    for (const ThreadResult& result : results) {
+        for (int operation = 0; operation < OPERATION_COUNT; ++operation) {
+            total.latencies[operation].merge(result.latencies[operation]);
+        }
+        total.not_found += result.not_found;
+        total.failed += result.failed;
+        total.value_bytes += result.value_bytes;
+    }
+    if (config.json) {
+        print_json_report(total, load_seconds, run_seconds);
+    } else {
+        print_text_report(total, load_seconds, run_seconds);
+    }
+    return total.failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <random>
+
+// The hashes of the last CAPACITY keys changed on this server, numbered in
+// the order they were added, for clients to poll for the entries of their
+// near caches to drop. Nothing is kept until the first client polls, since
+// every change then takes a shared counter.
+//
+// Slots are written without a lock, seqlock style: a writer clears the
+// slot's sequence, writes the hash and then the sequence, and a reader only
+// takes a hash whose slot showed the same sequence before and after.
+class ChangeLog {
+public:
+    static constexpr size_t CAPACITY = 1 << 16;
+
+    // Numbering starts somewhere random, so that a client that polled a
+    // previous run of the server finds its changes lost rather than reading
+    // unrelated ones under the numbers it remembers
+    ChangeLog() {
+        std::random_device random;
+        uint64_t base = (static_cast<uint64_t>(random()) << 32 | random()) >> 2;
+        next.store(base + 1, std::memory_order_relaxed);
+    }
+
+    void add(uint64_t key_hash) {
+        if (!active.load(std::memory_order_relaxed)) {
+            return;
+        }
+        uint64_t sequence = next.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = slots[sequence % CAPACITY];
+        slot.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.key_hash.store(key_hash, std::memory_order_relaxed);
+        slot.sequence.store(sequence, std::memory_order_release);
+    }
+
+    // Calls fn(key_hash) for the changes numbered since and later, and
+    // returns the number to read from next time. A since of 0 starts the log
+    // and reads nothing. Sets lost if changes since then were already
+    // overwritten, or since is from before the server started.
+    template <class Fn>
+    uint64_t read(uint64_t since, bool& lost, Fn&& fn) {
+        active.store(true, std::memory_order_relaxed);
+        uint64_t end = next.load(std::memory_order_acquire);
+        lost = since != 0 && (since > end || end - since > CAPACITY);
+        if (since == 0 || lost) {
+            return end;
+        }
+        for (; since < end; ++since) {
+            const Slot& slot = slots[since % CAPACITY];
+            uint64_t before = slot.sequence.load(std::memory_order_acquire);
+            uint64_t key_hash = slot.key_hash.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t after = slot.sequence.load(std::memory_order_relaxed);
+            if (before != since || after != since) {
+                // Still being written, read it next time, or already overwritten
+                lost = before > since || after > since;
+                return lost ? end : since;
+            }
+            fn(key_hash);
+        }
+        return since;
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence{0}; // 0 while being written
+        std::atomic<uint64_t> key_hash{0};
+    };
+
+    std::unique_ptr<Slot[]> slots{new Slot[CAPACITY]};
+    std::atomic<uint64_t> next{1};
+    std::atomic<bool> active{false};
+};
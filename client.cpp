@@ -1,9 +1,20 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <deque>
 #include <string>
 #include <sstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <cstring>
 #include <arpa/inet.h>
@@ -11,49 +22,243 @@
 #include <unordered_map>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <ifaddrs.h>
+#include <poll.h>
 #include <errno.h>
+#include <thread>
 
-const int MAX_BUFFER_SIZE = 1024;
+#include "hash_ring.h"
+#include "key_hash.h"
+#include "near_cache.h"
+#include "shm_channel.h"
+
+const int MAX_BUFFER_SIZE = 65536;
+
+// Requests in flight per connection before the client waits for responses
+const size_t DEFAULT_WINDOW_SIZE = 128;
+
+// Connections per server, shared by every thread using the client
+const size_t DEFAULT_POOL_SIZE = 8;
+
+// TCP keepalive: idle seconds before the first probe, seconds between probes,
+// and unanswered probes before the connection counts as broken
+const int KEEPALIVE_IDLE_SECONDS = 10;
+const int KEEPALIVE_INTERVAL_SECONDS = 5;
+const int KEEPALIVE_PROBES = 3;
+
+// Keys per batch message; larger batches are split into several messages
+const size_t MAX_BATCH_ENTRIES = 1024;
+
+// Buffered requests are sent once they reach this size, even if the window isn't full
+const size_t MAX_COALESCED_BYTES = 64 * 1024;
+
+// Values at least this large are sent from the caller's string, next to the
+// buffered requests, instead of being copied into the send buffer, and are
+// received straight into the string returned to the caller
+const size_t LARGE_VALUE_SIZE = MAX_COALESCED_BYTES;
+
+// Largest message the servers accept; a request's key and value must leave
+// room for its other fields
+const size_t MAX_MESSAGE_SIZE = 1 << 30;
+const size_t MAX_KEY_VALUE_SIZE = MAX_MESSAGE_SIZE - 64;
 
 // Define operation types
 const uint8_t OP_GET = 1;
 const uint8_t OP_PUT = 2;
 const uint8_t OP_DEL = 3;
+const uint8_t OP_STATS = 4;
+const uint8_t OP_MGET = 5;
+const uint8_t OP_MPUT = 6;
+const uint8_t OP_MDEL = 7;
+const uint8_t OP_SETEX = 8;
+const uint8_t OP_HANDOFF_BEGIN = 9;
+const uint8_t OP_HANDOFF_END = 10;
+const uint8_t OP_SCAN = 14;
+const uint8_t OP_INCR = 15;
+const uint8_t OP_CAS = 16;
+const uint8_t OP_APPEND = 17;
+const uint8_t OP_GETSET = 18;
+const uint8_t OP_INVALIDATIONS = 19;
+const uint8_t OP_SHM_ATTACH = 20;
+
+// A CAS's Expected Length when the key must not exist
+const uint32_t CAS_ABSENT = UINT32_MAX;
+
+// Keys asked for per SCAN by scan and scan_range
+const size_t DEFAULT_SCAN_COUNT = 1000;
+
+// A SCAN's next partition once the server has visited all of them
+const uint32_t SCAN_DONE = UINT32_MAX;
+
+// How often end_handoff asks the servers whether their migration is done
+const int HANDOFF_POLL_INTERVAL_MS = 100;
+
+// How long after a server was last polled for changed keys its values may
+// still be read from the near cache
+const uint32_t DEFAULT_NEAR_CACHE_STALENESS_MS = 20;
+
+// How connections reach a server on the client's own host, see
+// set_local_transport
+enum class LocalTransport { TCP, UNIX_SOCKET, SHARED_MEMORY };
+
+// Whether address, as written in node_list.txt, is one of this host's
+bool is_local_address(const std::string& address) {
+    in_addr parsed{};
+    if (address == "localhost") return true;
+    if (inet_pton(AF_INET, address.c_str(), &parsed) != 1) return false;
+    if ((ntohl(parsed.s_addr) >> 24) == 127) return true;
+
+    ifaddrs* interfaces;
+    if (getifaddrs(&interfaces) != 0) return false;
+    bool local = false;
+    for (ifaddrs* interface = interfaces; interface && !local; interface = interface->ifa_next) {
+        if (interface->ifa_addr && interface->ifa_addr->sa_family == AF_INET) {
+            local = reinterpret_cast<sockaddr_in*>(interface->ifa_addr)->sin_addr.s_addr == parsed.s_addr;
+        }
+    }
+    freeifaddrs(interfaces);
+    return local;
+}
 
 struct ServerInfo {
     std::string address;
     int port;
+    std::vector<ServerInfo> replicas; // Listed after the primary on its node_list.txt line
+
+    // The member name on the hash ring, as in node_list.txt
+    std::string member() const {
+        return address + ":" + std::to_string(port);
+    }
+};
+
+// Called once per request with whether a response arrived, its status code
+// and its payload.
+using ResponseHandler = std::function<void(bool delivered, char status_code, std::string& response)>;
+
+struct ConnectionPool;
+
+// One socket to a server. Only the thread that checked it out of its pool
+// uses it, for one request or for as long as that thread has asynchronous
+// requests pending on it.
+struct ServerConnection {
+    ConnectionPool* pool = nullptr;
+    int sock = -1; // -1 indicates no connection
+    std::vector<uint8_t> outgoing;         // Serialized requests not sent yet
+    size_t unsent_count = 0;               // Requests in outgoing
+    std::deque<ResponseHandler> in_flight; // Requests waiting for a response, oldest first
+    std::vector<uint8_t> incoming;         // Received bytes not parsed yet
+    std::atomic<bool> checked_out{false};
+    // Once attached, carries the requests and responses instead of sock,
+    // which then only tells whether the server is still there
+    std::unique_ptr<ShmSegment> shm;
+};
+
+// Up to pool_size connections to one server, shared by every thread using
+// the client and opened as they are first needed. A thread checks one out by
+// flipping its checked_out flag with a compare-and-swap, starting its search
+// at its own offset so that threads rarely try the same connection, and only
+// waits, on checkins, when every connection is busy.
+struct ConnectionPool {
+    ConnectionPool(const ServerInfo& server, size_t size)
+        : server(server), size(size), connections(new ServerConnection[size]), local(is_local_address(server.address)) {
+        for (size_t i = 0; i < size; ++i) {
+            connections[i].pool = this;
+        }
+    }
+
+    ~ConnectionPool() {
+        close_idle();
+    }
+
+    // Closes the connections no thread has checked out
+    void close_idle() {
+        for (size_t i = 0; i < size; ++i) {
+            bool expected = false;
+            if (connections[i].checked_out.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                if (connections[i].sock != -1) {
+                    close(connections[i].sock);
+                    connections[i].sock = -1;
+                }
+                connections[i].shm.reset();
+                connections[i].checked_out.store(false, std::memory_order_release);
+            }
+        }
+    }
+
+    ServerInfo server;
+    size_t size;
+    std::unique_ptr<ServerConnection[]> connections;
+    std::atomic<uint32_t> checkins{0}; // Waited on while every connection is checked out
+    bool local; // On this host, so maybe reachable over its Unix domain socket
+
+    // For the near cache: the sequence to poll the server's change log from,
+    // only used by the poller, and until when (steady clock, nanoseconds)
+    // the values read from the server may be served from the cache
+    uint64_t invalidations_since = 0;
+    std::atomic<int64_t> cache_fresh_until_ns{0};
+};
+
+// Near cache counters: the cache's own, and the polls for changed keys with
+// the key hashes and bytes they brought back. A flush empties the cache when
+// changes were lost, because a poll came too late or the server restarted.
+struct NearCacheStats {
+    NearCache::Stats cache;
+    uint64_t polls = 0;
+    uint64_t changed_keys = 0;
+    uint64_t poll_bytes = 0;
+    uint64_t flushes = 0;
 };
 
 class FinchClient {
 public:
-    FinchClient(const std::string& server_list_filename = "node_list.txt") {
-        servers = read_server_list(server_list_filename);
-        if (servers.empty()) {
+    // One client can be shared by any number of threads, which then share
+    // pool_size connections per server.
+    FinchClient(const std::string& server_list_filename = "node_list.txt", size_t window_size = DEFAULT_WINDOW_SIZE,
+                size_t pool_size = DEFAULT_POOL_SIZE)
+        : window_size(std::max<size_t>(1, window_size)), pool_size(std::max<size_t>(1, pool_size)) {
+        std::vector<ServerInfo> primaries = read_server_list(server_list_filename);
+        if (primaries.empty()) {
             throw std::runtime_error("No servers found in node_list.txt");
         }
 
-        // Initialize connections map
-        for (size_t i = 0; i < servers.size(); ++i) {
-            connections[i] = -1; // -1 indicates no connection
+        auto initial = std::make_unique<Topology>();
+        for (const ServerInfo& primary : primaries) {
+            initial->ring_server_ids.push_back(add_primary(*initial, primary));
         }
+        initial->ring = build_ring(*initial, initial->ring_server_ids);
+        publish(std::move(initial));
     }
 
     ~FinchClient() {
-        // Close all open sockets
-        for (auto& conn : connections) {
-            if (conn.second != -1) {
-                close(conn.second);
+        if (invalidation_poller.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(poller_mtx);
+                stopping_poller = true;
             }
+            poller_cv.notify_one();
+            invalidation_poller.join();
         }
+        // Complete this thread's pending asynchronous requests. The pools
+        // close all open sockets.
+        flush();
+        sessions.erase(client_id);
+        cached_session = nullptr;
+        cached_session_client_id = 0;
     }
 
     std::string get(const std::string& key) {
         std::string response;
         char status_code;
+        CachedRead cached;
+        if (read_cached(key, cached, response)) {
+            return response;
+        }
         if (send_command(OP_GET, key, "", status_code, response)) {
             if (status_code == '0') {
                 // Success, response contains the value
+                fill_cached(cached, key, response);
                 return response;
             } else {
                 // Failure, response contains error message
@@ -74,6 +279,18 @@ public:
         }
     }
 
+    // Stores the pair for ttl_seconds, after which the server deletes it. A
+    // later put without a TTL keeps the key until it is deleted.
+    bool setex(const std::string& key, uint32_t ttl_seconds, const std::string& value) {
+        std::string response;
+        char status_code;
+        if (send_command(OP_SETEX, key, value, status_code, response, ttl_seconds)) {
+            return status_code == '0';
+        } else {
+            return false;
+        }
+    }
+
     bool del(const std::string& key) {
         std::string response;
         char status_code;
@@ -88,73 +305,803 @@ public:
         }
     }
 
+    // Atomic read-modify-write operations, each run by the key's server under
+    // the partition lock, in one round trip. INCR and APPEND keep the key's
+    // TTL, while CAS and GETSET store it without one, as put does. They throw
+    // if no response arrives, without retrying, since the server may have
+    // applied them anyway.
+
+    // Adds delta to the key's value, a decimal 64-bit integer, and returns
+    // the result. A missing key counts as 0. Returns nothing if the value
+    // isn't an integer or the result would overflow.
+    std::optional<int64_t> incr(const std::string& key, int64_t delta = 1) {
+        std::string response;
+        char status_code;
+        if (!send_command(OP_INCR, key, std::to_string(delta), status_code, response)) {
+            throw std::runtime_error("Failed to increment the key: " + key);
+        }
+        if (status_code != '0') {
+            return std::nullopt;
+        }
+        return std::stoll(response);
+    }
+
+    std::optional<int64_t> decr(const std::string& key, int64_t delta = 1) {
+        if (delta == INT64_MIN) {
+            return std::nullopt;
+        }
+        return incr(key, -delta);
+    }
+
+    // Replaces the value with new_value if it is still expected. Returns
+    // false if it isn't, or if the key doesn't exist.
+    bool cas(const std::string& key, const std::string& expected, const std::string& new_value) {
+        return send_cas(key, &expected, new_value);
+    }
+
+    // Stores the pair only if the key doesn't exist yet
+    bool put_if_absent(const std::string& key, const std::string& value) {
+        return send_cas(key, nullptr, value);
+    }
+
+    // Appends suffix to the key's value, storing it as the value of a missing
+    // key. Returns the new length of the value.
+    size_t append(const std::string& key, const std::string& suffix) {
+        std::string response;
+        char status_code;
+        if (!send_command(OP_APPEND, key, suffix, status_code, response) || status_code != '0') {
+            throw std::runtime_error("Failed to append to the key: " + key);
+        }
+        return std::stoull(response);
+    }
+
+    // Stores value and returns the value it replaced, empty if the key
+    // didn't exist
+    std::string getset(const std::string& key, const std::string& value) {
+        std::string response;
+        char status_code;
+        if (!send_command(OP_GETSET, key, value, status_code, response)) {
+            throw std::runtime_error("Failed to set the key: " + key);
+        }
+        return status_code == '0' ? response : "";
+    }
+
+    // Streaming variants of get and put, for values too large to hold twice.
+    // get_stream writes the value to out piece by piece as it arrives and
+    // returns false if the key doesn't exist; put_stream sends size bytes read
+    // from in as they are read. Neither holds more than MAX_BUFFER_SIZE of the
+    // value at a time. Streaming reads go to the key's owner, and to its
+    // previous owner during a handoff, but not to replicas. A streaming put
+    // whose connection fails is not retried, since in can't be read again.
+    bool get_stream(const std::string& key, std::ostream& out) {
+        if (key.empty()) {
+            std::cerr << "Key cannot be empty.\n";
+            return false;
+        }
+        const Topology& topology = routing();
+        uint64_t key_hash = hash_key(key);
+        size_t server_id = server_for(topology, key_hash);
+        bool found = false;
+        if (!stream_from_server(*topology.servers[server_id], key_hash, key, out, found)) {
+            throw std::runtime_error("Failed to get the key: " + key);
+        }
+        size_t previous_id = previous_server_for(topology, key_hash);
+        if (!found && previous_id != server_id &&
+            stream_from_server(*topology.servers[previous_id], key_hash, key, out, found) && !found) {
+            // The key may have moved to its new owner between the two reads
+            stream_from_server(*topology.servers[server_id], key_hash, key, out, found);
+        }
+        return found;
+    }
+
+    bool put_stream(const std::string& key, std::istream& in, size_t size) {
+        if (key.empty() || key.size() + size > MAX_KEY_VALUE_SIZE) {
+            std::cerr << "Key cannot be empty or too large.\n";
+            return false;
+        }
+        const Topology& topology = routing();
+        uint64_t key_hash = hash_key(key);
+        ServerConnection& conn = acquire(*topology.servers[server_for(topology, key_hash)]);
+        bool stored = false;
+        ResponseHandler handler = [&](bool delivered, char status_code, std::string&) {
+            stored = delivered && status_code == '0';
+        };
+        if (near_cache) {
+            invalidate_cached(key_hash, handler);
+        }
+        reserve_slot(conn);
+        append_message_header(conn.outgoing, OP_PUT, key_hash, key, size);
+        commit_slot(conn, std::move(handler));
+
+        // Each piece is read into the emptied send buffer and sent from there
+        size_t remaining = size;
+        while (remaining > 0 && send_outgoing(conn)) {
+            size_t piece = std::min<size_t>(remaining, MAX_BUFFER_SIZE);
+            conn.outgoing.resize(piece);
+            in.read(reinterpret_cast<char*>(conn.outgoing.data()), piece);
+            if (static_cast<size_t>(in.gcount()) != piece) {
+                // The server would take whatever is sent next for the rest of the value
+                std::cerr << "Stream ended before " << size << " bytes for key: " << key << "\n";
+                fail_connection(conn);
+                break;
+            }
+            remaining -= piece;
+        }
+        release(conn);
+        return stored;
+    }
+
+    // Asynchronous variants of get, put, setex and del. Requests are buffered and
+    // pipelined, up to window_size per server, and coalesced into as few sends
+    // as possible. Futures are fulfilled as responses are read, which happens
+    // when a window fills up, on flush() or on any synchronous call to the same
+    // server. Call flush() before waiting on a future. Requests belong to the
+    // thread that made them, which keeps a connection per server checked out
+    // for them until they are complete, and only its flush() sends them.
+    std::future<std::string> get_async(const std::string& key) {
+        auto promise = std::make_shared<std::promise<std::string>>();
+        CachedRead cached;
+        std::string value;
+        if (read_cached(key, cached, value)) {
+            promise->set_value(std::move(value));
+            return promise->get_future();
+        }
+        enqueue_command(OP_GET, key, "", [this, promise, key, cached](bool delivered, char status_code, std::string& response) {
+            if (!delivered) {
+                promise->set_exception(std::make_exception_ptr(std::runtime_error("Failed to get the key: " + key)));
+            } else if (status_code == '0') {
+                fill_cached(cached, key, response);
+                promise->set_value(std::move(response));
+            } else {
+                promise->set_value("");
+            }
+        });
+        return promise->get_future();
+    }
+
+    std::future<bool> put_async(const std::string& key, const std::string& value) {
+        auto promise = std::make_shared<std::promise<bool>>();
+        enqueue_command(OP_PUT, key, value, [promise](bool delivered, char status_code, std::string&) {
+            promise->set_value(delivered && status_code == '0');
+        });
+        return promise->get_future();
+    }
+
+    std::future<bool> setex_async(const std::string& key, uint32_t ttl_seconds, const std::string& value) {
+        auto promise = std::make_shared<std::promise<bool>>();
+        enqueue_command(OP_SETEX, key, value, [promise](bool delivered, char status_code, std::string&) {
+            promise->set_value(delivered && status_code == '0');
+        }, ttl_seconds);
+        return promise->get_future();
+    }
+
+    std::future<bool> del_async(const std::string& key) {
+        auto promise = std::make_shared<std::promise<bool>>();
+        enqueue_command(OP_DEL, key, "", [promise](bool delivered, char status_code, std::string&) {
+            promise->set_value(delivered && status_code == '0');
+        });
+        return promise->get_future();
+    }
+
+    // Sends every request this thread has buffered, waits until all responses
+    // have arrived and returns the connections to their pools
+    void flush() {
+        Session& own = session();
+        while (true) {
+            // Send to every server first, so they all work while we wait
+            for (ServerConnection* conn : own.held) {
+                send_outgoing(*conn);
+            }
+            release_held(own);
+            if (own.fallbacks.empty()) {
+                return;
+            }
+            // During a handoff, some responses asked for a second request to
+            // the key's previous owner
+            std::deque<Fallback> sending;
+            sending.swap(own.fallbacks);
+            for (Fallback& fallback : sending) {
+                enqueue_to_server(*fallback.server, fallback.op_type, fallback.key_hash, fallback.key, "",
+                                  std::move(fallback.handler));
+            }
+        }
+    }
+
+    // Batch operations. Keys are grouped by server and every server receives
+    // its share in one message, with all servers working in parallel.
+
+    // Returns one value per key, empty for keys that don't exist
+    std::vector<std::string> mget(const std::vector<std::string>& keys) {
+        std::vector<BatchEntry> entries;
+        entries.reserve(keys.size());
+        for (const std::string& key : keys) {
+            entries.push_back({&key, nullptr});
+        }
+
+        std::vector<char> status_codes;
+        std::vector<std::string> values;
+        if (!send_batch(OP_MGET, entries, status_codes, values)) {
+            throw std::runtime_error("Failed to get " + std::to_string(keys.size()) + " keys");
+        }
+        return values;
+    }
+
+    // Returns true if every pair was stored
+    bool mput(const std::vector<std::pair<std::string, std::string>>& pairs) {
+        std::vector<BatchEntry> entries;
+        entries.reserve(pairs.size());
+        for (const auto& pair : pairs) {
+            entries.push_back({&pair.first, &pair.second});
+        }
+
+        std::vector<char> status_codes;
+        std::vector<std::string> results;
+        if (!send_batch(OP_MPUT, entries, status_codes, results)) {
+            return false;
+        }
+        return std::all_of(status_codes.begin(), status_codes.end(), [](char status_code) { return status_code == '0'; });
+    }
+
+    // Returns the number of keys that existed and were deleted
+    size_t mdel(const std::vector<std::string>& keys) {
+        std::vector<BatchEntry> entries;
+        entries.reserve(keys.size());
+        for (const std::string& key : keys) {
+            entries.push_back({&key, nullptr});
+        }
+
+        std::vector<char> status_codes;
+        std::vector<std::string> results;
+        send_batch(OP_MDEL, entries, status_codes, results);
+        return std::count(status_codes.begin(), status_codes.end(), '0');
+    }
+
+    // Returns the keys starting with prefix, from every server, in order.
+    // Servers must run with --ordered-index.
+    std::vector<std::string> scan(const std::string& prefix, size_t count_hint = DEFAULT_SCAN_COUNT) {
+        // The range ends at the first string after every string with the
+        // prefix: the prefix without its trailing 0xff bytes and the last
+        // byte before them incremented, or nowhere if it is all 0xff bytes
+        std::string end = prefix;
+        while (!end.empty() && static_cast<unsigned char>(end.back()) == 0xff) {
+            end.pop_back();
+        }
+        if (!end.empty()) {
+            end.back() = static_cast<char>(static_cast<unsigned char>(end.back()) + 1);
+        }
+        return scan_range(prefix, end, count_hint);
+    }
+
+    // Returns the keys in [start, end) from every server, in order, with an
+    // empty end for no upper bound. Every server is walked with SCANs of up to
+    // count_hint keys each, all servers at once, and the keys are merged.
+    // During a handoff the servers of both rings are walked, and a key found
+    // on both is listed once.
+    std::vector<std::string> scan_range(const std::string& start, const std::string& end, size_t count_hint = DEFAULT_SCAN_COUNT) {
+        const Topology& topology = routing();
+        std::vector<ScanCursor> cursors;
+        for (size_t server_id : handoff_server_ids(topology)) {
+            cursors.push_back({server_id, 0, ""});
+        }
+
+        std::vector<std::string> keys;
+        bool failed = false;
+        bool walking = true;
+        while (walking) {
+            walking = false;
+            for (ScanCursor& cursor : cursors) {
+                if (cursor.partition == SCAN_DONE) continue;
+                walking = true;
+                ServerConnection& conn = acquire(*topology.servers[cursor.server_id]);
+                reserve_slot(conn);
+                append_scan_message(conn.outgoing, cursor, start, end, count_hint);
+                commit_slot(conn, [&](bool delivered, char status_code, std::string& response) {
+                    if (!delivered || status_code != '0' || !decode_scan_response(response, cursor, keys)) {
+                        failed = true;
+                        cursor.partition = SCAN_DONE;
+                    }
+                });
+            }
+            flush();
+            if (failed) {
+                throw std::runtime_error("Failed to scan the keys from " + start);
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        return keys;
+    }
+
+    // Server IDs, for stats, run up to server_count(), replicas included
+    size_t server_count() const {
+        return routing().servers.size();
+    }
+
+    // Moves the keys to the servers listed in new_server_list_filename. Keys
+    // are placed on a consistent hash ring, so only the keys whose owner
+    // changes move, about 1/N of them when one of N servers joins or leaves.
+    //
+    // begin_handoff routes writes by the new ring right away and tells the
+    // current servers to stream the keys they no longer own to their new
+    // owners in the background. Until end_handoff, reads that miss on a key's
+    // new owner are retried on its previous owner and deletes go to both, so
+    // every key stays visible while it moves. Every client of the cluster
+    // should begin the handoff before keys are written through the new ring;
+    // the servers join the first client's handoff for the later ones.
+    //
+    // Other threads sharing the client keep working meanwhile, but should
+    // flush their asynchronous requests first: ones still pending when the
+    // handoff begins or ends complete under the servers they were routed to.
+    bool begin_handoff(const std::string& new_server_list_filename) {
+        std::scoped_lock lock(handoff_mtx);
+        std::vector<ServerInfo> new_servers = read_server_list(new_server_list_filename);
+        if (new_servers.empty() || routing().previous_ring) {
+            return false;
+        }
+        flush();
+
+        auto next = std::make_unique<Topology>(routing());
+        std::string member_list;
+        std::vector<size_t> new_ring_server_ids;
+        for (const ServerInfo& server : new_servers) {
+            member_list += server.member() + "\n";
+            new_ring_server_ids.push_back(add_primary(*next, server));
+        }
+
+        next->previous_ring = std::move(next->ring);
+        next->previous_ring_server_ids = std::move(next->ring_server_ids);
+        next->ring_server_ids = std::move(new_ring_server_ids);
+        next->ring = build_ring(*next, next->ring_server_ids);
+        const Topology& topology = publish(std::move(next));
+        // Keys move to servers whose change logs this client hasn't followed,
+        // so the near cache starts over; it isn't read until the handoff ends
+        clear_near_cache();
+
+        // New servers are told too, so they keep track of deletes meanwhile.
+        // Replicas only follow their primaries.
+        bool started = true;
+        for (size_t server_id : handoff_server_ids(topology)) {
+            ConnectionPool& server = *topology.servers[server_id];
+            std::string response;
+            char status_code;
+            started &= send_to_server(server, OP_HANDOFF_BEGIN, 0, server.server.member(), member_list, status_code,
+                                      response) &&
+                       status_code == '0';
+        }
+        return started;
+    }
+
+    // True once every previous server has streamed away the keys it no longer owns
+    bool handoff_done() {
+        const Topology& topology = routing();
+        if (!topology.previous_ring) {
+            return true;
+        }
+        for (size_t server_id : topology.previous_ring_server_ids) {
+            if (stats(server_id, "handoff").find("migrating=0") == std::string::npos) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Waits for the migration, ends the handoff and drops the servers that
+    // are not in the new list
+    void end_handoff() {
+        std::scoped_lock lock(handoff_mtx);
+        const Topology& current = routing();
+        if (!current.previous_ring) {
+            return;
+        }
+        while (!handoff_done()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(HANDOFF_POLL_INTERVAL_MS));
+        }
+        flush();
+        for (size_t server_id : handoff_server_ids(current)) {
+            ConnectionPool& server = *current.servers[server_id];
+            std::string response;
+            char status_code;
+            send_to_server(server, OP_HANDOFF_END, 0, server.server.member(), "", status_code, response);
+        }
+
+        // Keeps the servers of the new ring and their replicas
+        auto next = std::make_unique<Topology>();
+        auto keep = [&](size_t server_id) {
+            next->servers.push_back(current.servers[server_id]);
+            next->replica_ids.emplace_back();
+            return next->servers.size() - 1;
+        };
+        for (size_t server_id : current.ring_server_ids) {
+            size_t kept_id = keep(server_id);
+            for (size_t replica_id : current.replica_ids[server_id]) {
+                size_t kept_replica_id = keep(replica_id);
+                next->replica_ids[kept_id].push_back(kept_replica_id);
+            }
+            next->ring_server_ids.push_back(kept_id);
+        }
+        next->ring = current.ring;
+        for (ConnectionPool* server : current.servers) {
+            if (std::find(next->servers.begin(), next->servers.end(), server) == next->servers.end()) {
+                server->close_idle();
+            }
+        }
+        publish(std::move(next));
+        clear_near_cache();
+    }
+
+    // Sends GETs to the replicas listed in node_list.txt, round robin, as long
+    // as they have applied every change their primary made up to
+    // max_staleness_ms ago; a replica further behind answers STALE and the
+    // GET goes to the primary. Reads may then miss recent writes, even the
+    // client's own. 0, the default, reads from primaries only. Replicas are
+    // skipped during a handoff, and batch operations always use primaries.
+    void set_read_staleness(uint32_t max_staleness_ms) {
+        read_staleness_ms = max_staleness_ms;
+    }
+
+    // How new connections reach servers listed with an address of this host.
+    // UNIX_SOCKET connects to the Unix domain socket of a server started with
+    // --unix, skipping the TCP stack, and SHARED_MEMORY, the default, also
+    // asks the server to carry the connection's messages over a pair of
+    // shared memory rings, which only the threads engine does. Either falls
+    // back to the next best transport, down to TCP.
+    void set_local_transport(LocalTransport transport) {
+        local_transport = transport;
+    }
+
+    // Keeps the values read with get and get_async in this process, up to
+    // max_bytes of keys and values, and serves them again without a round
+    // trip. A background thread asks every server for the keys changed since
+    // it last asked, every max_staleness_ms / 2, and drops them from the
+    // cache, and a server that couldn't be asked within max_staleness_ms has
+    // its values read from it again. The client's own writes drop their keys
+    // right away. Values read from replicas or during a handoff aren't cached.
+    // Call once, before the client is shared between threads.
+    void enable_near_cache(size_t max_bytes, uint32_t max_staleness_ms = DEFAULT_NEAR_CACHE_STALENESS_MS) {
+        if (near_cache) {
+            return;
+        }
+        near_cache = std::make_unique<NearCache>(max_bytes);
+        near_cache_staleness_ms = std::max<uint32_t>(2, max_staleness_ms);
+        poll_invalidations();
+        invalidation_poller = std::thread([this] { run_invalidation_poller(); });
+    }
+
+    NearCacheStats near_cache_stats() const {
+        NearCacheStats stats;
+        if (near_cache) {
+            stats.cache = near_cache->stats();
+        }
+        stats.polls = invalidation_polls.load(std::memory_order_relaxed);
+        stats.changed_keys = invalidated_keys.load(std::memory_order_relaxed);
+        stats.poll_bytes = invalidation_bytes.load(std::memory_order_relaxed);
+        stats.flushes = near_cache_flushes.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    // Returns the server's counters as "name=value" pairs separated by spaces.
+    // The "operations", "memory" and "partitions" sections have one line of
+    // them per operation type or partition, "metrics" is in the Prometheus
+    // text format.
+    std::string stats(size_t server_id, const std::string& section = "") {
+        const Topology& topology = routing();
+        std::string response;
+        char status_code;
+        if (server_id < topology.servers.size() &&
+            send_to_server(*topology.servers[server_id], OP_STATS, 0, section, "", status_code, response) &&
+            status_code == '0') {
+            return response;
+        }
+        throw std::runtime_error("Failed to get stats from server " + std::to_string(server_id));
+    }
+
 private:
-    std::vector<ServerInfo> servers;
-    std::unordered_map<size_t, int> connections; // Map from server ID to socket FD
+    // Where requests go: the servers, replicas included, and the hash rings.
+    // A handoff publishes a new Topology instead of changing the current one,
+    // so threads route requests without taking a lock. Server IDs index
+    // servers and replica_ids, and ring members are indexed like their server
+    // IDs in ring_server_ids. The previous ring is only kept during a handoff.
+    struct Topology {
+        std::vector<ConnectionPool*> servers;
+        std::vector<std::vector<size_t>> replica_ids; // Empty for replicas
+        HashRing ring;
+        std::vector<size_t> ring_server_ids;
+        std::optional<HashRing> previous_ring;
+        std::vector<size_t> previous_ring_server_ids;
+    };
+
+    // A request for a key's previous owner or a replica's primary, sent on
+    // the next flush
+    struct Fallback {
+        ConnectionPool* server;
+        uint8_t op_type;
+        uint64_t key_hash;
+        std::string key;
+        ResponseHandler handler;
+    };
+
+    // What one thread has pending on the client: the connections it holds for
+    // its asynchronous requests and the requests waiting for its next flush
+    struct Session {
+        std::vector<ServerConnection*> held;
+        std::deque<Fallback> fallbacks;
+    };
+
+    size_t window_size;
+    size_t pool_size;
+
+    // Every pool ever created and every topology ever published live as long
+    // as the client, since another thread may still be using an old one
+    std::vector<std::unique_ptr<ConnectionPool>> pools;
+    std::vector<std::unique_ptr<Topology>> topologies;
+    std::atomic<const Topology*> current_topology{nullptr};
+    std::mutex handoff_mtx; // Serializes begin_handoff and end_handoff
+
+    std::atomic<uint32_t> read_staleness_ms{0};
+    std::atomic<LocalTransport> local_transport{LocalTransport::SHARED_MEMORY};
+    std::atomic<size_t> next_replica{0};
+
+    // See enable_near_cache
+    std::unique_ptr<NearCache> near_cache;
+    uint32_t near_cache_staleness_ms = 0;
+    std::thread invalidation_poller;
+    std::mutex poller_mtx;
+    std::condition_variable poller_cv;
+    bool stopping_poller = false;
+    std::atomic<uint64_t> invalidation_polls{0};
+    std::atomic<uint64_t> invalidated_keys{0};
+    std::atomic<uint64_t> invalidation_bytes{0};
+    std::atomic<uint64_t> near_cache_flushes{0};
+
+    // Sessions are per thread and per client, so they are keyed by a client ID
+    // that is never reused, unlike the client's address
+    inline static std::atomic<uint64_t> next_client_id{1};
+    uint64_t client_id = next_client_id++;
+    inline static thread_local std::unordered_map<uint64_t, Session> sessions;
+    inline static thread_local Session* cached_session = nullptr;
+    inline static thread_local uint64_t cached_session_client_id = 0;
+
+    Session& session() {
+        if (cached_session_client_id != client_id) {
+            cached_session = &sessions[client_id];
+            cached_session_client_id = client_id;
+        }
+        return *cached_session;
+    }
+
+    const Topology& routing() const {
+        return *current_topology.load(std::memory_order_acquire);
+    }
+
+    const Topology& publish(std::unique_ptr<Topology> next) {
+        const Topology& published = *next;
+        topologies.push_back(std::move(next));
+        current_topology.store(&published, std::memory_order_release);
+        return published;
+    }
+
+    HashRing build_ring(const Topology& topology, const std::vector<size_t>& server_ids) const {
+        std::vector<std::string> members;
+        for (size_t server_id : server_ids) {
+            members.push_back(topology.servers[server_id]->server.member());
+        }
+        return HashRing(members);
+    }
+
+    // Returns the ID of the server in the topology, adding it if it's new.
+    // A server added again after a handoff dropped it gets its old pool back.
+    size_t add_server(Topology& topology, const ServerInfo& server) {
+        for (size_t server_id = 0; server_id < topology.servers.size(); ++server_id) {
+            if (topology.servers[server_id]->server.member() == server.member()) {
+                return server_id;
+            }
+        }
+        auto pool = std::find_if(pools.begin(), pools.end(), [&](const std::unique_ptr<ConnectionPool>& pool) {
+            return pool->server.member() == server.member();
+        });
+        if (pool == pools.end()) {
+            pools.push_back(std::make_unique<ConnectionPool>(server, pool_size));
+            pool = pools.end() - 1;
+        }
+        topology.servers.push_back(pool->get());
+        topology.replica_ids.emplace_back();
+        return topology.servers.size() - 1;
+    }
+
+    // Adds the server and its replicas
+    size_t add_primary(Topology& topology, const ServerInfo& server) {
+        size_t server_id = add_server(topology, server);
+        for (const ServerInfo& replica : server.replicas) {
+            size_t replica_id = add_server(topology, replica);
+            std::vector<size_t>& replica_ids = topology.replica_ids[server_id];
+            if (std::find(replica_ids.begin(), replica_ids.end(), replica_id) == replica_ids.end()) {
+                replica_ids.push_back(replica_id);
+            }
+        }
+        return server_id;
+    }
+
+    // The servers on either ring, which take part in a handoff
+    std::vector<size_t> handoff_server_ids(const Topology& topology) const {
+        std::vector<size_t> server_ids = topology.previous_ring_server_ids;
+        for (size_t server_id : topology.ring_server_ids) {
+            if (std::find(server_ids.begin(), server_ids.end(), server_id) == server_ids.end()) {
+                server_ids.push_back(server_id);
+            }
+        }
+        return server_ids;
+    }
 
+    // One server per line, "host:port", followed by its replicas separated by spaces
     std::vector<ServerInfo> read_server_list(const std::string& filename) {
         std::vector<ServerInfo> servers;
         std::ifstream infile(filename);
         std::string line;
         while (std::getline(infile, line)) {
-            size_t colon_pos = line.find(':');
-            if (colon_pos != std::string::npos) {
-                servers.push_back({line.substr(0, colon_pos), std::stoi(line.substr(colon_pos + 1))});
+            std::istringstream members(line);
+            std::string member;
+            std::vector<ServerInfo> listed;
+            while (members >> member) {
+                size_t colon_pos = member.find(':');
+                if (colon_pos != std::string::npos) {
+                    listed.push_back({member.substr(0, colon_pos), std::stoi(member.substr(colon_pos + 1)), {}});
+                }
+            }
+            if (!listed.empty()) {
+                listed.front().replicas.assign(listed.begin() + 1, listed.end());
+                servers.push_back(std::move(listed.front()));
             }
         }
         return servers;
     }
 
-    int connect_to_server(size_t server_id) {
-        // Check if we already have a connection
-        if (connections[server_id] != -1) {
-            // Test if the connection is still alive
-            if (is_socket_alive(connections[server_id])) {
-                return connections[server_id];
-            } else {
-                // Connection is dead, close it
-                close(connections[server_id]);
-                connections[server_id] = -1;
-            }
+    // Connections aren't probed before use. A broken one fails the requests
+    // sent on it, through an error or end of stream from send or recv, and is
+    // replaced on the next send. Keepalive covers a server host that went
+    // away without a reset while a response is awaited.
+    bool connect_to_server(ServerConnection& conn) {
+        if (conn.pool->local && local_transport.load(std::memory_order_relaxed) != LocalTransport::TCP &&
+            connect_locally(conn)) {
+            return true;
         }
 
-        // Establish a new connection
         int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock == -1) return -1;
+        if (sock == -1) return false;
+
+        // Requests are coalesced here already, so Nagle's algorithm would only
+        // hold back the last one
+        int enabled = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &enabled, sizeof(enabled));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &KEEPALIVE_IDLE_SECONDS, sizeof(KEEPALIVE_IDLE_SECONDS));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &KEEPALIVE_INTERVAL_SECONDS, sizeof(KEEPALIVE_INTERVAL_SECONDS));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &KEEPALIVE_PROBES, sizeof(KEEPALIVE_PROBES));
 
         sockaddr_in server_addr{};
         server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(servers[server_id].port);
-        inet_pton(AF_INET, servers[server_id].address.c_str(), &server_addr.sin_addr);
+        server_addr.sin_port = htons(conn.pool->server.port);
+        inet_pton(AF_INET, conn.pool->server.address.c_str(), &server_addr.sin_addr);
 
         if (connect(sock, (sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
             close(sock);
-            return -1;
+            return false;
         }
 
-        connections[server_id] = sock;
-        return sock;
+        conn.sock = sock;
+        return true;
     }
 
-    bool is_socket_alive(int sock) {
-        // Check if the socket is still connected
-        char buffer;
-        int result = recv(sock, &buffer, 1, MSG_PEEK | MSG_DONTWAIT);
-        if (result == 0) {
-            // Connection has been closed
+    // Connects over the Unix domain socket of a server on this host, which
+    // is only there with --unix, and attaches shared memory rings if asked to
+    bool connect_locally(ServerConnection& conn) {
+        std::string path = unix_socket_path(conn.pool->server.port);
+        sockaddr_un server_addr{};
+        if (path.size() >= sizeof(server_addr.sun_path)) return false;
+        server_addr.sun_family = AF_UNIX;
+        std::memcpy(server_addr.sun_path, path.c_str(), path.size() + 1);
+
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock == -1) return false;
+        if (connect(sock, (sockaddr*)&server_addr, sizeof(server_addr)) == -1 ||
+            (local_transport.load(std::memory_order_relaxed) == LocalTransport::SHARED_MEMORY &&
+             !attach_shared_memory(sock, conn.shm))) {
+            close(sock);
             return false;
-        } else if (result < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // No data available, but socket is still alive
-                return true;
-            } else {
-                // An error occurred
-                return false;
-            }
-        } else {
-            // Data is available to read
+        }
+        conn.sock = sock;
+        return true;
+    }
+
+    // Creates a segment and hands its name to the server with an
+    // OP_SHM_ATTACH request. A server that can't use it answers with an
+    // error, and the connection stays on the socket. Returns false if the
+    // socket failed.
+    bool attach_shared_memory(int sock, std::unique_ptr<ShmSegment>& shm) {
+        std::string name;
+        std::unique_ptr<ShmSegment> segment = ShmSegment::create(name);
+        if (!segment) {
             return true;
         }
+        std::vector<uint8_t> request;
+        append_message(request, OP_SHM_ATTACH, 0, name, "");
+
+        // Response: Total Size (4 bytes, uint32_t) | Status ('0' or '1') | Payload
+        bool answered = send(sock, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size());
+        char header[sizeof(uint32_t) + 1];
+        answered = answered && recv(sock, header, sizeof(header), MSG_WAITALL) == sizeof(header);
+        std::string payload;
+        if (answered) {
+            uint32_t total_size_net;
+            std::memcpy(&total_size_net, header, sizeof(uint32_t));
+            payload.resize(ntohl(total_size_net) - sizeof(header));
+            answered = payload.empty() ||
+                       recv(sock, payload.data(), payload.size(), MSG_WAITALL) == static_cast<ssize_t>(payload.size());
+        }
+        // Both sides have it mapped now, or never will
+        shm_unlink(name.c_str());
+        if (answered && header[sizeof(uint32_t)] == '0') {
+            shm = std::move(segment);
+        }
+        return answered;
+    }
+
+    // The thread's connection to the server: the one it already holds, or one
+    // checked out of the pool and held until it is released
+    ServerConnection& acquire(ConnectionPool& server) {
+        Session& own = session();
+        for (ServerConnection* conn : own.held) {
+            if (conn->pool == &server) {
+                return *conn;
+            }
+        }
+        ServerConnection& conn = checkout(server, own);
+        own.held.push_back(&conn);
+        return conn;
+    }
+
+    ServerConnection& checkout(ConnectionPool& server, Session& own) {
+        thread_local size_t offset = std::hash<std::thread::id>{}(std::this_thread::get_id());
+        while (true) {
+            uint32_t checkins = server.checkins.load(std::memory_order_acquire);
+            for (size_t i = 0; i < server.size; ++i) {
+                ServerConnection& conn = server.connections[(offset + i) % server.size];
+                bool expected = false;
+                if (!conn.checked_out.load(std::memory_order_relaxed) &&
+                    conn.checked_out.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                    return conn;
+                }
+            }
+            // Waiting while holding connections could leave two threads
+            // waiting for each other's, so ours are completed and returned first
+            if (!own.held.empty()) {
+                release_held(own);
+                continue;
+            }
+            server.checkins.wait(checkins, std::memory_order_acquire);
+        }
+    }
+
+    void checkin(ServerConnection& conn) {
+        conn.checked_out.store(false, std::memory_order_release);
+        conn.pool->checkins.fetch_add(1, std::memory_order_release);
+        conn.pool->checkins.notify_one();
+    }
+
+    // Completes every request on the connection and returns it to its pool
+    void release(ServerConnection& conn) {
+        Session& own = session();
+        own.held.erase(std::find(own.held.begin(), own.held.end(), &conn));
+        receive_responses(conn, 0);
+        checkin(conn);
+    }
+
+    void release_held(Session& own) {
+        std::vector<ServerConnection*> releasing;
+        releasing.swap(own.held);
+        for (ServerConnection* conn : releasing) {
+            receive_responses(*conn, 0);
+            checkin(*conn);
+        }
     }
 
     uint32_t hton_uint32(uint32_t value) {
@@ -167,26 +1114,689 @@ private:
         return (static_cast<uint64_t>(low_part) << 32) | high_part;
     }
 
-    bool send_command(uint8_t op_type, const std::string& key, const std::string& value, char& status_code, std::string& response) {
+    static size_t server_for(const Topology& topology, uint64_t key_hash) {
+        return topology.ring_server_ids[topology.ring.owner(key_hash)];
+    }
+
+    // The key's owner before the handoff, or its owner when there is none
+    static size_t previous_server_for(const Topology& topology, uint64_t key_hash) {
+        return topology.previous_ring ? topology.previous_ring_server_ids[topology.previous_ring->owner(key_hash)]
+                                      : server_for(topology, key_hash);
+    }
+
+    // During a handoff, a GET that misses on the key's new owner and every DEL
+    // are sent to its previous owner too
+    static bool needs_previous_owner(uint8_t op_type, char status_code) {
+        return (op_type == OP_GET && status_code != '0') || op_type == OP_DEL;
+    }
+
+    // The replica to send a GET for the server's keys to, or the server itself
+    // when reads don't go to replicas
+    size_t read_server_for(const Topology& topology, size_t server_id) {
+        const std::vector<size_t>& replica_ids = topology.replica_ids[server_id];
+        if (read_staleness_ms.load(std::memory_order_relaxed) == 0 || topology.previous_ring || replica_ids.empty()) {
+            return server_id;
+        }
+        return replica_ids[next_replica.fetch_add(1, std::memory_order_relaxed) % replica_ids.size()];
+    }
+
+    static bool is_stale(char status_code, const std::string& response) {
+        return status_code != '0' && response == "STALE";
+    }
+
+    uint64_t hash_key(const std::string& key) const {
+        return ::hash_key(key);
+    }
+
+    bool send_command(uint8_t op_type, const std::string& key, const std::string& value, char& status_code, std::string& response,
+                      uint32_t ttl_seconds = 0) {
         if (key.empty()) {
             std::cerr << "Key cannot be empty.\n";
             return false;
         }
+        if (key.size() + value.size() > MAX_KEY_VALUE_SIZE) {
+            std::cerr << "Value too large for key: " << key << "\n";
+            return false;
+        }
 
         // Hash the key to determine the server
-        std::hash<std::string> hasher;
-        uint64_t key_hash = hasher(key);
-        size_t server_id = key_hash % servers.size();
+        const Topology& topology = routing();
+        uint64_t key_hash = hash_key(key);
+        size_t server_id = server_for(topology, key_hash);
+        ConnectionPool& server = *topology.servers[server_id];
+
+        if (op_type == OP_GET) {
+            size_t replica_id = read_server_for(topology, server_id);
+            if (replica_id != server_id &&
+                send_to_server(*topology.servers[replica_id], op_type, key_hash, key, value, status_code, response,
+                               read_staleness_ms.load(std::memory_order_relaxed)) &&
+                !is_stale(status_code, response)) {
+                return true;
+            }
+        }
+        size_t previous_id = previous_server_for(topology, key_hash);
+        if (previous_id != server_id && is_read_modify_write(op_type) &&
+            !copy_from_previous_owner(server, *topology.servers[previous_id], key_hash, key)) {
+            return false;
+        }
+        if (!send_to_server(server, op_type, key_hash, key, value, status_code, response, ttl_seconds)) {
+            return false;
+        }
+        if (previous_id != server_id && needs_previous_owner(op_type, status_code)) {
+            char previous_status_code;
+            std::string previous_response;
+            if (send_to_server(*topology.servers[previous_id], op_type, key_hash, key, value, previous_status_code,
+                               previous_response) &&
+                previous_status_code == '0') {
+                status_code = '0';
+                response = std::move(previous_response);
+            } else if (op_type == OP_GET) {
+                // The key may have moved to its new owner between the two reads
+                return send_to_server(server, op_type, key_hash, key, value, status_code, response);
+            }
+        }
+        return true;
+    }
+
+    static bool is_read_modify_write(uint8_t op_type) {
+        return op_type == OP_INCR || op_type == OP_CAS || op_type == OP_APPEND || op_type == OP_GETSET;
+    }
+
+    static bool changes_key(uint8_t op_type) {
+        return op_type == OP_PUT || op_type == OP_SETEX || op_type == OP_DEL || is_read_modify_write(op_type);
+    }
+
+    static int64_t steady_now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // A GET's view of the near cache: whether its value may be cached, and the
+    // generation taken before it was sent
+    struct CachedRead {
+        bool cacheable = false;
+        uint64_t key_hash = 0;
+        uint64_t generation = 0;
+    };
+
+    // Returns true with the key's value if the near cache has it. Otherwise,
+    // cached says whether the value the GET reads may be filled in.
+    bool read_cached(const std::string& key, CachedRead& cached, std::string& value) {
+        if (!near_cache || key.empty()) {
+            return false;
+        }
+        const Topology& topology = routing();
+        if (topology.previous_ring || read_staleness_ms.load(std::memory_order_relaxed) != 0) {
+            return false;
+        }
+        cached.key_hash = hash_key(key);
+        const ConnectionPool& server = *topology.servers[server_for(topology, cached.key_hash)];
+        if (server.cache_fresh_until_ns.load(std::memory_order_acquire) <= steady_now_ns()) {
+            return false;
+        }
+        cached.cacheable = true;
+        cached.generation = near_cache->generation(cached.key_hash);
+        return near_cache->get(cached.key_hash, key, value);
+    }
+
+    void fill_cached(const CachedRead& cached, const std::string& key, const std::string& value) {
+        if (cached.cacheable) {
+            near_cache->fill(cached.key_hash, key, value, cached.generation);
+        }
+    }
+
+    // A write drops its key before it is sent, so that no read started after
+    // it fills in the old value, and again once it's done, for the reads that
+    // were already on their way
+    void invalidate_cached(uint64_t key_hash, ResponseHandler& handler) {
+        near_cache->invalidate(key_hash);
+        handler = [this, key_hash, handler = std::move(handler)](bool delivered, char status_code, std::string& response) {
+            near_cache->invalidate(key_hash);
+            handler(delivered, status_code, response);
+        };
+    }
+
+    void clear_near_cache() {
+        if (near_cache) {
+            near_cache->clear();
+            near_cache_flushes.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void run_invalidation_poller() {
+        std::unique_lock<std::mutex> lock(poller_mtx);
+        auto interval = std::chrono::milliseconds(near_cache_staleness_ms / 2);
+        while (!poller_cv.wait_for(lock, interval, [this] { return stopping_poller; })) {
+            lock.unlock();
+            poll_invalidations();
+            lock.lock();
+        }
+    }
+
+    // Asks every server for the keys changed since the last poll, pipelined,
+    // and drops them from the near cache. Each server that answered may then
+    // have its values served from the cache until max staleness after the
+    // poll was sent, as every change made before that has been dropped.
+    void poll_invalidations() {
+        const Topology& topology = routing();
+        int64_t poll_start_ns = steady_now_ns();
+        for (size_t server_id : topology.ring_server_ids) {
+            ConnectionPool& server = *topology.servers[server_id];
+            ServerConnection& conn = acquire(server);
+            reserve_slot(conn);
+            // The sequence to read from goes in the Key Hash field
+            append_message(conn.outgoing, OP_INVALIDATIONS, server.invalidations_since, "", "");
+            commit_slot(conn, [this, &server, poll_start_ns](bool delivered, char status_code, std::string& response) {
+                if (delivered && status_code == '0' && apply_invalidations(server, response)) {
+                    server.cache_fresh_until_ns.store(poll_start_ns + int64_t{near_cache_staleness_ms} * 1000000,
+                                                      std::memory_order_release);
+                }
+            });
+        }
+        flush();
+        invalidation_polls.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // INVALIDATIONS response payload: Next (8 bytes, uint64_t) | Lost (1 byte)
+    // | Count (4 bytes, uint32_t) | Key Hash (8 bytes, uint64_t) per changed key.
+    // Lost changes, which the server no longer has, empty the whole cache.
+    bool apply_invalidations(ConnectionPool& server, const std::string& response) {
+        const size_t header_size = sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint32_t);
+        if (response.size() < header_size) {
+            return false;
+        }
+        uint64_t next_net;
+        uint32_t count_net;
+        std::memcpy(&next_net, response.data(), sizeof(uint64_t));
+        std::memcpy(&count_net, response.data() + sizeof(uint64_t) + sizeof(uint8_t), sizeof(uint32_t));
+        bool lost = response[sizeof(uint64_t)] != 0;
+        uint32_t count = ntohl(count_net);
+        if (response.size() != header_size + size_t{count} * sizeof(uint64_t)) {
+            return false;
+        }
+        if (lost) {
+            clear_near_cache();
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            uint64_t key_hash_net;
+            std::memcpy(&key_hash_net, response.data() + header_size + i * sizeof(uint64_t), sizeof(uint64_t));
+            // The swap is its own inverse
+            near_cache->invalidate(hton_uint64(key_hash_net));
+        }
+        server.invalidations_since = hton_uint64(next_net);
+        invalidated_keys.fetch_add(count, std::memory_order_relaxed);
+        invalidation_bytes.fetch_add(response.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    // During a handoff, a read-modify-write on the key's new owner has to
+    // start from the key's current value, so a key that only its previous
+    // owner has yet is copied over first, if the new owner still doesn't have
+    // it by then. The migrated copy is skipped once it arrives.
+    bool copy_from_previous_owner(ConnectionPool& server, ConnectionPool& previous, uint64_t key_hash, const std::string& key) {
+        char status_code;
+        std::string value;
+        if (!send_to_server(server, OP_GET, key_hash, key, "", status_code, value)) {
+            return false;
+        }
+        if (status_code == '0') {
+            return true;
+        }
+        if (!send_to_server(previous, OP_GET, key_hash, key, "", status_code, value)) {
+            return false;
+        }
+        if (status_code != '0') {
+            return true;
+        }
+        std::string response;
+        return send_to_server(server, OP_CAS, key_hash, key, cas_value(nullptr, value), status_code, response);
+    }
+
+    // CAS value: Expected Length (4 bytes, uint32_t, CAS_ABSENT for a key that
+    // must not exist) | Expected | New Value
+    std::string cas_value(const std::string* expected, const std::string& new_value) {
+        uint32_t expected_length_net = hton_uint32(expected ? expected->size() : CAS_ABSENT);
+        std::string value(reinterpret_cast<const char*>(&expected_length_net), sizeof(uint32_t));
+        if (expected) {
+            value += *expected;
+        }
+        value += new_value;
+        return value;
+    }
+
+    bool send_cas(const std::string& key, const std::string* expected, const std::string& new_value) {
+        std::string response;
+        char status_code;
+        if (!send_command(OP_CAS, key, cas_value(expected, new_value), status_code, response)) {
+            throw std::runtime_error("Failed to compare and set the key: " + key);
+        }
+        return status_code == '0';
+    }
+
+    // Sends one request and waits for its response, completing any
+    // asynchronous requests this thread queued before it on the same server.
+    // The trailer is the TTL in seconds of a PUT or SETEX, or the max
+    // staleness in milliseconds of a GET sent to a replica, 0 for none.
+    bool send_to_server(ConnectionPool& server, uint8_t op_type, uint64_t key_hash, const std::string& key, const std::string& value, char& status_code, std::string& response,
+                        uint32_t trailer = 0) {
+        for (int attempt = 0;; ++attempt) {
+            ServerConnection& conn = acquire(server);
+            bool reused = conn.sock != -1;
+            bool delivered = false;
+            enqueue_on(conn, op_type, key_hash, key, value, [&](bool ok, char status, std::string& payload) {
+                delivered = ok;
+                status_code = status;
+                response = std::move(payload);
+            }, trailer);
+            release(conn);
+            // The server may have closed a pooled connection while it sat idle,
+            // which only shows once it is used, so that is retried once on a new
+            // one. A read-modify-write isn't: the server may have applied it
+            // before the connection dropped, and applying it again would count
+            // an INCR or APPEND twice or fail a CAS that succeeded.
+            if (delivered || !reused || attempt > 0 || is_read_modify_write(op_type)) {
+                return delivered;
+            }
+        }
+    }
+
+    // Sends a GET and writes the value in its response to out as it is
+    // received. Sets found to whether the key exists and returns false if no
+    // response arrived.
+    bool stream_from_server(ConnectionPool& server, uint64_t key_hash, const std::string& key, std::ostream& out, bool& found) {
+        for (int attempt = 0;; ++attempt) {
+            ServerConnection& conn = acquire(server);
+            // Once earlier requests are complete, the next response is this one's
+            receive_responses(conn, 0);
+            bool reused = conn.sock != -1;
+            append_message(conn.outgoing, OP_GET, key_hash, key, "");
+            conn.unsent_count++;
+
+            // Response: Total Size (4 bytes, uint32_t) | Status ('0' or '1') | Payload
+            char header[sizeof(uint32_t) + 1];
+            bool delivered = send_outgoing(conn) && receive_exact(conn, header, sizeof(header));
+            if (delivered) {
+                uint32_t total_size_net;
+                std::memcpy(&total_size_net, header, sizeof(uint32_t));
+                size_t remaining = ntohl(total_size_net) - sizeof(header);
+                found = header[sizeof(uint32_t)] == '0';
+                char buffer[MAX_BUFFER_SIZE];
+                while (delivered && remaining > 0) {
+                    size_t piece = std::min<size_t>(remaining, MAX_BUFFER_SIZE);
+                    delivered = receive_exact(conn, buffer, piece);
+                    if (delivered && found) {
+                        out.write(buffer, piece);
+                    }
+                    remaining -= piece;
+                }
+            }
+            release(conn);
+            // As in send_to_server, but only while nothing was written to out
+            if (delivered || !reused || attempt > 0 || found) {
+                return delivered;
+            }
+        }
+    }
+
+    void enqueue_command(uint8_t op_type, const std::string& key, const std::string& value, ResponseHandler handler,
+                         uint32_t ttl_seconds = 0) {
+        if (key.empty() || key.size() + value.size() > MAX_KEY_VALUE_SIZE) {
+            std::cerr << "Key cannot be empty or too large.\n";
+            std::string no_response;
+            handler(false, '1', no_response);
+            return;
+        }
+
+        const Topology& topology = routing();
+        uint64_t key_hash = hash_key(key);
+        size_t server_id = server_for(topology, key_hash);
+        ConnectionPool* server = topology.servers[server_id];
+        size_t previous_id = previous_server_for(topology, key_hash);
+        if (previous_id != server_id && (op_type == OP_GET || op_type == OP_DEL)) {
+            handler = handoff_handler(op_type, key_hash, key, server, topology.servers[previous_id], std::move(handler));
+        }
+        size_t replica_id = op_type == OP_GET ? read_server_for(topology, server_id) : server_id;
+        if (replica_id != server_id) {
+            enqueue_to_server(*topology.servers[replica_id], op_type, key_hash, key, value,
+                              replica_handler(key_hash, key, server, std::move(handler)),
+                              read_staleness_ms.load(std::memory_order_relaxed));
+            return;
+        }
+        enqueue_to_server(*server, op_type, key_hash, key, value, std::move(handler), ttl_seconds);
+    }
 
-        int sock = connect_to_server(server_id);
-        if (sock == -1) {
-            std::cerr << "Failed to connect to server " << server_id << "\n";
+    // Wraps the handler of a GET sent to a replica, so that a replica too far
+    // behind or unreachable hands the GET to the primary on the next flush
+    ResponseHandler replica_handler(uint64_t key_hash, const std::string& key, ConnectionPool* server, ResponseHandler handler) {
+        return [=, this, handler = std::move(handler)](bool delivered, char status_code, std::string& response) mutable {
+            if (delivered && !is_stale(status_code, response)) {
+                handler(delivered, status_code, response);
+            } else {
+                session().fallbacks.push_back({server, OP_GET, key_hash, key, std::move(handler)});
+            }
+        };
+    }
+
+    // During a handoff, wraps the handler of a GET or DEL sent to the key's new
+    // owner: a DEL is repeated on the previous owner, and a GET that misses is
+    // retried there and then once more on the new owner, in case the key moved
+    // between the two reads. Handlers run while responses are read, on the
+    // thread that sent the request, so the follow-up requests wait in its
+    // fallbacks for its next flush.
+    ResponseHandler handoff_handler(uint8_t op_type, uint64_t key_hash, const std::string& key, ConnectionPool* server,
+                                    ConnectionPool* previous, ResponseHandler handler) {
+        return [=, this, handler = std::move(handler)](bool delivered, char status_code, std::string& response) mutable {
+            if (!delivered || !needs_previous_owner(op_type, status_code)) {
+                handler(delivered, status_code, response);
+                return;
+            }
+            if (op_type == OP_DEL) {
+                bool deleted = status_code == '0';
+                session().fallbacks.push_back({previous, op_type, key_hash, key,
+                                               [deleted, handler = std::move(handler)](bool delivered, char status_code, std::string& response) {
+                                                   std::string deleted_response = "DELETED";
+                                                   if (deleted) {
+                                                       handler(true, '0', deleted_response);
+                                                   } else {
+                                                       handler(delivered, status_code, response);
+                                                   }
+                                               }});
+                return;
+            }
+            session().fallbacks.push_back({previous, op_type, key_hash, key,
+                                           [this, server, key_hash, key, handler = std::move(handler)](
+                                               bool delivered, char status_code, std::string& response) mutable {
+                                               if (delivered && status_code != '0') {
+                                                   session().fallbacks.push_back({server, OP_GET, key_hash, key, std::move(handler)});
+                                               } else {
+                                                   handler(delivered, status_code, response);
+                                               }
+                                           }});
+        };
+    }
+
+    void enqueue_to_server(ConnectionPool& server, uint8_t op_type, uint64_t key_hash, const std::string& key, const std::string& value, ResponseHandler handler,
+                           uint32_t trailer = 0) {
+        enqueue_on(acquire(server), op_type, key_hash, key, value, std::move(handler), trailer);
+    }
+
+    void enqueue_on(ServerConnection& conn, uint8_t op_type, uint64_t key_hash, const std::string& key, const std::string& value, ResponseHandler handler,
+                    uint32_t trailer = 0) {
+        if (near_cache && changes_key(op_type)) {
+            invalidate_cached(key_hash, handler);
+        }
+        reserve_slot(conn);
+        if (value.size() >= LARGE_VALUE_SIZE && has_value(op_type)) {
+            // Sent right away, so the value needn't outlive the call
+            append_message_header(conn.outgoing, op_type, key_hash, key, value.size(), trailer);
+            conn.unsent_count++;
+            conn.in_flight.push_back(std::move(handler));
+            send_outgoing(conn, value, trailer);
+            return;
+        }
+        append_message(conn.outgoing, op_type, key_hash, key, value, trailer);
+        commit_slot(conn, std::move(handler));
+    }
+
+    // Waits until the connection's window has room for one more request
+    void reserve_slot(ServerConnection& conn) {
+        if (conn.in_flight.size() >= window_size) {
+            // Window is full, wait until at least one response has arrived
+            receive_responses(conn, window_size - 1);
+        }
+    }
+
+    // Registers the handler of the request just appended to outgoing
+    void commit_slot(ServerConnection& conn, ResponseHandler handler) {
+        conn.unsent_count++;
+        conn.in_flight.push_back(std::move(handler));
+
+        if (conn.outgoing.size() >= MAX_COALESCED_BYTES) {
+            send_outgoing(conn);
+        }
+    }
+
+    // Where the walk of one server's partitions stands: the next partition to
+    // visit and the key to resume from in it
+    struct ScanCursor {
+        size_t server_id;
+        uint32_t partition = 0;
+        std::string resume;
+    };
+
+    // SCAN message: Total Size | Operation Type | Key Hash (the cursor's
+    // partition) | Key Length | Key (start) | Value Length | Value (end) |
+    // Count (4 bytes, uint32_t) | Resume Length (4 bytes, uint32_t) | Resume
+    void append_scan_message(std::vector<uint8_t>& message, const ScanCursor& cursor, const std::string& start,
+                             const std::string& end, size_t count_hint) {
+        size_t message_start = message.size();
+        append_message_header(message, OP_SCAN, cursor.partition, start, end.size());
+        message.insert(message.end(), end.begin(), end.end());
+        for (uint32_t field : {static_cast<uint32_t>(std::min<size_t>(count_hint, UINT32_MAX)),
+                               static_cast<uint32_t>(cursor.resume.size())}) {
+            uint32_t field_net = hton_uint32(field);
+            message.insert(message.end(), reinterpret_cast<uint8_t*>(&field_net), reinterpret_cast<uint8_t*>(&field_net) + sizeof(uint32_t));
+        }
+        message.insert(message.end(), cursor.resume.begin(), cursor.resume.end());
+
+        uint32_t total_size_net = hton_uint32(message.size() - message_start);
+        std::memcpy(&message[message_start], &total_size_net, sizeof(uint32_t));
+    }
+
+    // SCAN response payload: Next Partition | Resume Length | Resume | Key
+    // Count, then Key Length | Key per key, all lengths 4 bytes. Moves the
+    // cursor on and appends the keys.
+    bool decode_scan_response(const std::string& payload, ScanCursor& cursor, std::vector<std::string>& keys) {
+        size_t offset = 0;
+        auto read_uint32 = [&](uint32_t& value) {
+            if (payload.size() - offset < sizeof(uint32_t)) return false;
+            std::memcpy(&value, &payload[offset], sizeof(uint32_t));
+            value = ntohl(value);
+            offset += sizeof(uint32_t);
+            return true;
+        };
+        auto read_string = [&](std::string& value) {
+            uint32_t length;
+            if (!read_uint32(length) || payload.size() - offset < length) return false;
+            value.assign(payload, offset, length);
+            offset += length;
+            return true;
+        };
+
+        uint32_t next_partition;
+        uint32_t key_count;
+        if (!read_uint32(next_partition) || !read_string(cursor.resume) || !read_uint32(key_count)) {
             return false;
         }
+        for (uint32_t i = 0; i < key_count; ++i) {
+            keys.emplace_back();
+            if (!read_string(keys.back())) return false;
+        }
+        cursor.partition = next_partition;
+        return true;
+    }
+
+    struct BatchEntry {
+        const std::string* key;
+        const std::string* value; // Only for MPUT
+    };
+
+    // Splits a batch by server and sends every server its share, at most
+    // MAX_BATCH_ENTRIES keys per message, before reading any response. Fills
+    // in one status code and one result per entry and returns false if any
+    // share wasn't delivered.
+    bool send_batch(uint8_t op_type, const std::vector<BatchEntry>& entries, std::vector<char>& status_codes, std::vector<std::string>& results) {
+        status_codes.assign(entries.size(), '1');
+        results.assign(entries.size(), "");
+
+        const Topology& topology = routing();
+        std::vector<uint64_t> key_hashes(entries.size());
+        std::vector<std::vector<size_t>> indices_by_server(topology.servers.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].key->empty()) {
+                std::cerr << "Key cannot be empty.\n";
+                return false;
+            }
+            key_hashes[i] = hash_key(*entries[i].key);
+            indices_by_server[server_for(topology, key_hashes[i])].push_back(i);
+        }
+        if (near_cache && op_type != OP_MGET) {
+            for (uint64_t key_hash : key_hashes) {
+                near_cache->invalidate(key_hash);
+            }
+        }
+        bool delivered_all = send_batch_shares(topology, op_type, entries, key_hashes, indices_by_server, status_codes, results);
+        if (near_cache && op_type != OP_MGET) {
+            for (uint64_t key_hash : key_hashes) {
+                near_cache->invalidate(key_hash);
+            }
+        }
+        if (!topology.previous_ring || op_type == OP_MPUT) {
+            return delivered_all;
+        }
+
+        // During a handoff, keys missing on their new owner are read from
+        // their previous owner, and deletes go to both
+        std::vector<std::vector<size_t>> previous_indices_by_server(topology.servers.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            size_t previous_id = previous_server_for(topology, key_hashes[i]);
+            if (previous_id != server_for(topology, key_hashes[i]) && (op_type == OP_MDEL || status_codes[i] != '0')) {
+                previous_indices_by_server[previous_id].push_back(i);
+            }
+        }
+        std::vector<char> previous_status_codes(entries.size(), '1');
+        std::vector<std::string> previous_results(entries.size());
+        delivered_all &= send_batch_shares(topology, op_type, entries, key_hashes, previous_indices_by_server,
+                                           previous_status_codes, previous_results);
+        std::vector<std::vector<size_t>> retry_indices_by_server(topology.servers.size());
+        for (const std::vector<size_t>& indices : previous_indices_by_server) {
+            for (size_t i : indices) {
+                if (previous_status_codes[i] == '0' && status_codes[i] != '0') {
+                    status_codes[i] = '0';
+                    results[i] = std::move(previous_results[i]);
+                } else if (op_type == OP_MGET) {
+                    retry_indices_by_server[server_for(topology, key_hashes[i])].push_back(i);
+                }
+            }
+        }
+        // Keys that moved to their new owner between the two reads
+        if (op_type == OP_MGET) {
+            delivered_all &= send_batch_shares(topology, op_type, entries, key_hashes, retry_indices_by_server,
+                                               status_codes, results);
+        }
+        return delivered_all;
+    }
+
+    // Sends every server the entries at its indices and waits for all
+    // responses, filling in the status codes and results at those indices
+    bool send_batch_shares(const Topology& topology, uint8_t op_type, const std::vector<BatchEntry>& entries,
+                           const std::vector<uint64_t>& key_hashes, const std::vector<std::vector<size_t>>& indices_by_server,
+                           std::vector<char>& status_codes, std::vector<std::string>& results) {
+        bool delivered_all = true;
+        for (size_t server_id = 0; server_id < topology.servers.size(); ++server_id) {
+            const std::vector<size_t>& indices = indices_by_server[server_id];
+            for (size_t start = 0; start < indices.size(); start += MAX_BATCH_ENTRIES) {
+                auto chunk = std::make_shared<std::vector<size_t>>(
+                    indices.begin() + start, indices.begin() + std::min(indices.size(), start + MAX_BATCH_ENTRIES));
+
+                ServerConnection& conn = acquire(*topology.servers[server_id]);
+                reserve_slot(conn);
+                append_batch_message(conn.outgoing, op_type, entries, key_hashes, *chunk);
+                commit_slot(conn, [&, chunk](bool delivered, char status_code, std::string& response) {
+                    if (!delivered || status_code != '0' || !decode_batch_response(response, *chunk, status_codes, results)) {
+                        delivered_all = false;
+                    }
+                });
+            }
+        }
+        flush();
+        return delivered_all;
+    }
+
+    // Batch message: Total Size | Operation Type | Entry Count (4 bytes, uint32_t),
+    // then Key Hash | Key Length | Key (| Value Length | Value for MPUT) per entry
+    void append_batch_message(std::vector<uint8_t>& message, uint8_t op_type, const std::vector<BatchEntry>& entries, const std::vector<uint64_t>& key_hashes, const std::vector<size_t>& chunk) {
+        size_t start = message.size();
+        uint32_t total_size = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t);
+        message.resize(start + total_size);
+        message[start + sizeof(uint32_t)] = op_type;
+        uint32_t entry_count_net = hton_uint32(chunk.size());
+        std::memcpy(&message[start + sizeof(uint32_t) + sizeof(uint8_t)], &entry_count_net, sizeof(uint32_t));
+
+        for (size_t i : chunk) {
+            uint64_t key_hash_net = hton_uint64(key_hashes[i]);
+            message.insert(message.end(), reinterpret_cast<uint8_t*>(&key_hash_net), reinterpret_cast<uint8_t*>(&key_hash_net) + sizeof(uint64_t));
+
+            const std::string& key = *entries[i].key;
+            uint32_t key_length_net = hton_uint32(key.size());
+            message.insert(message.end(), reinterpret_cast<uint8_t*>(&key_length_net), reinterpret_cast<uint8_t*>(&key_length_net) + sizeof(uint32_t));
+            message.insert(message.end(), key.begin(), key.end());
+
+            if (op_type == OP_MPUT) {
+                const std::string& value = *entries[i].value;
+                uint32_t value_length_net = hton_uint32(value.size());
+                message.insert(message.end(), reinterpret_cast<uint8_t*>(&value_length_net), reinterpret_cast<uint8_t*>(&value_length_net) + sizeof(uint32_t));
+                message.insert(message.end(), value.begin(), value.end());
+            }
+        }
+
+        uint32_t total_size_net = hton_uint32(message.size() - start);
+        std::memcpy(&message[start], &total_size_net, sizeof(uint32_t));
+    }
+
+    // Batch response payload: Entry Count, then Status | Length | Data per entry
+    bool decode_batch_response(const std::string& payload, const std::vector<size_t>& chunk, std::vector<char>& status_codes, std::vector<std::string>& results) {
+        size_t offset = 0;
+        uint32_t entry_count_net;
+        if (payload.size() < sizeof(uint32_t)) return false;
+        std::memcpy(&entry_count_net, payload.data(), sizeof(uint32_t));
+        if (ntohl(entry_count_net) != chunk.size()) return false;
+        offset += sizeof(uint32_t);
 
-        // Serialize the message according to the message structure
-        std::vector<uint8_t> message;
+        for (size_t i : chunk) {
+            if (payload.size() - offset < 1 + sizeof(uint32_t)) return false;
+            char status_code = payload[offset];
+            uint32_t data_length_net;
+            std::memcpy(&data_length_net, &payload[offset + 1], sizeof(uint32_t));
+            uint32_t data_length = ntohl(data_length_net);
+            offset += 1 + sizeof(uint32_t);
+            if (payload.size() - offset < data_length) return false;
 
+            status_codes[i] = status_code;
+            results[i].assign(payload, offset, data_length);
+            offset += data_length;
+        }
+        return true;
+    }
+
+    static bool has_value(uint8_t op_type) {
+        return op_type == OP_PUT || op_type == OP_SETEX || op_type == OP_HANDOFF_BEGIN || op_type == OP_SCAN ||
+               is_read_modify_write(op_type);
+    }
+
+    // Serializes a request according to the message structure, with the
+    // trailer as in send_to_server
+    void append_message(std::vector<uint8_t>& message, uint8_t op_type, uint64_t key_hash, const std::string& key, const std::string& value,
+                        uint32_t trailer = 0) {
+        append_message_header(message, op_type, key_hash, key, value.size(), trailer);
+
+        if (has_value(op_type)) {
+            // Append Value
+            message.insert(message.end(), value.begin(), value.end());
+        }
+
+        if (trailer > 0) {
+            // Append TTL (uint32_t, seconds) or Max Staleness (uint32_t, milliseconds)
+            uint32_t trailer_net = hton_uint32(trailer);
+            message.insert(message.end(), reinterpret_cast<uint8_t*>(&trailer_net), reinterpret_cast<uint8_t*>(&trailer_net) + sizeof(uint32_t));
+        }
+    }
+
+    // Serializes a request up to its value: Total Size, Operation Type, Key
+    // Hash, Key Length, Key and, for PUT, SETEX, HANDOFF_BEGIN, SCAN and the
+    // read-modify-write operations, Value Length. The value and trailer are
+    // expected to follow.
+    void append_message_header(std::vector<uint8_t>& message, uint8_t op_type, uint64_t key_hash, const std::string& key, size_t value_size,
+                               uint32_t trailer = 0) {
         // Operation Type
         uint8_t operation_type = op_type;
 
@@ -199,8 +1809,11 @@ private:
 
         // Total Size (uint32_t)
         uint32_t total_size = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t) + key_length;
-        if (operation_type == OP_PUT) { // PUT operation includes value
-            total_size += sizeof(uint32_t) + value.size(); // Add Value Length and Value size
+        if (has_value(operation_type)) {
+            total_size += sizeof(uint32_t) + value_size; // Add Value Length and Value size
+        }
+        if (trailer > 0) {
+            total_size += sizeof(uint32_t); // Add TTL or Max Staleness
         }
         uint32_t total_size_net = hton_uint32(total_size);
 
@@ -220,76 +1833,279 @@ private:
         // Append Key
         message.insert(message.end(), key.begin(), key.end());
 
-        if (operation_type == OP_PUT) { // PUT operation
+        if (has_value(operation_type)) {
             // Value Length (uint32_t)
-            uint32_t value_length = value.size();
-            uint32_t value_length_net = hton_uint32(value_length);
+            uint32_t value_length_net = hton_uint32(value_size);
 
             // Append Value Length
             message.insert(message.end(), reinterpret_cast<uint8_t*>(&value_length_net), reinterpret_cast<uint8_t*>(&value_length_net) + sizeof(uint32_t));
+        }
+    }
 
-            // Append Value
-            message.insert(message.end(), value.begin(), value.end());
+    // Sends all buffered requests in as few send calls as possible, followed
+    // by the value and trailer of a request whose header ends the buffer. The
+    // pieces go out together with sendmsg, without being copied into one
+    // buffer first. While the socket is full, responses are read so that the
+    // server never blocks on us. Returns false if the connection failed.
+    bool send_outgoing(ServerConnection& conn, const std::string& value = "", uint32_t trailer = 0) {
+        if (conn.outgoing.empty()) {
+            return true;
+        }
+
+        if (conn.sock == -1 && !connect_to_server(conn)) {
+            std::cerr << "Failed to connect to server " << conn.pool->server.member() << "\n";
+            fail_connection(conn);
+            return false;
         }
 
-        // Send the message
-        size_t total_sent = 0;
-        size_t message_size = message.size();
-        while (total_sent < message_size) {
-            ssize_t bytes_sent = send(sock, &message[total_sent], message_size - total_sent, 0);
-            if (bytes_sent <= 0) {
-                // Error occurred, try to reconnect
-                close(sock);
-                connections[server_id] = -1;
-                sock = connect_to_server(server_id);
-                if (sock == -1) {
-                    std::cerr << "Failed to reconnect to server " << server_id << "\n";
+        uint32_t trailer_net = hton_uint32(trailer);
+        iovec pieces[3];
+        size_t piece_count = 0;
+        pieces[piece_count++] = {conn.outgoing.data(), conn.outgoing.size()};
+        if (!value.empty()) {
+            pieces[piece_count++] = {const_cast<char*>(value.data()), value.size()};
+        }
+        if (trailer > 0) {
+            pieces[piece_count++] = {&trailer_net, sizeof(trailer_net)};
+        }
+
+        size_t first_unsent = 0;
+        while (first_unsent < piece_count) {
+            msghdr message{};
+            message.msg_iov = &pieces[first_unsent];
+            message.msg_iovlen = piece_count - first_unsent;
+            ssize_t bytes_sent = conn.shm ? write_shared(conn, message)
+                                          : sendmsg(conn.sock, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (bytes_sent > 0) {
+                // Skips the pieces sent in full and the sent part of the next one
+                size_t sent = bytes_sent;
+                while (first_unsent < piece_count && sent >= pieces[first_unsent].iov_len) {
+                    sent -= pieces[first_unsent].iov_len;
+                    first_unsent++;
+                }
+                if (first_unsent < piece_count) {
+                    pieces[first_unsent].iov_base = static_cast<char*>(pieces[first_unsent].iov_base) + sent;
+                    pieces[first_unsent].iov_len -= sent;
+                }
+                continue;
+            }
+            if (bytes_sent == -1 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (!wait_to_send(conn)) {
                     return false;
                 }
-                // Retry sending the remaining data
                 continue;
             }
-            total_sent += bytes_sent;
+            std::cerr << "Failed to send to server " << conn.pool->server.member() << "\n";
+            fail_connection(conn);
+            return false;
+        }
+
+        conn.outgoing.clear();
+        conn.unsent_count = 0;
+        return true;
+    }
+
+    // Copies the message's pieces into the request ring as far as they fit,
+    // failing like a full non-blocking socket when nothing does
+    ssize_t write_shared(ServerConnection& conn, const msghdr& message) {
+        ShmSegment::Channel channel(*conn.shm, true);
+        size_t written = 0;
+        for (size_t i = 0; i < message.msg_iovlen; ++i) {
+            size_t piece_written = channel.write_some(message.msg_iov[i].iov_base, message.msg_iov[i].iov_len);
+            written += piece_written;
+            if (piece_written < message.msg_iov[i].iov_len) {
+                break;
+            }
+        }
+        if (written == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        return written;
+    }
+
+    // Waits until the connection takes more bytes, reading the responses that
+    // arrive meanwhile. Returns false if the connection failed.
+    bool wait_to_send(ServerConnection& conn) {
+        if (conn.shm) {
+            ShmSegment::Channel channel(*conn.shm, true);
+            bool alive = channel.wait([&] { return channel.writable() > 0 || channel.readable() > 0; },
+                                      [&] { return peer_connected(conn.sock); });
+            if (!alive) {
+                std::cerr << "Connection closed by server " << conn.pool->server.member() << "\n";
+                fail_connection(conn);
+                return false;
+            }
+            return channel.readable() == 0 || read_responses(conn);
+        }
+        pollfd poll_fd{conn.sock, POLLIN | POLLOUT, 0};
+        poll(&poll_fd, 1, -1);
+        return !(poll_fd.revents & POLLIN) || read_responses(conn);
+    }
+
+    // Receives whatever has arrived, waiting for at least one byte, from the
+    // socket or the response ring. Returns 0 once the server is gone.
+    ssize_t receive_some(ServerConnection& conn, char* data, size_t size) {
+        if (!conn.shm) {
+            return recv(conn.sock, data, size, 0);
+        }
+        ShmSegment::Channel channel(*conn.shm, true);
+        if (!channel.wait([&] { return channel.readable() > 0; }, [&] { return peer_connected(conn.sock); })) {
+            return 0;
+        }
+        return channel.read_some(data, size);
+    }
+
+    // Sends buffered requests, then reads until at most `remaining` requests
+    // are still waiting for a response.
+    void receive_responses(ServerConnection& conn, size_t remaining) {
+        if (!send_outgoing(conn)) {
+            return;
+        }
+        while (conn.in_flight.size() > remaining) {
+            if (!read_responses(conn)) {
+                return;
+            }
         }
+    }
 
-        // Receive the response
+    // Reads once from the connection and completes every request whose
+    // response is now whole. Returns false if the connection failed.
+    bool read_responses(ServerConnection& conn) {
+        // Response: Total Size (4 bytes, uint32_t) | Status ('0' or '1') | Payload
         char buffer[MAX_BUFFER_SIZE];
-        memset(buffer, 0, MAX_BUFFER_SIZE);
-        ssize_t bytes_received = recv(sock, buffer, MAX_BUFFER_SIZE - 1, 0);
-        if (bytes_received > 0) {
-            response.assign(buffer, bytes_received);
-            // Remove any trailing newline characters
-            response.erase(response.find_last_not_of("\n\r") + 1);
-            if (response.empty()) {
-                std::cerr << "Empty response from server " << server_id << "\n";
+        ssize_t bytes_received = receive_some(conn, buffer, MAX_BUFFER_SIZE);
+        if (bytes_received == 0) {
+            std::cerr << "Connection closed by server " << conn.pool->server.member() << "\n";
+            fail_connection(conn);
+            return false;
+        } else if (bytes_received < 0) {
+            if (errno == EINTR) return true;
+            std::cerr << "Error receiving response from server " << conn.pool->server.member() << "\n";
+            fail_connection(conn);
+            return false;
+        }
+        conn.incoming.insert(conn.incoming.end(), buffer, buffer + bytes_received);
+
+        size_t offset = 0;
+        while (conn.incoming.size() - offset >= sizeof(uint32_t)) {
+            uint32_t total_size_net;
+            std::memcpy(&total_size_net, &conn.incoming[offset], sizeof(uint32_t));
+            uint32_t total_size = ntohl(total_size_net);
+            if (total_size <= sizeof(uint32_t) || conn.in_flight.empty()) {
+                std::cerr << "Invalid response from server " << conn.pool->server.member() << "\n";
+                fail_connection(conn);
                 return false;
             }
-            status_code = response[0];
-            response = response.substr(1); // Remove the status code
-            return true;
-        } else if (bytes_received == 0) {
-            // Connection closed by server
-            close(sock);
-            connections[server_id] = -1;
-            std::cerr << "Connection closed by server " << server_id << "\n";
+            if (conn.incoming.size() - offset < total_size) {
+                if (total_size - sizeof(uint32_t) - 1 >= LARGE_VALUE_SIZE && conn.incoming.size() - offset > sizeof(uint32_t)) {
+                    if (!receive_large_response(conn, offset, total_size)) {
+                        return false;
+                    }
+                    continue;
+                }
+                break;
+            }
+
+            char status_code = conn.incoming[offset + sizeof(uint32_t)];
+            const char* payload = reinterpret_cast<const char*>(&conn.incoming[offset + sizeof(uint32_t) + 1]);
+            std::string response(payload, total_size - sizeof(uint32_t) - 1);
+            offset += total_size;
+
+            ResponseHandler handler = std::move(conn.in_flight.front());
+            conn.in_flight.pop_front();
+            handler(true, status_code, response);
+        }
+        conn.incoming.erase(conn.incoming.begin(), conn.incoming.begin() + offset);
+        return true;
+    }
+
+    // Receives the rest of the large response whose start is at offset in
+    // incoming straight into the string handed to its handler, so the value
+    // is copied once rather than into incoming and then out of it
+    bool receive_large_response(ServerConnection& conn, size_t offset, uint32_t total_size) {
+        char status_code = conn.incoming[offset + sizeof(uint32_t)];
+        const char* payload = reinterpret_cast<const char*>(&conn.incoming[offset + sizeof(uint32_t) + 1]);
+        size_t received = conn.incoming.size() - offset - sizeof(uint32_t) - 1;
+        std::string response;
+        response.reserve(total_size - sizeof(uint32_t) - 1);
+        response.append(payload, received);
+        response.resize(total_size - sizeof(uint32_t) - 1);
+        if (!receive_exact(conn, response.data() + received, response.size() - received)) {
             return false;
-        } else {
-            // Error occurred
-            close(sock);
-            connections[server_id] = -1;
-            std::cerr << "Error receiving response from server " << server_id << "\n";
+        }
+        conn.incoming.resize(offset);
+
+        ResponseHandler handler = std::move(conn.in_flight.front());
+        conn.in_flight.pop_front();
+        handler(true, status_code, response);
+        return true;
+    }
+
+    // Receives exactly size bytes. Returns false if the connection failed.
+    bool receive_exact(ServerConnection& conn, char* data, size_t size) {
+        while (size > 0) {
+            ssize_t bytes_received = receive_some(conn, data, size);
+            if (bytes_received > 0) {
+                data += bytes_received;
+                size -= bytes_received;
+                continue;
+            }
+            if (bytes_received < 0 && errno == EINTR) {
+                continue;
+            }
+            std::cerr << (bytes_received == 0 ? "Connection closed by server " : "Error receiving response from server ")
+                      << conn.pool->server.member() << "\n";
+            fail_connection(conn);
             return false;
         }
+        return true;
+    }
+
+    // Closes the connection and fails every request still waiting on it
+    void fail_connection(ServerConnection& conn) {
+        if (conn.sock != -1) {
+            close(conn.sock);
+            conn.sock = -1;
+        }
+        conn.shm.reset();
+        conn.outgoing.clear();
+        conn.unsent_count = 0;
+        conn.incoming.clear();
+
+        std::deque<ResponseHandler> failed;
+        failed.swap(conn.in_flight);
+        for (auto& handler : failed) {
+            std::string no_response;
+            handler(false, '1', no_response);
+        }
     }
 };
 
 // The main function is included only when compiling client.cpp directly
 #ifndef FINCH_CLIENT_NO_MAIN
 
-int main() {
+// Without arguments, runs the example usage below. "./client stats [section]"
+// prints a STATS section of every server instead, "./client stats metrics"
+// all of their metrics.
+int main(int argc, char* argv[]) {
     try {
         FinchClient client;
 
+        if (argc > 1 && std::string(argv[1]) == "stats") {
+            std::string section = argc > 2 ? argv[2] : "";
+            for (size_t server_id = 0; server_id < client.server_count(); ++server_id) {
+                std::cout << "# server " << server_id << "\n" << client.stats(server_id, section);
+                if (section.empty()) {
+                    std::cout << "\n";
+                }
+            }
+            return 0;
+        }
+
         // Example usage
         if (client.put("mykey", "myvalue")) {
             std::cout << "Key stored successfully.\n";
@@ -316,10 +2132,33 @@ int main() {
         } else {
             std::cout << "Key not found after deletion.\n";
         }
+
+        // Pipelined usage: requests go out together and are answered on flush
+        std::vector<std::future<bool>> puts;
+        for (int i = 0; i < 10; ++i) {
+            puts.push_back(client.put_async("key" + std::to_string(i), "value" + std::to_string(i)));
+        }
+        std::future<std::string> pipelined_value = client.get_async("key7");
+        client.flush();
+
+        size_t stored = 0;
+        for (auto& put : puts) {
+            stored += put.get();
+        }
+        std::cout << "Pipelined " << stored << " puts, key7 = " << pipelined_value.get() << "\n";
+
+        // Batch usage: one message per server for all keys
+        std::vector<std::string> keys;
+        for (int i = 0; i < 10; ++i) {
+            keys.push_back("key" + std::to_string(i));
+        }
+        std::vector<std::string> values = client.mget(keys);
+        std::cout << "Batch get returned " << values.size() << " values, key3 = " << values[3] << "\n";
+        std::cout << "Batch delete removed " << client.mdel(keys) << " keys\n";
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << "\n";
     }
     return 0;
 }
 
-#endif // FINCH_CLIENT_NO_MAIN
\ No newline at end of file
+#endif // FINCH_CLIENT_NO_MAIN
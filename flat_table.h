@@ -0,0 +1,574 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <utility>
+
+#include "slab_arena.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Byte string in 24 bytes. Up to 23 bytes are stored inline, longer strings
+// in a chunk of the partition's SlabArena. The last byte holds the inline
+// size, or HEAP_TAG. The owner passes the arena in and releases the bytes
+// explicitly, so InlineBytes is trivially copyable and has no destructor.
+class InlineBytes {
+public:
+    InlineBytes() {
+        set_inline_size(0);
+    }
+
+    static bool fits(size_t) {
+        return true;
+    }
+
+    std::string_view view() const {
+        if (is_inline()) {
+            return std::string_view(storage, tag());
+        }
+        return std::string_view(heap_data(), heap_field(SIZE_OFFSET));
+    }
+
+    bool equals(std::string_view bytes) const {
+        return view() == bytes;
+    }
+
+    // Reuses the chunk if the new bytes fit in it
+    void assign(std::string_view bytes, SlabArena& arena) {
+        if (bytes.size() <= INLINE_CAPACITY) {
+            release(arena);
+            std::memcpy(storage, bytes.data(), bytes.size());
+            set_inline_size(bytes.size());
+            return;
+        }
+        if (!is_inline() && heap_field(CAPACITY_OFFSET) >= bytes.size()) {
+            std::memcpy(heap_data(), bytes.data(), bytes.size());
+            arena.account(static_cast<int64_t>(bytes.size()) - heap_field(SIZE_OFFSET), 0);
+            set_heap_field(SIZE_OFFSET, bytes.size());
+            return;
+        }
+
+        release(arena);
+        uint32_t capacity;
+        char* data = arena.allocate(bytes.size(), capacity);
+        std::memcpy(data, bytes.data(), bytes.size());
+        set_heap(data, bytes.size(), capacity);
+    }
+
+    void release(SlabArena& arena) {
+        if (!is_inline()) {
+            arena.free(heap_data(), heap_field(SIZE_OFFSET), heap_field(CAPACITY_OFFSET));
+            set_inline_size(0);
+        }
+    }
+
+    // Moves the bytes out of a slab the arena is evacuating
+    void relocate(SlabArena& arena) {
+        if (is_inline() || !arena.is_evacuating(heap_data(), heap_field(CAPACITY_OFFSET))) {
+            return;
+        }
+        size_t size = heap_field(SIZE_OFFSET);
+        uint32_t capacity;
+        char* data = arena.allocate(size, capacity);
+        std::memcpy(data, heap_data(), size);
+        arena.free(heap_data(), size, heap_field(CAPACITY_OFFSET));
+        set_heap(data, size, capacity);
+    }
+
+private:
+    static constexpr size_t INLINE_CAPACITY = 23;
+    static constexpr uint8_t HEAP_TAG = 0xFF;
+    // Heap layout: pointer, then 32-bit size and capacity
+    static constexpr size_t SIZE_OFFSET = sizeof(char*);
+    static constexpr size_t CAPACITY_OFFSET = SIZE_OFFSET + sizeof(uint32_t);
+
+    uint8_t tag() const {
+        return static_cast<uint8_t>(storage[INLINE_CAPACITY]);
+    }
+
+    bool is_inline() const {
+        return tag() != HEAP_TAG;
+    }
+
+    void set_inline_size(size_t size) {
+        storage[INLINE_CAPACITY] = static_cast<char>(size);
+    }
+
+    char* heap_data() const {
+        char* data;
+        std::memcpy(&data, storage, sizeof(char*));
+        return data;
+    }
+
+    void set_heap(char* data, size_t size, uint32_t capacity) {
+        std::memcpy(storage, &data, sizeof(char*));
+        set_heap_field(SIZE_OFFSET, size);
+        set_heap_field(CAPACITY_OFFSET, capacity);
+        storage[INLINE_CAPACITY] = static_cast<char>(HEAP_TAG);
+    }
+
+    uint32_t heap_field(size_t offset) const {
+        uint32_t value;
+        std::memcpy(&value, storage + offset, sizeof(uint32_t));
+        return value;
+    }
+
+    void set_heap_field(size_t offset, size_t value) {
+        uint32_t field = static_cast<uint32_t>(value);
+        std::memcpy(storage + offset, &field, sizeof(uint32_t));
+    }
+
+    char storage[INLINE_CAPACITY + 1];
+};
+
+// Exactly N bytes stored inline, with no size or tag byte, for stores whose
+// keys or values all have one size. Only bytes that fit are assigned, and the
+// arena is never used. Sizes that are a multiple of 16 are compared 16 bytes
+// at a time with SSE2.
+template <size_t N>
+class FixedBytes {
+public:
+    static_assert(N > 0, "FixedBytes needs at least one byte");
+
+    static bool fits(size_t size) {
+        return size == N;
+    }
+
+    std::string_view view() const {
+        return std::string_view(storage, N);
+    }
+
+    bool equals(std::string_view bytes) const {
+        if (bytes.size() != N) {
+            return false;
+        }
+#ifdef __SSE2__
+        if constexpr (N % 16 == 0) {
+            for (size_t i = 0; i < N; i += 16) {
+                __m128i stored = _mm_loadu_si128(reinterpret_cast<const __m128i*>(storage + i));
+                __m128i wanted = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes.data() + i));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(stored, wanted)) != 0xFFFF) {
+                    return false;
+                }
+            }
+            return true;
+        }
+#endif
+        return std::memcmp(storage, bytes.data(), N) == 0;
+    }
+
+    void assign(std::string_view bytes, SlabArena&) {
+        std::memcpy(storage, bytes.data(), N);
+    }
+
+    void release(SlabArena&) {}
+
+    void relocate(SlabArena&) {}
+
+private:
+    char storage[N];
+};
+
+// Open-addressing hash table in the style of Swiss tables. Every slot has a
+// control byte that is EMPTY, DELETED, or the low 7 bits of the key's hash.
+// Lookups scan a group of 16 control bytes at once with SSE2 and only compare
+// keys whose control byte matches. Slots store the key hash the client sent,
+// so nothing is rehashed on lookup or growth. KeyStorage and ValueStorage
+// hold the key and value inside the slot: InlineBytes for FlatTable, which
+// keeps up to 23 bytes there and longer ones in the table's SlabArena, and
+// FixedBytes for FixedTable.
+//
+// Every slot has an expiry deadline, 0 for none. Entries past their deadline
+// stay in the table until they are erased or expired, but lookups skip them.
+// Deadlines and now are milliseconds on the caller's clock.
+template <class KeyStorage, class ValueStorage>
+class BasicFlatTable {
+public:
+    BasicFlatTable() = default;
+
+    ~BasicFlatTable() {
+        destroy_slots();
+    }
+
+    BasicFlatTable(const BasicFlatTable&) = delete;
+    BasicFlatTable& operator=(const BasicFlatTable&) = delete;
+
+    // Whether a pair of these sizes can be stored. put must only be given
+    // pairs that fit.
+    static bool fits(size_t key_size, size_t value_size) {
+        return KeyStorage::fits(key_size) && ValueStorage::fits(value_size);
+    }
+
+    bool find(uint64_t hash, std::string_view key, std::string_view& value, uint64_t now) const {
+        uint64_t expires_at;
+        return find(hash, key, value, expires_at, now);
+    }
+
+    // Like find, also giving the entry's deadline, 0 for none
+    bool find(uint64_t hash, std::string_view key, std::string_view& value, uint64_t& expires_at, uint64_t now) const {
+        size_t index = find_index(hash, key);
+        if (index == NOT_FOUND || is_expired(index, now)) {
+            return false;
+        }
+        value = slots[index].value.view();
+        expires_at = slots[index].expires_at;
+        mark_referenced(index);
+        return true;
+    }
+
+    void put(uint64_t hash, std::string_view key, std::string_view value, uint64_t expires_at = 0) {
+        size_t index = find_index(hash, key);
+        if (index != NOT_FOUND) {
+            slots[index].value.assign(value, arena);
+            slots[index].expires_at = expires_at;
+            mark_referenced(index);
+            return;
+        }
+
+        if (used + 1 > capacity / 8 * 7) {
+            // Grow when mostly live entries, otherwise only clear the tombstones
+            rehash(entries + 1 > capacity / 16 * 7 ? std::max(capacity * 2, GROUP_WIDTH) : capacity);
+        }
+        index = find_free_slot(hash);
+        if (control[index] == EMPTY) {
+            used++;
+        }
+        entries.store(entries.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        arena.account(SLOT_BYTES, 0);
+        control[index] = control_byte(hash);
+        referenced[index].store(1, std::memory_order_relaxed);
+        Slot* slot = new (&slots[index]) Slot();
+        slot->hash = hash;
+        slot->expires_at = expires_at;
+        slot->key.assign(key, arena);
+        slot->value.assign(value, arena);
+    }
+
+    // Returns false if the key was missing or had already expired
+    bool erase(uint64_t hash, std::string_view key, uint64_t now) {
+        size_t index = find_index(hash, key);
+        if (index == NOT_FOUND) {
+            return false;
+        }
+        bool expired = is_expired(index, now);
+        erase_at(index);
+        return !expired;
+    }
+
+    // Erases the expired entries with this hash, for an expiry timer that
+    // only knows the hash, calling on_erase(key) before erasing each. Returns
+    // the number erased.
+    size_t expire(uint64_t hash, uint64_t now) {
+        return expire(hash, now, [](std::string_view) {});
+    }
+
+    template <class Fn>
+    size_t expire(uint64_t hash, uint64_t now, Fn&& on_erase) {
+        if (capacity == 0) {
+            return 0;
+        }
+        size_t expired = 0;
+        int8_t wanted = control_byte(hash);
+        size_t group = first_group(hash);
+        for (size_t step = 1; step <= capacity / GROUP_WIDTH; ++step) {
+            size_t group_start = group * GROUP_WIDTH;
+            Group bytes(&control[group_start]);
+            for (uint32_t mask = bytes.match(wanted); mask != 0; mask &= mask - 1) {
+                size_t index = group_start + __builtin_ctz(mask);
+                if (slots[index].hash == hash && is_expired(index, now)) {
+                    on_erase(slots[index].key.view());
+                    erase_at(index);
+                    expired++;
+                }
+            }
+            if (bytes.match(EMPTY)) {
+                break;
+            }
+            group = next_group(group, step);
+        }
+        return expired;
+    }
+
+    // Evicts one entry chosen by CLOCK. The hand sweeps the slots, clearing
+    // reference bits, and evicts the first entry that wasn't read or written
+    // since the hand last passed it, calling on_erase(hash, key) first.
+    // Returns false if the table is empty.
+    bool evict_one() {
+        return evict_one([](uint64_t, std::string_view) {});
+    }
+
+    template <class Fn>
+    bool evict_one(Fn&& on_erase) {
+        if (entries == 0) {
+            return false;
+        }
+        while (true) {
+            size_t index = clock_hand;
+            clock_hand = (clock_hand + 1) & (capacity - 1);
+            if (control[index] < 0) {
+                continue;
+            }
+            if (referenced[index].load(std::memory_order_relaxed)) {
+                referenced[index].store(0, std::memory_order_relaxed);
+                continue;
+            }
+            on_erase(slots[index].hash, slots[index].key.view());
+            erase_at(index);
+            return true;
+        }
+    }
+
+    // Safe to call from any thread, for stats
+    size_t size() const {
+        return entries.load(std::memory_order_relaxed);
+    }
+
+    // Calls fn(hash, key, value, expires_at) for every entry, expired or not
+    template <class Fn>
+    void for_each(Fn&& fn) const {
+        for (size_t i = 0; i < capacity; ++i) {
+            if (control[i] >= 0) {
+                fn(slots[i].hash, slots[i].key.view(), slots[i].value.view(), slots[i].expires_at);
+            }
+        }
+    }
+
+    // Shrinks a mostly empty table, releases the arena's empty slabs and moves
+    // keys and values out of its sparsest ones so that they are released too.
+    // Returns true if any memory was released.
+    bool compact() {
+        // Shrink once mostly empty, to a size that isn't about to grow again
+        bool released = false;
+        if (capacity > GROUP_WIDTH && entries < capacity / 8) {
+            size_t new_capacity = GROUP_WIDTH;
+            while (entries > new_capacity / 4) {
+                new_capacity *= 2;
+            }
+            rehash(new_capacity);
+            released = true;
+        }
+
+        released |= arena.release_empty_slabs();
+        if (!arena.plan_compaction()) {
+            return released;
+        }
+        for (size_t i = 0; i < capacity; ++i) {
+            if (control[i] >= 0) {
+                slots[i].key.relocate(arena);
+                slots[i].value.relocate(arena);
+            }
+        }
+        return true;
+    }
+
+    // Counts the slots and control bytes as well as the arena. A live slot is
+    // used, an empty one is fragmentation.
+    MemoryStats memory() const {
+        return arena.stats();
+    }
+
+private:
+    static constexpr size_t GROUP_WIDTH = 16;
+    static constexpr size_t NOT_FOUND = SIZE_MAX;
+    static constexpr int8_t EMPTY = -128;  // 0b10000000
+    static constexpr int8_t DELETED = -2;  // 0b11111110
+
+    struct Slot {
+        uint64_t hash;
+        uint64_t expires_at;
+        KeyStorage key;
+        ValueStorage value;
+    };
+
+    static constexpr size_t SLOT_BYTES = sizeof(Slot) + 2; // With its control and reference bytes
+
+    // A group of 16 control bytes, matched with one compare and movemask. Bit i
+    // of a mask is set when byte i matches.
+    struct Group {
+#ifdef __SSE2__
+        explicit Group(const int8_t* bytes) : bytes(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes))) {}
+
+        uint32_t match(int8_t value) const {
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(value)));
+        }
+
+        // EMPTY and DELETED are the only negative control bytes
+        uint32_t match_free() const {
+            return _mm_movemask_epi8(bytes);
+        }
+
+        __m128i bytes;
+#else
+        explicit Group(const int8_t* bytes) : bytes(bytes) {}
+
+        uint32_t match(int8_t value) const {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+                mask |= static_cast<uint32_t>(bytes[i] == value) << i;
+            }
+            return mask;
+        }
+
+        uint32_t match_free() const {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+                mask |= static_cast<uint32_t>(bytes[i] < 0) << i;
+            }
+            return mask;
+        }
+
+        const int8_t* bytes;
+#endif
+    };
+
+    // The low bits of the client's hash pick the partition, so every key in a
+    // table shares them. Mixing spreads the remaining bits over the whole word.
+    static uint64_t mix(uint64_t hash) {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    static int8_t control_byte(uint64_t hash) {
+        return static_cast<int8_t>(mix(hash) & 0x7F);
+    }
+
+    // Reads may run concurrently under a shared partition lock, so the
+    // reference byte is an atomic and only written when not already set
+    void mark_referenced(size_t index) const {
+        if (!referenced[index].load(std::memory_order_relaxed)) {
+            referenced[index].store(1, std::memory_order_relaxed);
+        }
+    }
+
+    bool is_expired(size_t index, uint64_t now) const {
+        return slots[index].expires_at != 0 && slots[index].expires_at <= now;
+    }
+
+    void erase_at(size_t index) {
+        slots[index].key.release(arena);
+        slots[index].value.release(arena);
+        entries.store(entries.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        arena.account(-static_cast<int64_t>(SLOT_BYTES), 0);
+
+        // Probes stop at the first group with an EMPTY byte. If this group
+        // already has one, no probe ever went past it and the slot can be
+        // EMPTY again, otherwise it becomes a tombstone.
+        size_t group_start = index & ~(GROUP_WIDTH - 1);
+        if (Group(&control[group_start]).match(EMPTY)) {
+            control[index] = EMPTY;
+            used--;
+        } else {
+            control[index] = DELETED;
+        }
+    }
+
+    size_t first_group(uint64_t hash) const {
+        return (mix(hash) >> 7) & (capacity / GROUP_WIDTH - 1);
+    }
+
+    // Probes whole groups in triangular steps, which visits every group once
+    // when the group count is a power of two
+    size_t next_group(size_t group, size_t step) const {
+        return (group + step) & (capacity / GROUP_WIDTH - 1);
+    }
+
+    size_t find_index(uint64_t hash, std::string_view key) const {
+        if (capacity == 0) {
+            return NOT_FOUND;
+        }
+        int8_t wanted = control_byte(hash);
+        size_t group = first_group(hash);
+        for (size_t step = 1; step <= capacity / GROUP_WIDTH; ++step) {
+            size_t group_start = group * GROUP_WIDTH;
+            Group bytes(&control[group_start]);
+            for (uint32_t mask = bytes.match(wanted); mask != 0; mask &= mask - 1) {
+                size_t index = group_start + __builtin_ctz(mask);
+                if (slots[index].hash == hash && slots[index].key.equals(key)) {
+                    return index;
+                }
+            }
+            if (bytes.match(EMPTY)) {
+                return NOT_FOUND;
+            }
+            group = next_group(group, step);
+        }
+        return NOT_FOUND;
+    }
+
+    // The table always has a free slot, since it grows before filling up
+    size_t find_free_slot(uint64_t hash) const {
+        size_t group = first_group(hash);
+        for (size_t step = 1; ; ++step) {
+            size_t group_start = group * GROUP_WIDTH;
+            uint32_t mask = Group(&control[group_start]).match_free();
+            if (mask != 0) {
+                return group_start + __builtin_ctz(mask);
+            }
+            group = next_group(group, step);
+        }
+    }
+
+    void rehash(size_t new_capacity) {
+        std::unique_ptr<int8_t[]> old_control = std::move(control);
+        std::unique_ptr<std::atomic<uint8_t>[]> old_referenced = std::move(referenced);
+        Slot* old_slots = slots;
+        size_t old_capacity = capacity;
+
+        capacity = new_capacity;
+        control.reset(new int8_t[capacity]);
+        std::memset(control.get(), EMPTY, capacity);
+        referenced = std::make_unique<std::atomic<uint8_t>[]>(capacity);
+        clock_hand = 0;
+        slots = static_cast<Slot*>(::operator new(capacity * sizeof(Slot)));
+        used = entries;
+        arena.account(0, (static_cast<int64_t>(capacity) - static_cast<int64_t>(old_capacity)) * SLOT_BYTES);
+
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old_control[i] < 0) {
+                continue;
+            }
+            size_t index = find_free_slot(old_slots[i].hash);
+            control[index] = old_control[i];
+            referenced[index].store(old_referenced[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            slots[index] = old_slots[i];
+        }
+        ::operator delete(old_slots);
+    }
+
+    void destroy_slots() {
+        for (size_t i = 0; i < capacity; ++i) {
+            if (control[i] >= 0) {
+                slots[i].key.release(arena);
+                slots[i].value.release(arena);
+            }
+        }
+        ::operator delete(slots);
+    }
+
+    SlabArena arena;
+    std::unique_ptr<int8_t[]> control;
+    std::unique_ptr<std::atomic<uint8_t>[]> referenced; // CLOCK reference bit per slot
+    Slot* slots = nullptr;
+    size_t capacity = 0; // A power of two, at least one group
+    std::atomic<size_t> entries{0}; // Live slots, written only by the owner but read by stats
+    size_t used = 0;     // Live slots and tombstones
+    size_t clock_hand = 0;
+};
+
+using FlatTable = BasicFlatTable<InlineBytes, InlineBytes>;
+
+// A table for keys of exactly KeyBytes and values of exactly ValueBytes, kept
+// in the slots without size bytes, heap pointers or arena chunks
+template <size_t KeyBytes, size_t ValueBytes>
+using FixedTable = BasicFlatTable<FixedBytes<KeyBytes>, FixedBytes<ValueBytes>>;
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "key_hash.h"
+
+// Consistent hash ring (Karger et al.) of server addresses. Every member is
+// placed at VIRTUAL_NODES points, the hash_key of "address#i", and a key belongs
+// to the member of the first point at or after its hash, wrapping around. A
+// member joining or leaving only moves the keys between its points and the
+// ones before them, about 1/N of all keys, and the virtual nodes even out the
+// share of every member.
+//
+// The client routes with it and the servers use it during a handoff to find
+// the keys they no longer own, so both must build it from the same address
+// strings, "host:port" as in node_list.txt.
+class HashRing {
+public:
+    static constexpr size_t VIRTUAL_NODES = 160;
+
+    HashRing() = default;
+
+    explicit HashRing(const std::vector<std::string>& members, size_t virtual_nodes = VIRTUAL_NODES) {
+        points.reserve(members.size() * virtual_nodes);
+        for (size_t member = 0; member < members.size(); ++member) {
+            for (size_t i = 0; i < virtual_nodes; ++i) {
+                points.emplace_back(hash_key(members[member] + "#" + std::to_string(i)), member);
+            }
+        }
+        std::sort(points.begin(), points.end());
+    }
+
+    bool empty() const {
+        return points.empty();
+    }
+
+    // Index in members of the member owning the key. The ring must not be empty.
+    size_t owner(uint64_t key_hash) const {
+        auto point = std::lower_bound(points.begin(), points.end(), std::make_pair(key_hash, size_t{0}));
+        return point == points.end() ? points.front().second : point->second;
+    }
+
+private:
+    std::vector<std::pair<uint64_t, size_t>> points; // Hash and member, ascending
+};
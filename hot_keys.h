@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The most requested keys of a server, from a sample of its requests. Every
+// sampled key is counted in a count-min sketch (Cormode and Muthukrishnan),
+// ROW_COUNT rows of counters indexed by separate bits of the key hash, whose
+// smallest counter over the rows never undercounts the key and overcounts it
+// by the keys colliding with it in every row. Keys whose estimate beats the
+// least of the TOP_COUNT keys tracked so far replace it. decay halves every
+// count, so the keys reported are those requested lately.
+//
+// Counters are shared atomics, which only the sampled requests touch. Whether
+// a key is among the tracked ones is read from their hashes without a lock;
+// only a key entering the top takes the mutex.
+class HotKeyTracker {
+public:
+    static constexpr size_t TOP_COUNT = 32;
+
+    struct HotKey {
+        std::string key;
+        uint64_t key_hash;
+        uint64_t count; // Sampled requests, halved by every decay
+    };
+
+    HotKeyTracker() : counters(new std::atomic<uint32_t>[ROW_COUNT * ROW_WIDTH]()) {}
+
+    void sample(uint64_t key_hash, std::string_view key) {
+        uint32_t estimate = UINT32_MAX;
+        for (size_t row = 0; row < ROW_COUNT; ++row) {
+            estimate = std::min(estimate, counter(row, key_hash).fetch_add(1, std::memory_order_relaxed) + 1);
+        }
+        if (estimate <= admission.load(std::memory_order_relaxed) || is_hot(key_hash)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        if (is_hot(key_hash)) {
+            return;
+        }
+        if (top.size() < TOP_COUNT) {
+            top.push_back({std::string(key), key_hash, estimate});
+            hot_hashes[top.size() - 1].store(key_hash, std::memory_order_relaxed);
+        } else {
+            refresh_counts();
+            size_t least = least_index();
+            if (estimate <= top[least].count) {
+                return;
+            }
+            top[least] = {std::string(key), key_hash, estimate};
+            hot_hashes[least].store(key_hash, std::memory_order_relaxed);
+        }
+        update_admission();
+    }
+
+    bool is_hot(uint64_t key_hash) const {
+        for (const std::atomic<uint64_t>& hot_hash : hot_hashes) {
+            if (hot_hash.load(std::memory_order_relaxed) == key_hash) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The tracked keys, most requested first
+    std::vector<HotKey> hottest() {
+        std::lock_guard<std::mutex> lock(mtx);
+        refresh_counts();
+        std::vector<HotKey> keys = top;
+        std::sort(keys.begin(), keys.end(), [](const HotKey& a, const HotKey& b) { return a.count > b.count; });
+        return keys;
+    }
+
+    // Halves every count. Increments racing with it may be lost, which only
+    // makes an estimate a little lower.
+    void decay() {
+        for (size_t i = 0; i < ROW_COUNT * ROW_WIDTH; ++i) {
+            counters[i].store(counters[i].load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        refresh_counts();
+        update_admission();
+    }
+
+private:
+    static constexpr size_t ROW_COUNT = 4;
+    static constexpr size_t ROW_BITS = 12;
+    static constexpr size_t ROW_WIDTH = size_t{1} << ROW_BITS;
+
+    // Row r takes ROW_BITS bits of the hash starting at bit 10 + r * ROW_BITS,
+    // above the partition's bits, which every key of a partition shares
+    std::atomic<uint32_t>& counter(size_t row, uint64_t key_hash) const {
+        size_t column = (key_hash >> (10 + row * ROW_BITS)) & (ROW_WIDTH - 1);
+        return counters[row * ROW_WIDTH + column];
+    }
+
+    uint32_t estimate(uint64_t key_hash) const {
+        uint32_t estimate = UINT32_MAX;
+        for (size_t row = 0; row < ROW_COUNT; ++row) {
+            estimate = std::min(estimate, counter(row, key_hash).load(std::memory_order_relaxed));
+        }
+        return estimate;
+    }
+
+    void refresh_counts() {
+        for (HotKey& hot_key : top) {
+            hot_key.count = estimate(hot_key.key_hash);
+        }
+    }
+
+    size_t least_index() const {
+        return std::min_element(top.begin(), top.end(),
+                                [](const HotKey& a, const HotKey& b) { return a.count < b.count; }) -
+               top.begin();
+    }
+
+    // Keys can only enter a full top by beating its least count
+    void update_admission() {
+        admission.store(top.size() < TOP_COUNT ? 0 : top[least_index()].count, std::memory_order_relaxed);
+    }
+
+    std::unique_ptr<std::atomic<uint32_t>[]> counters;
+    std::atomic<uint32_t> admission{0};
+    std::atomic<uint64_t> hot_hashes[TOP_COUNT]{};
+    std::mutex mtx;
+    std::vector<HotKey> top; // Under mtx, at most TOP_COUNT
+};
+
+// Copies of hot keys' values that any thread can read without the lock or
+// owning loop of their partition. A copy is filled by a GET of a hot key
+// while its partition is held, and every change to the key drops it while the
+// partition is still held, so a copy never outlives a write that has been
+// answered.
+//
+// Slots are seqlocks: a writer makes the sequence odd, writes and makes it
+// even again, and a reader copies the slot out and keeps the copy only if
+// the sequence was even and unchanged throughout. Readers write nothing, so
+// they don't bounce the slot's cache lines between cores. The bytes are
+// atomic words, so a torn read is a discarded copy and not a data race.
+class HotCopies {
+public:
+    static constexpr size_t SLOT_COUNT = 512;
+    static constexpr size_t MAX_BYTES = 512; // Key and value together, larger pairs aren't copied
+
+    HotCopies() : slots(new Slot[SLOT_COUNT]) {}
+
+    // Appends the key's value to output and returns true if a copy that
+    // hasn't expired by now is there
+    bool read(uint64_t key_hash, std::string_view key, uint64_t now, std::string& output) const {
+        const Slot& slot = slot_of(key_hash);
+        uint64_t before = slot.sequence.load(std::memory_order_acquire);
+        if (before % 2 == 1 || slot.key_hash.load(std::memory_order_relaxed) != key_hash) {
+            return false;
+        }
+        uint32_t key_length = slot.key_length.load(std::memory_order_relaxed);
+        uint32_t value_length = slot.value_length.load(std::memory_order_relaxed);
+        uint64_t expires_at = slot.expires_at.load(std::memory_order_relaxed);
+        if (key_length != key.size() || key_length + value_length > MAX_BYTES) {
+            return false;
+        }
+        uint64_t words[WORD_COUNT];
+        size_t word_count = (key_length + value_length + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        for (size_t i = 0; i < word_count; ++i) {
+            words[i] = slot.words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != before) {
+            return false;
+        }
+        const char* bytes = reinterpret_cast<const char*>(words);
+        if (std::string_view(bytes, key_length) != key || (expires_at != 0 && expires_at <= now)) {
+            return false;
+        }
+        output.append(bytes + key_length, value_length);
+        return true;
+    }
+
+    // Copies the pair over whatever its slot held, unless another writer has
+    // the slot or the pair is too large
+    void fill(uint64_t key_hash, std::string_view key, std::string_view value, uint64_t expires_at) {
+        if (key.size() + value.size() > MAX_BYTES) {
+            return;
+        }
+        Slot& slot = slot_of(key_hash);
+        uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+        if (sequence % 2 == 1 ||
+            !slot.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_acquire)) {
+            return;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        uint64_t words[WORD_COUNT] = {};
+        std::memcpy(words, key.data(), key.size());
+        std::memcpy(reinterpret_cast<char*>(words) + key.size(), value.data(), value.size());
+        size_t word_count = (key.size() + value.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        for (size_t i = 0; i < word_count; ++i) {
+            slot.words[i].store(words[i], std::memory_order_relaxed);
+        }
+        slot.key_hash.store(key_hash, std::memory_order_relaxed);
+        slot.key_length.store(key.size(), std::memory_order_relaxed);
+        slot.value_length.store(value.size(), std::memory_order_relaxed);
+        slot.expires_at.store(expires_at, std::memory_order_relaxed);
+        slot.sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    // Drops the key's copy, waiting for a writer that has its slot. Called
+    // for every change, so a slot holding another key is left alone without
+    // writing to it.
+    void invalidate(uint64_t key_hash) {
+        Slot& slot = slot_of(key_hash);
+        while (true) {
+            uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence % 2 == 0 && slot.key_hash.load(std::memory_order_relaxed) != key_hash) {
+                return;
+            }
+            if (sequence % 2 == 0 &&
+                slot.sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire)) {
+                std::atomic_thread_fence(std::memory_order_release);
+                slot.key_hash.store(0, std::memory_order_relaxed);
+                slot.key_length.store(0, std::memory_order_relaxed);
+                slot.sequence.store(sequence + 2, std::memory_order_release);
+                return;
+            }
+        }
+    }
+
+private:
+    static constexpr size_t WORD_COUNT = MAX_BYTES / sizeof(uint64_t);
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> sequence{0}; // Odd while a writer has the slot
+        std::atomic<uint64_t> key_hash{0};
+        std::atomic<uint64_t> expires_at{0};
+        std::atomic<uint32_t> key_length{0}; // 0 for an empty slot, keys aren't empty
+        std::atomic<uint32_t> value_length{0};
+        std::atomic<uint64_t> words[WORD_COUNT]{}; // The key, then the value
+    };
+
+    // Bits above the partition's, as in HotKeyTracker
+    Slot& slot_of(uint64_t key_hash) const {
+        return slots[(key_hash >> 10) % SLOT_COUNT];
+    }
+
+    std::unique_ptr<Slot[]> slots;
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// The key hash of the protocol: wyhash (final version 4) with seed 0 and the
+// default secret. The client sends it with every key, the servers pick
+// partitions and compare slots with it, and the hash ring places servers
+// with it, so every client has to compute exactly this function.
+// std::hash differs between standard libraries, and two clients built with
+// different toolchains would send a key to different servers.
+//
+// wyhash reads 16 bytes per 64x64->128-bit multiply, which on the short keys
+// Finch sees beats hashes that need 32+ byte inputs to fill SIMD lanes. Words
+// are read little-endian, whatever the host's byte order.
+//
+// A key's server comes from the ring, where ordering by the whole hash is
+// decided by its top bits, and its partition from the low 10 bits, so the
+// two choices use separate bits and every server spreads its keys over all
+// of its partitions.
+class WyHash {
+public:
+    static uint64_t hash(const void* key, size_t length, uint64_t seed = 0) {
+        const uint8_t* p = static_cast<const uint8_t*>(key);
+        seed ^= mix(seed ^ SECRET[0], SECRET[1]);
+        uint64_t a;
+        uint64_t b;
+        if (length <= 16) {
+            if (length >= 4) {
+                size_t middle = (length >> 3) << 2;
+                a = (read4(p) << 32) | read4(p + middle);
+                b = (read4(p + length - 4) << 32) | read4(p + length - 4 - middle);
+            } else if (length > 0) {
+                a = read3(p, length);
+                b = 0;
+            } else {
+                a = b = 0;
+            }
+        } else {
+            size_t remaining = length;
+            if (remaining >= 48) {
+                uint64_t seed1 = seed;
+                uint64_t seed2 = seed;
+                do {
+                    seed = mix(read8(p) ^ SECRET[1], read8(p + 8) ^ seed);
+                    seed1 = mix(read8(p + 16) ^ SECRET[2], read8(p + 24) ^ seed1);
+                    seed2 = mix(read8(p + 32) ^ SECRET[3], read8(p + 40) ^ seed2);
+                    p += 48;
+                    remaining -= 48;
+                } while (remaining >= 48);
+                seed ^= seed1 ^ seed2;
+            }
+            while (remaining > 16) {
+                seed = mix(read8(p) ^ SECRET[1], read8(p + 8) ^ seed);
+                p += 16;
+                remaining -= 16;
+            }
+            a = read8(p + remaining - 16);
+            b = read8(p + remaining - 8);
+        }
+        a ^= SECRET[1];
+        b ^= seed;
+        multiply(a, b);
+        return mix(a ^ SECRET[0] ^ length, b ^ SECRET[1]);
+    }
+
+private:
+    static constexpr uint64_t SECRET[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL,
+                                           0x4d5a2da51de1aa47ULL};
+
+    // The 128-bit product of a and b, low half in a and high half in b
+    static void multiply(uint64_t& a, uint64_t& b) {
+        __uint128_t product = static_cast<__uint128_t>(a) * b;
+        a = static_cast<uint64_t>(product);
+        b = static_cast<uint64_t>(product >> 64);
+    }
+
+    static uint64_t mix(uint64_t a, uint64_t b) {
+        multiply(a, b);
+        return a ^ b;
+    }
+
+    static uint64_t read8(const uint8_t* p) {
+        uint64_t value;
+        std::memcpy(&value, p, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        value = __builtin_bswap64(value);
+#endif
+        return value;
+    }
+
+    static uint64_t read4(const uint8_t* p) {
+        uint32_t value;
+        std::memcpy(&value, p, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        value = __builtin_bswap32(value);
+#endif
+        return value;
+    }
+
+    // The first, middle and last bytes of a 1 to 3 byte key
+    static uint64_t read3(const uint8_t* p, size_t length) {
+        return (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[length >> 1]) << 8) | p[length - 1];
+    }
+};
+
+inline uint64_t hash_key(std::string_view key) {
+    return WyHash::hash(key.data(), key.size());
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Latency histogram in the spirit of HdrHistogram: values below
+// 2^(SUB_BUCKET_BITS + 1) ns get a bucket each, and every power of two above
+// is split into 2^SUB_BUCKET_BITS buckets, so a recorded value is off by less
+// than 2^-SUB_BUCKET_BITS at any magnitude: 1.6% with 6 bits, 12.5% with 3.
+template <int SUB_BUCKET_BITS>
+class LatencyHistogram {
+public:
+    static constexpr size_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+    static size_t bucket_of(uint64_t value) {
+        if (value < (2u << SUB_BUCKET_BITS)) {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+        return (static_cast<size_t>(shift) << SUB_BUCKET_BITS) + (value >> shift);
+    }
+
+    // Highest value that falls into the bucket
+    static uint64_t bucket_end(size_t bucket) {
+        if (bucket < (2u << SUB_BUCKET_BITS)) {
+            return bucket;
+        }
+        int shift = (bucket >> SUB_BUCKET_BITS) - 1;
+        uint64_t start = (bucket - (static_cast<size_t>(shift) << SUB_BUCKET_BITS)) << shift;
+        return start + (uint64_t{1} << shift) - 1;
+    }
+
+    void record(uint64_t nanoseconds) {
+        buckets[bucket_of(nanoseconds)]++;
+        count++;
+        total += nanoseconds;
+        max = std::max(max, nanoseconds);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            buckets[i] += other.buckets[i];
+        }
+        count += other.count;
+        total += other.total;
+        max = std::max(max, other.max);
+    }
+
+    // Adds values bucketed elsewhere, such as counters kept by another thread:
+    // values in one bucket, or the sum and maximum of all of them
+    void add_to_bucket(size_t bucket, uint64_t values) {
+        buckets[bucket] += values;
+        count += values;
+    }
+
+    void add_totals(uint64_t sum, uint64_t maximum) {
+        total += sum;
+        max = std::max(max, maximum);
+    }
+
+    // Highest value of the bucket holding the given fraction of the values
+    uint64_t percentile(double fraction) const {
+        if (count == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * count)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                return std::min(max, bucket_end(i));
+            }
+        }
+        return max;
+    }
+
+    uint64_t size() const {
+        return count;
+    }
+
+    double mean() const {
+        return count == 0 ? 0 : static_cast<double>(total) / count;
+    }
+
+    uint64_t maximum() const {
+        return max;
+    }
+
+    uint64_t sum() const {
+        return total;
+    }
+
+private:
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(BUCKET_COUNT);
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+};
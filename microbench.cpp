@@ -0,0 +1,647 @@
+#define FINCH_SERVER_NO_MAIN
+#include "server.cpp"
+#include "zipfian.h"
+
+#include <chrono>
+#include <cmath>
+#include <malloc.h>
+#include <numeric>
+#include <random>
+
+// Builds a stream of PUT and GET messages like a pipelining client sends them
+std::vector<uint8_t> make_request_stream(size_t message_count, size_t value_size) {
+    std::vector<uint8_t> stream;
+    std::mt19937_64 rng(42);
+    std::string value(value_size, 'v');
+
+    auto append_uint32 = [&](uint32_t value) {
+        uint32_t network_value = htonl(value);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&network_value);
+        stream.insert(stream.end(), bytes, bytes + 4);
+    };
+
+    for (size_t i = 0; i < message_count; ++i) {
+        std::string key = "key" + std::to_string(rng() % 100000);
+        bool put = i % 2 == 0;
+        uint32_t total_size = 4 + 1 + 8 + 4 + key.size() + (put ? 4 + value.size() : 0);
+
+        append_uint32(total_size);
+        stream.push_back(put ? OP_PUT : OP_GET);
+        uint64_t key_hash = hash_key(key);
+        const uint8_t* hash_bytes = reinterpret_cast<const uint8_t*>(&key_hash);
+        stream.insert(stream.end(), hash_bytes, hash_bytes + 8);
+        append_uint32(key.size());
+        stream.insert(stream.end(), key.begin(), key.end());
+        if (put) {
+            append_uint32(value.size());
+            stream.insert(stream.end(), value.begin(), value.end());
+        }
+    }
+    return stream;
+}
+
+// The receive path before messages were parsed in place: every message was
+// copied out of the buffer, erased from its front, and its key and value
+// copied into strings.
+size_t parse_with_copies(const std::vector<uint8_t>& stream, uint64_t& copied_bytes) {
+    std::vector<uint8_t> input;
+    size_t parsed = 0;
+
+    for (size_t chunk = 0; chunk < stream.size(); chunk += MAX_BUFFER_SIZE) {
+        size_t chunk_size = std::min<size_t>(MAX_BUFFER_SIZE, stream.size() - chunk);
+        input.insert(input.end(), stream.begin() + chunk, stream.begin() + chunk + chunk_size);
+
+        while (input.size() >= 4) {
+            uint32_t message_size = ntoh_uint32(*reinterpret_cast<const uint32_t*>(input.data()));
+            if (input.size() < message_size) {
+                break;
+            }
+
+            std::vector<uint8_t> message(input.begin(), input.begin() + message_size);
+            input.erase(input.begin(), input.begin() + message_size);
+            copied_bytes += message_size + input.size();
+
+            Request request;
+            if (parse_request(message.data(), message.size(), request)) {
+                std::string key(request.key);
+                std::string value(request.value);
+                copied_bytes += key.size() + value.size();
+                parsed++;
+            }
+        }
+    }
+    return parsed;
+}
+
+size_t parse_in_place(const std::vector<uint8_t>& stream, uint64_t& copied_bytes) {
+    ClientBuffer input;
+    size_t parsed = 0;
+
+    for (size_t chunk = 0; chunk < stream.size(); chunk += MAX_BUFFER_SIZE) {
+        size_t chunk_size = std::min<size_t>(MAX_BUFFER_SIZE, stream.size() - chunk);
+        // Stands in for recv() into the buffer
+        input.prepare(MAX_BUFFER_SIZE);
+        std::memcpy(input.write_ptr(), stream.data() + chunk, chunk_size);
+        input.commit(chunk_size);
+
+        while (true) {
+            long message_size = next_message_size(input.read_ptr(), input.readable());
+            if (message_size <= 0) {
+                break;
+            }
+            Request request;
+            if (parse_request(input.read_ptr(), message_size, request)) {
+                parsed++;
+            }
+            input.consume(message_size);
+        }
+    }
+    copied_bytes += input.moved_bytes;
+    return parsed;
+}
+
+void run_parse_benchmark() {
+    const size_t message_count = 1000000;
+    const int rounds = 5;
+
+    for (size_t value_size : {16, 100, 1000}) {
+        std::vector<uint8_t> stream = make_request_stream(message_count, value_size);
+        std::cout << "Value size " << value_size << " (" << stream.size() / message_count << " bytes per message)" << std::endl;
+
+        auto measure = [&](const char* name, size_t (*parse)(const std::vector<uint8_t>&, uint64_t&)) {
+            uint64_t copied_bytes = 0;
+            size_t parsed = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int round = 0; round < rounds; ++round) {
+                parsed += parse(stream, copied_bytes);
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "  " << name << ": " << seconds * 1e9 / parsed << " ns/op, "
+                      << static_cast<double>(copied_bytes) / parsed << " bytes copied/op" << std::endl;
+        };
+
+        measure("copy and erase", parse_with_copies);
+        measure("in place      ", parse_in_place);
+    }
+}
+
+// Keys are generated on the fly so that large key counts only use memory for
+// the tables themselves. They are all BENCH_KEY_BYTES long, so that a
+// FixedTable can hold them.
+const size_t BENCH_KEY_BYTES = 16;
+
+struct BenchKey {
+    char bytes[24];
+    std::string_view key;
+    uint64_t hash;
+
+    explicit BenchKey(size_t i) {
+        int length = std::snprintf(bytes, sizeof(bytes), "key%013zu", i);
+        key = std::string_view(bytes, length);
+        hash = hash_key(key);
+    }
+};
+
+// Visits 0..count-1 in a scattered order, so lookups don't follow insertion order
+size_t scattered(size_t i, size_t count) {
+    return (i * 2654435761ULL) % count;
+}
+
+size_t heap_bytes() {
+    return mallinfo2().uordblks;
+}
+
+template <typename Table>
+void measure_table(const char* name, size_t key_count, std::string_view value) {
+    size_t heap_before = heap_bytes();
+    auto tables = std::make_unique<Table[]>(PARTITION_COUNT);
+
+    auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < key_count; ++i) {
+        BenchKey key(i);
+        tables[partition_of(key.hash)].put(key.hash, key.key, value);
+    }
+    double put_seconds = seconds_since(start);
+    size_t heap_used = heap_bytes() - heap_before;
+
+    size_t found = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < key_count; ++i) {
+        BenchKey key(scattered(i, key_count));
+        std::string_view stored;
+        found += tables[partition_of(key.hash)].find(key.hash, key.key, stored, 0);
+    }
+    double hit_seconds = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < key_count; ++i) {
+        BenchKey key(key_count + scattered(i, key_count));
+        std::string_view stored;
+        found += tables[partition_of(key.hash)].find(key.hash, key.key, stored, 0);
+    }
+    double miss_seconds = seconds_since(start);
+
+    if (found != key_count) {
+        std::cerr << name << ": found " << found << " of " << key_count << " keys" << std::endl;
+    }
+    std::cout << "  " << name << ": put " << put_seconds * 1e9 / key_count << " ns, get hit "
+              << hit_seconds * 1e9 / key_count << " ns, get miss " << miss_seconds * 1e9 / key_count << " ns, "
+              << static_cast<double>(heap_used) / key_count << " bytes/key" << std::endl;
+}
+
+// Values of VALUE_BYTES with 16-byte keys, the sizes FixedTable was made for
+template <size_t VALUE_BYTES>
+void measure_tables(size_t key_count) {
+    const std::string value(VALUE_BYTES, 'v');
+    std::cout << key_count << " keys with " << VALUE_BYTES << "-byte values over " << PARTITION_COUNT
+              << " partitions" << std::endl;
+    measure_table<StdTable>("std::unordered_map", key_count, value);
+    measure_table<FlatTable>("FlatTable         ", key_count, value);
+    measure_table<FixedTable<BENCH_KEY_BYTES, VALUE_BYTES>>("FixedTable        ", key_count, value);
+}
+
+void run_table_benchmark(const std::vector<size_t>& key_counts) {
+    for (size_t key_count : key_counts) {
+        measure_tables<8>(key_count);
+        measure_tables<64>(key_count);
+    }
+}
+
+// Runs GETs and PUTs with Zipfian keys through execute_request from several
+// threads, the way the thread engine's client threads do, and returns the
+// operations per second
+double measure_locks(const std::vector<std::string>& keys, const ZipfianGenerator& zipfian,
+                     int read_percent, int thread_count, double seconds) {
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> total_operations{0};
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&, t] {
+            std::mt19937_64 rng(t + 1);
+            std::string output;
+            uint64_t operations = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                const std::string& key = keys[zipfian.next(rng)];
+                Request request;
+                request.operation_type = static_cast<int>(rng() % 100) < read_percent ? OP_GET : OP_PUT;
+                request.key = key;
+                request.key_hash = hash_key(key);
+                request.value = "0123456789abcdef";
+                execute_request(request, output);
+                output.clear();
+                operations++;
+            }
+            total_operations += operations;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return total_operations / seconds;
+}
+
+void run_locks_benchmark(int thread_count) {
+    const size_t key_count = 1000000;
+    const double theta = 0.99;
+
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < key_count; ++i) {
+        keys.push_back("key" + std::to_string(i));
+        Request request;
+        request.operation_type = OP_PUT;
+        request.key = keys.back();
+        request.key_hash = hash_key(keys.back());
+        request.value = "0123456789abcdef";
+        std::string output;
+        execute_request(request, output);
+    }
+    ZipfianGenerator zipfian(key_count, theta);
+
+    std::cout << key_count << " keys, Zipfian theta " << theta << ", " << thread_count << " threads" << std::endl;
+    for (int read_percent : {95, 99}) {
+        config.shared_locks = false;
+        double mutex_rate = measure_locks(keys, zipfian, read_percent, thread_count, 2.0);
+        config.shared_locks = true;
+        double shared_rate = measure_locks(keys, zipfian, read_percent, thread_count, 2.0);
+        std::cout << "  " << read_percent << "/" << 100 - read_percent << " reads/writes: mutex "
+                  << mutex_rate / 1e6 << " Mops/s, shared " << shared_rate / 1e6 << " Mops/s" << std::endl;
+    }
+}
+
+// Stores keys with a TTL in FlatTables with one TimingWheel per partition,
+// then moves a simulated clock forward one maintenance interval at a time and
+// expires them the way maintain_partitions does. ttl_spread_ms 0 puts every
+// deadline on the same tick.
+void measure_expiry(const char* name, size_t key_count, uint64_t ttl_spread_ms) {
+    const std::string_view value = "0123456789abcdef";
+    const uint64_t start_ms = 1000000;
+    const uint64_t min_ttl_ms = 1000;
+    auto tables = std::make_unique<FlatTable[]>(PARTITION_COUNT);
+    std::vector<TimingWheel> wheels(PARTITION_COUNT, TimingWheel(start_ms));
+    std::mt19937_64 rng(42);
+
+    auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < key_count; ++i) {
+        BenchKey key(i);
+        uint64_t deadline = start_ms + min_ttl_ms + (ttl_spread_ms > 0 ? rng() % ttl_spread_ms : 0);
+        int partition_id = partition_of(key.hash);
+        tables[partition_id].put(key.hash, key.key, value, deadline);
+        wheels[partition_id].add({key.hash, deadline});
+    }
+    double put_seconds = seconds_since(start);
+    size_t timer_bytes = 0;
+    for (const TimingWheel& wheel : wheels) {
+        timer_bytes += wheel.memory_bytes();
+    }
+
+    size_t expired = 0;
+    size_t passes = 0;
+    double expire_seconds = 0;
+    double worst_pass_seconds = 0;
+    uint64_t end_ms = start_ms + min_ttl_ms + ttl_spread_ms + MAINTENANCE_INTERVAL_MS;
+    for (uint64_t now = start_ms; now <= end_ms || expired < key_count; now += MAINTENANCE_INTERVAL_MS) {
+        auto pass_start = std::chrono::steady_clock::now();
+        for (int partition_id = 0; partition_id < PARTITION_COUNT; ++partition_id) {
+            wheels[partition_id].advance(now, MAX_EXPIRATIONS_PER_PASS, [&](const TimingWheel::Timer& timer) {
+                expired += tables[partition_id].expire(timer.key_hash, now);
+            });
+        }
+        double pass_seconds = seconds_since(pass_start);
+        expire_seconds += pass_seconds;
+        worst_pass_seconds = std::max(worst_pass_seconds, pass_seconds);
+        passes++;
+    }
+
+    std::cout << "  " << name << ": put with timer " << put_seconds * 1e9 / key_count << " ns, "
+              << expired / expire_seconds / 1e6 << " M expirations/s over " << passes << " passes, worst pass "
+              << worst_pass_seconds * 1e3 << " ms, timer " << static_cast<double>(timer_bytes) / key_count
+              << " bytes/key + 8 bytes/key deadline in the slot" << std::endl;
+}
+
+void run_expiry_benchmark(size_t key_count) {
+    std::cout << key_count << " keys over " << PARTITION_COUNT << " partitions, "
+              << MAINTENANCE_INTERVAL_MS << " ms passes, at most " << MAX_EXPIRATIONS_PER_PASS
+              << " expirations per partition and pass" << std::endl;
+    measure_expiry("TTLs spread over 60 s", key_count, 60000);
+    measure_expiry("TTLs on one tick     ", key_count, 0);
+}
+
+// Fills the server's partitions, writes them to a snapshot and restarts from
+// it the way main does: time to first request is mapping the file and
+// answering a GET from it, time to full load is loading every partition with
+// one thread per core.
+void run_snapshot_benchmark(size_t key_count) {
+    const std::string_view value = "0123456789abcdef0123456789abcdef";
+    config.snapshot_path = "/tmp/finch_microbench.snapshot";
+    auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    for (size_t i = 0; i < key_count; ++i) {
+        BenchKey key(i);
+        partitions[partition_of(key.hash)].data.put(key.hash, key.key, value);
+    }
+    uint64_t written_keys;
+    auto start = std::chrono::steady_clock::now();
+    if (!write_snapshot(written_keys)) {
+        std::cerr << "Failed to write " << config.snapshot_path << std::endl;
+        return;
+    }
+    double write_seconds = seconds_since(start);
+    struct stat file_stat;
+    stat(config.snapshot_path.c_str(), &file_stat);
+    std::cout << "Wrote " << written_keys << " keys, " << file_stat.st_size / (1 << 20) << " MB, in "
+              << write_seconds * 1e3 << " ms" << std::endl;
+
+    partitions = std::vector<Partition>(PARTITION_COUNT);
+    malloc_trim(0);
+
+    BenchKey probe(key_count / 2);
+    Request request;
+    request.operation_type = OP_GET;
+    request.key_hash = probe.hash;
+    request.key = probe.key;
+    std::string response;
+    start = std::chrono::steady_clock::now();
+    if (!map_snapshot()) {
+        return;
+    }
+    apply_to_partition(partitions[partition_of(probe.hash)], request, response);
+    double first_request_seconds = seconds_since(start);
+
+    int thread_count = std::max(1u, std::thread::hardware_concurrency());
+    load_snapshot(thread_count);
+    double full_load_seconds = seconds_since(start);
+
+    size_t missing = 0;
+    for (size_t i = 0; i < key_count; i += 997) {
+        BenchKey key(i);
+        std::string_view found;
+        missing += !partitions[partition_of(key.hash)].data.find(key.hash, key.key, found, 0) || found != value;
+    }
+    std::cout << "Time to first request: " << first_request_seconds * 1e3 << " ms (GET "
+              << (response == "0" + std::string(value) ? "hit" : "MISSED") << ")" << std::endl
+              << "Time to full load: " << full_load_seconds * 1e3 << " ms with " << thread_count << " threads, "
+              << missing << " sampled keys missing" << std::endl;
+    unlink(config.snapshot_path.c_str());
+}
+
+// Keys that change server when one server joins server_count of them, and the
+// busiest server's share of the keys against an even share, for modulo
+// placement and for the hash ring with several virtual node counts
+void run_ring_benchmark(size_t server_count) {
+    const size_t key_count = 1000000;
+    std::vector<uint64_t> hashes(key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        hashes[i] = BenchKey(i).hash;
+    }
+    std::vector<std::string> members;
+    for (size_t i = 0; i <= server_count; ++i) {
+        members.push_back("10.0.0." + std::to_string(i + 1) + ":12345");
+    }
+    std::vector<std::string> old_members(members.begin(), members.end() - 1);
+
+    auto report = [&](const std::string& name, auto&& old_owner, auto&& new_owner) {
+        size_t moved = 0;
+        std::vector<size_t> keys_per_server(server_count);
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t hash : hashes) {
+            size_t owner = old_owner(hash);
+            keys_per_server[owner]++;
+            moved += owner != new_owner(hash);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double busiest = *std::max_element(keys_per_server.begin(), keys_per_server.end()) * server_count /
+                         static_cast<double>(key_count);
+        std::cout << "  " << name << ": " << 100.0 * moved / key_count << "% of keys move, busiest server "
+                  << busiest << "x an even share, " << seconds * 1e9 / (2 * key_count) << " ns per lookup" << std::endl;
+    };
+
+    std::cout << key_count << " keys, " << server_count << " servers to " << server_count + 1 << " (ideal: "
+              << 100.0 / (server_count + 1) << "% move)" << std::endl;
+    report("modulo          ", [&](uint64_t hash) { return hash % server_count; },
+           [&](uint64_t hash) { return hash % (server_count + 1); });
+    for (size_t virtual_nodes : {1, 16, 64, 160, 512}) {
+        HashRing old_ring(old_members, virtual_nodes);
+        HashRing new_ring(members, virtual_nodes);
+        std::string name = "ring, " + std::to_string(virtual_nodes) + " vnodes";
+        name.resize(16, ' ');
+        report(name, [&](uint64_t hash) { return old_ring.owner(hash); },
+               [&](uint64_t hash) { return new_ring.owner(hash); });
+    }
+}
+
+// Hash time per key size for std::hash and hash_key, then how evenly each
+// server's keys fill its partitions with 2, 4 and 8 servers, when servers are
+// picked by the hash modulo the server count and by the hash ring
+void run_hash_benchmark() {
+    std::mt19937_64 rng(42);
+    std::cout << "Hash time per key" << std::endl;
+    for (size_t key_size : {8, 16, 32, 64, 256, 1024}) {
+        std::vector<std::string> keys(1024);
+        for (std::string& key : keys) {
+            for (size_t i = 0; i < key_size; ++i) {
+                key += static_cast<char>('a' + rng() % 26);
+            }
+        }
+        // Around 256MB hashed per measurement
+        size_t rounds = std::max<size_t>(100, (256 << 20) / (key_size * keys.size()));
+        auto measure = [&](auto&& hash) {
+            uint64_t sum = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t round = 0; round < rounds; ++round) {
+                for (const std::string& key : keys) {
+                    sum += hash(std::string_view(key));
+                }
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            // Keeps the hashing from being optimized away
+            if (sum == 42) {
+                std::cout << "";
+            }
+            return seconds * 1e9 / (rounds * keys.size());
+        };
+        double std_ns = measure([](std::string_view key) { return std::hash<std::string_view>{}(key); });
+        double wy_ns = measure([](std::string_view key) { return hash_key(key); });
+        std::cout << "  " << key_size << " bytes: std::hash " << std_ns << " ns (" << key_size / std_ns
+                  << " GB/s), hash_key " << wy_ns << " ns (" << key_size / wy_ns << " GB/s)" << std::endl;
+    }
+
+    const size_t key_count = 1000000;
+    std::vector<uint64_t> hashes(key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        hashes[i] = BenchKey(i).hash;
+    }
+    std::cout << "Partitions used per server, " << key_count << " keys, hash_key" << std::endl;
+    for (size_t server_count : {2, 4, 8}) {
+        std::vector<std::string> members;
+        for (size_t i = 0; i < server_count; ++i) {
+            members.push_back("10.0.0." + std::to_string(i + 1) + ":12345");
+        }
+        HashRing ring(members);
+        auto report = [&](const char* name, auto&& server_of) {
+            std::vector<std::vector<size_t>> keys_per_partition(server_count, std::vector<size_t>(PARTITION_COUNT));
+            for (uint64_t hash : hashes) {
+                keys_per_partition[server_of(hash)][partition_of(hash)]++;
+            }
+            // The server with the fewest partitions in use, and the fullest
+            // partition of any server against that server's average
+            size_t fewest_used = PARTITION_COUNT;
+            double fullest = 0;
+            for (const std::vector<size_t>& partition_keys : keys_per_partition) {
+                size_t used = PARTITION_COUNT - std::count(partition_keys.begin(), partition_keys.end(), 0);
+                size_t server_keys = std::accumulate(partition_keys.begin(), partition_keys.end(), size_t{0});
+                fewest_used = std::min(fewest_used, used);
+                if (server_keys > 0) {
+                    fullest = std::max(fullest, *std::max_element(partition_keys.begin(), partition_keys.end()) *
+                                                    static_cast<double>(PARTITION_COUNT) / server_keys);
+                }
+            }
+            std::cout << "  " << server_count << " servers, " << name << ": at least " << fewest_used << " of "
+                      << PARTITION_COUNT << " partitions used, fullest partition " << fullest << "x its server's average"
+                      << std::endl;
+        };
+        report("modulo", [&](uint64_t hash) { return hash % server_count; });
+        report("ring  ", [&](uint64_t hash) { return ring.owner(hash); });
+    }
+}
+
+// Instrumentation cost: the thread engine's request path, from the receive
+// buffer to the responses, with --metrics off and on. It leaves out the
+// syscalls and network a real request also pays for, so this is the largest
+// share instrumentation can take. Each round measures both, in alternating
+// order, so drift in the machine's speed hits both alike. Noise only ever
+// adds time, so the fastest round of each is the closest to its real cost.
+// On a busy machine the noise is still larger than the difference, so the
+// sampling code execute_messages runs per request is also timed on its own,
+// which gives its share of the request path without the noise of the rest.
+void run_metrics_benchmark() {
+    const size_t message_count = 200000;
+    const int rounds = 41;
+
+    std::vector<uint8_t> stream = make_request_stream(message_count, 100);
+    std::cout << "GET and PUT alternating, 100 byte values, " << MAX_BUFFER_SIZE << " bytes per receive"
+              << std::endl;
+
+    auto measure = [&] {
+        ClientBuffer client_buffer;
+        std::string output;
+        std::unique_ptr<ShmSegment> no_shm;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t offset = 0; offset < stream.size(); offset += MAX_BUFFER_SIZE) {
+            size_t size = std::min<size_t>(MAX_BUFFER_SIZE, stream.size() - offset);
+            client_buffer.prepare(size);
+            std::memcpy(client_buffer.write_ptr(), &stream[offset], size);
+            client_buffer.commit(size);
+            output.clear();
+            execute_messages(client_buffer, output, -1, no_shm);
+        }
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+               message_count;
+    };
+
+    // A thread allocates its latency histograms when it starts counting
+    std::vector<double> times[2];
+    for (int round = 0; round < rounds; ++round) {
+        for (bool metrics : {round % 2 == 1, round % 2 == 0}) {
+            config.metrics = metrics;
+            std::thread([&] { times[metrics].push_back(measure()); }).join();
+        }
+    }
+    // What --metrics adds to every request, sampled or not
+    auto measure_sampling = [&] {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < message_count; ++i) {
+            uint64_t started = sample_latency() ? monotonic_ns() : 0;
+            if (started != 0) {
+                record_latency(OP_GET, monotonic_ns() - started);
+            }
+        }
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+               message_count;
+    };
+    std::vector<double> sampling_times[2];
+    for (int round = 0; round < rounds; ++round) {
+        for (bool metrics : {false, true}) {
+            config.metrics = metrics;
+            std::thread([&] { sampling_times[metrics].push_back(measure_sampling()); }).join();
+        }
+    }
+    config.metrics = false;
+
+    double off = *std::min_element(times[false].begin(), times[false].end());
+    double on = *std::min_element(times[true].begin(), times[true].end());
+    std::cout << "  metrics off: " << off << " ns/request (fastest of " << rounds << ")\n"
+              << "  metrics on:  " << on << " ns/request, " << (on / off - 1) * 100 << "% more\n";
+    double sampling = *std::min_element(sampling_times[true].begin(), sampling_times[true].end()) -
+                      *std::min_element(sampling_times[false].begin(), sampling_times[false].end());
+    std::cout << "  sampling:    " << sampling << " ns/request on its own, " << sampling / off * 100
+              << "% of the request path" << std::endl;
+}
+
+void print_benchmarks() {
+    std::cerr << "Usage: ./microbench <benchmark> [arguments]\n"
+              << "  parse                Receive path bytes copied and time per message\n"
+              << "  table [key count]... Partition stores, put and get time and memory per key\n"
+              << "                       (default 1000000 10000000)\n"
+              << "  locks [threads]      Partition lock modes at 95/5 and 99/1 reads/writes\n"
+              << "                       with Zipfian keys (default: one thread per core)\n"
+              << "  expiry [key count]   TTL timer cost per key and expiry throughput\n"
+              << "                       (default 1000000)\n"
+              << "  snapshot [key count] Snapshot write time, restart time to first request and\n"
+              << "                       to full load (default 10000000)\n"
+              << "  ring [servers]       Keys moved by adding a server and load balance, modulo\n"
+              << "                       against the hash ring (default 3)\n"
+              << "  metrics              Request path time with --metrics off and on\n"
+              << "  hash                 Key hash time per key size, and partitions used per server\n";
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        print_benchmarks();
+        return 1;
+    }
+
+    std::string benchmark = argv[1];
+    if (benchmark == "parse") {
+        run_parse_benchmark();
+    } else if (benchmark == "table") {
+        std::vector<size_t> key_counts;
+        for (int i = 2; i < argc; ++i) {
+            key_counts.push_back(std::stoull(argv[i]));
+        }
+        if (key_counts.empty()) {
+            key_counts = {1000000, 10000000};
+        }
+        run_table_benchmark(key_counts);
+    } else if (benchmark == "locks") {
+        int thread_count = argc > 2 ? std::stoi(argv[2]) : std::max(1u, std::thread::hardware_concurrency());
+        run_locks_benchmark(thread_count);
+    } else if (benchmark == "expiry") {
+        run_expiry_benchmark(argc > 2 ? std::stoull(argv[2]) : 1000000);
+    } else if (benchmark == "snapshot") {
+        run_snapshot_benchmark(argc > 2 ? std::stoull(argv[2]) : 10000000);
+    } else if (benchmark == "metrics") {
+        run_metrics_benchmark();
+    } else if (benchmark == "hash") {
+        run_hash_benchmark();
+    } else if (benchmark == "ring") {
+        run_ring_benchmark(argc > 2 ? std::stoull(argv[2]) : 3);
+    } else {
+        print_benchmarks();
+        return 1;
+    }
+    return 0;
+}
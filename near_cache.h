@@ -0,0 +1,174 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Values cached inside the client, evicted least recently used once the
+// cache holds max_bytes of keys and values. Entries are found by key hash,
+// so that an invalidation, which only carries the hash, finds them too, and
+// are spread over SHARD_COUNT shards with a lock each, so threads reading
+// different keys rarely share a lock.
+//
+// Every hash maps to a generation that invalidate bumps. A reader takes the
+// generation before it sends its GET and hands it to fill with the value, and
+// a fill whose generation has moved on is dropped: the value was read before
+// a change the cache has already been told about.
+class NearCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t fills = 0;
+        uint64_t evictions = 0;
+        uint64_t invalidations = 0; // Entries dropped by invalidate
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    explicit NearCache(size_t max_bytes) : shards(new Shard[SHARD_COUNT]) {
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            shards[i].max_bytes = max_bytes / SHARD_COUNT;
+        }
+    }
+
+    bool get(uint64_t key_hash, const std::string& key, std::string& value) {
+        Shard& shard = shard_of(key_hash);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto entry = shard.entries.find(key_hash);
+        if (entry == shard.entries.end() || entry->second.key != key) {
+            shard.misses++;
+            return false;
+        }
+        shard.order.splice(shard.order.begin(), shard.order, entry->second.position);
+        value = entry->second.value;
+        shard.hits++;
+        return true;
+    }
+
+    uint64_t generation(uint64_t key_hash) const {
+        return generations[generation_of(key_hash)].load(std::memory_order_acquire);
+    }
+
+    // Caches the value read after generation(key_hash) returned generation.
+    // Values too large for a tenth of a shard aren't cached.
+    void fill(uint64_t key_hash, const std::string& key, const std::string& value, uint64_t generation) {
+        Shard& shard = shard_of(key_hash);
+        size_t size = entry_size(key, value);
+        if (size > shard.max_bytes / 10) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        // Checked under the lock, which invalidate bumps the generation under
+        if (this->generation(key_hash) != generation) {
+            return;
+        }
+        erase(shard, key_hash);
+        shard.order.push_front(key_hash);
+        shard.entries.emplace(key_hash, Entry{key, value, shard.order.begin()});
+        shard.bytes += size;
+        shard.fills++;
+        while (shard.bytes > shard.max_bytes) {
+            erase(shard, shard.order.back());
+            shard.evictions++;
+        }
+    }
+
+    // Drops the entry for the hash, and any fill of a value read before now
+    void invalidate(uint64_t key_hash) {
+        Shard& shard = shard_of(key_hash);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        generations[generation_of(key_hash)].fetch_add(1, std::memory_order_acq_rel);
+        if (erase(shard, key_hash)) {
+            shard.invalidations++;
+        }
+    }
+
+    // Drops every entry, and any fill of a value read before now
+    void clear() {
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            Shard& shard = shards[i];
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            for (size_t generation = i; generation < GENERATION_COUNT; generation += SHARD_COUNT) {
+                generations[generation].fetch_add(1, std::memory_order_acq_rel);
+            }
+            shard.invalidations += shard.entries.size();
+            shard.entries.clear();
+            shard.order.clear();
+            shard.bytes = 0;
+        }
+    }
+
+    Stats stats() const {
+        Stats stats;
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            Shard& shard = shards[i];
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            stats.hits += shard.hits;
+            stats.misses += shard.misses;
+            stats.fills += shard.fills;
+            stats.evictions += shard.evictions;
+            stats.invalidations += shard.invalidations;
+            stats.entries += shard.entries.size();
+            stats.bytes += shard.bytes;
+        }
+        return stats;
+    }
+
+private:
+    static constexpr size_t SHARD_COUNT = 64;
+    // A multiple of SHARD_COUNT, so that every generation belongs to one shard
+    static constexpr size_t GENERATION_COUNT = 64 * SHARD_COUNT;
+
+    struct Entry {
+        std::string key;
+        std::string value;
+        std::list<uint64_t>::iterator position; // In order
+    };
+
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_map<uint64_t, Entry> entries;
+        std::list<uint64_t> order; // Key hashes, most recently used first
+        size_t bytes = 0;
+        size_t max_bytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t fills = 0;
+        uint64_t evictions = 0;
+        uint64_t invalidations = 0;
+    };
+
+    // Bits above the partition's, which every key of a partition shares
+    static size_t generation_of(uint64_t key_hash) {
+        return (key_hash >> 10) % GENERATION_COUNT;
+    }
+
+    Shard& shard_of(uint64_t key_hash) const {
+        return shards[generation_of(key_hash) % SHARD_COUNT];
+    }
+
+    // Strings and their heap buffers, roughly, and the map and list nodes
+    static size_t entry_size(const std::string& key, const std::string& value) {
+        return key.size() + value.size() + 2 * sizeof(std::string) + 64;
+    }
+
+    bool erase(Shard& shard, uint64_t key_hash) {
+        auto entry = shard.entries.find(key_hash);
+        if (entry == shard.entries.end()) {
+            return false;
+        }
+        shard.bytes -= entry_size(entry->second.key, entry->second.value);
+        shard.order.erase(entry->second.position);
+        shard.entries.erase(entry);
+        return true;
+    }
+
+    std::unique_ptr<Shard[]> shards;
+    std::unique_ptr<std::atomic<uint64_t>[]> generations{new std::atomic<uint64_t>[GENERATION_COUNT]()};
+};
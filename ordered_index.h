@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Sorted set of a partition's keys, kept next to its hash table so that keys
+// can be listed by range or prefix. Keys sit in sorted leaves of up to
+// LEAF_CAPACITY keys, and a leaf is found by binary search over the leaves'
+// first keys: a B+tree cut at two levels. A server's keys are spread over
+// 1024 partitions, so even a million keys is only a handful of leaves per
+// partition and a deeper tree wouldn't pay for itself.
+//
+// A full leaf is split in two, and a leaf shrunk to a quarter merges with
+// its successor when they fit in half a leaf together, so inserting and
+// erasing around a split point doesn't split and merge over and over.
+//
+// Not thread-safe, the partition lock or owning loop serializes access.
+class OrderedIndex {
+public:
+    void insert(std::string_view key) {
+        if (leaves.empty()) {
+            leaves.emplace_back(1, std::string(key));
+            add_bytes(key, true);
+            return;
+        }
+        size_t leaf_index = leaf_for(key);
+        std::vector<std::string>& leaf = leaves[leaf_index];
+        auto position = std::lower_bound(leaf.begin(), leaf.end(), key);
+        if (position != leaf.end() && *position == key) {
+            return;
+        }
+        leaf.emplace(position, key);
+        add_bytes(key, true);
+        if (leaf.size() > LEAF_CAPACITY) {
+            std::vector<std::string> upper(std::make_move_iterator(leaf.begin() + leaf.size() / 2),
+                                           std::make_move_iterator(leaf.end()));
+            leaf.resize(leaf.size() / 2);
+            leaves.insert(leaves.begin() + leaf_index + 1, std::move(upper));
+        }
+    }
+
+    void erase(std::string_view key) {
+        if (leaves.empty()) {
+            return;
+        }
+        size_t leaf_index = leaf_for(key);
+        std::vector<std::string>& leaf = leaves[leaf_index];
+        auto position = std::lower_bound(leaf.begin(), leaf.end(), key);
+        if (position == leaf.end() || *position != key) {
+            return;
+        }
+        add_bytes(key, false);
+        leaf.erase(position);
+        if (leaf.empty()) {
+            leaves.erase(leaves.begin() + leaf_index);
+        } else if (leaf.size() <= LEAF_CAPACITY / 4 && leaf_index + 1 < leaves.size() &&
+                   leaf.size() + leaves[leaf_index + 1].size() <= LEAF_CAPACITY / 2) {
+            std::vector<std::string>& next = leaves[leaf_index + 1];
+            leaf.insert(leaf.end(), std::make_move_iterator(next.begin()), std::make_move_iterator(next.end()));
+            leaves.erase(leaves.begin() + leaf_index + 1);
+        }
+    }
+
+    void clear() {
+        leaves.clear();
+        key_count = 0;
+        bytes = 0;
+    }
+
+    // Calls fn(key) for every key in [from, to) in order, with an empty to for
+    // no upper bound, until fn returns false
+    template <class Fn>
+    void scan(std::string_view from, std::string_view to, Fn&& fn) const {
+        if (leaves.empty()) {
+            return;
+        }
+        size_t leaf_index = leaf_for(from);
+        const std::vector<std::string>& first = leaves[leaf_index];
+        size_t position = std::lower_bound(first.begin(), first.end(), from) - first.begin();
+        for (; leaf_index < leaves.size(); ++leaf_index, position = 0) {
+            const std::vector<std::string>& leaf = leaves[leaf_index];
+            for (; position < leaf.size(); ++position) {
+                if (!to.empty() && std::string_view(leaf[position]) >= to) {
+                    return;
+                }
+                if (!fn(std::string_view(leaf[position]))) {
+                    return;
+                }
+            }
+        }
+    }
+
+    size_t size() const {
+        return key_count;
+    }
+
+    // Bytes held for the keys, strings and their heap buffers, leaves excluded
+    size_t memory() const {
+        return bytes;
+    }
+
+private:
+    static constexpr size_t LEAF_CAPACITY = 128;
+
+    // The leaf whose range holds key: the last one starting at or before it,
+    // or the first leaf for keys before all others
+    size_t leaf_for(std::string_view key) const {
+        auto after = std::upper_bound(leaves.begin(), leaves.end(), key,
+                                      [](std::string_view wanted, const std::vector<std::string>& leaf) {
+                                          return wanted < std::string_view(leaf.front());
+                                      });
+        return after == leaves.begin() ? 0 : after - leaves.begin() - 1;
+    }
+
+    // Counts a key in (added) or out, as a std::string and the heap buffer of
+    // a key too long to be stored inline
+    void add_bytes(std::string_view key, bool added) {
+        size_t key_bytes = sizeof(std::string) + (key.size() > 15 ? key.size() + 1 : 0);
+        if (added) {
+            key_count++;
+            bytes += key_bytes;
+        } else {
+            key_count--;
+            bytes -= key_bytes;
+        }
+    }
+
+    std::vector<std::vector<std::string>> leaves; // Sorted and never empty
+    size_t key_count = 0;
+    size_t bytes = 0;
+};
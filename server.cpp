@@ -1,185 +1,3986 @@
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <charconv>
 #include <sstream>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <malloc.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <cstring>
+#include <cerrno>
 #include <arpa/inet.h>
 #include <algorithm>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <sys/un.h>
+#include <linux/io_uring.h>
+#include <cstdio>
+
+#include "append_log.h"
+#include "change_log.h"
+#include "flat_table.h"
+#include "hash_ring.h"
+#include "hot_keys.h"
+#include "key_hash.h"
+#include "latency_histogram.h"
+#include "ordered_index.h"
+#include "shm_channel.h"
+#include "snapshot.h"
+#include "timing_wheel.h"
 
 const int PARTITION_COUNT = 1024;
 const int MAX_BUFFER_SIZE = 4096; // Increased buffer size
+const int DEFAULT_PORT = 12345;
+const int MAX_EPOLL_EVENTS = 256;
+const size_t CROSS_CORE_QUEUE_CAPACITY = 4096;
+const int MAINTENANCE_INTERVAL_MS = 100;
+const size_t MAX_EXPIRATIONS_PER_PASS = 1024; // Per partition, bounds how long expiry holds it
+const size_t MAX_PEER_BATCH_ENTRIES = 1024;      // Migration and replication batches
+const size_t MAX_PEER_BATCH_BYTES = 16 << 20;    // A batch is closed once it holds this much
+const size_t MAX_PEER_BATCHES_IN_FLIGHT = 8;     // Per peer connection
+const int REPLICATION_HEARTBEAT_MS = 10;         // Longest a replica goes without a batch
+const int REPLICA_RECONNECT_INTERVAL_MS = 1000;
+const size_t REPLICATION_BUFFER_LIMIT = 256 << 20; // Unsent changes before a replica is copied again
+const uint32_t MAX_SCAN_COUNT = 10000;             // Keys per SCAN response, whatever the count hint
+
+// Total Size + Operation Type
+const size_t MIN_MESSAGE_SIZE = sizeof(uint32_t) + sizeof(uint8_t);
+
+// Larger messages are rejected before any room is made for them
+const size_t MAX_MESSAGE_SIZE = 1 << 30;
+
+// The largest value a GET response can carry, which APPEND stops at
+const size_t MAX_VALUE_SIZE = MAX_MESSAGE_SIZE - MIN_MESSAGE_SIZE;
+
+// Define operation types
+const uint8_t OP_GET = 1;
+const uint8_t OP_PUT = 2;
+const uint8_t OP_DEL = 3;
+const uint8_t OP_STATS = 4;
+const uint8_t OP_MGET = 5;
+const uint8_t OP_MPUT = 6;
+const uint8_t OP_MDEL = 7;
+const uint8_t OP_SETEX = 8;
+const uint8_t OP_HANDOFF_BEGIN = 9;
+const uint8_t OP_HANDOFF_END = 10;
+const uint8_t OP_MIGRATE = 11;
+const uint8_t OP_REPLICATE = 12;
+const uint8_t OP_CLEAR_PARTITION = 13; // Only inside OP_REPLICATE batches
+const uint8_t OP_SCAN = 14;
+const uint8_t OP_INCR = 15;
+const uint8_t OP_CAS = 16;
+const uint8_t OP_APPEND = 17;
+const uint8_t OP_GETSET = 18;
+const uint8_t OP_INVALIDATIONS = 19;
+const uint8_t OP_SHM_ATTACH = 20;
+
+// A CAS's Expected Length when the key must not exist
+const uint32_t CAS_ABSENT = UINT32_MAX;
+
+// SCAN's next partition once every partition has been visited
+const uint32_t SCAN_DONE = UINT32_MAX;
+
+enum class Engine {
+    THREADS, // One blocking thread per client connection
+    EPOLL,   // One pinned edge-triggered epoll loop per core, partitions split between loops
+    URING    // Same as EPOLL, with io_uring doing the socket I/O
+};
+
+struct ServerConfig {
+    Engine engine = Engine::THREADS;
+    int loop_count = std::max(1u, std::thread::hardware_concurrency());
+    int port = DEFAULT_PORT;
+    bool shared_locks = false; // Reader-writer partition locks in the thread engine
+    uint64_t max_memory = 0;   // Bytes of used memory before evicting, 0 for no limit
+    std::string aof_path;      // Append-only log, empty for none
+    AppendLog::FsyncPolicy fsync_policy = AppendLog::FsyncPolicy::PERIODIC;
+    int fsync_interval_ms = 1000;
+    uint64_t aof_rewrite_min = 64 << 20; // Log size before the first rewrite
+    std::string snapshot_path;           // Snapshot to load at startup and write periodically, empty for none
+    int snapshot_interval_seconds = 300;
+    std::vector<std::string> replica_addresses; // "host:port" of every replica to stream changes to
+    bool metrics = false; // Time every request and every wait for a partition lock
+    bool ordered_index = false; // Keep every partition's keys sorted too, for SCAN
+    bool verify_hashes = false; // Reject messages whose key hashes aren't hash_key of their keys
+    bool hot_keys = false;      // Track the most requested keys and answer GETs for them from copies
+    bool unix_socket = false;   // Listen on unix_socket_path(port) too
+};
+
+ServerConfig config;
+
+// Lets partitions be searched with std::string_view keys pointing into the
+// received message, without building a std::string first
+struct StringHash {
+    using is_transparent = void;
+
+    size_t operator()(std::string_view key) const {
+        return std::hash<std::string_view>{}(key);
+    }
+};
+
+// The node-based store partitions used before FlatTable, with the same
+// interface. Selected by building without FINCH_FLAT_TABLE. It can't see the
+// allocator's overhead, so it reports its key and value bytes as both used
+// and reserved, and has nothing to compact.
+class StdTable {
+public:
+    static bool fits(size_t, size_t) {
+        return true;
+    }
+
+    bool find(uint64_t hash, std::string_view key, std::string_view& value, uint64_t now) const {
+        uint64_t expires_at;
+        return find(hash, key, value, expires_at, now);
+    }
+
+    bool find(uint64_t hash, std::string_view key, std::string_view& value, uint64_t& expires_at, uint64_t now) const {
+        auto it = data.find(key);
+        if (it == data.end() || it->second.is_expired(now)) {
+            return false;
+        }
+        value = it->second.value;
+        expires_at = it->second.expires_at;
+        return true;
+    }
+
+    void put(uint64_t hash, std::string_view key, std::string_view value, uint64_t expires_at = 0) {
+        auto it = data.find(key);
+        if (it != data.end()) {
+            account(static_cast<int64_t>(value.size()) - it->second.value.size());
+            it->second.value.assign(value);
+            if (expires_at != 0 && it->second.expires_at == 0) {
+                expiring_keys.emplace(hash, key);
+            }
+            it->second.expires_at = expires_at;
+        } else {
+            account(key.size() + value.size());
+            data.emplace(key, Entry{std::string(value), hash, expires_at});
+            key_count.store(data.size(), std::memory_order_relaxed);
+            if (expires_at != 0) {
+                expiring_keys.emplace(hash, key);
+            }
+        }
+    }
+
+    bool erase(uint64_t hash, std::string_view key, uint64_t now) {
+        auto it = data.find(key);
+        if (it == data.end()) {
+            return false;
+        }
+        bool expired = it->second.is_expired(now);
+        erase_entry(it);
+        return !expired;
+    }
+
+    template <class Fn>
+    size_t expire(uint64_t hash, uint64_t now, Fn&& on_erase) {
+        size_t expired = 0;
+        auto [it, end] = expiring_keys.equal_range(hash);
+        while (it != end) {
+            // Keys deleted or stored without a deadline since are just forgotten
+            auto entry = data.find(it->second);
+            bool has_deadline = entry != data.end() && entry->second.expires_at != 0;
+            if (has_deadline && !entry->second.is_expired(now)) {
+                ++it;
+                continue;
+            }
+            if (has_deadline) {
+                on_erase(std::string_view(entry->first));
+                erase_entry(entry);
+                expired++;
+            }
+            it = expiring_keys.erase(it);
+        }
+        return expired;
+    }
+
+    // Safe to call from any thread, for stats
+    size_t size() const {
+        return key_count.load(std::memory_order_relaxed);
+    }
+
+    template <class Fn>
+    void for_each(Fn&& fn) const {
+        for (const auto& [key, entry] : data) {
+            fn(entry.hash, std::string_view(key), std::string_view(entry.value), entry.expires_at);
+        }
+    }
+
+    // No access order is kept, so this evicts whichever entry comes first
+    template <class Fn>
+    bool evict_one(Fn&& on_erase) {
+        if (data.empty()) {
+            return false;
+        }
+        on_erase(data.begin()->second.hash, std::string_view(data.begin()->first));
+        erase_entry(data.begin());
+        return true;
+    }
+
+    bool compact() {
+        return false;
+    }
+
+    MemoryStats memory() const {
+        MemoryStats stats;
+        stats.used = stats.reserved = data_bytes.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    struct Entry {
+        std::string value;
+        uint64_t hash;
+        uint64_t expires_at;
+
+        bool is_expired(uint64_t now) const {
+            return expires_at != 0 && expires_at <= now;
+        }
+    };
+
+    using Map = std::unordered_map<std::string, Entry, StringHash, std::equal_to<>>;
+
+    void account(int64_t delta) {
+        data_bytes.store(data_bytes.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    void erase_entry(Map::iterator it) {
+        account(-static_cast<int64_t>(it->first.size() + it->second.value.size()));
+        data.erase(it);
+        key_count.store(data.size(), std::memory_order_relaxed);
+    }
+
+    Map data;
+    // Keys that were given a deadline, by hash, since expiry timers only know
+    // the hash. Cleaned up as their timers fire.
+    std::unordered_multimap<uint64_t, std::string> expiring_keys;
+    std::atomic<uint64_t> data_bytes{0};
+    std::atomic<size_t> key_count{0};
+};
+
+#if defined(FINCH_FIXED_KEY_BYTES) && defined(FINCH_FIXED_VALUE_BYTES)
+using PartitionTable = FixedTable<FINCH_FIXED_KEY_BYTES, FINCH_FIXED_VALUE_BYTES>;
+#elif defined(FINCH_FLAT_TABLE)
+using PartitionTable = FlatTable;
+#else
+using PartitionTable = StdTable;
+#endif
+
+struct Partition {
+    PartitionTable data;
+    std::unique_ptr<TimingWheel> expiry_timers; // Only while the partition has keys with a TTL
+    OrderedIndex index;       // The keys of data in order, only kept with --ordered-index
+    SnapshotSection snapshot; // Entries of the mapped snapshot not loaded into data yet
+    // Keys deleted during the handoff of handoff_deletes_epoch, so that a copy
+    // streamed in later by their previous owner doesn't bring them back
+    std::unordered_set<std::string, StringHash, std::equal_to<>> handoff_deletes;
+    uint64_t handoff_deletes_epoch = 0;
+    std::mutex mtx;
+    std::shared_mutex shared_mtx; // Used instead of mtx with --locks=shared
+    std::atomic<uint64_t> lock_waits{0}; // With --metrics, see PartitionLock
+    std::atomic<uint64_t> lock_wait_ns{0};
+};
+
+std::vector<Partition> partitions(PARTITION_COUNT);
+
+// Hashes of the keys changed lately, which clients with a near cache poll
+// with OP_INVALIDATIONS
+ChangeLog change_log;
+
+// With --hot-keys, the most requested keys, from every KEY_SAMPLE_INTERVAL-th
+// keyed request of each thread, and copies of their values outside the
+// partitions. Counts are halved every HOT_KEY_DECAY_INTERVAL_MS.
+const uint32_t KEY_SAMPLE_INTERVAL = 16;
+const uint64_t HOT_KEY_DECAY_INTERVAL_MS = 1000;
+
+std::unique_ptr<HotKeyTracker> hot_keys;
+std::unique_ptr<HotCopies> hot_copies;
+std::atomic<uint64_t> next_hot_key_decay_ms{0};
+
+// Every change to a key: clients' near caches and the key's hot copy drop it
+void note_changed(uint64_t key_hash) {
+    change_log.add(key_hash);
+    if (hot_copies) {
+        hot_copies->invalidate(key_hash);
+    }
+}
+
+// Server counters, reported through OP_STATS: syscalls and operations so the
+// test can compute server syscalls per operation, GET hits and misses and
+// evictions for the hit ratio under --maxmemory, keys reclaimed by their
+// expiry timer, keys and key and value bytes streamed away in handoffs,
+// changes applied from a primary, bytes received and sent on client and peer
+// connections, with --metrics the waits for a partition lock another thread
+// held and their total time, and with --hot-keys the GETs answered from hot
+// copies. Requests are also counted by type, and
+// with --metrics their latencies are kept by type too. Each thread counts into
+// its own cache lines and folds its totals into retired_counters when it
+// exits.
+enum Counter {
+    SYSCALLS,
+    OPERATIONS,
+    GET_HITS,
+    GET_MISSES,
+    EVICTIONS,
+    EXPIRATIONS,
+    MIGRATED_KEYS,
+    MIGRATED_BYTES,
+    REPLICATED,
+    BYTES_IN,
+    BYTES_OUT,
+    LOCK_WAITS,
+    LOCK_WAIT_NS,
+    HOT_COPY_HITS,
+    COUNTER_COUNT
+};
+
+const char* const COUNTER_NAMES[COUNTER_COUNT] = {"syscalls",   "operations",  "get_hits",       "get_misses",
+                                                  "evictions",  "expirations", "migrated_keys",  "migrated_bytes",
+                                                  "replicated", "bytes_in",    "bytes_out",      "lock_waits",
+                                                  "lock_wait_ns", "hot_copy_hits"};
+
+// Requests are counted by operation type, anything unknown as type 0
+const int OPERATION_TYPE_COUNT = OP_SHM_ATTACH + 1;
+
+const char* const OPERATION_TYPE_NAMES[OPERATION_TYPE_COUNT] = {
+    "unknown", "get",           "put",         "del",     "stats",     "mget",      "mput",
+    "mdel",    "setex",         "handoff_begin", "handoff_end", "migrate", "replicate", "clear_partition", "scan",
+    "incr",    "cas",           "append",      "getset",      "invalidations", "shm_attach"};
+
+// Request latencies from parsing a request to its response being ready to
+// send, queueing behind other loops included. 8 buckets per power of two keep
+// a thread's histograms small enough for the thread engine's thread per client.
+// Reading the clock costs tens of nanoseconds, a tenth of a pipelined request
+// on some machines, so only every LATENCY_SAMPLE_INTERVAL-th request of a
+// thread is timed. The requests themselves are all counted.
+using RequestHistogram = LatencyHistogram<3>;
+
+const uint32_t LATENCY_SAMPLE_INTERVAL = 32;
+
+struct RequestLatencies {
+    std::atomic<uint64_t> buckets[RequestHistogram::BUCKET_COUNT]{};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+};
+
+struct alignas(64) Counters {
+    std::atomic<uint64_t> values[COUNTER_COUNT]{};
+    std::atomic<uint64_t> requests[OPERATION_TYPE_COUNT]{};
+    std::unique_ptr<RequestLatencies[]> latencies; // By operation type, only with --metrics
+};
+
+std::mutex counters_mtx;
+std::vector<Counters*> live_counters;
+Counters retired_counters;
+
+// Only the owning thread writes its counters, so no atomic read-modify-write is needed
+void add_to(std::atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+class ThreadCounters {
+public:
+    ThreadCounters() {
+        if (config.metrics) {
+            counters.latencies = std::make_unique<RequestLatencies[]>(OPERATION_TYPE_COUNT);
+        }
+        std::scoped_lock lock(counters_mtx);
+        live_counters.push_back(&counters);
+    }
+
+    ~ThreadCounters() {
+        std::scoped_lock lock(counters_mtx);
+        for (int i = 0; i < COUNTER_COUNT; ++i) {
+            add_to(retired_counters.values[i], counters.values[i].load());
+        }
+        for (int type = 0; type < OPERATION_TYPE_COUNT; ++type) {
+            add_to(retired_counters.requests[type], counters.requests[type].load());
+        }
+        if (counters.latencies) {
+            if (!retired_counters.latencies) {
+                retired_counters.latencies = std::make_unique<RequestLatencies[]>(OPERATION_TYPE_COUNT);
+            }
+            for (int type = 0; type < OPERATION_TYPE_COUNT; ++type) {
+                RequestLatencies& from = counters.latencies[type];
+                RequestLatencies& to = retired_counters.latencies[type];
+                for (size_t i = 0; i < RequestHistogram::BUCKET_COUNT; ++i) {
+                    add_to(to.buckets[i], from.buckets[i].load());
+                }
+                add_to(to.total_ns, from.total_ns.load());
+                to.max_ns = std::max(to.max_ns.load(), from.max_ns.load());
+            }
+        }
+        live_counters.erase(std::find(live_counters.begin(), live_counters.end(), &counters));
+    }
+
+    Counters counters;
+    uint32_t requests_until_sample = 1;
+};
+
+thread_local ThreadCounters thread_counters;
+
+void count(Counter counter, uint64_t amount = 1) {
+    add_to(thread_counters.counters.values[counter], amount);
+}
+
+void count_syscall() {
+    count(SYSCALLS);
+}
+
+void count_operation() {
+    count(OPERATIONS);
+}
+
+uint8_t counted_operation_type(uint8_t operation_type) {
+    return operation_type < OPERATION_TYPE_COUNT ? operation_type : 0;
+}
+
+void count_request(uint8_t operation_type) {
+    add_to(thread_counters.counters.requests[counted_operation_type(operation_type)], 1);
+}
+
+// Whether to time the thread's next request, see LATENCY_SAMPLE_INTERVAL
+bool sample_latency() {
+    if (!config.metrics || --thread_counters.requests_until_sample > 0) {
+        return false;
+    }
+    thread_counters.requests_until_sample = LATENCY_SAMPLE_INTERVAL;
+    return true;
+}
+
+// For requests sample_latency picked
+void record_latency(uint8_t operation_type, uint64_t nanoseconds) {
+    RequestLatencies& latencies = thread_counters.counters.latencies[counted_operation_type(operation_type)];
+    add_to(latencies.buckets[RequestHistogram::bucket_of(nanoseconds)], 1);
+    add_to(latencies.total_ns, nanoseconds);
+    if (nanoseconds > latencies.max_ns.load(std::memory_order_relaxed)) {
+        latencies.max_ns.store(nanoseconds, std::memory_order_relaxed);
+    }
+}
+
+// Every thread's counters added up, exited threads included
+struct CounterTotals {
+    uint64_t values[COUNTER_COUNT] = {};
+    uint64_t requests[OPERATION_TYPE_COUNT] = {};
+    std::vector<RequestHistogram> latencies; // By operation type, only with --metrics
+};
+
+CounterTotals total_counters() {
+    CounterTotals totals;
+    if (config.metrics) {
+        totals.latencies.resize(OPERATION_TYPE_COUNT);
+    }
+    auto add = [&](const Counters& counters) {
+        for (int i = 0; i < COUNTER_COUNT; ++i) {
+            totals.values[i] += counters.values[i].load(std::memory_order_relaxed);
+        }
+        for (int type = 0; type < OPERATION_TYPE_COUNT; ++type) {
+            totals.requests[type] += counters.requests[type].load(std::memory_order_relaxed);
+        }
+        if (!counters.latencies || totals.latencies.empty()) {
+            return;
+        }
+        for (int type = 0; type < OPERATION_TYPE_COUNT; ++type) {
+            const RequestLatencies& latencies = counters.latencies[type];
+            for (size_t i = 0; i < RequestHistogram::BUCKET_COUNT; ++i) {
+                if (uint64_t values = latencies.buckets[i].load(std::memory_order_relaxed)) {
+                    totals.latencies[type].add_to_bucket(i, values);
+                }
+            }
+            totals.latencies[type].add_totals(latencies.total_ns.load(std::memory_order_relaxed),
+                                              latencies.max_ns.load(std::memory_order_relaxed));
+        }
+    };
+    std::scoped_lock lock(counters_mtx);
+    add(retired_counters);
+    for (Counters* counters : live_counters) {
+        add(*counters);
+    }
+    return totals;
+}
+
+std::string counter_stats(const CounterTotals& totals) {
+    std::string stats;
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        stats += (i > 0 ? " " : "") + std::string(COUNTER_NAMES[i]) + "=" + std::to_string(totals.values[i]);
+    }
+    return stats;
+}
+
+// Expiry deadlines are wall clock milliseconds, so they keep their meaning
+// when written out. The coarse clock is read without a syscall and is a few
+// milliseconds behind at most, much finer than the one second TTL unit.
+uint64_t now_ms() {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+// Request latencies and lock waits are timed with the monotonic clock, read
+// through the vDSO without a syscall
+uint64_t monotonic_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+// The thread engine shares every partition between all client threads, so each
+// access takes the partition mutex. The epoll engine gives every partition a
+// single owning loop and turns locking off.
+bool lock_partitions = true;
+
+// With --locks=shared, reads take the partition's shared_mutex in shared mode,
+// so GETs on a partition only wait for writers and never for each other.
+// Reads must not modify the partition in any way.
+//
+// With --metrics, a lock that isn't free at once counts as a wait, timed
+// until it is taken, for the server and for the partition.
+class PartitionLock {
+public:
+    explicit PartitionLock(Partition& partition, bool read_only = false) {
+        if (!lock_partitions) {
+            return;
+        }
+        if (!config.shared_locks) {
+            lock = std::unique_lock<std::mutex>(partition.mtx, std::defer_lock);
+            acquire(partition, lock);
+        } else if (read_only) {
+            read_lock = std::shared_lock<std::shared_mutex>(partition.shared_mtx, std::defer_lock);
+            acquire(partition, read_lock);
+        } else {
+            write_lock = std::unique_lock<std::shared_mutex>(partition.shared_mtx, std::defer_lock);
+            acquire(partition, write_lock);
+        }
+    }
+
+private:
+    template <class Lock>
+    static void acquire(Partition& partition, Lock& partition_lock) {
+        if (!config.metrics || partition_lock.try_lock()) {
+            if (!partition_lock.owns_lock()) {
+                partition_lock.lock();
+            }
+            return;
+        }
+        uint64_t started = monotonic_ns();
+        partition_lock.lock();
+        uint64_t waited = monotonic_ns() - started;
+        count(LOCK_WAITS);
+        count(LOCK_WAIT_NS, waited);
+        // Shared between threads, but only touched by those that had to wait anyway
+        partition.lock_waits.fetch_add(1, std::memory_order_relaxed);
+        partition.lock_wait_ns.fetch_add(waited, std::memory_order_relaxed);
+    }
+
+    std::unique_lock<std::mutex> lock;
+    std::shared_lock<std::shared_mutex> read_lock;
+    std::unique_lock<std::shared_mutex> write_lock;
+};
+
+// Keeps the partition's ordered index in step with its table
+void index_key(Partition& partition, std::string_view key) {
+    if (config.ordered_index) {
+        partition.index.insert(key);
+    }
+}
+
+void unindex(Partition& partition, std::string_view key) {
+    if (config.ordered_index) {
+        partition.index.erase(key);
+    }
+}
+
+// Erases the key from a partition the caller has locked. Returns false if the
+// key was missing or had already expired.
+bool erase_key(Partition& partition, uint64_t key_hash, std::string_view key, uint64_t now) {
+    unindex(partition, key);
+    return partition.data.erase(key_hash, key, now);
+}
+
+// Erases the keys of a partition the caller has locked whose timers are due,
+// up to MAX_EXPIRATIONS_PER_PASS of them. Lookups already skip expired keys,
+// this gives their memory back without scanning the table.
+void expire_partition(Partition& partition, uint64_t now) {
+    if (!partition.expiry_timers) {
+        return;
+    }
+    size_t expired = 0;
+    partition.expiry_timers->advance(now, MAX_EXPIRATIONS_PER_PASS, [&](const TimingWheel::Timer& timer) {
+        expired += partition.data.expire(timer.key_hash, now, [&](std::string_view key) {
+            unindex(partition, key);
+            note_changed(timer.key_hash);
+        });
+    });
+    count(EXPIRATIONS, expired);
+    if (partition.expiry_timers->size() == 0) {
+        partition.expiry_timers.reset();
+    }
+}
+
+// Halves the hot key counts once per HOT_KEY_DECAY_INTERVAL_MS, on whichever
+// thread gets there first
+void decay_hot_keys(uint64_t now) {
+    uint64_t due = next_hot_key_decay_ms.load(std::memory_order_relaxed);
+    if (!hot_keys || now < due ||
+        !next_hot_key_decay_ms.compare_exchange_strong(due, now + HOT_KEY_DECAY_INTERVAL_MS, std::memory_order_relaxed)) {
+        return;
+    }
+    if (due != 0) {
+        hot_keys->decay();
+    }
+}
+
+// Background upkeep of every step-th partition starting at first: the thread
+// engine's maintenance thread covers them all, each loop the ones it owns.
+void maintain_partitions(int first, int step) {
+    bool released = false;
+    uint64_t now = now_ms();
+    decay_hot_keys(now);
+    for (int partition_id = first; partition_id < PARTITION_COUNT; partition_id += step) {
+        Partition& partition = partitions[partition_id];
+        PartitionLock lock(partition);
+        expire_partition(partition, now);
+        released |= partition.data.compact();
+    }
+    // Compaction frees slabs to malloc, trimming gives the pages back to the OS
+    if (released) {
+        malloc_trim(0);
+    }
+}
+
+void run_maintenance_thread() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(MAINTENANCE_INTERVAL_MS));
+        maintain_partitions(0, 1);
+    }
+}
+
+// Per-connection receive buffer. recv writes straight into the free space at
+// the end and messages are parsed in place, so consuming a message only moves
+// the read position. The unparsed tail is moved to the front only when the
+// free space runs out, which moves each byte at most once per message.
+class ClientBuffer {
+public:
+    uint8_t* write_ptr() {
+        return data.data() + write_pos;
+    }
+
+    size_t writable() const {
+        return data.size() - write_pos;
+    }
+
+    void commit(size_t size) {
+        write_pos += size;
+    }
+
+    const uint8_t* read_ptr() const {
+        return data.data() + read_pos;
+    }
+
+    size_t readable() const {
+        return write_pos - read_pos;
+    }
+
+    void consume(size_t size) {
+        read_pos += size;
+        if (read_pos == write_pos) {
+            read_pos = write_pos = 0;
+        }
+    }
+
+    // Makes room for at least size more bytes
+    void prepare(size_t size) {
+        if (writable() >= size) {
+            return;
+        }
+        size_t unread = readable();
+        if (unread + size > data.size()) {
+            data.resize(std::max(data.size() * 2, unread + size));
+        }
+        if (read_pos > 0) {
+            std::memmove(data.data(), data.data() + read_pos, unread);
+            moved_bytes += unread;
+            read_pos = 0;
+            write_pos = unread;
+        }
+    }
+
+    void append(const uint8_t* bytes, size_t size) {
+        prepare(size);
+        std::memcpy(write_ptr(), bytes, size);
+        commit(size);
+    }
+
+    uint64_t moved_bytes = 0; // Bytes moved to the front so far
+
+private:
+    std::vector<uint8_t> data;
+    size_t read_pos = 0;
+    size_t write_pos = 0;
+};
+
+uint32_t ntoh_uint32(uint32_t value) {
+    return ntohl(value);
+}
+
+uint64_t ntoh_uint64(uint64_t value) {
+    uint32_t high_part = ntohl(static_cast<uint32_t>(value & 0xFFFFFFFF));
+    uint32_t low_part = ntohl(static_cast<uint32_t>(value >> 32));
+    return (static_cast<uint64_t>(high_part) << 32) | low_part;
+}
+
+// A decoded message. Key and value point into the received bytes, which must
+// outlive the request.
+struct Request {
+    uint8_t operation_type = 0;
+    uint64_t key_hash = 0;
+    std::string_view key;
+    std::string_view value; // Only for put operations
+    uint32_t ttl_seconds = 0; // Only for put operations, 0 for no expiry
+    uint64_t expires_at = 0;  // Only for OP_MIGRATE and replicated PUT entries, the absolute deadline or 0
+    uint32_t max_staleness_ms = 0; // Only for GET, 0 for any
+    uint64_t sent_at_ms = 0;       // Only for OP_REPLICATE
+    uint32_t scan_count = 0;       // Only for SCAN, the count hint
+    std::string_view scan_resume;  // Only for SCAN, where to resume in the cursor's partition
+    std::vector<Request> batch; // Only for batch operations, one GET, PUT or DEL per key
+};
+
+// The low bits of the key hash, while the hash ring places keys by their top
+// bits, see key_hash.h. SCAN sends the partition itself as its key hash.
+int partition_of(uint64_t key_hash) {
+    return key_hash % PARTITION_COUNT;
+}
+
+bool is_batch_operation(uint8_t operation_type) {
+    return operation_type == OP_MGET || operation_type == OP_MPUT || operation_type == OP_MDEL ||
+           operation_type == OP_MIGRATE || operation_type == OP_REPLICATE;
+}
+
+// Requests that read a key and store a new value for it in one go
+bool is_read_modify_write(uint8_t operation_type) {
+    return operation_type == OP_INCR || operation_type == OP_CAS || operation_type == OP_APPEND ||
+           operation_type == OP_GETSET;
+}
+
+// Requests about the whole server rather than a partition
+bool is_server_operation(uint8_t operation_type) {
+    return operation_type == OP_STATS || operation_type == OP_HANDOFF_BEGIN || operation_type == OP_HANDOFF_END ||
+           operation_type == OP_INVALIDATIONS || operation_type == OP_SHM_ATTACH;
+}
+
+// With --verify-hashes, whether the request's key hash is hash_key of its key.
+// Requests whose Key Hash field holds something else always pass.
+bool hash_verified(const Request& request) {
+    if (!config.verify_hashes || is_server_operation(request.operation_type) || request.operation_type == OP_SCAN ||
+        request.operation_type == OP_CLEAR_PARTITION) {
+        return true;
+    }
+    return request.key_hash == hash_key(request.key);
+}
+
+// The swap is its own inverse
+uint64_t hton_uint64(uint64_t value) {
+    return ntoh_uint64(value);
+}
+
+// Reads Key Hash, Key Length, Key and, for PUT, SETEX, OP_MIGRATE entries,
+// OP_HANDOFF_BEGIN, SCAN and the read-modify-write operations, Value Length
+// and Value starting at offset. Returns false if they don't fit in the message.
+bool parse_key_value(const uint8_t* message, size_t message_size, size_t& offset, Request& request) {
+    if (offset + sizeof(uint64_t) + sizeof(uint32_t) > message_size) {
+        return false;
+    }
+
+    // Key Hash
+    uint64_t key_hash_net;
+    std::memcpy(&key_hash_net, &message[offset], sizeof(uint64_t));
+    request.key_hash = ntoh_uint64(key_hash_net);
+    offset += sizeof(uint64_t);
+
+    // Key Length
+    uint32_t key_length_net;
+    std::memcpy(&key_length_net, &message[offset], sizeof(uint32_t));
+    uint32_t key_length = ntoh_uint32(key_length_net);
+    offset += sizeof(uint32_t);
+
+    if (key_length > message_size - offset) {
+        // Key length exceeds message size
+        return false;
+    }
+
+    // Key
+    const char* key_ptr = reinterpret_cast<const char*>(&message[offset]);
+    request.key = std::string_view(key_ptr, key_length);
+    offset += key_length;
+
+    if (request.operation_type == OP_PUT || request.operation_type == OP_SETEX || request.operation_type == OP_MIGRATE ||
+        request.operation_type == OP_HANDOFF_BEGIN || request.operation_type == OP_SCAN ||
+        is_read_modify_write(request.operation_type)) {
+        // Value Length
+        if (offset + sizeof(uint32_t) > message_size) {
+            return false;
+        }
+        uint32_t value_length_net;
+        std::memcpy(&value_length_net, &message[offset], sizeof(uint32_t));
+        uint32_t value_length = ntoh_uint32(value_length_net);
+        offset += sizeof(uint32_t);
+
+        if (value_length > message_size - offset) {
+            return false;
+        }
+
+        // Value
+        const char* value_ptr = reinterpret_cast<const char*>(&message[offset]);
+        request.value = std::string_view(value_ptr, value_length);
+        offset += value_length;
+    }
+    return true;
+}
+
+// Decodes one complete framed message. Returns false if the lengths inside the
+// message don't add up, or with --verify-hashes if a key hash is wrong.
+bool parse_request(const uint8_t* message, size_t message_size, Request& request) {
+    if (message_size < MIN_MESSAGE_SIZE) {
+        return false;
+    }
+
+    // Total Size (already read by the caller)
+    size_t offset = sizeof(uint32_t);
+
+    // Operation Type
+    request.operation_type = message[offset];
+    offset += sizeof(uint8_t);
+
+    if (!is_batch_operation(request.operation_type)) {
+        if (!parse_key_value(message, message_size, offset, request) || !hash_verified(request)) {
+            return false;
+        }
+        // SCAN: the cursor's partition as the Key Hash, the range's start as
+        // the Key and its end as the Value, then Count (4 bytes) and
+        // optionally Resume Length (4 bytes) and Resume, the cursor's key
+        if (request.operation_type == OP_SCAN) {
+            if (offset + sizeof(uint32_t) > message_size) {
+                return false;
+            }
+            uint32_t count_net;
+            std::memcpy(&count_net, &message[offset], sizeof(uint32_t));
+            request.scan_count = ntoh_uint32(count_net);
+            offset += sizeof(uint32_t);
+            if (offset == message_size) {
+                return true;
+            }
+            if (offset + sizeof(uint32_t) > message_size) {
+                return false;
+            }
+            uint32_t resume_length_net;
+            std::memcpy(&resume_length_net, &message[offset], sizeof(uint32_t));
+            uint32_t resume_length = ntoh_uint32(resume_length_net);
+            offset += sizeof(uint32_t);
+            if (resume_length != message_size - offset) {
+                return false;
+            }
+            request.scan_resume = std::string_view(reinterpret_cast<const char*>(&message[offset]), resume_length);
+            return true;
+        }
+        // TTL, optional for PUT and required for SETEX
+        if ((request.operation_type == OP_PUT || request.operation_type == OP_GET) && offset == message_size) {
+            return true;
+        }
+        // Max Staleness, optional for GET
+        if (request.operation_type == OP_GET) {
+            if (offset + sizeof(uint32_t) > message_size) {
+                return false;
+            }
+            uint32_t max_staleness_net;
+            std::memcpy(&max_staleness_net, &message[offset], sizeof(uint32_t));
+            request.max_staleness_ms = ntoh_uint32(max_staleness_net);
+            return true;
+        }
+        if (request.operation_type == OP_PUT || request.operation_type == OP_SETEX) {
+            if (offset + sizeof(uint32_t) > message_size) {
+                return false;
+            }
+            uint32_t ttl_net;
+            std::memcpy(&ttl_net, &message[offset], sizeof(uint32_t));
+            request.ttl_seconds = ntoh_uint32(ttl_net);
+            return request.ttl_seconds > 0 || request.operation_type == OP_PUT;
+        }
+        return true;
+    }
+
+    // Entry Count, then Key Hash, Key Length, Key (and Value Length, Value for
+    // MPUT, and Value Length, Value, Expires At (8 bytes) for OP_MIGRATE) for
+    // every entry. OP_REPLICATE has Sent At (8 bytes) after the count, and
+    // every entry starts with its Type (1 byte), OP_PUT entries ending like
+    // OP_MIGRATE ones.
+    if (offset + sizeof(uint32_t) > message_size) {
+        return false;
+    }
+    uint32_t entry_count_net;
+    std::memcpy(&entry_count_net, &message[offset], sizeof(uint32_t));
+    uint32_t entry_count = ntoh_uint32(entry_count_net);
+    offset += sizeof(uint32_t);
+
+    if (request.operation_type == OP_REPLICATE) {
+        if (offset + sizeof(uint64_t) > message_size) {
+            return false;
+        }
+        uint64_t sent_at_net;
+        std::memcpy(&sent_at_net, &message[offset], sizeof(uint64_t));
+        request.sent_at_ms = ntoh_uint64(sent_at_net);
+        offset += sizeof(uint64_t);
+    }
+
+    uint8_t entry_operation = request.operation_type == OP_MGET ? OP_GET
+                            : request.operation_type == OP_MPUT ? OP_PUT
+                            : request.operation_type == OP_MIGRATE ? OP_MIGRATE
+                            : request.operation_type == OP_REPLICATE ? OP_REPLICATE
+                            : OP_DEL;
+    // Every entry takes at least a hash and a key length
+    if (entry_count > (message_size - offset) / (sizeof(uint64_t) + sizeof(uint32_t))) {
+        return false;
+    }
+    request.batch.resize(entry_count);
+    for (Request& entry : request.batch) {
+        entry.operation_type = entry_operation;
+        if (entry_operation == OP_REPLICATE) {
+            if (offset >= message_size) {
+                return false;
+            }
+            entry.operation_type = message[offset];
+            offset += sizeof(uint8_t);
+            if (entry.operation_type != OP_PUT && entry.operation_type != OP_DEL &&
+                entry.operation_type != OP_CLEAR_PARTITION) {
+                return false;
+            }
+        }
+        if (!parse_key_value(message, message_size, offset, entry) || !hash_verified(entry)) {
+            return false;
+        }
+        if (entry.operation_type == OP_MIGRATE || (entry_operation == OP_REPLICATE && entry.operation_type == OP_PUT)) {
+            if (offset + sizeof(uint64_t) > message_size) {
+                return false;
+            }
+            uint64_t expires_at_net;
+            std::memcpy(&expires_at_net, &message[offset], sizeof(uint64_t));
+            entry.expires_at = ntoh_uint64(expires_at_net);
+            offset += sizeof(uint64_t);
+        }
+    }
+    return true;
+}
+
+// Evicts entries until the partition is back within its share of --maxmemory.
+// Every partition gets an equal share of the limit, so no counter is shared
+// between partitions.
+void enforce_memory_limit(Partition& partition) {
+    if (config.max_memory == 0) {
+        return;
+    }
+    uint64_t budget = config.max_memory / PARTITION_COUNT;
+    while (partition.data.memory().used > budget &&
+           partition.data.evict_one([&](uint64_t key_hash, std::string_view key) {
+               unindex(partition, key);
+               note_changed(key_hash);
+           })) {
+        count(EVICTIONS);
+    }
+}
+
+// Whether the partition store can hold the pair, and otherwise the error to
+// answer with. A server built with FINCH_FIXED_KEY_BYTES only stores pairs of
+// its key and value sizes.
+bool store_fits(std::string_view key, std::string_view value, [[maybe_unused]] std::string& response) {
+    if (PartitionTable::fits(key.size(), value.size())) {
+        return true;
+    }
+#if defined(FINCH_FIXED_KEY_BYTES) && defined(FINCH_FIXED_VALUE_BYTES)
+    response += "1ERROR: This server only stores " + std::to_string(FINCH_FIXED_KEY_BYTES) + "-byte keys with " +
+                std::to_string(FINCH_FIXED_VALUE_BYTES) + "-byte values";
+#endif
+    return false;
+}
+
+// Stores the pair with its expiry deadline, 0 for none, and starts its timer.
+// Pairs the store can't hold, from a log or snapshot another build wrote,
+// are skipped.
+void put_with_deadline(Partition& partition, uint64_t key_hash, std::string_view key, std::string_view value,
+                       uint64_t expires_at, uint64_t now) {
+    if (!PartitionTable::fits(key.size(), value.size())) {
+        return;
+    }
+    partition.data.put(key_hash, key, value, expires_at);
+    index_key(partition, key);
+    if (expires_at == 0) {
+        return;
+    }
+    if (!partition.expiry_timers) {
+        partition.expiry_timers = std::make_unique<TimingWheel>(now);
+    }
+    partition.expiry_timers->add({key_hash, expires_at});
+}
+
+// Append-only log for --aof. Every PUT, SETEX and DEL that changes a partition
+// is appended while the partition is still locked, so the log has the
+// changes of every key in the order they were applied. Record payload, host
+// byte order:
+// Type (1 byte, OP_PUT or OP_DEL) | Key Hash (8 bytes) | Key Length (4 bytes)
+// | Key | and for OP_PUT: Expires At (8 bytes, 0 for none) | Value
+// SETEX is logged as OP_PUT with its absolute deadline, so replaying it
+// later doesn't extend the TTL.
+std::unique_ptr<AppendLog> append_log;
+
+// The last record this thread appended, which its responses wait for with
+// --fsync=always
+thread_local uint64_t last_log_sequence = 0;
+
+template <typename T>
+std::string_view bytes_of(const T& value) {
+    return std::string_view(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void append_uint32_net(std::string& output, uint32_t value) {
+    uint32_t value_net = htonl(value);
+    output += bytes_of(value_net);
+}
+
+void log_put(uint64_t key_hash, std::string_view key, std::string_view value, uint64_t expires_at) {
+    uint32_t key_length = key.size();
+    last_log_sequence = append_log->append(
+        {bytes_of(OP_PUT), bytes_of(key_hash), bytes_of(key_length), key, bytes_of(expires_at), value});
+}
+
+void log_del(uint64_t key_hash, std::string_view key) {
+    uint32_t key_length = key.size();
+    last_log_sequence = append_log->append({bytes_of(OP_DEL), bytes_of(key_hash), bytes_of(key_length), key});
+}
+
+// Hands a change to the replica senders, see Replica below
+void capture_change(uint8_t type, uint64_t key_hash, std::string_view key, const std::string_view* value,
+                    uint64_t expires_at);
+
+// Records a change to a locked partition in the append-only log, the stream
+// to every replica, the change log and the key's hot copy, in the order the
+// partition saw it
+void record_put(uint64_t key_hash, std::string_view key, std::string_view value, uint64_t expires_at) {
+    if (append_log) {
+        log_put(key_hash, key, value, expires_at);
+    }
+    capture_change(OP_PUT, key_hash, key, &value, expires_at);
+    note_changed(key_hash);
+}
+
+void record_del(uint64_t key_hash, std::string_view key) {
+    if (append_log) {
+        log_del(key_hash, key);
+    }
+    capture_change(OP_DEL, key_hash, key, nullptr, 0);
+    note_changed(key_hash);
+}
+
+// On a replica, the primary's clock when it took the last batch applied
+// here: every change the primary made before then has been applied. 0 while
+// a full copy is still arriving, or when this server isn't a replica.
+std::atomic<uint64_t> replicated_through_ms{0};
+
+// Called once an OP_REPLICATE batch and every batch before it are applied
+void note_replicated(uint64_t sent_at_ms, size_t entry_count) {
+    replicated_through_ms.store(sent_at_ms, std::memory_order_relaxed);
+    count(REPLICATED, entry_count);
+}
+
+// Whether a GET bounded to max_staleness_ms may be answered here
+bool fresh_enough(uint32_t max_staleness_ms, uint64_t now) {
+    uint64_t through = replicated_through_ms.load(std::memory_order_relaxed);
+    return max_staleness_ms == 0 || (through != 0 && through + max_staleness_ms >= now);
+}
+
+// Moves a partition's snapshot entries into its table, see below
+void load_snapshot_partition(Partition& partition);
+
+// Replays one record at startup, before any engine runs. A PUT whose
+// deadline has passed removes the key instead. Keys are hashed again, so logs
+// written with the std::hash key hashes of earlier clients still replay. A
+// partition still in the snapshot is loaded first, so the record applies on
+// top of it.
+bool apply_log_record(std::string_view record, uint64_t now) {
+    const size_t header_size = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t);
+    if (record.size() < header_size) {
+        return false;
+    }
+    uint8_t type = record[0];
+    uint32_t key_length;
+    std::memcpy(&key_length, record.data() + sizeof(uint8_t) + sizeof(uint64_t), sizeof(uint32_t));
+    if (key_length > record.size() - header_size) {
+        return false;
+    }
+    std::string_view key = record.substr(header_size, key_length);
+    uint64_t key_hash = hash_key(key);
+    Partition& partition = partitions[partition_of(key_hash)];
+    load_snapshot_partition(partition);
+
+    if (type == OP_DEL) {
+        erase_key(partition, key_hash, key, now);
+        return true;
+    }
+    size_t value_offset = header_size + key_length + sizeof(uint64_t);
+    if (type != OP_PUT || value_offset > record.size()) {
+        return false;
+    }
+    uint64_t expires_at;
+    std::memcpy(&expires_at, record.data() + header_size + key_length, sizeof(uint64_t));
+    if (expires_at != 0 && expires_at <= now) {
+        erase_key(partition, key_hash, key, now);
+    } else {
+        put_with_deadline(partition, key_hash, key, record.substr(value_offset), expires_at, now);
+        enforce_memory_limit(partition);
+    }
+    return true;
+}
+
+// With --fsync=always, waits until the records this thread appended are on
+// disk. Called before responses are sent, so a client never sees a change
+// acknowledged that a crash could lose.
+void wait_for_log() {
+    if (append_log) {
+        append_log->wait_durable(last_log_sequence);
+    }
+}
+
+// Snapshot given with --snapshot. At startup every partition points at its
+// section of the mapped file and answers GETs from it, until the partition is
+// loaded into its table by a loader thread or by the first request that
+// changes it. The file is unmapped once every partition is loaded.
+SnapshotImage snapshot_image;
+std::atomic<int> unloaded_partitions{0};
+std::atomic<uint64_t> snapshot_keys_loaded{0};
+std::chrono::steady_clock::time_point snapshot_load_start;
+
+// Moves the snapshot entries of a partition the caller has locked for
+// writing into its table, skipping the ones that expired meanwhile
+void load_snapshot_partition(Partition& partition) {
+    if (!partition.snapshot) {
+        return;
+    }
+    SnapshotSection section = partition.snapshot;
+    partition.snapshot = SnapshotSection();
+    if (section.valid()) {
+        uint64_t now = now_ms();
+        size_t loaded = 0;
+        section.for_each([&](uint64_t key_hash, std::string_view key, std::string_view value, uint64_t expires_at) {
+            if (expires_at != 0 && expires_at <= now) return;
+            put_with_deadline(partition, key_hash, key, value, expires_at, now);
+            enforce_memory_limit(partition);
+            loaded++;
+        });
+        snapshot_keys_loaded += loaded;
+    } else {
+        std::cerr << "Skipping a corrupt partition of " << config.snapshot_path << "\n";
+    }
+
+    if (unloaded_partitions.fetch_sub(1) == 1) {
+        snapshot_image.unmap();
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                                                              snapshot_load_start);
+        std::cout << "Loaded " << snapshot_keys_loaded.load() << " keys from " << config.snapshot_path << " "
+                  << elapsed.count() << " ms after startup\n";
+    }
+}
+
+// Calls fn(hash, key, value, expires_at) on every entry of a locked
+// partition, whether or not it has been loaded from the snapshot yet
+template <class Fn>
+void for_each_entry(Partition& partition, Fn&& fn) {
+    partition.data.for_each(fn);
+    if (partition.snapshot && partition.snapshot.valid()) {
+        partition.snapshot.for_each(fn);
+    }
+}
+
+// Handoff to a new set of servers, from OP_HANDOFF_BEGIN to OP_HANDOFF_END.
+// Meanwhile clients send writes to a key's new owner, and deletes and reads
+// that miss there to its previous owner as well, while every server streams
+// the keys it no longer owns to their new owners as OP_MIGRATE batches.
+// handoff_epoch is odd during a handoff.
+std::mutex handoff_mtx;
+std::atomic<uint64_t> handoff_epoch{0};
+std::atomic<bool> migrating{false};
+
+// Runs on its own thread, with the background threads below
+void run_migration(std::string self, std::vector<std::string> members);
+
+// Starts a handoff to the members listed in member_list, one "host:port" per
+// line, with self the address the clients know this server by. A second
+// client starting the same handoff joins it. Returns false while the previous
+// handoff's migration is still running.
+bool begin_handoff(std::string_view self, std::string_view member_list) {
+    std::vector<std::string> members;
+    std::istringstream lines{std::string(member_list)};
+    for (std::string line; std::getline(lines, line);) {
+        if (!line.empty()) {
+            members.push_back(line);
+        }
+    }
+
+    std::scoped_lock lock(handoff_mtx);
+    if (handoff_epoch % 2 == 1) {
+        return true;
+    }
+    if (members.empty() || migrating) {
+        return false;
+    }
+    migrating = true;
+    handoff_epoch++;
+    std::thread(run_migration, std::string(self), std::move(members)).detach();
+    return true;
+}
+
+void end_handoff() {
+    std::scoped_lock lock(handoff_mtx);
+    if (handoff_epoch % 2 == 1) {
+        handoff_epoch++;
+    }
+}
+
+// The keys deleted from a locked partition during the current handoff
+std::unordered_set<std::string, StringHash, std::equal_to<>>& handoff_deletes(Partition& partition) {
+    uint64_t epoch = handoff_epoch.load(std::memory_order_relaxed);
+    if (partition.handoff_deletes_epoch != epoch) {
+        partition.handoff_deletes.clear();
+        partition.handoff_deletes_epoch = epoch;
+    }
+    return partition.handoff_deletes;
+}
+
+// Parses a whole decimal 64-bit integer, the form INCR stores numbers in
+bool parse_int64(std::string_view text, int64_t& number) {
+    const char* end = text.data() + text.size();
+    auto [parsed_end, error] = std::from_chars(text.data(), end, number);
+    return !text.empty() && error == std::errc() && parsed_end == end;
+}
+
+// Runs an INCR, CAS, APPEND or GETSET on a partition the caller has locked and
+// whose snapshot is loaded, appending the response. The new value is stored,
+// logged and replicated as a PUT of the whole value. INCR and APPEND keep the
+// key's deadline; CAS and GETSET store the key without one, like PUT.
+void apply_read_modify_write(Partition& partition, const Request& request, uint64_t now, std::string& response) {
+    size_t response_start = response.size();
+    std::string_view current;
+    uint64_t expires_at = 0;
+    bool found = partition.data.find(request.key_hash, request.key, current, expires_at, now);
+
+    std::string updated;
+    std::string_view new_value = request.value;
+    if (request.operation_type == OP_INCR) {
+        // Value: the delta in decimal. A missing key counts as 0.
+        int64_t delta;
+        int64_t number = 0;
+        if (!parse_int64(request.value, delta) || (found && !parse_int64(current, number))) {
+            response += "1ERROR: Not an integer";
+            return;
+        }
+        if (__builtin_add_overflow(number, delta, &number)) {
+            response += "1ERROR: Overflow";
+            return;
+        }
+        updated = std::to_string(number);
+        new_value = updated;
+        response += '0';
+        response += updated;
+    } else if (request.operation_type == OP_APPEND) {
+        if (current.size() + request.value.size() > MAX_VALUE_SIZE) {
+            response += "1ERROR: Value too large";
+            return;
+        }
+        updated.reserve(current.size() + request.value.size());
+        updated.append(current);
+        updated.append(request.value);
+        new_value = updated;
+        response += '0';
+        response += std::to_string(updated.size());
+    } else if (request.operation_type == OP_GETSET) {
+        // Copied out before the store overwrites it
+        if (found) {
+            response += '0';
+            response += current;
+        } else {
+            response += "1NOT_FOUND";
+        }
+    } else {
+        // Value: Expected Length (4 bytes, CAS_ABSENT if the key must not
+        // exist) | Expected | New Value
+        if (request.value.size() < sizeof(uint32_t)) {
+            response += "1ERROR: Invalid CAS";
+            return;
+        }
+        uint32_t expected_length;
+        std::memcpy(&expected_length, request.value.data(), sizeof(uint32_t));
+        expected_length = ntoh_uint32(expected_length);
+        std::string_view rest = request.value.substr(sizeof(uint32_t));
+        if (expected_length != CAS_ABSENT && expected_length > rest.size()) {
+            response += "1ERROR: Invalid CAS";
+            return;
+        }
+        bool matches = expected_length == CAS_ABSENT ? !found : found && current == rest.substr(0, expected_length);
+        if (!matches) {
+            response += "1MISMATCH";
+            return;
+        }
+        new_value = expected_length == CAS_ABSENT ? rest : rest.substr(expected_length);
+        response += "0OK";
+    }
+
+    if (!PartitionTable::fits(request.key.size(), new_value.size())) {
+        // Answer the error instead of the response built so far
+        response.resize(response_start);
+        store_fits(request.key, new_value, response);
+        return;
+    }
+    uint64_t deadline = found && (request.operation_type == OP_INCR || request.operation_type == OP_APPEND) ? expires_at : 0;
+    if (found) {
+        // Already indexed, and a deadline it keeps already has its timer
+        partition.data.put(request.key_hash, request.key, new_value, deadline);
+    } else {
+        put_with_deadline(partition, request.key_hash, request.key, new_value, 0, now);
+    }
+    record_put(request.key_hash, request.key, new_value, deadline);
+    enforce_memory_limit(partition);
+}
+
+// Runs a GET, PUT, SETEX, DEL, read-modify-write, OP_MIGRATE or OP_CLEAR_PARTITION entry on a partition the caller has locked. Appends
+// the response, prefixed with '0' for success or '1' for error. The partition
+// allocates only when a PUT stores a new key or a larger value.
+void apply_to_partition(Partition& partition, const Request& request, std::string& response) {
+    uint64_t now = now_ms();
+    if (request.operation_type == OP_GET) {
+        if (!fresh_enough(request.max_staleness_ms, now)) {
+            response += "1STALE";
+            return;
+        }
+        std::string_view value;
+        uint64_t expires_at;
+        bool found;
+        if (partition.snapshot) {
+            // Not loaded yet, read straight from the mapping
+            found = partition.snapshot.find(request.key_hash, request.key, value, expires_at) &&
+                    (expires_at == 0 || expires_at > now);
+        } else {
+            found = partition.data.find(request.key_hash, request.key, value, expires_at, now);
+        }
+        if (found && hot_copies && hot_keys->is_hot(request.key_hash)) {
+            hot_copies->fill(request.key_hash, request.key, value, expires_at);
+        }
+        if (found) {
+            count(GET_HITS);
+            response += '0';
+            response += value;
+        } else {
+            count(GET_MISSES);
+            response += "1NOT_FOUND";
+        }
+        return;
+    }
+
+    // Anything else changes the partition, so its table has to hold all of it first
+    load_snapshot_partition(partition);
+    if ((request.operation_type == OP_PUT || request.operation_type == OP_SETEX || request.operation_type == OP_MIGRATE) &&
+        !store_fits(request.key, request.value, response)) {
+        return;
+    }
+    if (request.operation_type == OP_PUT || request.operation_type == OP_SETEX) {
+        uint64_t expires_at = request.ttl_seconds > 0 ? now + static_cast<uint64_t>(request.ttl_seconds) * 1000
+                                                      : request.expires_at;
+        put_with_deadline(partition, request.key_hash, request.key, request.value, expires_at, now);
+        record_put(request.key_hash, request.key, request.value, expires_at);
+        enforce_memory_limit(partition);
+        response += "0OK";
+    } else if (request.operation_type == OP_MIGRATE) {
+        // A copy from the key's previous owner, older than anything written or
+        // deleted here since the handoff began
+        std::string_view existing;
+        if (partition.data.find(request.key_hash, request.key, existing, now) ||
+            handoff_deletes(partition).count(request.key) > 0 || (request.expires_at != 0 && request.expires_at <= now)) {
+            response += "0SKIPPED";
+        } else {
+            put_with_deadline(partition, request.key_hash, request.key, request.value, request.expires_at, now);
+            record_put(request.key_hash, request.key, request.value, request.expires_at);
+            enforce_memory_limit(partition);
+            response += "0OK";
+        }
+    } else if (request.operation_type == OP_DEL) {
+        if (handoff_epoch.load(std::memory_order_relaxed) % 2 == 1) {
+            handoff_deletes(partition).emplace(request.key);
+        }
+        if (erase_key(partition, request.key_hash, request.key, now)) {
+            record_del(request.key_hash, request.key);
+            response += "0DELETED";
+        } else {
+            response += "1NOT_FOUND";
+        }
+    } else if (request.operation_type == OP_CLEAR_PARTITION) {
+        // A full copy from the primary follows
+        std::vector<std::pair<uint64_t, std::string>> keys;
+        partition.data.for_each([&](uint64_t key_hash, std::string_view key, std::string_view, uint64_t) {
+            keys.emplace_back(key_hash, key);
+        });
+        for (const auto& [key_hash, key] : keys) {
+            if (erase_key(partition, key_hash, key, now)) {
+                record_del(key_hash, key);
+            }
+        }
+        response += "0OK";
+    } else if (is_read_modify_write(request.operation_type)) {
+        apply_read_modify_write(partition, request, now, response);
+    } else {
+        response += "1ERROR: Unknown command";
+    }
+}
+
+// Runs the entries of a batch, locking each partition once for all of its
+// entries. Returns one response per entry, in entry order.
+std::vector<std::string> execute_batch_entries(const std::vector<Request>& entries) {
+    std::vector<uint32_t> order(entries.size());
+    for (uint32_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    // Stable, so that repeated keys are applied in the order they were sent
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return partition_of(entries[a].key_hash) < partition_of(entries[b].key_hash);
+    });
+
+    std::vector<std::string> responses(entries.size());
+    size_t group_start = 0;
+    while (group_start < order.size()) {
+        int partition_id = partition_of(entries[order[group_start]].key_hash);
+        size_t group_end = group_start;
+        while (group_end < order.size() && partition_of(entries[order[group_end]].key_hash) == partition_id) {
+            group_end++;
+        }
+
+        Partition& partition = partitions[partition_id];
+        PartitionLock lock(partition, entries[order[group_start]].operation_type == OP_GET);
+        for (size_t i = group_start; i < group_end; ++i) {
+            count_operation();
+            apply_to_partition(partition, entries[order[i]], responses[order[i]]);
+        }
+        group_start = group_end;
+    }
+    return responses;
+}
+
+// Batch response payload: Entry Count (4 bytes, uint32_t), then for every
+// entry Status ('0' or '1'), Length (4 bytes, uint32_t) and Data. Data is the
+// value for MGET and empty for MPUT and MDEL.
+void encode_batch_response(uint8_t operation_type, const std::vector<std::string>& responses, std::string& output) {
+    output += '0';
+    uint32_t entry_count_net = htonl(static_cast<uint32_t>(responses.size()));
+    output.append(reinterpret_cast<const char*>(&entry_count_net), sizeof(uint32_t));
+    for (const std::string& response : responses) {
+        bool found = !response.empty() && response[0] == '0';
+        size_t data_length = operation_type == OP_MGET && found ? response.size() - 1 : 0;
+        uint32_t data_length_net = htonl(static_cast<uint32_t>(data_length));
+        output += found ? '0' : '1';
+        output.append(reinterpret_cast<const char*>(&data_length_net), sizeof(uint32_t));
+        output.append(response, 1, data_length);
+    }
+}
+
+// Responses are sent on the wire as:
+// Total Size (4 bytes, uint32_t) | Status ('0' or '1') | Payload
+// begin_frame reserves the size, which end_frame fills in once the status and
+// payload have been appended.
+size_t begin_frame(std::string& output) {
+    size_t frame_start = output.size();
+    output.append(sizeof(uint32_t), '\0');
+    return frame_start;
+}
+
+void end_frame(std::string& output, size_t frame_start) {
+    uint32_t total_size_net = htonl(static_cast<uint32_t>(output.size() - frame_start));
+    std::memcpy(&output[frame_start], &total_size_net, sizeof(uint32_t));
+}
+
+void append_framed_response(std::string& output, std::string_view response) {
+    size_t frame_start = begin_frame(output);
+    output += response;
+    end_frame(output, frame_start);
+}
+
+void append_framed_batch_response(std::string& output, uint8_t operation_type, const std::vector<std::string>& responses) {
+    size_t frame_start = begin_frame(output);
+    encode_batch_response(operation_type, responses, output);
+    end_frame(output, frame_start);
+}
+
+std::string memory_stats_fields(const MemoryStats& stats) {
+    return "used_bytes=" + std::to_string(stats.used) + " reserved_bytes=" + std::to_string(stats.reserved) +
+           " fragmented_bytes=" + std::to_string(stats.fragmented());
+}
+
+// One line per replica given with --replicas, see Replica below
+std::string replica_stats();
+
+std::string format_number(const char* format, double value) {
+    char text[32];
+    snprintf(text, sizeof(text), format, value);
+    return text;
+}
+
+// "operations" line of a type: its requests, then with --metrics their latency
+std::string operation_stats(const CounterTotals& totals, int operation_type) {
+    std::string stats = std::string("op=") + OPERATION_TYPE_NAMES[operation_type] +
+                        " requests=" + std::to_string(totals.requests[operation_type]);
+    if (!totals.latencies.empty()) {
+        const RequestHistogram& latencies = totals.latencies[operation_type];
+        auto micros = [](double nanoseconds) { return format_number("%.1f", nanoseconds / 1000); };
+        stats += " mean_us=" + micros(latencies.mean()) + " p50_us=" + micros(latencies.percentile(0.5)) +
+                 " p99_us=" + micros(latencies.percentile(0.99)) + " p999_us=" + micros(latencies.percentile(0.999)) +
+                 " max_us=" + micros(latencies.maximum());
+    }
+    return stats;
+}
+
+// Everything the other sections report, in the Prometheus text format, so a
+// scraper or a person with grep can read it without knowing the sections
+std::string metrics_dump(const CounterTotals& totals) {
+    std::string dump;
+    auto metric = [&](const std::string& name, const char* type) {
+        dump += "# TYPE finch_" + name + " " + type + "\n";
+    };
+    auto seconds = [](double nanoseconds) { return format_number("%.9g", nanoseconds / 1e9); };
+
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        metric(std::string(COUNTER_NAMES[i]) + "_total", "counter");
+        dump += "finch_" + std::string(COUNTER_NAMES[i]) + "_total " + std::to_string(totals.values[i]) + "\n";
+    }
+
+    metric("requests_total", "counter");
+    for (int type = 0; type < OPERATION_TYPE_COUNT; ++type) {
+        if (totals.requests[type] == 0) continue;
+        dump += std::string("finch_requests_total{op=\"") + OPERATION_TYPE_NAMES[type] + "\"} " +
+                std::to_string(totals.requests[type]) + "\n";
+    }
+    if (!totals.latencies.empty()) {
+        metric("request_latency_seconds", "summary");
+        for (int type = 0; type < OPERATION_TYPE_COUNT; ++type) {
+            const RequestHistogram& latencies = totals.latencies[type];
+            if (latencies.size() == 0) continue;
+            std::string op = std::string("op=\"") + OPERATION_TYPE_NAMES[type] + "\"";
+            for (const char* quantile : {"0.5", "0.99", "0.999"}) {
+                dump += "finch_request_latency_seconds{" + op + ",quantile=\"" + quantile + "\"} " +
+                        seconds(latencies.percentile(std::stod(quantile))) + "\n";
+            }
+            dump += "finch_request_latency_seconds_sum{" + op + "} " + seconds(latencies.sum()) + "\n";
+            dump += "finch_request_latency_seconds_count{" + op + "} " + std::to_string(latencies.size()) + "\n";
+        }
+    }
+
+    metric("partition_keys", "gauge");
+    metric("partition_used_bytes", "gauge");
+    metric("partition_reserved_bytes", "gauge");
+    metric("partition_lock_waits_total", "counter");
+    metric("partition_lock_wait_ns_total", "counter");
+    for (int partition_id = 0; partition_id < PARTITION_COUNT; ++partition_id) {
+        const Partition& partition = partitions[partition_id];
+        std::string label = "{partition=\"" + std::to_string(partition_id) + "\"} ";
+        MemoryStats memory = partition.data.memory();
+        dump += "finch_partition_keys" + label + std::to_string(partition.data.size()) + "\n";
+        dump += "finch_partition_used_bytes" + label + std::to_string(memory.used) + "\n";
+        dump += "finch_partition_reserved_bytes" + label + std::to_string(memory.reserved) + "\n";
+        dump += "finch_partition_lock_waits_total" + label + std::to_string(partition.lock_waits.load()) + "\n";
+        dump += "finch_partition_lock_wait_ns_total" + label + std::to_string(partition.lock_wait_ns.load()) + "\n";
+    }
+    return dump;
+}
+
+// Printable bytes of a key as they are, spaces, backslashes and the rest as \xNN
+std::string escape_key(std::string_view key) {
+    std::string escaped;
+    for (unsigned char c : key) {
+        if (c >= 0x20 && c < 0x7f && c != '\\' && c != ' ') {
+            escaped += static_cast<char>(c);
+        } else {
+            char hex[5];
+            std::snprintf(hex, sizeof(hex), "\\x%02x", c);
+            escaped += hex;
+        }
+    }
+    return escaped;
+}
+
+// OP_STATS payload, the key picks the section. The empty section is a summary
+// of the counters, keys and memory, "operations" has one line per operation
+// type with requests, "memory" one line per partition, "partitions" the keys,
+// bytes and lock waits of every partition, "handoff" says whether a handoff
+// is on and its migration still running, "replication" how far behind its
+// primary this server is, then how far behind this server each of its
+// replicas is, "hotkeys" the most requested keys lately with --hot-keys, and
+// "metrics" is all of it for a metrics scraper. Memory and
+// key counts are atomics, so any thread can read every partition's.
+void append_stats(std::string_view section, std::string& output) {
+    if (section.empty()) {
+        MemoryStats total;
+        size_t keys = 0;
+        for (const Partition& partition : partitions) {
+            total += partition.data.memory();
+            keys += partition.data.size();
+        }
+        output += '0';
+        output += counter_stats(total_counters()) + " keys=" + std::to_string(keys) + " " + memory_stats_fields(total);
+    } else if (section == "operations") {
+        CounterTotals totals = total_counters();
+        output += '0';
+        for (int type = 0; type < OPERATION_TYPE_COUNT; ++type) {
+            if (totals.requests[type] > 0) {
+                output += operation_stats(totals, type) + "\n";
+            }
+        }
+    } else if (section == "partitions") {
+        output += '0';
+        for (int partition_id = 0; partition_id < PARTITION_COUNT; ++partition_id) {
+            const Partition& partition = partitions[partition_id];
+            output += "partition=" + std::to_string(partition_id) + " keys=" + std::to_string(partition.data.size()) +
+                      " used_bytes=" + std::to_string(partition.data.memory().used) +
+                      " lock_waits=" + std::to_string(partition.lock_waits.load()) +
+                      " lock_wait_ns=" + std::to_string(partition.lock_wait_ns.load()) + "\n";
+        }
+    } else if (section == "metrics") {
+        output += '0';
+        output += metrics_dump(total_counters());
+    } else if (section == "memory") {
+        output += '0';
+        for (int partition_id = 0; partition_id < PARTITION_COUNT; ++partition_id) {
+            output += "partition=" + std::to_string(partition_id) + " " +
+                      memory_stats_fields(partitions[partition_id].data.memory()) + "\n";
+        }
+    } else if (section == "handoff") {
+        output += '0';
+        output += "active=" + std::to_string(handoff_epoch.load() % 2) + " migrating=" + std::to_string(migrating.load());
+    } else if (section == "hotkeys") {
+        if (!hot_keys) {
+            output += "1ERROR: Hot keys need --hot-keys";
+            return;
+        }
+        output += '0';
+        for (const HotKeyTracker::HotKey& hot_key : hot_keys->hottest()) {
+            output += "key=" + escape_key(hot_key.key) + " partition=" + std::to_string(partition_of(hot_key.key_hash)) +
+                      " requests=" + std::to_string(hot_key.count * KEY_SAMPLE_INTERVAL) + "\n";
+        }
+    } else if (section == "replication") {
+        uint64_t through = replicated_through_ms.load();
+        uint64_t now = now_ms();
+        output += '0';
+        output += "lag_ms=" + (through == 0 ? std::string("none") : std::to_string(now > through ? now - through : 0)) + "\n";
+        output += replica_stats();
+    } else {
+        output += "1ERROR: Unknown stats section";
+    }
+}
+
+// SCAN lists the keys in [start, end) of the cursor's partition, from its
+// resume key on, and of the partitions after it, until count keys are found.
+// Keys come in order within a partition, and a partition is locked on its own
+// for at most count keys, so a SCAN never holds a lock for long. Partitions
+// are visited in the order p, p + stride, p + 2 * stride..., where the stride
+// is the loop count with the loop engines, so a SCAN only visits partitions
+// of the loop owning the cursor's and leaves the next loop's to the next
+// SCAN. The cursor is all the state there is, so a SCAN can resume anywhere
+// and any time, even on another connection. Keys stored or deleted meanwhile
+// may be listed or not, but a key present throughout is listed once. Keys
+// that expired but haven't been reaped yet are listed too.
+//
+// Response payload: Next Partition (4 bytes, SCAN_DONE after the last one) |
+// Resume Length (4 bytes) | Resume | Key Count (4 bytes) | Key Length (4
+// bytes) and Key per key
+void scan_partitions(const Request& request, std::string& output) {
+    if (!config.ordered_index) {
+        output += "1ERROR: SCAN needs --ordered-index";
+        return;
+    }
+    int stride = config.engine == Engine::THREADS ? 1 : std::min(config.loop_count, PARTITION_COUNT);
+    uint32_t wanted = std::clamp<uint32_t>(request.scan_count, 1, MAX_SCAN_COUNT);
+    uint32_t partition_id = partition_of(request.key_hash);
+    std::string_view from = std::max(request.key, request.scan_resume);
+    std::string keys;
+    uint32_t key_count = 0;
+    std::string resume;
+    while (partition_id != SCAN_DONE) {
+        count_operation();
+        Partition& partition = partitions[partition_id];
+        {
+            PartitionLock lock(partition);
+            load_snapshot_partition(partition);
+            partition.index.scan(from, request.value, [&](std::string_view key) {
+                if (key_count == wanted) {
+                    resume = key;
+                    return false;
+                }
+                append_uint32_net(keys, key.size());
+                keys += key;
+                key_count++;
+                return true;
+            });
+        }
+        if (!resume.empty()) {
+            break;
+        }
+        // The next partition this loop owns, or the first of the next loop's
+        uint32_t next_id = partition_id + stride;
+        if (next_id >= PARTITION_COUNT) {
+            next_id = partition_id % stride + 1 < static_cast<uint32_t>(stride) ? partition_id % stride + 1 : SCAN_DONE;
+        }
+        bool next_loop = next_id == SCAN_DONE || next_id % stride != partition_id % stride;
+        partition_id = next_id;
+        from = request.key;
+        if (next_loop || key_count == wanted) {
+            break;
+        }
+    }
+    output += '0';
+    append_uint32_net(output, partition_id);
+    append_uint32_net(output, resume.size());
+    output += resume;
+    append_uint32_net(output, key_count);
+    output += keys;
+}
+
+// OP_INVALIDATIONS carries the sequence to read the change log from as its
+// Key Hash. Response payload, in network byte order: Next (8 bytes), the
+// sequence to poll from next | Lost (1 byte, 1 if changes since the sequence
+// were overwritten or it is from before the server started) | Count (4 bytes)
+// | Key Hash (8 bytes) per changed key
+void append_invalidations(uint64_t since, std::string& output) {
+    output += '0';
+    size_t header_start = output.size();
+    output.append(sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint32_t), '\0');
+    uint32_t key_count = 0;
+    bool lost;
+    uint64_t next = change_log.read(since, lost, [&](uint64_t key_hash) {
+        uint64_t key_hash_net = hton_uint64(key_hash);
+        output += bytes_of(key_hash_net);
+        key_count++;
+    });
+    if (lost) {
+        output.resize(header_start + sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint32_t));
+        key_count = 0;
+    }
+    uint64_t next_net = hton_uint64(next);
+    uint32_t key_count_net = htonl(key_count);
+    std::memcpy(&output[header_start], &next_net, sizeof(uint64_t));
+    output[header_start + sizeof(uint64_t)] = lost ? 1 : 0;
+    std::memcpy(&output[header_start + sizeof(uint64_t) + sizeof(uint8_t)], &key_count_net, sizeof(uint32_t));
+}
+
+// With --hot-keys, counts every KEY_SAMPLE_INTERVAL-th request of the
+// thread that reads or changes one key
+void sample_key(const Request& request) {
+    thread_local uint32_t requests_until_sample = 1;
+    uint8_t type = request.operation_type;
+    if (!hot_keys || !(type == OP_GET || type == OP_PUT || type == OP_SETEX || type == OP_DEL || is_read_modify_write(type)) ||
+        --requests_until_sample > 0) {
+        return;
+    }
+    requests_until_sample = KEY_SAMPLE_INTERVAL;
+    hot_keys->sample(request.key_hash, request.key);
+}
+
+// Appends the framed response to a GET whose key has a hot copy, without
+// touching its partition, and returns false if there is none
+bool answer_from_hot_copy(const Request& request, std::string& output) {
+    if (!hot_copies || request.operation_type != OP_GET) {
+        return false;
+    }
+    uint64_t now = now_ms();
+    if (!fresh_enough(request.max_staleness_ms, now)) {
+        return false;
+    }
+    size_t frame_start = begin_frame(output);
+    output += '0';
+    if (!hot_copies->read(request.key_hash, request.key, now, output)) {
+        output.resize(frame_start);
+        return false;
+    }
+    end_frame(output, frame_start);
+    count_operation();
+    count(GET_HITS);
+    count(HOT_COPY_HITS);
+    return true;
+}
+
+// Applies a request to its partition and appends the framed response to
+// output. A GET copies the value once, straight into the output buffer.
+void execute_request(const Request& request, std::string& output) {
+    if (answer_from_hot_copy(request, output)) {
+        return;
+    }
+    size_t frame_start = begin_frame(output);
+    if (request.operation_type == OP_STATS) {
+        append_stats(request.key, output);
+    } else if (request.operation_type == OP_HANDOFF_BEGIN) {
+        output += begin_handoff(request.key, request.value) ? "0OK" : "1ERROR: The previous migration is still running";
+    } else if (request.operation_type == OP_HANDOFF_END) {
+        end_handoff();
+        output += "0OK";
+    } else if (request.operation_type == OP_INVALIDATIONS) {
+        append_invalidations(request.key_hash, output);
+    } else if (request.operation_type == OP_SHM_ATTACH) {
+        // handle_client takes it when it can serve shared memory
+        output += "1ERROR: Shared memory needs --engine=threads and a Unix socket";
+    } else if (is_batch_operation(request.operation_type)) {
+        encode_batch_response(request.operation_type, execute_batch_entries(request.batch), output);
+    } else if (request.operation_type == OP_SCAN) {
+        scan_partitions(request, output);
+    } else {
+        count_operation();
+        Partition& partition = partitions[partition_of(request.key_hash)];
+        PartitionLock lock(partition, request.operation_type == OP_GET);
+        apply_to_partition(partition, request, output);
+    }
+    end_frame(output, frame_start);
+}
+
+bool send_all(int sock, const std::string& data) {
+    size_t total_sent = 0;
+    while (total_sent < data.size()) {
+        count_syscall();
+        ssize_t bytes_sent = send(sock, data.data() + total_sent, data.size() - total_sent, MSG_NOSIGNAL);
+        if (bytes_sent <= 0) {
+            if (bytes_sent == -1 && errno == EINTR) continue;
+            return false;
+        }
+        count(BYTES_OUT, bytes_sent);
+        total_sent += bytes_sent;
+    }
+    return true;
+}
+
+// Returns the size of the complete message at the start of data, 0 if more
+// bytes are needed, or -1 if the size is bogus and the stream can't be
+// resynchronized.
+long next_message_size(const uint8_t* data, size_t size) {
+    if (size < sizeof(uint32_t)) {
+        // Not enough data to read total size
+        return 0;
+    }
+
+    // Read Total Size (N)
+    uint32_t total_size_net;
+    std::memcpy(&total_size_net, data, sizeof(uint32_t));
+    uint32_t total_size = ntoh_uint32(total_size_net);
+
+    if (total_size < MIN_MESSAGE_SIZE || total_size > MAX_MESSAGE_SIZE) {
+        return -1;
+    }
+    if (size < total_size) {
+        // Wait for more data
+        return 0;
+    }
+    return total_size;
+}
+
+// Room to make in a receive buffer before the next recv: the rest of the
+// message at its read position if only its start has arrived, so that a large
+// value is received straight into place without the buffer doubling its way
+// up to it, and at least MAX_BUFFER_SIZE.
+size_t receive_size(const ClientBuffer& buffer) {
+    if (buffer.readable() < sizeof(uint32_t)) {
+        return MAX_BUFFER_SIZE;
+    }
+    uint32_t total_size_net;
+    std::memcpy(&total_size_net, buffer.read_ptr(), sizeof(uint32_t));
+    size_t total_size = ntoh_uint32(total_size_net);
+    if (total_size > MAX_MESSAGE_SIZE || total_size <= buffer.readable()) {
+        return MAX_BUFFER_SIZE;
+    }
+    return std::max<size_t>(MAX_BUFFER_SIZE, total_size - buffer.readable());
+}
+
+// Maps the shared memory segment named in an OP_SHM_ATTACH request that came
+// over a Unix domain socket, if it belongs to the user on the other end
+std::unique_ptr<ShmSegment> attach_shared_memory(int client_sock, const std::string& name) {
+    sockaddr_storage address{};
+    socklen_t address_size = sizeof(address);
+    ucred peer{};
+    socklen_t peer_size = sizeof(peer);
+    if (getsockname(client_sock, reinterpret_cast<sockaddr*>(&address), &address_size) != 0 ||
+        address.ss_family != AF_UNIX || getsockopt(client_sock, SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) != 0) {
+        return nullptr;
+    }
+    return ShmSegment::attach(name, peer.uid);
+}
+
+// Runs every complete message in the thread engine's client buffer, in
+// place, appending the responses to output. An OP_SHM_ATTACH request maps
+// the client's segment into shm, which carries the connection's messages
+// from then on. Returns false if the stream is broken and the connection has
+// to be closed after sending them.
+bool execute_messages(ClientBuffer& client_buffer, std::string& output, int client_sock, std::unique_ptr<ShmSegment>& shm) {
+    while (true) {
+        long message_size = next_message_size(client_buffer.read_ptr(), client_buffer.readable());
+        if (message_size == 0) {
+            return true;
+        }
+        if (message_size < 0) {
+            append_framed_response(output, "1ERROR: Invalid message");
+            return false;
+        }
+
+        Request request;
+        if (parse_request(client_buffer.read_ptr(), message_size, request)) {
+            count_request(request.operation_type);
+            sample_key(request);
+            if (request.operation_type == OP_SHM_ATTACH && !shm) {
+                shm = attach_shared_memory(client_sock, std::string(request.key));
+                append_framed_response(output, shm ? "0OK" : "1ERROR: Failed to attach the shared memory");
+                client_buffer.consume(message_size);
+                continue;
+            }
+            uint64_t started = sample_latency() ? monotonic_ns() : 0;
+            execute_request(request, output);
+            if (started != 0) {
+                record_latency(request.operation_type, monotonic_ns() - started);
+            }
+            if (request.operation_type == OP_REPLICATE) {
+                note_replicated(request.sent_at_ms, request.batch.size());
+            }
+        } else {
+            append_framed_response(output, "1ERROR: Invalid message");
+        }
+        client_buffer.consume(message_size);
+    }
+}
+
+// Writes all of data to the response ring, waiting for room while the
+// client reads. Returns false if the client went away.
+bool send_shared(ShmSegment::Channel& channel, int client_sock, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        if (!channel.wait([&] { return channel.writable() > 0; }, [&] { return peer_connected(client_sock); })) {
+            return false;
+        }
+        sent += channel.write_some(data.data() + sent, data.size() - sent);
+    }
+    count(BYTES_OUT, data.size());
+    return true;
+}
+
+// Serves a client over its shared memory rings the way handle_client serves
+// it over its socket, which now only tells whether the client is still there
+void serve_shared_memory(int client_sock, ShmSegment& segment, ClientBuffer& client_buffer) {
+    ShmSegment::Channel channel(segment, false);
+    std::unique_ptr<ShmSegment> attached_again;
+    std::string output;
+    while (channel.wait([&] { return channel.readable() > 0; }, [&] { return peer_connected(client_sock); })) {
+        client_buffer.prepare(receive_size(client_buffer));
+        size_t received = channel.read_some(client_buffer.write_ptr(), client_buffer.writable());
+        count(BYTES_IN, received);
+        client_buffer.commit(received);
+
+        output.clear();
+        bool stream_intact = execute_messages(client_buffer, output, -1, attached_again);
+        wait_for_log();
+        if (!send_shared(channel, client_sock, output) || !stream_intact) {
+            return;
+        }
+    }
+}
+
+void handle_client(int client_sock) {
+    ClientBuffer client_buffer;
+    std::string output;
+    std::unique_ptr<ShmSegment> shm;
+
+    while (true) {
+        // Receive straight into the client's buffer
+        client_buffer.prepare(receive_size(client_buffer));
+        count_syscall();
+        ssize_t bytes_received = recv(client_sock, client_buffer.write_ptr(), client_buffer.writable(), 0);
+        if (bytes_received <= 0) break;
+        count(BYTES_IN, bytes_received);
+        client_buffer.commit(bytes_received);
+
+        // Responses to every message that arrived together go out in one send
+        output.clear();
+        bool stream_intact = execute_messages(client_buffer, output, client_sock, shm);
+        wait_for_log();
+        if (!output.empty() && !send_all(client_sock, output)) break;
+        if (!stream_intact) break;
+        if (shm) {
+            serve_shared_memory(client_sock, *shm, client_buffer);
+            break;
+        }
+    }
+    close(client_sock);
+}
+
+// Lock-free single-producer single-consumer ring used between epoll loops.
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : slots(capacity + 1) {}
+
+    bool push(T item) {
+        size_t current_tail = tail.load(std::memory_order_relaxed);
+        size_t next_tail = (current_tail + 1) % slots.size();
+        if (next_tail == head.load(std::memory_order_acquire)) {
+            return false; // Full
+        }
+        slots[current_tail] = std::move(item);
+        tail.store(next_tail, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        size_t current_head = head.load(std::memory_order_relaxed);
+        if (current_head == tail.load(std::memory_order_acquire)) {
+            return false; // Empty
+        }
+        item = std::move(slots[current_head]);
+        head.store((current_head + 1) % slots.size(), std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> slots;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+// A request forwarded to the loop owning its partition. The owner fills in the
+// response and sends the same object back to the origin loop.
+struct CrossCoreMessage {
+    int origin_loop;
+    uint64_t connection_id;
+    uint64_t sequence;
+    std::shared_ptr<std::vector<uint8_t>> bytes; // The message the request points into
+    Request request;
+    std::string response; // Framed
+    // For a share of a batch: where its entries sit in the original batch and
+    // one response per entry
+    std::vector<uint32_t> entry_indices;
+    std::vector<std::string> entry_responses;
+    bool completed = false;
+    // The owner's last log record once it ran the request, which the
+    // response may only be sent after with --fsync=always
+    uint64_t log_sequence = 0;
+};
+
+struct PendingResponse {
+    bool ready = false;
+    std::string response; // Framed
+    // A batch spread over several loops is answered once every share is back
+    uint8_t batch_operation = 0;
+    std::vector<std::string> entry_responses;
+    int remaining_shares = 0;
+    // An OP_REPLICATE batch only counts as applied once the batches before
+    // it are too, when its response is collected
+    bool replicated = false;
+    uint64_t sent_at_ms = 0;
+    size_t entry_count = 0;
+    // A sampled request's latency is recorded once it is collected
+    uint8_t operation_type = 0;
+    uint64_t started_ns = 0;
+    // A forwarded request that may change keys, and the partition it changes,
+    // so that a later GET doesn't read a hot copy the change hasn't reached
+    bool changes_keys = false;
+    int partition = -1; // -1 for a batch, which may change any partition
+};
+
+struct Connection {
+    int sock;
+    uint64_t id;
+    ClientBuffer input;
+    std::string output;
+    // Responses are sent in request order, even when a forwarded request
+    // completes after a later local one.
+    std::deque<PendingResponse> pending;
+    uint64_t first_pending_sequence = 0;
+
+    // Used by the epoll engine only: the part of output already sent, erased
+    // once it is at least half of it rather than after every partial send
+    size_t output_sent = 0;
+
+    // With --fsync=always, responses are held in output until the log records
+    // they depend on are on disk, instead of blocking the loop. Positions
+    // count the bytes appended to output since the connection opened; the
+    // bytes before each mark's position wait for its log sequence.
+    uint64_t output_position = 0;   // Position of output[0]
+    uint64_t released_position = 0; // Bytes before it may be sent
+    std::deque<std::pair<uint64_t, uint64_t>> log_marks;
+    uint64_t forwarded_log_sequence = 0; // The latest of the completed forwarded requests
+    bool waiting_for_log = false;
+
+    // Used by the io_uring engine only
+    std::string sending;       // Buffer owned by the send in flight
+    size_t sending_offset = 0;
+    bool send_in_flight = false;
+    int operations_in_flight = 0;
+    bool closing = false;
+};
+
+class EventLoop;
+
+std::vector<std::unique_ptr<EventLoop>> loops;
+
+// cross_core_queues[from * loop_count + to]
+std::vector<std::unique_ptr<SpscQueue<CrossCoreMessage*>>> cross_core_queues;
+
+int owner_loop_of(int partition_id) {
+    return partition_id % config.loop_count;
+}
+
+SpscQueue<CrossCoreMessage*>& cross_core_queue(int from, int to) {
+    return *cross_core_queues[from * config.loop_count + to];
+}
+
+// Request framing, partition ownership and cross-core forwarding shared by the
+// epoll and io_uring loops. Subclasses only move bytes in and out of sockets.
+class EventLoop {
+public:
+    explicit EventLoop(int index)
+        : index(index), backlog(config.loop_count), wake(config.loop_count, false) {
+        wakeup_fd = eventfd(0, EFD_NONBLOCK);
+    }
+
+    virtual ~EventLoop() = default;
+
+    virtual void run() = 0;
+
+    void wakeup() {
+        uint64_t one = 1;
+        count_syscall();
+        ssize_t ignored = write(wakeup_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    // Called by the log writer once more records are on disk, see sendable_bytes
+    void wake_for_log() {
+        if (log_waiters.load()) {
+            wakeup();
+        }
+    }
+
+    // Runs task on this loop's thread, between two batches of events
+    void post(std::function<void()> task) {
+        {
+            std::scoped_lock lock(tasks_mtx);
+            posted_tasks.push_back(std::move(task));
+        }
+        wakeup();
+    }
+
+protected:
+    int index;
+    int wakeup_fd;
+    uint64_t next_connection_id = 1;
+    std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections;
+    // Forwarded messages waiting for room in a full queue, per destination loop
+    std::vector<std::vector<CrossCoreMessage*>> backlog;
+    std::vector<bool> wake;
+    std::mutex tasks_mtx;
+    std::vector<std::function<void()>> posted_tasks;
+    std::chrono::steady_clock::time_point next_maintenance = std::chrono::steady_clock::now();
+    std::vector<uint64_t> waiting_for_log; // Connections holding responses for the log
+    std::atomic<bool> log_waiters{false};  // Whether waiting_for_log isn't empty, for the log writer
+
+    // Sends whatever responses are ready. Returns false if the connection failed.
+    virtual bool flush_connection(Connection& conn) = 0;
+    virtual void close_connection(Connection& conn) = 0;
+
+    // The number of bytes at the front of output that may be sent. With
+    // --fsync=always that excludes responses to changes whose log records
+    // aren't on disk yet, and the responses after them. Every response in
+    // output is taken to depend on the last record this loop appended and on
+    // the forwarded requests completed so far; the connection waits for the
+    // log writer to wake the loop, see flush_synced_connections.
+    size_t sendable_bytes(Connection& conn) {
+        if (!append_log || !append_log->syncs_every_record()) {
+            return conn.output.size();
+        }
+        uint64_t durable = append_log->durable();
+        uint64_t needed = std::max(last_log_sequence, conn.forwarded_log_sequence);
+        uint64_t end = conn.output_position + conn.output.size();
+        if (needed > durable) {
+            if (!conn.log_marks.empty() && conn.log_marks.back().first == end) {
+                conn.log_marks.back().second = std::max(conn.log_marks.back().second, needed);
+            } else {
+                conn.log_marks.emplace_back(end, needed);
+            }
+        }
+        while (true) {
+            while (!conn.log_marks.empty() && conn.log_marks.front().second <= durable) {
+                conn.released_position = conn.log_marks.front().first;
+                conn.log_marks.pop_front();
+            }
+            if (conn.log_marks.empty()) {
+                conn.released_position = end;
+                return conn.output.size();
+            }
+            if (!conn.waiting_for_log) {
+                conn.waiting_for_log = true;
+                waiting_for_log.push_back(conn.id);
+            }
+            // The writer only wakes loops with this set, so check again after
+            // setting it in case the records got on disk in between
+            log_waiters.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            uint64_t now_durable = append_log->durable();
+            if (now_durable == durable) {
+                return conn.released_position - conn.output_position;
+            }
+            durable = now_durable;
+        }
+    }
+
+    // Sends the responses of connections that waited for the log, once the
+    // writer has woken the loop
+    void flush_synced_connections() {
+        if (waiting_for_log.empty()) {
+            return;
+        }
+        log_waiters.store(false);
+        std::vector<uint64_t> ids;
+        ids.swap(waiting_for_log);
+        for (uint64_t id : ids) {
+            auto it = connections.find(id);
+            if (it == connections.end() || it->second->closing) continue;
+            Connection& conn = *it->second;
+            conn.waiting_for_log = false;
+            if (!flush_connection(conn)) {
+                close_connection(conn);
+            }
+        }
+    }
+
+    // Runs maintenance on the partitions this loop owns once per interval
+    void maintain() {
+        auto now = std::chrono::steady_clock::now();
+        if (now < next_maintenance) {
+            return;
+        }
+        maintain_partitions(index, config.loop_count);
+        next_maintenance = now + std::chrono::milliseconds(MAINTENANCE_INTERVAL_MS);
+    }
+
+    int maintenance_timeout_ms() const {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(next_maintenance - std::chrono::steady_clock::now());
+        return std::max<int>(0, remaining.count());
+    }
+
+    void pin_to_core() {
+        unsigned int core_count = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(index % core_count, &cpu_set);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    }
+
+    Connection& add_connection(int sock) {
+        auto conn = std::make_unique<Connection>();
+        conn->sock = sock;
+        conn->id = next_connection_id++;
+        Connection& added = *conn;
+        connections[added.id] = std::move(conn);
+        return added;
+    }
+
+    // Handles every complete message in data, which is either the connection's
+    // input buffer or a buffer the kernel filled. Returns the number of bytes
+    // consumed, or -1 if the stream can't be resynchronized.
+    long handle_messages(Connection& conn, const uint8_t* data, size_t size) {
+        size_t offset = 0;
+        while (true) {
+            long message_size = next_message_size(data + offset, size - offset);
+            if (message_size < 0) {
+                return -1;
+            }
+            if (message_size == 0) {
+                break;
+            }
+
+            Request request;
+            if (!parse_request(data + offset, message_size, request)) {
+                add_error(conn, "1ERROR: Invalid message");
+            } else {
+                dispatch(conn, data + offset, message_size, request);
+            }
+            offset += message_size;
+        }
+        return offset;
+    }
+
+    // Handles every complete message in the input buffer. Returns false if the
+    // stream can't be resynchronized.
+    bool handle_input(Connection& conn) {
+        long consumed = handle_messages(conn, conn.input.read_ptr(), conn.input.readable());
+        if (consumed < 0) {
+            return false;
+        }
+        conn.input.consume(consumed);
+        return true;
+    }
+
+    // Responses go straight to the output buffer, unless a forwarded request
+    // sent earlier on the connection is still waiting for its response.
+    void add_error(Connection& conn, std::string_view response) {
+        if (conn.pending.empty()) {
+            append_framed_response(conn.output, response);
+            return;
+        }
+        PendingResponse slot;
+        slot.ready = true;
+        append_framed_response(slot.response, response);
+        conn.pending.push_back(std::move(slot));
+    }
+
+    void execute_local(Connection& conn, const Request& request) {
+        if (conn.pending.empty()) {
+            execute_request(request, conn.output);
+            if (request.operation_type == OP_REPLICATE) {
+                note_replicated(request.sent_at_ms, request.batch.size());
+            }
+            return;
+        }
+        PendingResponse slot;
+        slot.ready = true;
+        execute_request(request, slot.response);
+        note_replicated_later(slot, request);
+        conn.pending.push_back(std::move(slot));
+    }
+
+    // Whether a request sent earlier on the connection may still change the
+    // partition, on a loop that hasn't applied it yet
+    bool change_in_flight(const Connection& conn, int partition) const {
+        for (const PendingResponse& slot : conn.pending) {
+            if (!slot.ready && slot.changes_keys && (slot.partition < 0 || slot.partition == partition)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool answer_locally_from_hot_copy(Connection& conn, const Request& request) {
+        if (conn.pending.empty()) {
+            return answer_from_hot_copy(request, conn.output);
+        }
+        if (change_in_flight(conn, partition_of(request.key_hash))) {
+            return false;
+        }
+        PendingResponse slot;
+        slot.ready = true;
+        if (!answer_from_hot_copy(request, slot.response)) {
+            return false;
+        }
+        conn.pending.push_back(std::move(slot));
+        return true;
+    }
+
+    void note_replicated_later(PendingResponse& slot, const Request& request) {
+        if (request.operation_type == OP_REPLICATE) {
+            slot.replicated = true;
+            slot.sent_at_ms = request.sent_at_ms;
+            slot.entry_count = request.batch.size();
+        }
+    }
+
+    // Moves the responses that are ready, in order, to the output buffer.
+    void collect_ready_responses(Connection& conn) {
+        while (!conn.pending.empty() && conn.pending.front().ready) {
+            conn.output += conn.pending.front().response;
+            if (conn.pending.front().replicated) {
+                note_replicated(conn.pending.front().sent_at_ms, conn.pending.front().entry_count);
+            }
+            if (conn.pending.front().started_ns != 0) {
+                record_latency(conn.pending.front().operation_type, monotonic_ns() - conn.pending.front().started_ns);
+            }
+            conn.pending.pop_front();
+            conn.first_pending_sequence++;
+        }
+    }
+
+    // Copies a message so that requests parsed from it can outlive the receive
+    // buffer, and parses it again from the copy.
+    std::shared_ptr<std::vector<uint8_t>> copy_message(const uint8_t* message, size_t message_size, Request& request) {
+        auto bytes = std::make_shared<std::vector<uint8_t>>(message, message + message_size);
+        request = Request();
+        parse_request(bytes->data(), bytes->size(), request);
+        return bytes;
+    }
+
+    // Counts the request and, if it is sampled, times it until its response is
+    // ready: right away if it went straight to the output buffer, otherwise
+    // once its pending slot is collected.
+    void dispatch(Connection& conn, const uint8_t* message, size_t message_size, Request& request) {
+        count_request(request.operation_type);
+        sample_key(request);
+        if (!sample_latency()) {
+            route(conn, message, message_size, request);
+            return;
+        }
+        uint8_t operation_type = request.operation_type;
+        size_t pending_before = conn.pending.size();
+        uint64_t started = monotonic_ns();
+        route(conn, message, message_size, request);
+        if (conn.pending.size() == pending_before) {
+            record_latency(operation_type, monotonic_ns() - started);
+        } else {
+            conn.pending.back().operation_type = operation_type;
+            conn.pending.back().started_ns = started;
+        }
+    }
+
+    // Executes the request if this loop owns its partition, otherwise forwards
+    // it to the owner and reserves its place in the response order. Only
+    // forwarded messages are copied out of the receive buffer.
+    void route(Connection& conn, const uint8_t* message, size_t message_size, Request& request) {
+        if (is_batch_operation(request.operation_type)) {
+            dispatch_batch(conn, message, message_size, request);
+            return;
+        }
+
+        int owner = owner_loop_of(partition_of(request.key_hash));
+        if (owner == index || is_server_operation(request.operation_type)) {
+            execute_local(conn, request);
+            return;
+        }
+        // A GET for a hot key is answered here, without the hop to its owner,
+        // unless a change sent before it on the connection is still on its way
+        if (answer_locally_from_hot_copy(conn, request)) {
+            return;
+        }
+
+        auto forwarded = new CrossCoreMessage();
+        forwarded->origin_loop = index;
+        forwarded->connection_id = conn.id;
+        forwarded->sequence = conn.first_pending_sequence + conn.pending.size();
+        forwarded->bytes = copy_message(message, message_size, forwarded->request);
+        PendingResponse slot;
+        slot.changes_keys = request.operation_type != OP_GET;
+        slot.partition = partition_of(request.key_hash);
+        conn.pending.push_back(std::move(slot));
+        send_cross_core(owner, forwarded);
+    }
+
+    // Splits a batch by owning loop. This loop runs its own share right away
+    // and the other shares are forwarded; the response is assembled once all
+    // of them are back.
+    void dispatch_batch(Connection& conn, const uint8_t* message, size_t message_size, Request& request) {
+        std::vector<std::vector<uint32_t>> indices_by_loop(config.loop_count);
+        for (uint32_t i = 0; i < request.batch.size(); ++i) {
+            indices_by_loop[owner_loop_of(partition_of(request.batch[i].key_hash))].push_back(i);
+        }
+        if (indices_by_loop[index].size() == request.batch.size()) {
+            execute_local(conn, request);
+            return;
+        }
+
+        // The shares sent to other loops point into one shared copy
+        Request copy;
+        std::shared_ptr<std::vector<uint8_t>> bytes = copy_message(message, message_size, copy);
+
+        PendingResponse slot;
+        slot.batch_operation = copy.operation_type;
+        slot.entry_responses.resize(copy.batch.size());
+        slot.changes_keys = copy.operation_type != OP_MGET;
+        note_replicated_later(slot, copy);
+        uint64_t sequence = conn.first_pending_sequence + conn.pending.size();
+
+        for (int owner = 0; owner < config.loop_count; ++owner) {
+            std::vector<uint32_t>& indices = indices_by_loop[owner];
+            if (indices.empty()) continue;
+
+            std::vector<Request> share;
+            share.reserve(indices.size());
+            for (uint32_t i : indices) {
+                share.push_back(std::move(copy.batch[i]));
+            }
+
+            if (owner == index) {
+                std::vector<std::string> responses = execute_batch_entries(share);
+                for (size_t i = 0; i < indices.size(); ++i) {
+                    slot.entry_responses[indices[i]] = std::move(responses[i]);
+                }
+                continue;
+            }
+
+            auto forwarded = new CrossCoreMessage();
+            forwarded->origin_loop = index;
+            forwarded->connection_id = conn.id;
+            forwarded->sequence = sequence;
+            forwarded->bytes = bytes;
+            forwarded->request.operation_type = copy.operation_type;
+            forwarded->request.batch = std::move(share);
+            forwarded->entry_indices = std::move(indices);
+            slot.remaining_shares++;
+            send_cross_core(owner, forwarded);
+        }
+        conn.pending.push_back(std::move(slot));
+    }
+
+    void send_cross_core(int to, CrossCoreMessage* message) {
+        if (!backlog[to].empty() || !cross_core_queue(index, to).push(message)) {
+            backlog[to].push_back(message);
+            return;
+        }
+        wake[to] = true;
+    }
+
+    void drain_cross_core_queues() {
+        std::vector<CrossCoreMessage*> executed;
+        for (int from = 0; from < config.loop_count; ++from) {
+            if (from == index) continue;
+            CrossCoreMessage* message;
+            while (cross_core_queue(from, index).pop(message)) {
+                if (message->completed) {
+                    complete(message);
+                } else {
+                    if (is_batch_operation(message->request.operation_type)) {
+                        message->entry_responses = execute_batch_entries(message->request.batch);
+                    } else {
+                        execute_request(message->request, message->response);
+                    }
+                    message->completed = true;
+                    executed.push_back(message);
+                }
+            }
+        }
+        // The origin holds these responses until the log has the records
+        // this loop appended for them
+        for (CrossCoreMessage* message : executed) {
+            message->log_sequence = last_log_sequence;
+            send_cross_core(message->origin_loop, message);
+        }
+    }
+
+    // Runs the tasks other threads posted for the partitions this loop owns
+    void run_posted_tasks() {
+        std::vector<std::function<void()>> tasks;
+        {
+            std::scoped_lock lock(tasks_mtx);
+            tasks.swap(posted_tasks);
+        }
+        for (auto& task : tasks) {
+            task();
+        }
+    }
+
+    void complete(CrossCoreMessage* message) {
+        std::unique_ptr<CrossCoreMessage> owned(message);
+        auto it = connections.find(message->connection_id);
+        if (it == connections.end() || it->second->closing) return; // Connection closed meanwhile
+
+        Connection& conn = *it->second;
+        conn.forwarded_log_sequence = std::max(conn.forwarded_log_sequence, message->log_sequence);
+        PendingResponse& slot = conn.pending[message->sequence - conn.first_pending_sequence];
+        if (slot.batch_operation != 0) {
+            for (size_t i = 0; i < message->entry_indices.size(); ++i) {
+                slot.entry_responses[message->entry_indices[i]] = std::move(message->entry_responses[i]);
+            }
+            if (--slot.remaining_shares > 0) return;
+            append_framed_batch_response(slot.response, slot.batch_operation, slot.entry_responses);
+        } else {
+            slot.response = std::move(message->response);
+        }
+        slot.ready = true;
+        if (!flush_connection(conn)) {
+            close_connection(conn);
+        }
+    }
+
+    bool backlog_empty() const {
+        for (const auto& messages : backlog) {
+            if (!messages.empty()) return false;
+        }
+        return true;
+    }
+
+    void retry_backlog() {
+        for (int to = 0; to < config.loop_count; ++to) {
+            auto& messages = backlog[to];
+            size_t pushed = 0;
+            while (pushed < messages.size() && cross_core_queue(index, to).push(messages[pushed])) {
+                pushed++;
+            }
+            if (pushed > 0) {
+                messages.erase(messages.begin(), messages.begin() + pushed);
+                wake[to] = true;
+            }
+        }
+    }
+
+    // One eventfd write per destination per iteration, however many messages were queued
+    void wake_peers() {
+        for (int to = 0; to < config.loop_count; ++to) {
+            if (wake[to]) {
+                loops[to]->wakeup();
+                wake[to] = false;
+            }
+        }
+    }
+};
+
+class EpollLoop : public EventLoop {
+public:
+    EpollLoop(int index, int listen_sock, int unix_sock)
+        : EventLoop(index), listen_sock(listen_sock), unix_sock(unix_sock) {
+        epoll_fd = epoll_create1(0);
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLET;
+        event.data.u64 = LISTEN_ID;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &event);
+
+        if (unix_sock != -1) {
+            // Shared by every loop, and only one of them needs waking per client
+            epoll_event unix_event{};
+            unix_event.events = EPOLLIN | EPOLLEXCLUSIVE;
+            unix_event.data.u64 = UNIX_LISTEN_ID;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, unix_sock, &unix_event);
+        }
+
+        event.data.u64 = WAKEUP_ID;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event);
+    }
+
+    void run() override {
+        pin_to_core();
+
+        epoll_event events[MAX_EPOLL_EVENTS];
+        while (true) {
+            // Sleep until the next maintenance at most, and poll while some
+            // forwarded messages couldn't be queued
+            int timeout = backlog_empty() ? maintenance_timeout_ms() : 1;
+            count_syscall();
+            int event_count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+            if (event_count == -1 && errno != EINTR) {
+                std::cerr << "epoll_wait failed on loop " << index << "\n";
+                return;
+            }
+
+            for (int i = 0; i < event_count; ++i) {
+                uint64_t id = events[i].data.u64;
+                if (id == LISTEN_ID) {
+                    accept_connections(listen_sock);
+                } else if (id == UNIX_LISTEN_ID) {
+                    accept_connections(unix_sock);
+                } else if (id == WAKEUP_ID) {
+                    uint64_t count;
+                    count_syscall();
+                    while (read(wakeup_fd, &count, sizeof(count)) > 0) {
+                        count_syscall();
+                    }
+                } else {
+                    auto it = connections.find(id);
+                    if (it == connections.end()) continue;
+                    Connection& conn = *it->second;
+                    if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                        if (!read_connection(conn)) {
+                            close_connection(conn);
+                            continue;
+                        }
+                    }
+                    if ((events[i].events & EPOLLOUT) && !flush_connection(conn)) {
+                        close_connection(conn);
+                    }
+                }
+            }
+
+            drain_cross_core_queues();
+            run_posted_tasks();
+            flush_synced_connections();
+            retry_backlog();
+            wake_peers();
+            maintain();
+        }
+    }
+
+private:
+    // Connection ids start at 1, so these can't collide with them
+    static constexpr uint64_t LISTEN_ID = UINT64_MAX;
+    static constexpr uint64_t WAKEUP_ID = UINT64_MAX - 1;
+    static constexpr uint64_t UNIX_LISTEN_ID = UINT64_MAX - 2;
+
+    int listen_sock;
+    int unix_sock; // -1 without --unix
+    int epoll_fd;
+
+    void accept_connections(int sock) {
+        while (true) {
+            count_syscall();
+            int client_sock = accept4(sock, nullptr, nullptr, SOCK_NONBLOCK);
+            if (client_sock == -1) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    std::cerr << "Failed to accept client.\n";
+                }
+                return;
+            }
+
+            Connection& conn = add_connection(client_sock);
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.u64 = conn.id;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &event) == -1) {
+                close(client_sock);
+                connections.erase(conn.id);
+            }
+        }
+    }
+
+    void close_connection(Connection& conn) override {
+        // Closing the socket also removes it from the epoll set. Completions of
+        // requests still in flight on other loops are dropped on arrival.
+        close(conn.sock);
+        connections.erase(conn.id);
+    }
+
+    // Reads until the socket would block, then handles every complete message.
+    // Returns false if the connection should be closed.
+    bool read_connection(Connection& conn) {
+        bool peer_closed = false;
+        while (true) {
+            conn.input.prepare(receive_size(conn.input));
+            count_syscall();
+            ssize_t bytes_received = recv(conn.sock, conn.input.write_ptr(), conn.input.writable(), 0);
+            if (bytes_received > 0) {
+                count(BYTES_IN, bytes_received);
+                conn.input.commit(bytes_received);
+                continue;
+            }
+            if (bytes_received == 0) {
+                peer_closed = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+
+        if (!handle_input(conn)) {
+            return false;
+        }
+        return flush_connection(conn) && !peer_closed;
+    }
+
+    bool flush_connection(Connection& conn) override {
+        collect_ready_responses(conn);
+        size_t sendable = sendable_bytes(conn);
+
+        size_t& total_sent = conn.output_sent;
+        while (total_sent < sendable) {
+            count_syscall();
+            ssize_t bytes_sent = send(conn.sock, conn.output.data() + total_sent, sendable - total_sent, MSG_NOSIGNAL);
+            if (bytes_sent > 0) {
+                count(BYTES_OUT, bytes_sent);
+                total_sent += bytes_sent;
+            } else if (bytes_sent == -1 && errno == EINTR) {
+                continue;
+            } else if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break; // EPOLLOUT will fire once there is room again
+            } else {
+                return false;
+            }
+        }
+        if (total_sent == conn.output.size()) {
+            conn.output_position += total_sent;
+            conn.output.clear();
+            total_sent = 0;
+        } else if (total_sent >= conn.output.size() / 2) {
+            conn.output_position += total_sent;
+            conn.output.erase(0, total_sent);
+            total_sent = 0;
+        }
+        return true;
+    }
+};
+
+int io_uring_setup(unsigned entries, io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                   io_uring_getevents_arg* arg = nullptr) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, arg ? sizeof(*arg) : 0);
+}
+
+int io_uring_register(int ring_fd, unsigned opcode, void* arg, unsigned arg_count) {
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, arg_count);
+}
+
+// io_uring loop driven by raw syscalls, without liburing. Accept and recv are
+// multishot, received data lands in a provided buffer ring, and all sends
+// queued while handling one batch of completions go out in a single
+// io_uring_enter.
+class UringLoop : public EventLoop {
+public:
+    // Multishot recv and provided buffer rings need Linux 6.0
+    static bool supported() {
+        utsname name{};
+        int major = 0, minor = 0;
+        if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2) {
+            return false;
+        }
+        if (major < 6) {
+            return false;
+        }
+
+        io_uring_params params{};
+        int ring_fd = io_uring_setup(8, &params);
+        if (ring_fd < 0) {
+            return false;
+        }
+        close(ring_fd);
+        return true;
+    }
+
+    UringLoop(int index, int listen_sock, int unix_sock)
+        : EventLoop(index), listen_sock(listen_sock), unix_sock(unix_sock) {
+        // A read on a non-blocking eventfd completes at once with -EAGAIN
+        // instead of waiting for a wakeup
+        fcntl(wakeup_fd, F_SETFL, fcntl(wakeup_fd, F_GETFL) & ~O_NONBLOCK);
+    }
+
+    void run() override {
+        pin_to_core();
+        if (!setup_ring()) {
+            std::cerr << "io_uring setup failed on loop " << index << "\n";
+            return;
+        }
+
+        arm_accept(listen_sock);
+        if (unix_sock != -1) {
+            arm_accept(unix_sock);
+        }
+        arm_wakeup();
+        while (true) {
+            // Wait until the next maintenance at most, or 1ms while some
+            // forwarded messages couldn't be queued
+            int timeout_ms = backlog_empty() ? maintenance_timeout_ms() : 1;
+            __kernel_timespec wait_time{};
+            wait_time.tv_sec = timeout_ms / 1000;
+            wait_time.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            io_uring_getevents_arg wait_arg{};
+            wait_arg.ts = reinterpret_cast<uint64_t>(&wait_time);
+
+            unsigned to_submit = sq_local_tail - *sq_tail;
+            __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+            count_syscall();
+            int result = io_uring_enter(ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &wait_arg);
+            if (result < 0 && errno != EINTR && errno != EBUSY && errno != ETIME) {
+                std::cerr << "io_uring_enter failed on loop " << index << "\n";
+                return;
+            }
+
+            reap_completions();
+            drain_cross_core_queues();
+            run_posted_tasks();
+            flush_synced_connections();
+            retry_backlog();
+            wake_peers();
+            maintain();
+        }
+    }
+
+private:
+    static constexpr unsigned RING_ENTRIES = 4096;
+    static constexpr unsigned BUFFER_COUNT = 1024; // Must be a power of two
+    static constexpr unsigned BUFFER_SIZE = MAX_BUFFER_SIZE;
+    static constexpr uint16_t BUFFER_GROUP_ID = 0;
+
+    // The top byte of user_data says which kind of operation completed, the
+    // rest holds the connection id, or for an accept the listening socket.
+    enum Kind : uint64_t { ACCEPT = 1, RECV = 2, SEND = 3, WAKEUP = 4 };
+    static constexpr int KIND_SHIFT = 56;
+
+    int listen_sock;
+    int unix_sock; // -1 without --unix
+    int ring_fd = -1;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    io_uring_sqe* sqes;
+    unsigned sq_local_tail = 0;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+
+    io_uring_buf_ring* buffer_ring;
+    std::vector<uint8_t> buffers;
+    uint16_t buffer_ring_tail = 0;
+
+    uint64_t wakeup_count;
+
+    bool setup_ring() {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+        ring_fd = io_uring_setup(RING_ENTRIES, &params);
+        if (ring_fd < 0) {
+            // Older kernels reject the flags above
+            params = io_uring_params{};
+            ring_fd = io_uring_setup(RING_ENTRIES, &params);
+            if (ring_fd < 0) return false;
+        }
+
+        size_t sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+
+        void* sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) return false;
+        void* cq_ring = sq_ring;
+        if (!single_mmap) {
+            cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED) return false;
+        }
+        void* sqe_memory = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqe_memory == MAP_FAILED) return false;
+
+        auto sq_base = static_cast<uint8_t*>(sq_ring);
+        sq_head = reinterpret_cast<unsigned*>(sq_base + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq_base + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq_base + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sq_array = reinterpret_cast<unsigned*>(sq_base + params.sq_off.array);
+        sqes = static_cast<io_uring_sqe*>(sqe_memory);
+        sq_local_tail = *sq_tail;
+
+        auto cq_base = static_cast<uint8_t*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned*>(cq_base + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq_base + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq_base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq_base + params.cq_off.cqes);
+
+        // Provided buffer ring: the kernel picks a free buffer for every recv
+        size_t buffer_ring_size = BUFFER_COUNT * sizeof(io_uring_buf);
+        void* ring_memory = mmap(nullptr, buffer_ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ring_memory == MAP_FAILED) return false;
+        buffer_ring = static_cast<io_uring_buf_ring*>(ring_memory);
+
+        io_uring_buf_reg registration{};
+        registration.ring_addr = reinterpret_cast<uint64_t>(ring_memory);
+        registration.ring_entries = BUFFER_COUNT;
+        registration.bgid = BUFFER_GROUP_ID;
+        if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+            return false;
+        }
+
+        buffers.resize(static_cast<size_t>(BUFFER_COUNT) * BUFFER_SIZE);
+        for (uint16_t buffer_id = 0; buffer_id < BUFFER_COUNT; ++buffer_id) {
+            add_buffer(buffer_id);
+        }
+        publish_buffers();
+        return true;
+    }
+
+    void add_buffer(uint16_t buffer_id) {
+        // Only addr, len and bid are written: the ring tail overlays bufs[0].resv.
+        // Indexing goes through a plain io_uring_buf pointer because the kernel
+        // header's flexible array member is misplaced when compiled as C++.
+        io_uring_buf* ring_entries = reinterpret_cast<io_uring_buf*>(buffer_ring);
+        io_uring_buf& buffer = ring_entries[buffer_ring_tail & (BUFFER_COUNT - 1)];
+        buffer.addr = reinterpret_cast<uint64_t>(&buffers[static_cast<size_t>(buffer_id) * BUFFER_SIZE]);
+        buffer.len = BUFFER_SIZE;
+        buffer.bid = buffer_id;
+        buffer_ring_tail++;
+    }
+
+    void publish_buffers() {
+        __atomic_store_n(&buffer_ring->tail, buffer_ring_tail, __ATOMIC_RELEASE);
+    }
+
+    io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (sq_local_tail - head >= sq_entries) {
+            // Submission queue is full, hand what we have to the kernel first
+            unsigned to_submit = sq_local_tail - *sq_tail;
+            __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+            count_syscall();
+            io_uring_enter(ring_fd, to_submit, 0, 0);
+        }
+        unsigned slot = sq_local_tail & sq_mask;
+        sq_array[slot] = slot;
+        io_uring_sqe* sqe = &sqes[slot];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_local_tail++;
+        return sqe;
+    }
+
+    static uint64_t user_data(Kind kind, uint64_t connection_id = 0) {
+        return (static_cast<uint64_t>(kind) << KIND_SHIFT) | connection_id;
+    }
+
+    void arm_accept(int sock) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = sock;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = user_data(ACCEPT, sock);
+    }
+
+    void arm_wakeup() {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wakeup_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&wakeup_count);
+        sqe->len = sizeof(wakeup_count);
+        sqe->user_data = user_data(WAKEUP);
+    }
+
+    void arm_recv(Connection& conn) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn.sock;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP_ID;
+        sqe->user_data = user_data(RECV, conn.id);
+        conn.operations_in_flight++;
+    }
+
+    void submit_send(Connection& conn) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn.sock;
+        sqe->addr = reinterpret_cast<uint64_t>(conn.sending.data() + conn.sending_offset);
+        sqe->len = conn.sending.size() - conn.sending_offset;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = user_data(SEND, conn.id);
+        conn.send_in_flight = true;
+        conn.operations_in_flight++;
+    }
+
+    void reap_completions() {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        bool buffers_returned = false;
+        while (head != tail) {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            buffers_returned |= handle_completion(cqe);
+            if (head == tail) {
+                tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            }
+        }
+        if (buffers_returned) {
+            publish_buffers();
+        }
+    }
+
+    // Returns true if a provided buffer went back to the ring.
+    bool handle_completion(const io_uring_cqe& cqe) {
+        Kind kind = static_cast<Kind>(cqe.user_data >> KIND_SHIFT);
+        uint64_t connection_id = cqe.user_data & ((1ULL << KIND_SHIFT) - 1);
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+
+        if (kind == ACCEPT) {
+            if (cqe.res >= 0) {
+                arm_recv(add_connection(cqe.res));
+            }
+            if (!more) {
+                arm_accept(static_cast<int>(connection_id));
+            }
+            return false;
+        }
+        if (kind == WAKEUP) {
+            arm_wakeup();
+            return false;
+        }
+
+        auto it = connections.find(connection_id);
+        Connection* conn = it == connections.end() ? nullptr : it->second.get();
+        bool buffer_returned = false;
+
+        if (kind == RECV) {
+            const uint8_t* data = nullptr;
+            uint16_t buffer_id = 0;
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                data = &buffers[static_cast<size_t>(buffer_id) * BUFFER_SIZE];
+            }
+
+            if (conn) {
+                if (!more) {
+                    conn->operations_in_flight--;
+                }
+
+                if (conn->closing) {
+                    // Waiting for outstanding operations before releasing the socket
+                } else if (cqe.res == -ENOBUFS) {
+                    // Every provided buffer was in use, recv again once they are returned
+                    if (!more) arm_recv(*conn);
+                } else if (cqe.res <= 0 || !data) {
+                    close_connection(*conn);
+                } else {
+                    if (!more) arm_recv(*conn);
+                    count(BYTES_IN, cqe.res);
+                    if (!receive(*conn, data, cqe.res) || !flush_connection(*conn)) {
+                        close_connection(*conn);
+                    }
+                }
+            }
+
+            // The kernel only reuses the buffer once the ring tail is published,
+            // after every completion of this batch has been handled
+            if (data) {
+                add_buffer(buffer_id);
+                buffer_returned = true;
+            }
+        } else if (kind == SEND) {
+            if (!conn) return false;
+            conn->operations_in_flight--;
+            conn->send_in_flight = false;
+            if (conn->closing) {
+                // Waiting for outstanding operations before releasing the socket
+            } else if (cqe.res < 0) {
+                close_connection(*conn);
+            } else {
+                count(BYTES_OUT, cqe.res);
+                conn->sending_offset += cqe.res;
+                if (conn->sending_offset < conn->sending.size()) {
+                    submit_send(*conn);
+                } else {
+                    conn->sending.clear();
+                    conn->sending_offset = 0;
+                    flush_connection(*conn);
+                }
+            }
+        }
+
+        if (conn && conn->closing) {
+            release_connection(*conn);
+        }
+        return buffer_returned;
+    }
 
-struct Partition {
-    std::unordered_map<std::string, std::string> data;
-    std::mutex mtx;
-};
+    // Handles the messages in a provided buffer in place. Only a partial
+    // message left at the end is copied, into the connection's input buffer.
+    bool receive(Connection& conn, const uint8_t* data, size_t size) {
+        if (conn.input.readable() > 0) {
+            conn.input.append(data, size);
+            return handle_input(conn);
+        }
+        long consumed = handle_messages(conn, data, size);
+        if (consumed < 0) {
+            return false;
+        }
+        conn.input.append(data + consumed, size - consumed);
+        return true;
+    }
 
-std::vector<Partition> partitions(PARTITION_COUNT);
+    bool flush_connection(Connection& conn) override {
+        collect_ready_responses(conn);
+        size_t sendable = sendable_bytes(conn);
+        if (!conn.send_in_flight && sendable > 0) {
+            // The kernel reads from the buffer until the send completes, so
+            // new responses accumulate in output meanwhile
+            if (sendable == conn.output.size()) {
+                conn.sending.swap(conn.output);
+            } else {
+                conn.sending.assign(conn.output, 0, sendable);
+                conn.output.erase(0, sendable);
+            }
+            conn.output_position += sendable;
+            conn.sending_offset = 0;
+            submit_send(conn);
+        }
+        return true;
+    }
+
+    void close_connection(Connection& conn) override {
+        if (conn.closing) return;
+        conn.closing = true;
+        // Ends the multishot recv and any send in flight. The socket and its
+        // buffers stay alive until the kernel has completed both.
+        count_syscall();
+        shutdown(conn.sock, SHUT_RDWR);
+    }
 
-struct ClientBuffer {
-    std::vector<uint8_t> buffer;
+    // Called after every completion of a closing connection.
+    void release_connection(Connection& conn) {
+        if (conn.operations_in_flight > 0) return;
+        count_syscall();
+        close(conn.sock);
+        connections.erase(conn.id);
+    }
 };
 
-uint32_t ntoh_uint32(uint32_t value) {
-    return ntohl(value);
+int open_listener(int port, bool reuse_port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) return -1;
+
+    // A restarted server gets its port back even while connections it closed
+    // linger in TIME_WAIT, so a primary finds its replica where it was
+    int enable = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (reuse_port) {
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+    }
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(sock, (sockaddr*)&server_addr, sizeof(server_addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
 }
 
-uint64_t ntoh_uint64(uint64_t value) {
-    uint32_t high_part = ntohl(static_cast<uint32_t>(value & 0xFFFFFFFF));
-    uint32_t low_part = ntohl(static_cast<uint32_t>(value >> 32));
-    return (static_cast<uint64_t>(high_part) << 32) | low_part;
+// Listens on unix_socket_path(port), replacing the socket file a previous run
+// left behind. Returns -1 on failure.
+int open_unix_listener(int port) {
+    std::string path = unix_socket_path(port);
+    sockaddr_un server_addr{};
+    if (path.size() >= sizeof(server_addr.sun_path)) return -1;
+    server_addr.sun_family = AF_UNIX;
+    std::memcpy(server_addr.sun_path, path.c_str(), path.size() + 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) return -1;
+    unlink(path.c_str());
+    if (bind(sock, (sockaddr*)&server_addr, sizeof(server_addr)) != 0 || listen(sock, SOMAXCONN) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
 }
 
-void handle_client(int client_sock) {
-    ClientBuffer client_buffer;
+// Opens the Unix domain socket listener if --unix asked for one, and reports
+// where it is. Returns -1 if there is none.
+int open_unix_listener_if_enabled(int port) {
+    if (!config.unix_socket) return -1;
+    int sock = open_unix_listener(port);
+    if (sock == -1) {
+        std::cerr << "Failed to listen on " << unix_socket_path(port) << "\n";
+    } else {
+        std::cout << "Server listening on " << unix_socket_path(port) << "\n";
+    }
+    return sock;
+}
 
+void accept_clients(int server_sock) {
     while (true) {
-        uint8_t temp_buffer[MAX_BUFFER_SIZE];
-        ssize_t bytes_received = recv(client_sock, temp_buffer, MAX_BUFFER_SIZE, 0);
-        if (bytes_received <= 0) break;
+        count_syscall();
+        int client_sock = accept(server_sock, nullptr, nullptr);
+        if (client_sock == -1) {
+            std::cerr << "Failed to accept client.\n";
+            continue;
+        }
+        std::thread(handle_client, client_sock).detach();
+    }
+}
 
-        // Append received data to the client's buffer
-        client_buffer.buffer.insert(client_buffer.buffer.end(), temp_buffer, temp_buffer + bytes_received);
+// Runs fn on a partition from a thread outside the engine: under the partition
+// lock in the thread engine, on the owning loop in the loop engines. Returns
+// once fn has run.
+void run_on_partition(int partition_id, bool read_only, const std::function<void(Partition&)>& fn) {
+    Partition& partition = partitions[partition_id];
+    if (lock_partitions) {
+        PartitionLock lock(partition, read_only);
+        fn(partition);
+        return;
+    }
+    std::promise<void> done;
+    loops[owner_loop_of(partition_id)]->post([&] {
+        fn(partition);
+        done.set_value();
+    });
+    done.get_future().wait();
+}
 
-        // Process messages in the buffer
-        while (true) {
-            if (client_buffer.buffer.size() < sizeof(uint32_t)) {
-                // Not enough data to read total size
-                break;
+// Rewrites the append-only log as one PUT per live entry. Partitions are
+// copied one at a time, so each is held only while its own entries are
+// serialized, and requests keep being served and logged meanwhile.
+bool rewrite_log() {
+    std::string new_path = config.aof_path + ".rewrite";
+    int fd = open(new_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    if (!append_log->begin_rewrite(fd)) {
+        close(fd);
+        unlink(new_path.c_str());
+        return false;
+    }
+
+    std::string records;
+    bool written = true;
+    for (int partition_id = 0; partition_id < PARTITION_COUNT && written; ++partition_id) {
+        uint64_t now = now_ms();
+        run_on_partition(partition_id, true, [&](Partition& partition) {
+            for_each_entry(partition, [&](uint64_t key_hash, std::string_view key, std::string_view value, uint64_t expires_at) {
+                if (expires_at != 0 && expires_at <= now) return;
+                uint32_t key_length = key.size();
+                AppendLog::frame_record(records, {bytes_of(OP_PUT), bytes_of(key_hash), bytes_of(key_length), key,
+                                                  bytes_of(expires_at), value});
+            });
+        });
+        written = write(fd, records.data(), records.size()) == static_cast<ssize_t>(records.size());
+        records.clear();
+    }
+
+    if (!written) {
+        append_log->abort_rewrite();
+        close(fd);
+        unlink(new_path.c_str());
+        return false;
+    }
+    return append_log->finish_rewrite(fd, new_path);
+}
+
+void run_log_rewrite_thread() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(MAINTENANCE_INTERVAL_MS));
+        if (!append_log->needs_rewrite()) continue;
+
+        uint64_t old_size = append_log->size();
+        auto start = std::chrono::steady_clock::now();
+        if (!rewrite_log()) {
+            std::cerr << "Failed to rewrite " << config.aof_path << "\n";
+            continue;
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        std::cout << "Rewrote " << config.aof_path << " from " << old_size << " to " << append_log->size()
+                  << " bytes in " << elapsed.count() << " ms\n";
+    }
+}
+
+// Writes a snapshot of every live entry to --snapshot. Like rewrite_log, it
+// copies one partition at a time and sorts and writes it after letting go, so
+// a partition is held only while its entries are copied. The snapshot is
+// written next to the old one and renamed over it once it is on disk.
+//
+// With --aof, the header records the log's position before the first
+// partition is copied. Every change logged before it is in the snapshot, and
+// replaying the records after it on top of the snapshot gives the state the
+// whole log would, since each record stores a key's whole value or deletes
+// it. The log is synced up to the position before the snapshot replaces the
+// old one, so the position never points past the log's end after a crash.
+bool write_snapshot(uint64_t& key_count) {
+    std::string new_path = config.snapshot_path + ".tmp";
+    int fd = open(new_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    AppendLog::Position log_position;
+    if (append_log) {
+        log_position = append_log->position();
+    }
+
+    SnapshotSectionBuilder builder;
+    std::string section;
+    std::vector<uint64_t> offsets;
+    uint64_t offset = SnapshotImage::header_size(PARTITION_COUNT);
+    key_count = 0;
+    bool written = true;
+    for (int partition_id = 0; partition_id < PARTITION_COUNT && written; ++partition_id) {
+        uint64_t now = now_ms();
+        run_on_partition(partition_id, true, [&](Partition& partition) {
+            for_each_entry(partition, [&](uint64_t key_hash, std::string_view key, std::string_view value, uint64_t expires_at) {
+                if (expires_at != 0 && expires_at <= now) return;
+                builder.add(key_hash, key, value, expires_at);
+                key_count++;
+            });
+        });
+        builder.encode(section);
+        offsets.push_back(offset);
+        written = pwrite(fd, section.data(), section.size(), offset) == static_cast<ssize_t>(section.size());
+        offset += section.size();
+        section.clear();
+    }
+    offsets.push_back(offset);
+
+    std::string header = SnapshotImage::encode_header(offsets, log_position.log_id, log_position.offset);
+    written = written && pwrite(fd, header.data(), header.size(), 0) == static_cast<ssize_t>(header.size()) &&
+              fdatasync(fd) == 0;
+    close(fd);
+    if (written && append_log) {
+        append_log->sync(log_position);
+    }
+    if (!written || rename(new_path.c_str(), config.snapshot_path.c_str()) != 0) {
+        unlink(new_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+void run_snapshot_thread() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(config.snapshot_interval_seconds));
+
+        uint64_t key_count;
+        auto start = std::chrono::steady_clock::now();
+        if (!write_snapshot(key_count)) {
+            std::cerr << "Failed to write " << config.snapshot_path << "\n";
+            continue;
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        std::cout << "Wrote " << key_count << " keys to " << config.snapshot_path << " in " << elapsed.count() << " ms\n";
+    }
+}
+
+// Maps the snapshot given with --snapshot and points every partition at its
+// section. Takes the same time for any snapshot size, so the server starts
+// serving right away. A missing file is an empty snapshot.
+bool map_snapshot() {
+    snapshot_load_start = std::chrono::steady_clock::now();
+    if (access(config.snapshot_path.c_str(), F_OK) != 0) {
+        return true;
+    }
+    if (!snapshot_image.map(config.snapshot_path, PARTITION_COUNT)) {
+        std::cerr << "Failed to map " << config.snapshot_path << ", it isn't a snapshot of " << PARTITION_COUNT
+                  << " partitions\n";
+        return false;
+    }
+    for (int partition_id = 0; partition_id < PARTITION_COUNT; ++partition_id) {
+        partitions[partition_id].snapshot = snapshot_image.section(partition_id);
+    }
+    unloaded_partitions = PARTITION_COUNT;
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                                                          snapshot_load_start);
+    std::cout << "Mapped " << config.snapshot_path << " in " << elapsed.count() << " us, serving reads from it while "
+              << "partitions load\n";
+    return true;
+}
+
+// Forgets the mapped snapshot before any partition is loaded from it
+void drop_snapshot() {
+    for (int partition_id = 0; partition_id < PARTITION_COUNT; ++partition_id) {
+        partitions[partition_id].snapshot = SnapshotSection();
+    }
+    unloaded_partitions = 0;
+    snapshot_image.unmap();
+}
+
+// Loads the partitions still in the mapped snapshot with thread_count
+// threads. Thread t takes every thread_count-th partition starting at t, which
+// in the loop engines are the partitions of loop t, so every loop loads its
+// own partitions in parallel, one partition between two rounds of requests.
+void load_snapshot(int thread_count) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; ++t) {
+        threads.emplace_back([t, thread_count] {
+            for (int partition_id = t; partition_id < PARTITION_COUNT; partition_id += thread_count) {
+                run_on_partition(partition_id, false, load_snapshot_partition);
             }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
 
-            // Read Total Size (N)
-            uint32_t total_size_net;
-            std::memcpy(&total_size_net, &client_buffer.buffer[0], sizeof(uint32_t));
-            uint32_t total_size = ntoh_uint32(total_size_net);
+// Starts the background work of --aof and --snapshot
+void start_persistence_threads(int loader_count) {
+    if (append_log) {
+        std::thread(run_log_rewrite_thread).detach();
+    }
+    if (!config.snapshot_path.empty()) {
+        if (unloaded_partitions > 0) {
+            std::thread(load_snapshot, loader_count).detach();
+        }
+        std::thread(run_snapshot_thread).detach();
+    }
+}
 
-            if (client_buffer.buffer.size() < total_size) {
-                // Wait for more data
-                break;
+// A connection to another server, for migration and replication. Requests
+// are pipelined and their responses only counted.
+struct PeerConnection {
+    int sock = -1;
+    size_t in_flight = 0; // Requests sent without a response yet
+    std::string incoming;
+};
+
+int connect_to_member(const std::string& member) {
+    size_t colon = member.rfind(':');
+    if (colon == std::string::npos) {
+        return -1;
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(std::stoi(member.substr(colon + 1)));
+    if (inet_pton(AF_INET, member.substr(0, colon).c_str(), &address.sin_addr) != 1) {
+        return -1;
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock != -1 && connect(sock, (sockaddr*)&address, sizeof(address)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+void close_peer(PeerConnection& peer) {
+    if (peer.sock != -1) {
+        close(peer.sock);
+    }
+    peer = PeerConnection();
+}
+
+// Reads responses until at most remaining requests are unanswered, calling
+// answered for each response in order. Without wait, only reads what has
+// already arrived. Returns false if the connection failed or a request was
+// refused.
+bool receive_peer_responses(PeerConnection& peer, size_t remaining, bool wait,
+                            const std::function<void()>& answered = nullptr) {
+    char buffer[MAX_BUFFER_SIZE];
+    while (peer.in_flight > remaining) {
+        ssize_t bytes_received = recv(peer.sock, buffer, sizeof(buffer), wait ? 0 : MSG_DONTWAIT);
+        if (bytes_received <= 0) {
+            if (bytes_received == -1 && errno == EINTR) continue;
+            return bytes_received == -1 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        count(BYTES_IN, bytes_received);
+        peer.incoming.append(buffer, bytes_received);
+
+        size_t offset = 0;
+        while (peer.incoming.size() - offset > sizeof(uint32_t)) {
+            uint32_t total_size_net;
+            std::memcpy(&total_size_net, &peer.incoming[offset], sizeof(uint32_t));
+            uint32_t total_size = ntohl(total_size_net);
+            if (total_size <= sizeof(uint32_t) || peer.in_flight == 0) {
+                return false;
+            }
+            if (peer.incoming.size() - offset < total_size) break;
+            if (peer.incoming[offset + sizeof(uint32_t)] != '0') {
+                return false;
+            }
+            offset += total_size;
+            peer.in_flight--;
+            if (answered) {
+                answered();
             }
+        }
+        peer.incoming.erase(0, offset);
+    }
+    return true;
+}
+
+// Fills in the total size of a batch and sends it, first waiting until fewer
+// than MAX_PEER_BATCHES_IN_FLIGHT batches are unanswered
+bool send_peer_batch(PeerConnection& peer, std::string& batch, const std::function<void()>& answered = nullptr) {
+    uint32_t total_size_net = htonl(batch.size());
+    std::memcpy(&batch[0], &total_size_net, sizeof(uint32_t));
+    if (!receive_peer_responses(peer, MAX_PEER_BATCHES_IN_FLIGHT - 1, true, answered) || !send_all(peer.sock, batch)) {
+        return false;
+    }
+    peer.in_flight++;
+    return true;
+}
 
-            // Extract the complete message
-            std::vector<uint8_t> message(client_buffer.buffer.begin(), client_buffer.buffer.begin() + total_size);
+// Batches of entries for another server, encoded as they are added. Batch:
+// Total Size | Operation Type | Entry Count | header_size more bytes, filled
+// in by the sender, then the entries, all in network byte order.
+struct PeerBatches {
+    std::vector<std::string> batches;
+    uint32_t entry_count = 0; // In batches.back(), if it isn't full yet
+    size_t bytes = 0;
 
-            // Remove the message from the buffer
-            client_buffer.buffer.erase(client_buffer.buffer.begin(), client_buffer.buffer.begin() + total_size);
+    // Returns the batch to append the next entry to
+    std::string& next_entry(uint8_t operation_type, size_t header_size = 0) {
+        if (batches.empty() || entry_count == MAX_PEER_BATCH_ENTRIES || batches.back().size() >= MAX_PEER_BATCH_BYTES) {
+            batches.emplace_back(sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t) + header_size, '\0');
+            batches.back()[sizeof(uint32_t)] = operation_type;
+            entry_count = 0;
+        }
+        entry_count++;
+        uint32_t entry_count_net = htonl(entry_count);
+        std::memcpy(&batches.back()[sizeof(uint32_t) + sizeof(uint8_t)], &entry_count_net, sizeof(uint32_t));
+        return batches.back();
+    }
 
-            // Process the message
-            size_t offset = 0;
+    void clear() {
+        batches.clear();
+        entry_count = 0;
+        bytes = 0;
+    }
+};
 
-            // Total Size (already read)
-            offset += sizeof(uint32_t);
+void append_uint64_net(std::string& output, uint64_t value) {
+    uint64_t value_net = hton_uint64(value);
+    output += bytes_of(value_net);
+}
 
-            // Operation Type
-            uint8_t operation_type = message[offset];
-            offset += sizeof(uint8_t);
+// Key Hash | Key Length | Key, and for a stored key Value Length | Value | Expires At (8 bytes)
+void append_peer_entry(std::string& batch, uint64_t key_hash, std::string_view key, const std::string_view* value,
+                       uint64_t expires_at) {
+    append_uint64_net(batch, key_hash);
+    append_uint32_net(batch, key.size());
+    batch += key;
+    if (value) {
+        append_uint32_net(batch, value->size());
+        batch += *value;
+        append_uint64_net(batch, expires_at);
+    }
+}
 
-            // Key Hash (not used here, but we can validate if needed)
-            uint64_t key_hash_net;
-            std::memcpy(&key_hash_net, &message[offset], sizeof(uint64_t));
-            uint64_t key_hash = ntoh_uint64(key_hash_net);
-            offset += sizeof(uint64_t);
+// Streams the keys that members gives to other servers to their new owners
+// as OP_MIGRATE batches, one partition at a time: its leaving entries are
+// copied under the lock, sent after letting go, and erased here once their
+// new owner has them. A new owner keeps whatever clients wrote there since
+// the handoff began, so the copies never overwrite newer data. Requests keep
+// being served throughout.
+void run_migration(std::string self, std::vector<std::string> members) {
+    auto start = std::chrono::steady_clock::now();
+    HashRing ring(members);
+    std::vector<PeerConnection> peers(members.size());
+    std::vector<PeerBatches> outgoing(members.size());
+    uint64_t migrated_keys = 0;
+    uint64_t migrated_bytes = 0;
+    bool failed = false;
 
-            // Key Length
-            uint32_t key_length_net;
-            std::memcpy(&key_length_net, &message[offset], sizeof(uint32_t));
-            uint32_t key_length = ntoh_uint32(key_length_net);
-            offset += sizeof(uint32_t);
+    for (int partition_id = 0; partition_id < PARTITION_COUNT && !failed; ++partition_id) {
+        uint64_t now = now_ms();
+        std::vector<std::pair<uint64_t, std::string>> leaving;
+        size_t leaving_bytes = 0;
+        run_on_partition(partition_id, true, [&](Partition& partition) {
+            for_each_entry(partition, [&](uint64_t key_hash, std::string_view key, std::string_view value, uint64_t expires_at) {
+                if (expires_at != 0 && expires_at <= now) return;
+                size_t owner = ring.owner(key_hash);
+                if (members[owner] == self) return;
+                append_peer_entry(outgoing[owner].next_entry(OP_MIGRATE), key_hash, key, &value, expires_at);
+                leaving.emplace_back(key_hash, key);
+                leaving_bytes += key.size() + value.size();
+            });
+        });
+        if (leaving.empty()) continue;
 
-            if (offset + key_length > message.size()) {
-                // Invalid message, key length exceeds message size
-                send(client_sock, "1ERROR: Invalid message", 23, 0);
-                continue;
+        for (size_t member = 0; member < members.size() && !failed; ++member) {
+            PeerConnection& peer = peers[member];
+            if (outgoing[member].batches.empty()) continue;
+            if (peer.sock == -1 && (peer.sock = connect_to_member(members[member])) == -1) {
+                std::cerr << "Failed to connect to " << members[member] << " for the handoff\n";
+                failed = true;
+                break;
+            }
+            for (std::string& batch : outgoing[member].batches) {
+                failed = failed || !send_peer_batch(peer, batch);
             }
+            failed = failed || !receive_peer_responses(peer, 0, true);
+            if (failed) {
+                std::cerr << "Failed to migrate keys to " << members[member] << "\n";
+            }
+            outgoing[member].clear();
+        }
+        if (failed) break;
 
-            // Key
-            const char* key_ptr = reinterpret_cast<const char*>(&message[offset]);
-            std::string key(key_ptr, key_ptr + key_length); // Fixed ambiguity
-            offset += key_length;
+        run_on_partition(partition_id, false, [&](Partition& partition) {
+            load_snapshot_partition(partition);
+            for (const auto& [key_hash, key] : leaving) {
+                if (erase_key(partition, key_hash, key, now)) {
+                    record_del(key_hash, key);
+                }
+            }
+        });
+        migrated_keys += leaving.size();
+        migrated_bytes += leaving_bytes;
+        count(MIGRATED_KEYS, leaving.size());
+        count(MIGRATED_BYTES, leaving_bytes);
+    }
 
-            size_t hash = key_hash; // Use the key hash from the message
-            int partition_id = hash % PARTITION_COUNT;
+    for (PeerConnection& peer : peers) {
+        close_peer(peer);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << (failed ? "Stopped the handoff after migrating " : "Migrated ") << migrated_keys << " keys, "
+              << migrated_bytes << " bytes of keys and values, in " << elapsed.count() << " ms\n";
+    migrating = false;
+}
 
-            if (operation_type == 1) { // GET
-                std::string result;
-                {
-                    std::scoped_lock lock(partitions[partition_id].mtx);
-                    auto it = partitions[partition_id].data.find(key);
-                    if (it != partitions[partition_id].data.end()) {
-                        result = "0" + it->second; // Prepend '0' for success
-                    } else {
-                        result = "1NOT_FOUND"; // Prepend '1' for error
-                    }
-                }
-                send(client_sock, result.c_str(), result.size(), 0);
-            } else if (operation_type == 2) { // PUT
-                // Value Length
-                if (offset + sizeof(uint32_t) > message.size()) {
-                    send(client_sock, "1ERROR: Invalid message", 23, 0);
-                    continue;
-                }
-                uint32_t value_length_net;
-                std::memcpy(&value_length_net, &message[offset], sizeof(uint32_t));
-                uint32_t value_length = ntoh_uint32(value_length_net);
-                offset += sizeof(uint32_t);
-
-                if (offset + value_length > message.size()) {
-                    send(client_sock, "1ERROR: Invalid message", 23, 0);
-                    continue;
-                }
+// Streams the changes to one replica given with --replicas. On connecting it
+// sends a full copy, partition by partition like a log rewrite, each preceded
+// by an entry that clears the replica's partition; the changes made
+// meanwhile are captured from the start of the copy and follow it, and
+// applying them again is harmless. After that, a sender thread takes every
+// change captured since its last batch at once, like the append-only log's
+// writer, and sends them as pipelined OP_REPLICATE batches. A batch carries
+// the primary's clock when it was taken, so the replica knows how current it
+// is, and an empty one goes out every REPLICATION_HEARTBEAT_MS when idle.
+struct Replica {
+    std::string address;
 
-                // Value
-                const char* value_ptr = reinterpret_cast<const char*>(&message[offset]);
-                std::string value(value_ptr, value_ptr + value_length); // Fixed ambiguity
-                offset += value_length;
+    std::mutex mtx;
+    std::condition_variable work_cv;
+    bool capturing = false; // Only while connected, or changes would pile up
+    bool overflowed = false;
+    PeerBatches pending;
 
-                {
-                    std::scoped_lock lock(partitions[partition_id].mtx);
-                    partitions[partition_id].data[key] = value;
-                }
-                send(client_sock, "0OK", 3, 0); // Prepend '0' for success
-            } else if (operation_type == 3) { // DEL
-                bool erased = false;
-                {
-                    std::scoped_lock lock(partitions[partition_id].mtx);
-                    erased = partitions[partition_id].data.erase(key) > 0;
-                }
+    std::atomic<bool> connected{false};
+    std::atomic<uint64_t> acked_through_ms{0}; // When the last batch the replica applied was taken
+    std::atomic<uint64_t> sent_entries{0};
+    std::atomic<uint64_t> full_copies{0};
+};
 
-                std::string response = erased ? "0DELETED" : "1NOT_FOUND"; // Prepend '0' or '1'
-                send(client_sock, response.c_str(), response.size(), 0);
-            } else {
-                send(client_sock, "1ERROR: Unknown command", 23, 0);
-            }
+std::vector<std::unique_ptr<Replica>> replicas;
+
+// OP_REPLICATE batches have the time they were taken after the entry count
+const size_t REPLICATE_HEADER_SIZE = sizeof(uint64_t);
+
+void capture_change(uint8_t type, uint64_t key_hash, std::string_view key, const std::string_view* value,
+                    uint64_t expires_at) {
+    for (auto& replica : replicas) {
+        std::scoped_lock lock(replica->mtx);
+        if (!replica->capturing) continue;
+        bool was_empty = replica->pending.batches.empty();
+        std::string& batch = replica->pending.next_entry(OP_REPLICATE, REPLICATE_HEADER_SIZE);
+        size_t batch_bytes = batch.size();
+        batch += static_cast<char>(type);
+        append_peer_entry(batch, key_hash, key, value, expires_at);
+        replica->pending.bytes += batch.size() - batch_bytes;
+        if (replica->pending.bytes > REPLICATION_BUFFER_LIMIT) {
+            // The replica can't keep up; start over with a full copy
+            replica->capturing = false;
+            replica->overflowed = true;
+            replica->pending.clear();
+        }
+        if (was_empty) {
+            replica->work_cv.notify_one();
         }
     }
-    close(client_sock);
 }
 
-int main() {
-    int server_sock;
-    int port = 12345;
+// Sends the batches, each stamped with taken_at, recording the stamp of every
+// batch the replica acknowledges
+bool send_replica_batches(Replica& replica, PeerConnection& peer, std::vector<std::string>& batches,
+                          std::deque<uint64_t>& unacked, uint64_t taken_at) {
+    auto answered = [&] {
+        replica.acked_through_ms = unacked.front();
+        unacked.pop_front();
+    };
+    for (std::string& batch : batches) {
+        uint64_t taken_at_net = hton_uint64(taken_at);
+        std::memcpy(&batch[sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t)], &taken_at_net, sizeof(uint64_t));
+        if (!send_peer_batch(peer, batch, answered)) {
+            return false;
+        }
+        unacked.push_back(taken_at);
+    }
+    return receive_peer_responses(peer, 0, false, answered);
+}
+
+// Sends a copy of every partition, see Replica
+bool send_full_copy(Replica& replica, PeerConnection& peer, std::deque<uint64_t>& unacked) {
+    {
+        std::scoped_lock lock(replica.mtx);
+        replica.pending.clear();
+        replica.capturing = true;
+        replica.overflowed = false;
+    }
+    PeerBatches copy;
+    for (int partition_id = 0; partition_id < PARTITION_COUNT; ++partition_id) {
+        uint64_t now = now_ms();
+        std::string& clear = copy.next_entry(OP_REPLICATE, REPLICATE_HEADER_SIZE);
+        clear += static_cast<char>(OP_CLEAR_PARTITION);
+        append_peer_entry(clear, partition_id, "", nullptr, 0);
+        run_on_partition(partition_id, true, [&](Partition& partition) {
+            for_each_entry(partition, [&](uint64_t key_hash, std::string_view key, std::string_view value, uint64_t expires_at) {
+                if (expires_at != 0 && expires_at <= now) return;
+                std::string& batch = copy.next_entry(OP_REPLICATE, REPLICATE_HEADER_SIZE);
+                batch += static_cast<char>(OP_PUT);
+                append_peer_entry(batch, key_hash, key, &value, expires_at);
+            });
+        });
+        // Stamped 0, as the replica isn't current until the whole copy and
+        // the changes captured meanwhile have arrived
+        if (!send_replica_batches(replica, peer, copy.batches, unacked, 0)) {
+            return false;
+        }
+        copy.clear();
+    }
+    return true;
+}
+
+void run_replica_sender(Replica& replica) {
+    PeerConnection peer;
+    std::deque<uint64_t> unacked; // When the unanswered batches were taken, oldest first
     while (true) {
-        server_sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_sock == -1) {
-            std::cerr << "Failed to create socket.\n";
-            return 1;
+        if (peer.sock == -1) {
+            peer.sock = connect_to_member(replica.address);
+            if (peer.sock == -1) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(REPLICA_RECONNECT_INTERVAL_MS));
+                continue;
+            }
+            auto start = std::chrono::steady_clock::now();
+            unacked.clear();
+            if (!send_full_copy(replica, peer, unacked)) {
+                std::cerr << "Lost replica " << replica.address << " during its full copy\n";
+                close_peer(peer);
+                continue;
+            }
+            replica.connected = true;
+            replica.full_copies++;
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            std::cout << "Copied every partition to replica " << replica.address << " in " << elapsed.count() << " ms\n";
         }
 
-        sockaddr_in server_addr{};
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(port);
-        server_addr.sin_addr.s_addr = INADDR_ANY;
+        std::unique_lock lock(replica.mtx);
+        replica.work_cv.wait_for(lock, std::chrono::milliseconds(REPLICATION_HEARTBEAT_MS),
+                                 [&] { return !replica.pending.batches.empty() || replica.overflowed; });
+        bool overflowed = replica.overflowed;
+        std::vector<std::string> batches;
+        batches.swap(replica.pending.batches);
+        replica.pending.clear();
+        // Every change made before now is in these batches
+        uint64_t taken_at = now_ms();
+        lock.unlock();
 
-        if (bind(server_sock, (sockaddr*)&server_addr, sizeof(server_addr)) == 0) {
-            break;
+        if (batches.empty()) {
+            PeerBatches heartbeat;
+            heartbeat.batches.emplace_back(sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t) + REPLICATE_HEADER_SIZE, '\0');
+            heartbeat.batches.back()[sizeof(uint32_t)] = OP_REPLICATE;
+            batches.swap(heartbeat.batches);
+        }
+        size_t entry_count = 0;
+        for (const std::string& batch : batches) {
+            uint32_t count_net;
+            std::memcpy(&count_net, &batch[sizeof(uint32_t) + sizeof(uint8_t)], sizeof(uint32_t));
+            entry_count += ntohl(count_net);
+        }
+        if (overflowed || !send_replica_batches(replica, peer, batches, unacked, taken_at)) {
+            std::cerr << (overflowed ? "Replica " + replica.address + " fell too far behind, copying again\n"
+                                     : "Lost replica " + replica.address + "\n");
+            replica.connected = false;
+            {
+                std::scoped_lock capture_lock(replica.mtx);
+                replica.capturing = false;
+                replica.pending.clear();
+            }
+            close_peer(peer);
+            continue;
+        }
+        replica.sent_entries += entry_count;
+    }
+}
+
+std::string replica_stats() {
+    uint64_t now = now_ms();
+    std::string stats;
+    for (auto& replica : replicas) {
+        uint64_t acked_through = replica->acked_through_ms.load();
+        size_t pending_bytes;
+        {
+            std::scoped_lock lock(replica->mtx);
+            pending_bytes = replica->pending.bytes;
+        }
+        stats += "replica=" + replica->address + " connected=" + std::to_string(replica->connected.load()) +
+                 " lag_ms=" + (acked_through == 0 ? std::string("none") : std::to_string(now > acked_through ? now - acked_through : 0)) +
+                 " pending_bytes=" + std::to_string(pending_bytes) + " sent=" + std::to_string(replica->sent_entries.load()) +
+                 " full_copies=" + std::to_string(replica->full_copies.load()) + "\n";
+    }
+    return stats;
+}
+
+void start_replication() {
+    for (auto& replica : replicas) {
+        std::thread(run_replica_sender, std::ref(*replica)).detach();
+    }
+}
+
+// Replays the log given with --aof, then opens it for appending. With a
+// mapped snapshot taken from this log, only the records logged after the
+// snapshot's position are replayed, on top of it. A snapshot of another log,
+// which a rewrite replaced since, is dropped and the whole log replayed, as
+// the log alone has every change. A log without records is started from the
+// snapshot instead, which keeps its keys once the snapshot is dropped.
+bool open_append_log() {
+    uint64_t log_id;
+    uint64_t log_size;
+    if (!AppendLog::read_header(config.aof_path, log_id, log_size)) {
+        std::cerr << "Failed to read " << config.aof_path << "\n";
+        return false;
+    }
+    uint64_t start_offset = 0;
+    bool seed_from_snapshot = false;
+    if (snapshot_image.mapped()) {
+        uint64_t snapshot_log_id;
+        uint64_t snapshot_log_offset;
+        snapshot_image.log_position(snapshot_log_id, snapshot_log_offset);
+        if (log_size <= AppendLog::header_size(log_id)) {
+            seed_from_snapshot = true;
+        } else if (snapshot_log_id != 0 && snapshot_log_id == log_id && snapshot_log_offset <= log_size) {
+            start_offset = snapshot_log_offset;
         } else {
-            close(server_sock);
-            port++;  // Try next port
+            std::cout << config.snapshot_path << " wasn't taken from " << config.aof_path
+                      << " as it is now, replaying the whole log instead\n";
+            drop_snapshot();
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t now = now_ms();
+    size_t record_count = 0;
+    size_t bad_records = 0;
+    bool replayed = AppendLog::replay(config.aof_path, [&](std::string_view record) {
+        record_count++;
+        bad_records += !apply_log_record(record, now);
+    }, start_offset);
+    if (!replayed) {
+        std::cerr << "Failed to read " << config.aof_path << "\n";
+        return false;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << "Replayed " << record_count << " records from " << config.aof_path;
+    if (start_offset != 0) {
+        std::cout << " after the snapshot's position, byte " << start_offset << " of " << log_size << ",";
+    }
+    std::cout << " in " << elapsed.count() << " ms";
+    if (bad_records > 0) {
+        std::cout << ", skipped " << bad_records << " malformed";
+    }
+    std::cout << "\n";
+
+    append_log = std::make_unique<AppendLog>();
+    if (!append_log->open(config.aof_path, config.fsync_policy, config.fsync_interval_ms, config.aof_rewrite_min)) {
+        std::cerr << "Failed to open " << config.aof_path << "\n";
+        return false;
+    }
+    if (seed_from_snapshot && !rewrite_log()) {
+        std::cerr << "Failed to write the keys of " << config.snapshot_path << " to " << config.aof_path << "\n";
+        return false;
+    }
+    return true;
+}
+
+int run_thread_engine() {
+    int server_sock;
+    int port = config.port;
+    while (true) {
+        server_sock = open_listener(port, false);
+        if (server_sock != -1) {
+            break;
         }
+        port++;  // Try next port
     }
 
     std::cout << "Server listening on port " << port << "\n";
@@ -189,17 +3990,248 @@ int main() {
         return 1;
     }
 
-    while (true) {
-        sockaddr_in client_addr{};
-        socklen_t client_size = sizeof(client_addr);
-        int client_sock = accept(server_sock, (sockaddr*)&client_addr, &client_size);
-        if (client_sock == -1) {
-            std::cerr << "Failed to accept client.\n";
-            continue;
-        }
-        std::thread(handle_client, client_sock).detach();
+    int unix_sock = open_unix_listener_if_enabled(port);
+
+    std::thread(run_maintenance_thread).detach();
+    start_persistence_threads(std::max(1u, std::thread::hardware_concurrency()));
+    start_replication();
+
+    if (unix_sock != -1) {
+        std::thread(accept_clients, unix_sock).detach();
     }
+    accept_clients(server_sock);
 
     close(server_sock);
     return 0;
 }
+
+// Runs the epoll or io_uring engine: one loop per core, each owning a share of
+// the partitions.
+int run_loop_engine() {
+    lock_partitions = false;
+
+    // Every loop gets its own SO_REUSEPORT listener on the same port and the
+    // kernel spreads incoming connections between them. A plain bind probes
+    // first, so two servers on one host don't end up sharing a port.
+    std::vector<int> listeners;
+    int port = config.port;
+    while (listeners.empty()) {
+        int probe = open_listener(port, false);
+        if (probe == -1) {
+            port++;
+            continue;
+        }
+        close(probe);
+
+        for (int i = 0; i < config.loop_count; ++i) {
+            int sock = open_listener(port, true);
+            if (sock == -1 || listen(sock, SOMAXCONN) == -1) {
+                if (sock != -1) close(sock);
+                for (int opened : listeners) close(opened);
+                listeners.clear();
+                port++;
+                break;
+            }
+            if (config.engine == Engine::EPOLL) {
+                fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+            }
+            listeners.push_back(sock);
+        }
+    }
+
+    for (int i = 0; i < config.loop_count * config.loop_count; ++i) {
+        cross_core_queues.push_back(std::make_unique<SpscQueue<CrossCoreMessage*>>(CROSS_CORE_QUEUE_CAPACITY));
+    }
+    const char* engine_name = config.engine == Engine::URING ? "io_uring" : "epoll";
+    std::cout << "Server listening on port " << port << " with " << config.loop_count << " " << engine_name << " loops\n";
+
+    // There is only one Unix domain socket, which every loop accepts from
+    int unix_sock = open_unix_listener_if_enabled(port);
+    if (unix_sock != -1 && config.engine == Engine::EPOLL) {
+        fcntl(unix_sock, F_SETFL, fcntl(unix_sock, F_GETFL) | O_NONBLOCK);
+    }
+    for (int i = 0; i < config.loop_count; ++i) {
+        if (config.engine == Engine::URING) {
+            loops.push_back(std::make_unique<UringLoop>(i, listeners[i], unix_sock));
+        } else {
+            loops.push_back(std::make_unique<EpollLoop>(i, listeners[i], unix_sock));
+        }
+    }
+
+    // With --fsync=always, loops hold responses until their log records are
+    // on disk, and the writer wakes them to send them
+    if (append_log && append_log->syncs_every_record()) {
+        append_log->set_durable_listener([] {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            for (auto& loop : loops) {
+                loop->wake_for_log();
+            }
+        });
+    }
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < config.loop_count; ++i) {
+        threads.emplace_back([i] { loops[i]->run(); });
+    }
+    start_persistence_threads(config.loop_count);
+    start_replication();
+    loops[0]->run();
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return 1;
+}
+
+void print_usage() {
+    std::cerr << "Usage: server [--engine=threads|epoll|io_uring] [--loops=N] [--port=N] [--locks=mutex|shared]\n"
+              << "              [--maxmemory=BYTES[K|M|G]] [--aof=FILE] [--fsync=always|never|MS]\n"
+              << "              [--aof-rewrite-min=BYTES[K|M|G]] [--snapshot=FILE] [--snapshot-interval=SECONDS]\n"
+              << "              [--replicas=HOST:PORT[,HOST:PORT...]] [--metrics] [--ordered-index]\n"
+              << "              [--verify-hashes] [--hot-keys] [--unix]\n"
+              << "  --engine  threads:  one thread per client (default)\n"
+              << "            epoll:    one pinned event loop per core, shared-nothing partitions\n"
+              << "            io_uring: like epoll, with io_uring for socket I/O (falls back to epoll)\n"
+              << "  --loops   number of event loops (default: number of cores)\n"
+              << "  --port    first port to try (default: " << DEFAULT_PORT << ")\n"
+              << "  --locks   mutex:  one mutex per partition (default)\n"
+              << "            shared: reader-writer lock per partition, GETs share it (threads engine)\n"
+              << "  --maxmemory  evict entries (CLOCK) once used memory passes this (default: no limit)\n"
+              << "  --aof     append-only log to replay at startup and append changes to (default: none)\n"
+              << "  --fsync   always: acknowledge changes once on disk\n"
+              << "            never:  leave flushing to the kernel\n"
+              << "            MS:     fsync every MS milliseconds (default: 1000)\n"
+              << "  --aof-rewrite-min  log size before the first background rewrite (default: 64M)\n"
+              << "  --snapshot  snapshot to load at startup and write periodically (default: none);\n"
+              << "              with --aof, only the log written after the snapshot is replayed\n"
+              << "  --snapshot-interval  seconds between snapshots (default: 300)\n"
+              << "  --replicas  servers to stream every change to, for reads (default: none)\n"
+              << "  --metrics   time every request and partition lock wait, for STATS operations,\n"
+              << "              partitions and metrics (default: off)\n"
+              << "  --ordered-index  keep every partition's keys sorted too, for SCAN (default: off)\n"
+              << "  --verify-hashes  reject messages carrying a key with the wrong key hash\n"
+              << "                   (default: off)\n"
+              << "  --hot-keys  track the most requested keys, for STATS hotkeys, and answer GETs for\n"
+              << "              them from copies outside their partitions (default: off)\n"
+              << "  --unix    listen on /tmp/finch-PORT.sock too, for clients on this host, who also\n"
+              << "            get shared memory rings over it with the threads engine (default: off)\n";
+}
+
+// Parses a byte count with an optional K, M or G suffix
+bool parse_size(const std::string& text, uint64_t& size) {
+    size_t digits;
+    size = std::stoull(text, &digits);
+    std::string suffix = text.substr(digits);
+    if (suffix == "K" || suffix == "k") {
+        size <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        size <<= 20;
+    } else if (suffix == "G" || suffix == "g") {
+        size <<= 30;
+    } else if (!suffix.empty()) {
+        return false;
+    }
+    return true;
+}
+
+bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg == "--engine=threads") {
+                config.engine = Engine::THREADS;
+            } else if (arg == "--engine=epoll") {
+                config.engine = Engine::EPOLL;
+            } else if (arg == "--engine=io_uring") {
+                config.engine = Engine::URING;
+            } else if (arg.rfind("--loops=", 0) == 0) {
+                config.loop_count = std::stoi(arg.substr(8));
+                if (config.loop_count < 1) return false;
+            } else if (arg.rfind("--port=", 0) == 0) {
+                config.port = std::stoi(arg.substr(7));
+            } else if (arg.rfind("--maxmemory=", 0) == 0) {
+                if (!parse_size(arg.substr(12), config.max_memory)) return false;
+            } else if (arg.rfind("--aof=", 0) == 0) {
+                config.aof_path = arg.substr(6);
+                if (config.aof_path.empty()) return false;
+            } else if (arg == "--fsync=always") {
+                config.fsync_policy = AppendLog::FsyncPolicy::ALWAYS;
+            } else if (arg == "--fsync=never") {
+                config.fsync_policy = AppendLog::FsyncPolicy::NEVER;
+            } else if (arg.rfind("--fsync=", 0) == 0) {
+                config.fsync_policy = AppendLog::FsyncPolicy::PERIODIC;
+                config.fsync_interval_ms = std::stoi(arg.substr(8));
+                if (config.fsync_interval_ms < 1) return false;
+            } else if (arg.rfind("--aof-rewrite-min=", 0) == 0) {
+                if (!parse_size(arg.substr(18), config.aof_rewrite_min)) return false;
+            } else if (arg.rfind("--snapshot=", 0) == 0) {
+                config.snapshot_path = arg.substr(11);
+                if (config.snapshot_path.empty()) return false;
+            } else if (arg.rfind("--snapshot-interval=", 0) == 0) {
+                config.snapshot_interval_seconds = std::stoi(arg.substr(20));
+                if (config.snapshot_interval_seconds < 1) return false;
+            } else if (arg.rfind("--replicas=", 0) == 0) {
+                std::istringstream addresses(arg.substr(11));
+                for (std::string address; std::getline(addresses, address, ',');) {
+                    if (address.find(':') == std::string::npos) return false;
+                    config.replica_addresses.push_back(address);
+                }
+                if (config.replica_addresses.empty()) return false;
+            } else if (arg == "--locks=mutex") {
+                config.shared_locks = false;
+            } else if (arg == "--locks=shared") {
+                config.shared_locks = true;
+            } else if (arg == "--metrics") {
+                config.metrics = true;
+            } else if (arg == "--ordered-index") {
+                config.ordered_index = true;
+            } else if (arg == "--verify-hashes") {
+                config.verify_hashes = true;
+            } else if (arg == "--hot-keys") {
+                config.hot_keys = true;
+            } else if (arg == "--unix") {
+                config.unix_socket = true;
+            } else {
+                return false;
+            }
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifndef FINCH_SERVER_NO_MAIN
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        print_usage();
+        return 1;
+    }
+
+    if (!config.snapshot_path.empty() && !map_snapshot()) {
+        return 1;
+    }
+    if (!config.aof_path.empty() && !open_append_log()) {
+        return 1;
+    }
+    if (config.hot_keys) {
+        hot_keys = std::make_unique<HotKeyTracker>();
+        hot_copies = std::make_unique<HotCopies>();
+    }
+    for (const std::string& address : config.replica_addresses) {
+        replicas.push_back(std::make_unique<Replica>());
+        replicas.back()->address = address;
+    }
+
+    if (config.engine == Engine::URING && !UringLoop::supported()) {
+        std::cerr << "io_uring with multishot recv is not available, falling back to epoll.\n";
+        config.engine = Engine::EPOLL;
+    }
+    if (config.engine != Engine::THREADS) {
+        return run_loop_engine();
+    }
+    return run_thread_engine();
+}
+
+#endif // FINCH_SERVER_NO_MAIN
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <memory>
+#include <new>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+// The Unix domain socket of a server started with --unix, found by the port
+// it listens on, so that clients reach a server on their own host without
+// going through the TCP loopback stack
+inline std::string unix_socket_path(int port) {
+    return "/tmp/finch-" + std::to_string(port) + ".sock";
+}
+
+// Whether the other end of a connected socket is still there, without
+// blocking or consuming anything. Pending bytes count as still there.
+inline bool peer_connected(int sock) {
+    char byte;
+    ssize_t peeked = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return peeked > 0 || (peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+}
+
+// A shared memory segment holding two single-producer single-consumer byte
+// rings, requests from a client and responses from a server, which carry
+// the same byte stream a socket would. Messages are written and read with
+// memcpy instead of send and recv.
+//
+// A side that finds nothing to do spins for SPIN_NS, yielding now and then
+// so that a peer on the same core gets to run, and then sleeps on a futex in
+// the segment. Either side wakes the other after moving a ring's head or
+// tail, but only when the other has said it is asleep, so a busy pair makes
+// no system calls at all. Sleeps time out every WAIT_TIMEOUT_MS so that a
+// side notices when the socket the segment was set up over has closed.
+//
+// The client creates the segment under a fresh name, sends the name in an
+// OP_SHM_ATTACH request over a Unix domain socket, and removes the name once
+// the server has answered; the mappings stay.
+class ShmSegment {
+public:
+    static constexpr size_t RING_BYTES = 256 << 10; // Per direction, a power of two
+    static constexpr int64_t SPIN_NS = 50000;
+    static constexpr int WAIT_TIMEOUT_MS = 100;
+
+    // One direction: the writer owns tail, the reader head, and both only
+    // ever grow, so their difference is the bytes waiting
+    struct Ring {
+        alignas(64) std::atomic<uint64_t> head{0};
+        alignas(64) std::atomic<uint64_t> tail{0};
+    };
+
+    // A side's wakeup word: waiting says it is about to sleep on wakeups
+    struct Sleeper {
+        alignas(64) std::atomic<uint32_t> waiting{0};
+        std::atomic<uint32_t> wakeups{0};
+    };
+
+    // One side's view of the segment
+    class Channel {
+    public:
+        Channel(ShmSegment& segment, bool client)
+            : outgoing(client ? segment.header->requests : segment.header->responses),
+              incoming(client ? segment.header->responses : segment.header->requests),
+              outgoing_data(segment.ring_data(client ? 0 : 1)),
+              incoming_data(segment.ring_data(client ? 1 : 0)),
+              self(client ? segment.header->client : segment.header->server),
+              peer(client ? segment.header->server : segment.header->client) {}
+
+        size_t readable() const {
+            return incoming.tail.load(std::memory_order_acquire) - incoming.head.load(std::memory_order_relaxed);
+        }
+
+        size_t writable() const {
+            return RING_BYTES - (outgoing.tail.load(std::memory_order_relaxed) - outgoing.head.load(std::memory_order_acquire));
+        }
+
+        // Copies as much of data as fits and returns how much that was
+        size_t write_some(const void* data, size_t size) {
+            uint64_t tail = outgoing.tail.load(std::memory_order_relaxed);
+            size = std::min(size, writable());
+            copy_in(outgoing_data, tail, static_cast<const char*>(data), size);
+            outgoing.tail.store(tail + size, std::memory_order_seq_cst);
+            if (size > 0) {
+                wake_peer();
+            }
+            return size;
+        }
+
+        // Copies up to size waiting bytes and returns how many there were
+        size_t read_some(void* data, size_t size) {
+            uint64_t head = incoming.head.load(std::memory_order_relaxed);
+            size = std::min(size, readable());
+            copy_out(incoming_data, head, static_cast<char*>(data), size);
+            incoming.head.store(head + size, std::memory_order_seq_cst);
+            if (size > 0) {
+                wake_peer();
+            }
+            return size;
+        }
+
+        // Waits until ready() holds, and returns false instead once alive()
+        // doesn't. Both are checked again after every wakeup.
+        template <class Ready, class Alive>
+        bool wait(Ready&& ready, Alive&& alive) {
+            auto spin_until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(SPIN_NS);
+            for (uint32_t spins = 1;; ++spins) {
+                if (ready()) {
+                    return true;
+                }
+                if (spins % 16 == 0) {
+                    if (std::chrono::steady_clock::now() > spin_until) {
+                        break;
+                    }
+                    std::this_thread::yield();
+                }
+            }
+            while (true) {
+                uint32_t wakeups = self.wakeups.load(std::memory_order_acquire);
+                self.waiting.store(1, std::memory_order_seq_cst);
+                // Pairs with the store and load in wake_peer: either the peer
+                // sees waiting, or this sees what the peer did before looking
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (ready()) {
+                    self.waiting.store(0, std::memory_order_relaxed);
+                    return true;
+                }
+                timespec timeout{0, WAIT_TIMEOUT_MS * 1000000L};
+                syscall(SYS_futex, &self.wakeups, FUTEX_WAIT, wakeups, &timeout, nullptr, 0);
+                self.waiting.store(0, std::memory_order_relaxed);
+                if (ready()) {
+                    return true;
+                }
+                if (!alive()) {
+                    return false;
+                }
+            }
+        }
+
+    private:
+        Ring& outgoing;
+        Ring& incoming;
+        char* outgoing_data;
+        char* incoming_data;
+        Sleeper& self;
+        Sleeper& peer;
+
+        void wake_peer() {
+            if (peer.waiting.load(std::memory_order_seq_cst) != 0) {
+                peer.waiting.store(0, std::memory_order_relaxed);
+                peer.wakeups.fetch_add(1, std::memory_order_release);
+                syscall(SYS_futex, &peer.wakeups, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+            }
+        }
+
+        static void copy_in(char* ring, uint64_t position, const char* data, size_t size) {
+            size_t offset = position % RING_BYTES;
+            size_t first = std::min(size, RING_BYTES - offset);
+            std::memcpy(ring + offset, data, first);
+            std::memcpy(ring, data + first, size - first);
+        }
+
+        static void copy_out(const char* ring, uint64_t position, char* data, size_t size) {
+            size_t offset = position % RING_BYTES;
+            size_t first = std::min(size, RING_BYTES - offset);
+            std::memcpy(data, ring + offset, first);
+            std::memcpy(data + first, ring, size - first);
+        }
+    };
+
+    // Creates a segment under a name nobody else uses. Returns null on failure.
+    static std::unique_ptr<ShmSegment> create(std::string& name) {
+        static std::atomic<uint64_t> next_id{0};
+        name = "/finch-" + std::to_string(getpid()) + "-" + std::to_string(next_id.fetch_add(1));
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd == -1) {
+            return nullptr;
+        }
+        if (ftruncate(fd, SEGMENT_BYTES) != 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+        std::unique_ptr<ShmSegment> segment = map(fd);
+        close(fd);
+        if (!segment) {
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+        new (segment->header) Header();
+        segment->header->magic = MAGIC;
+        return segment;
+    }
+
+    // Maps a segment the client created, if it is one and belongs to owner_uid
+    static std::unique_ptr<ShmSegment> attach(const std::string& name, uid_t owner_uid) {
+        if (name.size() < 2 || name[0] != '/' || name.find('/', 1) != std::string::npos) {
+            return nullptr;
+        }
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd == -1) {
+            return nullptr;
+        }
+        struct stat info;
+        std::unique_ptr<ShmSegment> segment;
+        if (fstat(fd, &info) == 0 && info.st_uid == owner_uid && static_cast<size_t>(info.st_size) == SEGMENT_BYTES) {
+            segment = map(fd);
+        }
+        close(fd);
+        if (segment && segment->header->magic != MAGIC) {
+            segment.reset();
+        }
+        return segment;
+    }
+
+    ~ShmSegment() {
+        munmap(header, SEGMENT_BYTES);
+    }
+
+private:
+    static constexpr uint64_t MAGIC = 0x46494e4348534d31ULL; // "FINCHSM1"
+
+    struct Header {
+        uint64_t magic = 0;
+        Ring requests;
+        Ring responses;
+        Sleeper client;
+        Sleeper server;
+    };
+
+    static constexpr size_t HEADER_BYTES = (sizeof(Header) + 4095) / 4096 * 4096;
+    static constexpr size_t SEGMENT_BYTES = HEADER_BYTES + 2 * RING_BYTES;
+
+    explicit ShmSegment(void* memory) : header(static_cast<Header*>(memory)) {}
+
+    static std::unique_ptr<ShmSegment> map(int fd) {
+        void* memory = mmap(nullptr, SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (memory == MAP_FAILED) {
+            return nullptr;
+        }
+        return std::unique_ptr<ShmSegment>(new ShmSegment(memory));
+    }
+
+    char* ring_data(int ring) const {
+        return reinterpret_cast<char*>(header) + HEADER_BYTES + ring * RING_BYTES;
+    }
+
+    Header* header;
+};
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Byte counts for capacity planning. Reserved is everything taken from the
+// allocator, used is the part holding data, and the rest is fragmentation:
+// chunk rounding, free chunks and empty table slots.
+struct MemoryStats {
+    uint64_t used = 0;
+    uint64_t reserved = 0;
+
+    uint64_t fragmented() const {
+        return reserved - used;
+    }
+
+    MemoryStats& operator+=(const MemoryStats& other) {
+        used += other.used;
+        reserved += other.reserved;
+        return *this;
+    }
+};
+
+// Per-partition allocator for keys and values. Sizes up to MAX_CHUNK_SIZE are
+// rounded up to a size class and carved out of SLAB_SIZE slabs, one set of
+// slabs per class; larger ones get their own allocation. Freed chunks go on a
+// per-class free list and are reused before a new slab is taken.
+//
+// The owner compacts the arena by releasing the empty slabs, then calling
+// plan_compaction, which marks the sparsest slabs of each class as
+// evacuating, and moving every chunk for which is_evacuating is true into a
+// fresh chunk. An evacuating slab is released as soon as its last chunk is
+// freed.
+//
+// Not thread-safe, the partition lock or owning loop serializes access. The
+// byte counts are atomics so that stats can be read from any thread.
+class SlabArena {
+public:
+    // One page, also the slab alignment. Small slabs keep a sparse partition
+    // from reserving a mostly empty slab for every size class it touches.
+    static constexpr size_t SLAB_SIZE = 4096;
+    static constexpr size_t MAX_CHUNK_SIZE = 1024;
+
+    SlabArena() = default;
+
+    ~SlabArena() {
+        for (auto& slabs : class_slabs) {
+            for (Slab* slab : slabs) {
+                std::free(slab);
+            }
+        }
+    }
+
+    SlabArena(const SlabArena&) = delete;
+    SlabArena& operator=(const SlabArena&) = delete;
+
+    // Returns room for size bytes and sets capacity to the usable size
+    char* allocate(size_t size, uint32_t& capacity) {
+        account_used(size);
+        if (size > MAX_CHUNK_SIZE) {
+            capacity = static_cast<uint32_t>(size);
+            account_reserved(size);
+            return new char[size];
+        }
+
+        size_t size_class = size_class_of(size);
+        capacity = CLASS_SIZES[size_class];
+        if (!free_chunks[size_class]) {
+            add_slab(size_class);
+        }
+        FreeChunk* chunk = free_chunks[size_class];
+        free_chunks[size_class] = chunk->next;
+        slab_of(chunk)->live_chunks++;
+        return reinterpret_cast<char*>(chunk);
+    }
+
+    // size and capacity must be the ones the data was allocated with
+    void free(char* data, size_t size, uint32_t capacity) {
+        account_used(-static_cast<int64_t>(size));
+        if (capacity > MAX_CHUNK_SIZE) {
+            account_reserved(-static_cast<int64_t>(capacity));
+            delete[] data;
+            return;
+        }
+
+        Slab* slab = slab_of(data);
+        slab->live_chunks--;
+        if (slab->evacuating) {
+            // Chunks of an evacuating slab are not reused
+            if (slab->live_chunks == 0) {
+                release_slab(slab);
+            }
+            return;
+        }
+        FreeChunk* chunk = reinterpret_cast<FreeChunk*>(data);
+        chunk->next = free_chunks[slab->size_class];
+        free_chunks[slab->size_class] = chunk;
+    }
+
+    bool is_evacuating(const char* data, uint32_t capacity) const {
+        return capacity <= MAX_CHUNK_SIZE && slab_of(data)->evacuating;
+    }
+
+    // Releases the slabs with no live chunks. Returns true if there were any.
+    bool release_empty_slabs() {
+        bool released = false;
+        for (size_t size_class = 0; size_class < CLASS_COUNT; ++size_class) {
+            std::vector<Slab*> empty;
+            for (Slab* slab : class_slabs[size_class]) {
+                if (slab->live_chunks == 0) {
+                    slab->evacuating = true;
+                    empty.push_back(slab);
+                }
+            }
+            if (empty.empty()) continue;
+            drop_evacuating_free_chunks(size_class);
+            for (Slab* slab : empty) {
+                release_slab(slab);
+            }
+            released = true;
+        }
+        return released;
+    }
+
+    // Marks the slabs that are less than half full as evacuating, sparsest
+    // first, as long as their live chunks fit in the free chunks of the other
+    // slabs of their class, so compaction never takes a new slab. Moving
+    // chunks means a pass over the whole table, so nothing is marked unless
+    // at least 1/COMPACTION_MIN_FRACTION of the slabs would be released.
+    // Returns true if the owner should relocate.
+    bool plan_compaction() {
+        std::vector<Slab*> candidates;
+        size_t slab_count = 0;
+        for (size_t size_class = 0; size_class < CLASS_COUNT; ++size_class) {
+            std::vector<Slab*>& slabs = class_slabs[size_class];
+            slab_count += slabs.size();
+            uint32_t chunk_count = chunks_per_slab(size_class);
+            std::sort(slabs.begin(), slabs.end(), [](const Slab* a, const Slab* b) {
+                return a->live_chunks < b->live_chunks;
+            });
+
+            uint64_t free_elsewhere = 0;
+            for (Slab* slab : slabs) {
+                free_elsewhere += chunk_count - slab->live_chunks;
+            }
+            uint64_t to_move = 0;
+            for (Slab* slab : slabs) {
+                if (slab->live_chunks * 2 >= chunk_count) break;
+                uint64_t slab_free = chunk_count - slab->live_chunks;
+                if (free_elsewhere - slab_free < to_move + slab->live_chunks) break;
+                free_elsewhere -= slab_free;
+                to_move += slab->live_chunks;
+                candidates.push_back(slab);
+            }
+        }
+
+        if (candidates.empty() || candidates.size() * COMPACTION_MIN_FRACTION < slab_count) {
+            return false;
+        }
+        std::array<bool, CLASS_COUNT> affected{};
+        for (Slab* slab : candidates) {
+            slab->evacuating = true;
+            affected[slab->size_class] = true;
+        }
+        for (size_t size_class = 0; size_class < CLASS_COUNT; ++size_class) {
+            if (affected[size_class]) {
+                drop_evacuating_free_chunks(size_class);
+            }
+        }
+        return true;
+    }
+
+    // Lets the owner count memory that isn't in the arena, like its table
+    void account(int64_t used_delta, int64_t reserved_delta) {
+        account_used(used_delta);
+        account_reserved(reserved_delta);
+    }
+
+    MemoryStats stats() const {
+        MemoryStats stats;
+        stats.used = used_bytes.load(std::memory_order_relaxed);
+        stats.reserved = reserved_bytes.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    struct FreeChunk {
+        FreeChunk* next;
+    };
+
+    struct Slab {
+        uint32_t size_class;
+        uint32_t live_chunks;
+        bool evacuating;
+    };
+
+    // Chunks start after the header, at a cache line boundary
+    static constexpr size_t SLAB_HEADER_SIZE = 64;
+    static constexpr size_t COMPACTION_MIN_FRACTION = 8;
+
+    // Four classes per doubling from 32 to MAX_CHUNK_SIZE bytes, so a chunk
+    // wastes at most a fifth of itself to rounding
+    static constexpr size_t CLASS_COUNT = 21;
+    static constexpr std::array<uint32_t, CLASS_COUNT> CLASS_SIZES = {
+        32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+        320, 384, 448, 512, 640, 768, 896, 1024};
+
+    static size_t size_class_of(size_t size) {
+        return std::lower_bound(CLASS_SIZES.begin(), CLASS_SIZES.end(), size) - CLASS_SIZES.begin();
+    }
+
+    static uint32_t chunks_per_slab(size_t size_class) {
+        return (SLAB_SIZE - SLAB_HEADER_SIZE) / CLASS_SIZES[size_class];
+    }
+
+    static Slab* slab_of(const void* chunk) {
+        return reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(chunk) & ~(SLAB_SIZE - 1));
+    }
+
+    void add_slab(size_t size_class) {
+        Slab* slab = static_cast<Slab*>(std::aligned_alloc(SLAB_SIZE, SLAB_SIZE));
+        if (!slab) {
+            throw std::bad_alloc();
+        }
+        slab->size_class = static_cast<uint32_t>(size_class);
+        slab->live_chunks = 0;
+        slab->evacuating = false;
+        class_slabs[size_class].push_back(slab);
+        account_reserved(SLAB_SIZE);
+
+        // Pushed in reverse so that chunks are handed out in address order
+        char* chunks = reinterpret_cast<char*>(slab) + SLAB_HEADER_SIZE;
+        uint32_t chunk_size = CLASS_SIZES[size_class];
+        for (uint32_t i = chunks_per_slab(size_class); i-- > 0;) {
+            FreeChunk* chunk = reinterpret_cast<FreeChunk*>(chunks + static_cast<size_t>(i) * chunk_size);
+            chunk->next = free_chunks[size_class];
+            free_chunks[size_class] = chunk;
+        }
+    }
+
+    void release_slab(Slab* slab) {
+        std::vector<Slab*>& slabs = class_slabs[slab->size_class];
+        slabs.erase(std::find(slabs.begin(), slabs.end(), slab));
+        account_reserved(-static_cast<int64_t>(SLAB_SIZE));
+        std::free(slab);
+    }
+
+    void drop_evacuating_free_chunks(size_t size_class) {
+        FreeChunk** link = &free_chunks[size_class];
+        while (*link) {
+            if (slab_of(*link)->evacuating) {
+                *link = (*link)->next;
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+
+    // Single writer, so a relaxed load and store is enough
+    void account_used(int64_t delta) {
+        used_bytes.store(used_bytes.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    void account_reserved(int64_t delta) {
+        reserved_bytes.store(reserved_bytes.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    std::array<std::vector<Slab*>, CLASS_COUNT> class_slabs;
+    std::array<FreeChunk*, CLASS_COUNT> free_chunks{};
+    std::atomic<uint64_t> used_bytes{0};
+    std::atomic<uint64_t> reserved_bytes{0};
+};
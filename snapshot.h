@@ -0,0 +1,302 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Point-in-time snapshot of the partitions in a format that is used straight
+// from an mmap of the file. All integers are 8-byte aligned, in host order.
+//
+// File:    Magic (8 bytes) | Version (4 bytes) | Partition Count (4 bytes)
+//          | Log Id (8 bytes) | Log Offset (8 bytes)
+//          | Section Offset (8 bytes, Partition Count + 1 times) | Sections
+// Section: Entry Count (8 bytes) | Key Hash (8 bytes, Entry Count times,
+//          ascending) | Entry Offset (8 bytes, Entry Count times) | Entries
+// Entry:   Expires At (8 bytes) | Key Length (4 bytes) | Value Length (4
+//          bytes) | Key | Value | padding to 8 bytes
+//
+// The last section offset is the file size. Entry offsets are relative to the
+// section's first entry, and a lookup binary searches the sorted hashes.
+// Log Id and Log Offset are the append-only log's position when the snapshot
+// started: every change logged before it is in the snapshot. Log Id is 0 for
+// a snapshot taken without a log.
+
+// One partition's section of a mapped snapshot. Empty when data is null.
+class SnapshotSection {
+public:
+    SnapshotSection() = default;
+
+    SnapshotSection(const char* data, size_t size) : data(data), size(size) {}
+
+    explicit operator bool() const {
+        return data != nullptr;
+    }
+
+    std::string_view bytes() const {
+        return std::string_view(data, size);
+    }
+
+    uint64_t entry_count() const {
+        return read_uint64(0);
+    }
+
+    // Finds the entry with this hash and key, expired or not. Only reads
+    // inside the section, even if the file is corrupt.
+    bool find(uint64_t hash, std::string_view key, std::string_view& value, uint64_t& expires_at) const {
+        if (!index_fits()) {
+            return false;
+        }
+        uint64_t count = entry_count();
+        const char* hashes = data + sizeof(uint64_t);
+        size_t low = 0;
+        size_t high = count;
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (read_at(hashes, middle) < hash) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        for (size_t i = low; i < count && read_at(hashes, i) == hash; ++i) {
+            std::string_view entry_key;
+            if (read_entry(i, entry_key, value, expires_at) && entry_key == key) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Checks that every entry lies inside the section
+    bool valid() const {
+        if (!index_fits()) {
+            return false;
+        }
+        for (size_t i = 0; i < entry_count(); ++i) {
+            std::string_view key;
+            std::string_view value;
+            uint64_t expires_at;
+            if (!read_entry(i, key, value, expires_at)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Calls fn(hash, key, value, expires_at) for every entry of a valid section
+    template <class Fn>
+    void for_each(Fn&& fn) const {
+        uint64_t count = entry_count();
+        const char* hashes = data + sizeof(uint64_t);
+        for (size_t i = 0; i < count; ++i) {
+            std::string_view key;
+            std::string_view value;
+            uint64_t expires_at = 0;
+            if (read_entry(i, key, value, expires_at)) {
+                fn(read_at(hashes, i), key, value, expires_at);
+            }
+        }
+    }
+
+    static constexpr size_t ENTRY_HEADER_SIZE = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+
+private:
+    static uint64_t read_at(const char* array, size_t index) {
+        uint64_t value;
+        std::memcpy(&value, array + index * sizeof(uint64_t), sizeof(uint64_t));
+        return value;
+    }
+
+    uint64_t read_uint64(size_t offset) const {
+        uint64_t value;
+        std::memcpy(&value, data + offset, sizeof(uint64_t));
+        return value;
+    }
+
+    // The entry count, hashes and offsets fit in the section
+    bool index_fits() const {
+        return size >= sizeof(uint64_t) && entry_count() <= (size - sizeof(uint64_t)) / (2 * sizeof(uint64_t));
+    }
+
+    // Returns false if the entry doesn't fit in the section
+    bool read_entry(size_t index, std::string_view& key, std::string_view& value, uint64_t& expires_at) const {
+        uint64_t count = entry_count();
+        const char* offsets = data + sizeof(uint64_t) * (1 + count);
+        size_t entries_start = sizeof(uint64_t) * (1 + 2 * count);
+        uint64_t offset = read_at(offsets, index);
+        if (offset > size - entries_start || size - entries_start - offset < ENTRY_HEADER_SIZE) {
+            return false;
+        }
+        const char* entry = data + entries_start + offset;
+        uint32_t key_length;
+        uint32_t value_length;
+        std::memcpy(&expires_at, entry, sizeof(uint64_t));
+        std::memcpy(&key_length, entry + sizeof(uint64_t), sizeof(uint32_t));
+        std::memcpy(&value_length, entry + sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint32_t));
+        if (static_cast<uint64_t>(key_length) + value_length > size - entries_start - offset - ENTRY_HEADER_SIZE) {
+            return false;
+        }
+        key = std::string_view(entry + ENTRY_HEADER_SIZE, key_length);
+        value = std::string_view(entry + ENTRY_HEADER_SIZE + key_length, value_length);
+        return true;
+    }
+
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+// Collects one partition's entries and encodes them as a section. Adding only
+// copies the entry, the sort happens in encode, which the caller can run
+// after it has let go of the partition.
+class SnapshotSectionBuilder {
+public:
+    void add(uint64_t hash, std::string_view key, std::string_view value, uint64_t expires_at) {
+        index.emplace_back(hash, entries.size());
+        uint32_t key_length = key.size();
+        uint32_t value_length = value.size();
+        entries.append(reinterpret_cast<const char*>(&expires_at), sizeof(uint64_t));
+        entries.append(reinterpret_cast<const char*>(&key_length), sizeof(uint32_t));
+        entries.append(reinterpret_cast<const char*>(&value_length), sizeof(uint32_t));
+        entries += key;
+        entries += value;
+        entries.append((8 - entries.size() % 8) % 8, '\0');
+    }
+
+    // Appends the section and clears the builder
+    void encode(std::string& output) {
+        std::sort(index.begin(), index.end());
+        append_uint64(output, index.size());
+        for (const auto& [hash, offset] : index) {
+            append_uint64(output, hash);
+        }
+        for (const auto& [hash, offset] : index) {
+            append_uint64(output, offset);
+        }
+        output += entries;
+        index.clear();
+        entries.clear();
+    }
+
+private:
+    static void append_uint64(std::string& output, uint64_t value) {
+        output.append(reinterpret_cast<const char*>(&value), sizeof(uint64_t));
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> index; // Hash and entry offset
+    std::string entries;
+};
+
+// A snapshot file mapped read-only
+class SnapshotImage {
+public:
+    static constexpr char MAGIC[8] = {'F', 'I', 'N', 'C', 'H', 'S', 'N', 'P'};
+    // 2 since keys are hashed with hash_key, whose hashes the sections are sorted by,
+    // 3 since the header has the log position
+    static constexpr uint32_t VERSION = 3;
+
+    SnapshotImage() = default;
+
+    ~SnapshotImage() {
+        unmap();
+    }
+
+    SnapshotImage(const SnapshotImage&) = delete;
+    SnapshotImage& operator=(const SnapshotImage&) = delete;
+
+    static size_t header_size(uint32_t partition_count) {
+        return sizeof(MAGIC) + 2 * sizeof(uint32_t) + (partition_count + 3) * sizeof(uint64_t);
+    }
+
+    // Fills the header of a snapshot whose sections start at offsets, with
+    // the file size as the last offset
+    static std::string encode_header(const std::vector<uint64_t>& offsets, uint64_t log_id, uint64_t log_offset) {
+        std::string header(MAGIC, sizeof(MAGIC));
+        uint32_t version = VERSION;
+        uint32_t partition_count = offsets.size() - 1;
+        header.append(reinterpret_cast<const char*>(&version), sizeof(uint32_t));
+        header.append(reinterpret_cast<const char*>(&partition_count), sizeof(uint32_t));
+        header.append(reinterpret_cast<const char*>(&log_id), sizeof(uint64_t));
+        header.append(reinterpret_cast<const char*>(&log_offset), sizeof(uint64_t));
+        header.append(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+        return header;
+    }
+
+    // Maps the file and checks the header. Sections are only checked when
+    // they are used, so mapping takes the same time for any size.
+    // Returns false if the file is missing or isn't a snapshot of
+    // partition_count partitions.
+    bool map(const std::string& path, uint32_t partition_count) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0 || static_cast<uint64_t>(file_stat.st_size) < header_size(partition_count)) {
+            close(fd);
+            return false;
+        }
+        size = file_stat.st_size;
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<const char*>(mapped);
+
+        uint32_t version;
+        uint32_t count;
+        std::memcpy(&version, data + sizeof(MAGIC), sizeof(uint32_t));
+        std::memcpy(&count, data + sizeof(MAGIC) + sizeof(uint32_t), sizeof(uint32_t));
+        if (std::memcmp(data, MAGIC, sizeof(MAGIC)) != 0 || version != VERSION || count != partition_count) {
+            unmap();
+            return false;
+        }
+        const char* position = data + sizeof(MAGIC) + 2 * sizeof(uint32_t);
+        std::memcpy(&logged_id, position, sizeof(uint64_t));
+        std::memcpy(&logged_offset, position + sizeof(uint64_t), sizeof(uint64_t));
+        offsets.resize(count + 1);
+        std::memcpy(offsets.data(), position + 2 * sizeof(uint64_t), offsets.size() * sizeof(uint64_t));
+        if (offsets.front() < header_size(count) || offsets.back() != size ||
+            !std::is_sorted(offsets.begin(), offsets.end())) {
+            unmap();
+            return false;
+        }
+        return true;
+    }
+
+    bool mapped() const {
+        return data != nullptr;
+    }
+
+    // The log position in the header, see above
+    void log_position(uint64_t& log_id, uint64_t& log_offset) const {
+        log_id = logged_id;
+        log_offset = logged_offset;
+    }
+
+    SnapshotSection section(size_t partition_id) const {
+        return SnapshotSection(data + offsets[partition_id], offsets[partition_id + 1] - offsets[partition_id]);
+    }
+
+    void unmap() {
+        if (data) {
+            munmap(const_cast<char*>(data), size);
+            data = nullptr;
+        }
+    }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+    uint64_t logged_id = 0;
+    uint64_t logged_offset = 0;
+    std::vector<uint64_t> offsets;
+};
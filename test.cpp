@@ -8,23 +8,240 @@
 #include <atomic>
 #include <iterator> // For std::next
 #include <algorithm> // For std::remove
+#include <sstream>
 
 #define FINCH_CLIENT_NO_MAIN // Exclude main function from client.cpp
 #include "client.cpp"
 
-// Total number of operations per client
-const int OPERATIONS_PER_CLIENT = 100000; // Adjust as needed
+// Correctness check: a few deterministic checks run first, then every client
+// thread runs random PUTs, GETs and DELs and checks every answer against its
+// own copy of the data. Performance is measured by ./bench instead.
 
-// Number of client threads
-const int NUM_CLIENTS = 10; // Adjust as needed
+// Total number of operations per client, --operations
+int operations_per_client = 100000;
+
+// Number of client threads, --clients
+int num_clients = 10;
+
+// With --shared-client, every thread uses one FinchClient and its connection
+// pools instead of a client of its own
+bool shared_client = false;
+
+// With --ordered-index, the servers run with --ordered-index and SCAN is
+// checked too
+bool ordered_index = false;
+
+// With --allow-evictions, a key the server no longer has counts as evicted
+// instead of failed, for servers running with --maxmemory
+bool allow_evictions = false;
 
 std::atomic<int> successful_operations(0);
 std::atomic<int> failed_operations(0);
+std::atomic<int> evicted_keys(0);
 std::atomic<int> total_operations_completed(0); // For progress tracking
 std::mutex cout_mutex; // For synchronized console output
 
-void client_thread_function(int client_id) {
-    FinchClient client; // Each thread has its own client instance
+// Counts a deterministic check as a successful or failed operation
+void check(bool passed, const std::string& what) {
+    if (passed) {
+        successful_operations++;
+        return;
+    }
+    failed_operations++;
+    std::lock_guard<std::mutex> lock(cout_mutex);
+    std::cerr << "Check failed: " << what << "\n";
+}
+
+// hash_key is part of the protocol, so it must stay wyhash final version 4
+// bit for bit: these are wyhash's published test vectors, which hash the i-th
+// message with seed i
+void check_key_hash() {
+    const std::pair<std::string, uint64_t> vectors[] = {
+        {"", 0x93228a4de0eec5a2ULL},
+        {"a", 0xc5bac3db178713c4ULL},
+        {"abc", 0xa97f2f7b1d9b3314ULL},
+        {"message digest", 0x786d1f1df3801df4ULL},
+        {"abcdefghijklmnopqrstuvwxyz", 0xdca5a8138ad37c87ULL},
+        {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789", 0xb9e734f117cfaf70ULL},
+        {"12345678901234567890123456789012345678901234567890123456789012345678901234567890", 0x6cc5eab49a92d617ULL},
+    };
+    for (uint64_t seed = 0; seed < std::size(vectors); ++seed) {
+        const std::string& message = vectors[seed].first;
+        check(WyHash::hash(message.data(), message.size(), seed) == vectors[seed].second,
+              "wyhash of \"" + message + "\" with seed " + std::to_string(seed));
+    }
+    check(hash_key("") == 0x93228a4de0eec5a2ULL, "hash_key of the empty key");
+}
+
+// INCR, CAS, APPEND and GETSET, and the TTLs they keep or drop
+void check_read_modify_write(FinchClient& client) {
+    const std::string counter = "check:counter";
+    check(client.incr(counter, 5) == std::optional<int64_t>(5), "INCR of a missing key starts from 0");
+    check(client.decr(counter, 7) == std::optional<int64_t>(-2), "DECR below 0");
+    check(client.get(counter) == "-2", "INCR stores the result");
+    client.put(counter, "not a number");
+    check(!client.incr(counter).has_value(), "INCR of a value that isn't an integer fails");
+    check(client.get(counter) == "not a number", "a failed INCR leaves the value");
+    client.put(counter, std::to_string(INT64_MAX));
+    check(!client.incr(counter).has_value(), "INCR past INT64_MAX fails");
+    client.del(counter);
+
+    const std::string swapped = "check:cas";
+    check(!client.cas(swapped, "", "a"), "CAS of a missing key fails");
+    check(client.put_if_absent(swapped, "a"), "CAS_ABSENT stores a missing key");
+    check(!client.put_if_absent(swapped, "b"), "CAS_ABSENT fails on an existing key");
+    check(!client.cas(swapped, "b", "c"), "CAS with a mismatched value fails");
+    check(client.get(swapped) == "a", "a failed CAS leaves the value");
+    check(client.cas(swapped, "a", "c"), "CAS with the current value succeeds");
+    check(client.get(swapped) == "c", "CAS stores the new value");
+    client.del(swapped);
+
+    const std::string appended = "check:append";
+    check(client.append(appended, "ab") == 2, "APPEND to a missing key stores the suffix");
+    check(client.append(appended, "cd") == 4, "APPEND returns the new length");
+    check(client.get(appended) == "abcd", "APPEND stores the joined value");
+    client.del(appended);
+
+    const std::string replaced = "check:getset";
+    check(client.getset(replaced, "a") == "", "GETSET of a missing key returns nothing");
+    check(client.getset(replaced, "b") == "a", "GETSET returns the replaced value");
+    check(client.get(replaced) == "b", "GETSET stores the new value");
+
+    // APPEND keeps the key's TTL and GETSET drops it, like PUT
+    const std::string expiring = "check:setex";
+    const std::string appended_expiring = "check:setex:append";
+    check(client.setex(expiring, 1, "a"), "SETEX");
+    check(client.setex(appended_expiring, 1, "a"), "SETEX");
+    check(client.setex(replaced, 1, "c"), "SETEX");
+    client.append(appended_expiring, "b");
+    client.getset(replaced, "d");
+    check(client.get(expiring) == "a", "a SETEX key before its TTL");
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    check(client.get(expiring).empty(), "a SETEX key after its TTL");
+    check(client.get(appended_expiring).empty(), "APPEND keeps the key's TTL");
+    check(client.get(replaced) == "d", "GETSET drops the key's TTL");
+    client.del(replaced);
+}
+
+// SCAN pages through every server and returns every key in the range exactly
+// once, in order
+void check_scan(FinchClient& client) {
+    const std::string prefix = "check:scan:";
+    std::vector<std::string> expected;
+    for (int i = 0; i < 500; ++i) {
+        std::string key = prefix + std::to_string(1000 + i);
+        client.put(key, "v");
+        expected.push_back(key);
+    }
+    client.put("check:scam", "v");
+    client.put("check:scan;", "v");
+
+    // A small count hint makes every server answer over many pages
+    std::vector<std::string> keys = client.scan(prefix, 7);
+    check(keys == expected, "SCAN of " + prefix + " returned " + std::to_string(keys.size()) + " of " +
+                                std::to_string(expected.size()) + " keys");
+    keys = client.scan_range(prefix + "1100", prefix + "1200", 7);
+    check(keys == std::vector<std::string>(expected.begin() + 100, expected.begin() + 200),
+          "SCAN of [" + prefix + "1100, " + prefix + "1200)");
+
+    client.mdel(expected);
+    client.del("check:scam");
+    client.del("check:scan;");
+}
+
+// A GET pipelined behind a PUT of the same key must see the PUT. Against
+// servers with --hot-keys and an event loop engine with --loops above 1, this
+// covers GETs of hot keys answered from hot copies on loops that don't own
+// them. Several keys are made hot, so that some are owned by another loop
+// than the one serving the connection.
+void check_pipelined_hot_reads(FinchClient& client) {
+    const int key_count = 16;
+    const int reads_to_heat = 2000;
+    const int rounds = 100;
+    for (int k = 0; k < key_count; ++k) {
+        std::string key = "check:hot:" + std::to_string(k);
+        client.put(key, "0");
+        for (int i = 0; i < reads_to_heat; ++i) {
+            client.get(key);
+        }
+        bool passed = true;
+        for (int round = 1; round <= rounds && passed; ++round) {
+            std::string value = std::to_string(round);
+            std::future<bool> put = client.put_async(key, value);
+            std::future<std::string> get = client.get_async(key);
+            client.flush();
+            passed = put.get() && get.get() == value;
+        }
+        check(passed, "GET pipelined after a PUT of " + key + " missed the PUT");
+        client.del(key);
+    }
+}
+
+// MPUT, MGET and MDEL, with about twice MAX_BATCH_ENTRIES keys per server so
+// that every server gets its share over several messages
+void check_batches(FinchClient& client) {
+    const size_t key_count = client.server_count() * 2 * MAX_BATCH_ENTRIES + 100;
+    std::vector<std::pair<std::string, std::string>> pairs;
+    std::vector<std::string> keys;
+    std::vector<std::string> expected;
+    for (size_t i = 0; i < key_count; ++i) {
+        std::string key = "check:batch:" + std::to_string(i);
+        pairs.emplace_back(key, "v" + std::to_string(i));
+        // Every third key read back doesn't exist
+        keys.push_back(i % 3 == 2 ? "check:batch:missing:" + std::to_string(i) : key);
+        expected.push_back(i % 3 == 2 ? "" : pairs.back().second);
+    }
+    check(client.mput(pairs), "MPUT of " + std::to_string(key_count) + " keys");
+    check(client.mget(keys) == expected, "MGET of stored and missing keys");
+    check(client.mdel(keys) == key_count - key_count / 3, "MDEL counts only the keys that existed");
+    std::vector<std::string> values = client.mget(keys);
+    check(std::all_of(values.begin(), values.end(), [](const std::string& value) { return value.empty(); }),
+          "MGET after MDEL");
+    std::vector<std::string> remaining;
+    for (size_t i = 2; i < key_count; i += 3) {
+        remaining.push_back(pairs[i].first);
+    }
+    check(client.mdel(remaining) == remaining.size(), "MDEL of the keys left");
+}
+
+// Values at and around the client's size thresholds round-trip through
+// every path: 1 KB is copied into the send buffer, LARGE_VALUE_SIZE and
+// larger are sent from the caller's string with sendmsg and received straight
+// into the returned string, and a few MB take many receives
+void check_large_values(FinchClient& client) {
+    for (size_t size : {size_t(1024), LARGE_VALUE_SIZE, size_t(3 << 20) + 5}) {
+        std::string value(size, '\0');
+        for (size_t i = 0; i < size; ++i) {
+            value[i] = 'a' + i % 23;
+        }
+        std::string size_text = std::to_string(size) + " byte value";
+        const std::string key = "check:large:" + std::to_string(size);
+
+        check(client.put(key, value), "PUT of a " + size_text);
+        check(client.get(key) == value, "GET of a " + size_text);
+        std::ostringstream streamed_out;
+        check(client.get_stream(key, streamed_out) && streamed_out.str() == value,
+              "GET streaming a " + size_text);
+
+        std::reverse(value.begin(), value.end());
+        std::istringstream streamed_in(value);
+        check(client.put_stream(key, streamed_in, value.size()), "PUT streaming a " + size_text);
+        check(client.get(key) == value, "GET of a streamed " + size_text);
+
+        const std::string small_key = "check:large:small";
+        check(client.mput({{small_key, "v"}, {key, value + "b"}}), "MPUT holding a " + size_text);
+        check(client.mget({small_key, key}) == std::vector<std::string>{"v", value + "b"},
+              "MGET holding a " + size_text);
+        client.mdel({small_key, key});
+    }
+}
+
+void client_thread_function(int client_id, FinchClient* shared) {
+    std::unique_ptr<FinchClient> own_client;
+    if (!shared) {
+        own_client = std::make_unique<FinchClient>();
+    }
+    FinchClient& client = shared ? *shared : *own_client;
 
     std::unordered_map<std::string, std::string> local_store; // Local map to track keys and values
     std::vector<std::string> keys; // Vector to store keys for random access
@@ -38,7 +255,7 @@ void client_thread_function(int client_id) {
 
     const int progress_interval = 10000; // Adjust as needed for more frequent updates
 
-    for (int i = 0; i < OPERATIONS_PER_CLIENT; ++i) {
+    for (int i = 0; i < operations_per_client; ++i) {
         int op_choice = op_dist(rng);
 
         try {
@@ -89,6 +306,11 @@ void client_thread_function(int client_id) {
                         std::lock_guard<std::mutex> lock(cout_mutex);
                         std::cerr << "Client " << client_id << " GET value mismatch for key: " << key << "\n";
                     }
+                } else if (allow_evictions) {
+                    evicted_keys++;
+                    local_store.erase(key);
+                    key_set.erase(key);
+                    keys.erase(std::remove(keys.begin(), keys.end(), key), keys.end());
                 } else {
                     // Key not found
                     failed_operations++;
@@ -102,8 +324,13 @@ void client_thread_function(int client_id) {
                 std::string key = keys[rng() % keys.size()];
 
                 // Perform DEL operation
-                if (client.del(key)) {
-                    successful_operations++;
+                bool deleted = client.del(key);
+                if (deleted || allow_evictions) {
+                    if (deleted) {
+                        successful_operations++;
+                    } else {
+                        evicted_keys++;
+                    }
                     // Remove key from local map
                     local_store.erase(key);
                     // Remove key from key_set
@@ -125,7 +352,7 @@ void client_thread_function(int client_id) {
         // Update progress
         if ((i + 1) % progress_interval == 0) {
             int completed = total_operations_completed.fetch_add(progress_interval) + progress_interval;
-            int total_operations = NUM_CLIENTS * OPERATIONS_PER_CLIENT;
+            int total_operations = num_clients * operations_per_client;
             double percentage = (double)completed / total_operations * 100.0;
 
             // Use cout_mutex to synchronize output
@@ -138,10 +365,10 @@ void client_thread_function(int client_id) {
     }
 
     // Handle any remaining operations not captured by the interval
-    int remaining_ops = OPERATIONS_PER_CLIENT % progress_interval;
+    int remaining_ops = operations_per_client % progress_interval;
     if (remaining_ops > 0) {
         int completed = total_operations_completed.fetch_add(remaining_ops) + remaining_ops;
-        int total_operations = NUM_CLIENTS * OPERATIONS_PER_CLIENT;
+        int total_operations = num_clients * operations_per_client;
         double percentage = (double)completed / total_operations * 100.0;
 
         // Use cout_mutex to synchronize output
@@ -158,6 +385,8 @@ void client_thread_function(int client_id) {
             std::string value = client.get(pair.first);
             if (value == pair.second) {
                 successful_operations++;
+            } else if (value.empty() && allow_evictions) {
+                evicted_keys++;
             } else {
                 failed_operations++;
                 std::lock_guard<std::mutex> lock(cout_mutex);
@@ -171,15 +400,109 @@ void client_thread_function(int client_id) {
     }
 }
 
-int main() {
+struct ServerIoStats {
+    uint64_t syscalls = 0;
+    uint64_t operations = 0;
+    uint64_t get_hits = 0;
+    uint64_t get_misses = 0;
+    uint64_t evictions = 0;
+    bool available = true;
+};
+
+// Sums the syscall and operation counters reported by every server
+ServerIoStats collect_server_io_stats() {
+    ServerIoStats totals;
+    try {
+        FinchClient client;
+        for (size_t i = 0; i < client.server_count(); ++i) {
+            std::istringstream stats(client.stats(i));
+            std::string field;
+            while (stats >> field) {
+                size_t equals_pos = field.find('=');
+                if (equals_pos == std::string::npos) continue;
+                std::string name = field.substr(0, equals_pos);
+                uint64_t value = std::stoull(field.substr(equals_pos + 1));
+                if (name == "syscalls") {
+                    totals.syscalls += value;
+                } else if (name == "operations") {
+                    totals.operations += value;
+                } else if (name == "get_hits") {
+                    totals.get_hits += value;
+                } else if (name == "get_misses") {
+                    totals.get_misses += value;
+                } else if (name == "evictions") {
+                    totals.evictions += value;
+                }
+            }
+        }
+    } catch (const std::exception& e) {
+        totals.available = false;
+    }
+    return totals;
+}
+
+bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg == "--allow-evictions") {
+                allow_evictions = true;
+            } else if (arg == "--ordered-index") {
+                ordered_index = true;
+            } else if (arg == "--shared-client") {
+                shared_client = true;
+            } else if (arg.rfind("--clients=", 0) == 0) {
+                num_clients = std::stoi(arg.substr(10));
+                if (num_clients < 1) return false;
+            } else if (arg.rfind("--operations=", 0) == 0) {
+                operations_per_client = std::stoi(arg.substr(13));
+                if (operations_per_client < 1) return false;
+            } else {
+                return false;
+            }
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        std::cerr << "Usage: test [--allow-evictions] [--clients=N] [--operations=N] [--shared-client] [--ordered-index]\n"
+                  << "  --clients        client threads (default: 10)\n"
+                  << "  --operations     operations per client (default: 100000)\n"
+                  << "  --shared-client  all threads share one client (default: one each)\n"
+                  << "  --ordered-index  the servers run with --ordered-index, check SCAN too (default: off)\n";
+        return 1;
+    }
+
     // Start the server before running this test
-    std::cout << "Starting test with " << NUM_CLIENTS << " clients, each performing " << OPERATIONS_PER_CLIENT << " operations.\n";
+    check_key_hash();
+    {
+        FinchClient client;
+        check_read_modify_write(client);
+        if (ordered_index) {
+            check_scan(client);
+        }
+        check_pipelined_hot_reads(client);
+        check_batches(client);
+        check_large_values(client);
+    }
+
+    std::cout << "Starting test with " << num_clients << " clients, each performing " << operations_per_client << " operations.\n";
+
+    ServerIoStats stats_before = collect_server_io_stats();
 
     std::vector<std::thread> client_threads;
+    std::unique_ptr<FinchClient> client;
+    if (shared_client) {
+        client = std::make_unique<FinchClient>();
+    }
 
     // Launch client threads
-    for (int i = 0; i < NUM_CLIENTS; ++i) {
-        client_threads.emplace_back(client_thread_function, i);
+    for (int i = 0; i < num_clients; ++i) {
+        client_threads.emplace_back(client_thread_function, i, client.get());
     }
 
     // Wait for all threads to complete
@@ -191,6 +514,28 @@ int main() {
     std::cout << "Test completed.\n";
     std::cout << "Successful operations: " << successful_operations.load() << "\n";
     std::cout << "Failed operations: " << failed_operations.load() << "\n";
+    if (allow_evictions) {
+        std::cout << "Evicted keys: " << evicted_keys.load() << "\n";
+    }
+
+    ServerIoStats stats_after = collect_server_io_stats();
+    if (stats_before.available && stats_after.available && stats_after.operations > stats_before.operations) {
+        uint64_t syscalls = stats_after.syscalls - stats_before.syscalls;
+        uint64_t operations = stats_after.operations - stats_before.operations;
+        std::cout << "Server syscalls per operation: " << (double)syscalls / operations
+                  << " (" << syscalls << " syscalls, " << operations << " operations)\n";
+    } else {
+        std::cout << "Server syscalls per operation: unavailable\n";
+    }
+
+    if (stats_before.available && stats_after.available) {
+        uint64_t hits = stats_after.get_hits - stats_before.get_hits;
+        uint64_t misses = stats_after.get_misses - stats_before.get_misses;
+        if (hits + misses > 0) {
+            std::cout << "Server GET hit ratio: " << (double)hits / (hits + misses)
+                      << " (" << stats_after.evictions - stats_before.evictions << " evictions)\n";
+        }
+    }
 
     return 0;
 }
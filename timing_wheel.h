@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Hierarchical timing wheel (Varghese and Lauck) of key expiry deadlines.
+// LEVELS wheels of SLOTS buckets each, where a bucket of level l spans
+// SLOTS^l ticks of TICK_MS. A timer goes into the lowest level whose current
+// rotation contains its tick, and is moved down a level each time the wheel
+// below wraps around to its bucket, so adding is O(1) and every timer is moved
+// at most LEVELS times before it fires. Timers beyond the top level's range
+// wait in the top bucket that comes around last and are placed again then.
+//
+// Timers aren't removed when their key is deleted or given a new deadline,
+// the caller checks the key when the timer fires. Times are milliseconds on
+// the caller's clock. Not thread-safe, the owner of the partition serializes
+// access.
+class TimingWheel {
+public:
+    static constexpr uint64_t TICK_MS = 10;
+    static constexpr size_t LEVEL_BITS = 6;
+    static constexpr size_t SLOTS = size_t{1} << LEVEL_BITS;
+    static constexpr size_t LEVELS = 4; // 64^4 ticks, about 46 hours
+
+    struct Timer {
+        uint64_t key_hash;
+        uint64_t deadline_ms;
+    };
+
+    explicit TimingWheel(uint64_t now_ms) : current_tick(now_ms / TICK_MS) {}
+
+    void add(const Timer& timer) {
+        timer_count++;
+        place(timer);
+    }
+
+    // Fires the timers whose deadline is at most now_ms, calling expire on
+    // each, until budget of them have fired. The rest fire on the next call,
+    // so a burst of deadlines is spread over several calls instead of holding
+    // the partition for all of them. Returns the number fired.
+    template <class Expire>
+    size_t advance(uint64_t now_ms, size_t budget, Expire&& expire) {
+        uint64_t target_tick = now_ms / TICK_MS;
+        if (target_tick < current_tick) {
+            // The clock went back, wait for it to catch up
+            return 0;
+        }
+        if (timer_count == 0) {
+            // Nothing to cascade, skip the idle ticks
+            current_tick = std::max(current_tick, target_tick);
+            return 0;
+        }
+
+        size_t fired = 0;
+        while (true) {
+            while (!due.empty() && fired < budget) {
+                Timer timer = due.back();
+                due.pop_back();
+                timer_count--;
+                expire(timer);
+                fired++;
+            }
+            if (fired >= budget || current_tick >= target_tick) {
+                return fired;
+            }
+            tick();
+        }
+    }
+
+    size_t size() const {
+        return timer_count;
+    }
+
+    // Heap bytes of the buckets, and the wheel itself
+    size_t memory_bytes() const {
+        size_t bytes = sizeof(*this) + due.capacity() * sizeof(Timer);
+        for (const auto& level : buckets) {
+            for (const std::vector<Timer>& bucket : level) {
+                bytes += bucket.capacity() * sizeof(Timer);
+            }
+        }
+        return bytes;
+    }
+
+private:
+    static size_t shift(size_t level) {
+        return level * LEVEL_BITS;
+    }
+
+    static uint64_t deadline_tick(uint64_t deadline_ms) {
+        return (deadline_ms + TICK_MS - 1) / TICK_MS;
+    }
+
+    // Every tick up to current_tick has been moved to due
+    void place(const Timer& timer) {
+        uint64_t tick = deadline_tick(timer.deadline_ms);
+        if (tick <= current_tick) {
+            due.push_back(timer);
+            return;
+        }
+        for (size_t level = 0; level < LEVELS; ++level) {
+            // Same rotation of the level above, so the bucket comes later in this one
+            if ((tick >> shift(level + 1)) == (current_tick >> shift(level + 1))) {
+                buckets[level][(tick >> shift(level)) & (SLOTS - 1)].push_back(timer);
+                return;
+            }
+        }
+        // The bucket just behind the current one comes around last
+        buckets[LEVELS - 1][((current_tick >> shift(LEVELS - 1)) - 1) & (SLOTS - 1)].push_back(timer);
+    }
+
+    // Moves to the next tick. Where lower levels wrap around, the bucket of
+    // the level above that starts here is spread over the levels below, top
+    // down, then the level 0 bucket for this tick becomes due.
+    void tick() {
+        current_tick++;
+        for (size_t level = LEVELS - 1; level > 0; --level) {
+            if ((current_tick & ((uint64_t{1} << shift(level)) - 1)) != 0) {
+                continue;
+            }
+            std::vector<Timer> cascading;
+            cascading.swap(buckets[level][(current_tick >> shift(level)) & (SLOTS - 1)]);
+            for (const Timer& timer : cascading) {
+                place(timer);
+            }
+        }
+
+        std::vector<Timer>& bucket = buckets[0][current_tick & (SLOTS - 1)];
+        if (due.empty()) {
+            due.swap(bucket);
+        } else {
+            due.insert(due.end(), bucket.begin(), bucket.end());
+            bucket.clear();
+        }
+    }
+
+    std::array<std::array<std::vector<Timer>, SLOTS>, LEVELS> buckets;
+    std::vector<Timer> due; // Timers of past ticks that haven't fired yet
+    uint64_t current_tick;
+    size_t timer_count = 0;
+};
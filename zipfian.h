@@ -0,0 +1,41 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+
+// Zipfian ranks as generated by YCSB (Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases"). Rank 0 is the most popular.
+class ZipfianGenerator {
+public:
+    ZipfianGenerator(uint64_t item_count, double theta)
+        : item_count(item_count), theta(theta), alpha(1.0 / (1.0 - theta)) {
+        zetan = zeta(item_count);
+        double zeta2 = zeta(2);
+        eta = (1.0 - std::pow(2.0 / item_count, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+    }
+
+    uint64_t next(std::mt19937_64& rng) const {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + std::pow(0.5, theta)) return 1;
+        return std::min<uint64_t>(item_count - 1, item_count * std::pow(eta * u - eta + 1.0, alpha));
+    }
+
+private:
+    double zeta(uint64_t count) const {
+        double sum = 0;
+        for (uint64_t i = 1; i <= count; ++i) {
+            sum += 1.0 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+    uint64_t item_count;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};